@@ -0,0 +1,770 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "shared_state.h"
+#include "game.h"
+#include "room.h"
+#include "logger.h"
+#include "score.h"
+#include "scoredb.h"
+#include "outbox.h"
+#include "config.h"
+#include "timer.h"
+#include "latency.h"
+
+/*
+ * Micro-benchmarks for the server's hot paths (make bench).
+ *
+ * Each benchmark runs a fixed number of operations with fixed seeds, once
+ * to warm up and then --repeat times; the median and fastest runs are
+ * kept. Everything runs in a scratch directory under /tmp, so the score
+ * and log files of a real server are never touched. The code under test
+ * is linked in as make builds it for the server.
+ *
+ * Results go to --out as JSON, one benchmark per line. Given a previous
+ * run with --baseline, each benchmark also carries the baseline's median
+ * and the change in percent, and a table of the changes goes to stderr.
+ */
+
+#define BENCH_SEED 0x6d656d6f7279ULL
+#define MAX_RESULTS 64
+#define NAME_LENGTH 48
+#define LOG_BURST (LOG_QUEUE_SIZE / 2)
+#define SCORE_UPDATES 1000
+
+volatile bool serverRunning = true;     // the room and logger code checks it
+
+typedef struct {
+    char name[NAME_LENGTH];
+    unsigned long iterations;
+    double medianNs;        // per operation
+    double minNs;
+    double baselineNs;      // 0 when the baseline has no such benchmark
+} BenchResult;
+
+typedef struct {
+    const char *outPath;
+    const char *baselinePath;
+    int repeat;
+    double scale;           // multiplies every iteration count
+    const char *filter;
+} BenchConfig;
+
+static BenchConfig config = {
+    .outPath = "bench.json",
+    .repeat = 5,
+    .scale = 1.0,
+};
+
+static BenchResult results[MAX_RESULTS];
+static int resultCount = 0;
+static int savedStdout = -1;
+
+static uint64_t nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static unsigned long scaled(unsigned long iterations)
+{
+    unsigned long n = (unsigned long)(iterations * config.scale);
+    return n > 0 ? n : 1;
+}
+
+static bool selected(const char *name)
+{
+    return !config.filter || strstr(name, config.filter);
+}
+
+static int compareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Keeps the median and fastest of runs per-operation times, in nanoseconds */
+static void addResult(const char *name, unsigned long iterations, double *runs, int count)
+{
+    if (resultCount == MAX_RESULTS)
+        return;
+    qsort(runs, (size_t)count, sizeof(double), compareDoubles);
+    BenchResult *result = &results[resultCount++];
+    snprintf(result->name, sizeof(result->name), "%s", name);
+    result->iterations = iterations;
+    result->medianNs = count % 2 ? runs[count / 2] : (runs[count / 2 - 1] + runs[count / 2]) / 2;
+    result->minNs = runs[0];
+    fprintf(stderr, "  %-34s %12.1f ns/op\n", name, result->medianNs);
+}
+
+/* One warm-up call, then config.repeat timed ones; run returns the nanoseconds its iterations took */
+static void runBenchmark(const char *name, unsigned long iterations, uint64_t (*run)(void *arg, unsigned long iterations), void *arg)
+{
+    if (!selected(name))
+        return;
+    double runs[64];
+    int count = config.repeat < 64 ? config.repeat : 64;
+    run(arg, iterations);
+    for (int i = 0; i < count; i++)
+        runs[i] = (double)run(arg, iterations) / (double)iterations;
+    addResult(name, iterations, runs, count);
+}
+
+/* A room with four seated players, set up by hand rather than through createRoom() */
+static SharedGameState *benchRoom(ServerState *server, int rows, int cols)
+{
+    SharedGameState *room = calloc(1, sizeof(SharedGameState));
+    if (!room)
+    {
+        perror("bench: calloc");
+        exit(1);
+    }
+    pthread_mutex_init(&room->mutex, NULL);
+    room->server = server;
+    room->roomID = 1;
+    snprintf(room->roomName, ROOM_NAME_LENGTH, "Bench");
+    rngSeed(&room->rng, BENCH_SEED);
+    initGameState(room);
+    setupBoard(room, rows, cols);
+    return room;
+}
+
+static void freeBenchRoom(SharedGameState *room)
+{
+    pthread_mutex_destroy(&room->mutex);
+    freeGameState(room);
+    free(room);
+}
+
+/* ---- formatOfBoard and setupBoard ---- */
+
+static uint64_t runFormatBoard(void *arg, unsigned long iterations)
+{
+    SharedGameState *room = arg;
+    static char buffer[1 << 20];
+    uint64_t start = nowNs();
+    for (unsigned long i = 0; i < iterations; i++)
+    {
+        //Turn a card over each time, as a flip would
+        int card = (int)(i % (unsigned long)(room->boardRows * room->boardCols));
+        cardSetFlipped(&room->cards, card, !cardFlipped(&room->cards, card));
+        formatOfBoard(room, buffer, sizeof(buffer));
+    }
+    return nowNs() - start;
+}
+
+static uint64_t runSetupBoard(void *arg, unsigned long iterations)
+{
+    SharedGameState *room = arg;
+    uint64_t start = nowNs();
+    for (unsigned long i = 0; i < iterations; i++)
+        setupBoard(room, room->boardRows, room->boardCols);
+    return nowNs() - start;
+}
+
+static void benchBoards(ServerState *server)
+{
+    static const int sizes[][2] = {{3, 4}, {4, 6}, {16, 16}, {64, 64}};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        char name[NAME_LENGTH];
+        SharedGameState *room = benchRoom(server, sizes[i][0], sizes[i][1]);
+        //Fewer rounds on bigger boards, so each size takes about as long as 3x4
+        unsigned long perCard = 12 * 100000UL / (unsigned long)(sizes[i][0] * sizes[i][1]);
+
+        snprintf(name, sizeof(name), "format_board_%dx%d", sizes[i][0], sizes[i][1]);
+        runBenchmark(name, scaled(perCard), runFormatBoard, room);
+        snprintf(name, sizeof(name), "setup_board_%dx%d", sizes[i][0], sizes[i][1]);
+        runBenchmark(name, scaled(2 * perCard), runSetupBoard, room);
+
+        freeBenchRoom(room);
+    }
+}
+
+/* ---- sendBoardStateToAll into socketpairs ---- */
+
+typedef struct {
+    SharedGameState *room;
+    int sinks[MAX_PLAYERS];
+    Outbox outboxes[MAX_PLAYERS];
+    pthread_t reader;
+    atomic_bool stopping;
+} BroadcastBench;
+
+/* Reads and discards everything the players are sent, like four clients that keep up */
+static void *sinkReader(void *arg)
+{
+    BroadcastBench *bench = arg;
+    struct pollfd fds[MAX_PLAYERS];
+    char buffer[65536];
+    for (int i = 0; i < MAX_PLAYERS; i++)
+        fds[i] = (struct pollfd){.fd = bench->sinks[i], .events = POLLIN};
+
+    while (!atomic_load(&bench->stopping))
+    {
+        if (poll(fds, MAX_PLAYERS, 50) <= 0)
+            continue;
+        for (int i = 0; i < MAX_PLAYERS; i++)
+        {
+            if (fds[i].revents & POLLIN)
+                while (recv(fds[i].fd, buffer, sizeof(buffer), MSG_DONTWAIT) > 0)
+                    ;
+        }
+    }
+    return NULL;
+}
+
+static uint64_t runBroadcast(void *arg, unsigned long iterations)
+{
+    BroadcastBench *bench = arg;
+    SharedGameState *room = bench->room;
+    int cards = room->boardRows * room->boardCols;
+    uint64_t start = nowNs();
+    for (unsigned long i = 0; i < iterations; i++)
+    {
+        pthread_mutex_lock(&room->mutex);
+        int card = (int)(i % (unsigned long)cards);
+        cardSetFlipped(&room->cards, card, !cardFlipped(&room->cards, card));
+        room->stateVersion++;
+        pthread_mutex_unlock(&room->mutex);
+        sendBoardStateToAll(room);
+        //What the event loop would do once the sockets drain
+        for (int p = 0; p < MAX_PLAYERS; p++)
+            outboxFlush(&bench->outboxes[p]);
+    }
+    return nowNs() - start;
+}
+
+static void benchBroadcast(ServerState *server, bool binary)
+{
+    const char *name = binary ? "broadcast_board_binary_4_players" : "broadcast_board_text_4_players";
+    if (!selected(name))
+        return;
+
+    BroadcastBench bench;
+    memset(&bench, 0, sizeof(bench));
+    bench.room = benchRoom(server, 4, 6);
+    for (int i = 0; i < MAX_PLAYERS; i++)
+    {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+        {
+            perror("bench: socketpair");
+            exit(1);
+        }
+        fcntl(pair[0], F_SETFL, fcntl(pair[0], F_GETFL, 0) | O_NONBLOCK);
+        bench.sinks[i] = pair[1];
+        outboxInit(&bench.outboxes[i], pair[0], -1, NULL);
+        int slot = joinRoom(bench.room, pair[0], &bench.outboxes[i]);
+        bench.room->players[slot].binaryProtocol = binary;
+    }
+    pthread_mutex_lock(&bench.room->mutex);
+    bench.room->gameStarted = true;
+    bench.room->currentTurn = 0;
+    pthread_mutex_unlock(&bench.room->mutex);
+    sendBoardSnapshotToAll(bench.room);
+
+    pthread_create(&bench.reader, NULL, sinkReader, &bench);
+    runBenchmark(name, scaled(20000), runBroadcast, &bench);
+    atomic_store(&bench.stopping, true);
+    pthread_join(bench.reader, NULL);
+
+    for (int i = 0; i < MAX_PLAYERS; i++)
+    {
+        close(bench.outboxes[i].fd);
+        outboxDestroy(&bench.outboxes[i]);
+        close(bench.sinks[i]);
+    }
+    freeBenchRoom(bench.room);
+}
+
+/* ---- pushLogEvent and the logger thread ---- */
+
+typedef struct {
+    ServerState *server;
+    uint64_t pushNs;        // time spent inside pushLogEvent() in the last run
+} LogBench;
+
+static void waitForLogger(ServerState *server)
+{
+    while (atomic_load(&server->logQueueHead) != atomic_load(&server->logQueueTail))
+        sched_yield();
+}
+
+/* Pushes in bursts of half the ring and lets the logger drain each, so nothing is dropped */
+static uint64_t runLog(void *arg, unsigned long iterations)
+{
+    LogBench *bench = arg;
+    bench->pushNs = 0;
+    uint64_t start = nowNs();
+    for (unsigned long done = 0; done < iterations;)
+    {
+        uint64_t burstStart = nowNs();
+        for (int i = 0; i < LOG_BURST && done < iterations; i++, done++)
+            pushLogEvent(bench->server, LOG_GAME, LOGEV_CARD_FLIPPED, (int)(done % MAX_PLAYERS), NULL, 2, (int)(done % 24), 7);
+        bench->pushNs += nowNs() - burstStart;
+        waitForLogger(bench->server);
+    }
+    return nowNs() - start;
+}
+
+static uint64_t runLogPush(void *arg, unsigned long iterations)
+{
+    LogBench *bench = arg;
+    runLog(bench, iterations);
+    return bench->pushNs;
+}
+
+static void benchLogger(ServerState *server)
+{
+    if (!selected("log_push") && !selected("logger_throughput"))
+        return;
+
+    pthread_t logger;
+    sem_init(&server->logReadySemaphore, 0, 0);
+    sem_init(&server->logItemsSemaphore, 0, 0);
+    initLogQueue(server);
+    pthread_create(&logger, NULL, loggerLoopThread, server);
+    sem_wait(&server->logReadySemaphore);
+
+    LogBench bench = {.server = server};
+    runBenchmark("log_push", scaled(200000), runLogPush, &bench);
+    runBenchmark("logger_throughput", scaled(200000), runLog, &bench);
+
+    serverRunning = false;
+    sem_post(&server->logItemsSemaphore);
+    pthread_join(logger, NULL);
+    serverRunning = true;
+    sem_destroy(&server->logReadySemaphore);
+    sem_destroy(&server->logItemsSemaphore);
+    if (atomic_load(&server->logDropped) > 0)
+        fprintf(stderr, "  (the logger dropped %lu events)\n", (unsigned long)atomic_load(&server->logDropped));
+}
+
+/* ---- scores_get_wins and scores_save ---- */
+
+static const ScoreEntry *syntheticPlayer(void *arg, size_t index)
+{
+    static ScoreEntry entry;
+    (void)arg;
+    snprintf(entry.name, sizeof(entry.name), "player%08zu", index);
+    entry.wins = (int)(index % 1000);
+    return &entry;
+}
+
+/*
+ * The score store keeps its state in file-scope variables and shuts its
+ * worker down for good in scores_save(), so every run gets a process of
+ * its own: it writes a scores.db of players entries, loads it, times
+ * lookups (one in ten misses), applies SCORE_UPDATES changes and times
+ * scores_save() folding them into a new scores.db.
+ */
+static void scoreRun(size_t players, unsigned long lookups, double *lookupNs, double *saveNs)
+{
+    int pipeFDs[2];
+    if (pipe(pipeFDs) < 0)
+    {
+        perror("bench: pipe");
+        exit(1);
+    }
+
+    pid_t child = fork();
+    if (child == 0)
+    {
+        close(pipeFDs[0]);
+        char dir[64];
+        snprintf(dir, sizeof(dir), "scores-%zu", players);
+        mkdir(dir, 0755);
+        if (chdir(dir) != 0)
+            _exit(1);
+        unlink("scores.db");
+        unlink("scores.journal");
+        if (!scoreDbWrite("scores.db", players, syntheticPlayer, NULL))
+            _exit(1);
+
+        ServerState *server = calloc(1, sizeof(ServerState));
+        pthread_mutex_init(&server->mutex, NULL);
+        scores_init(server);
+        scores_load(server);
+
+        Rng rng;
+        rngSeed(&rng, BENCH_SEED);
+        char name[PLAYER_NAME_LENGTH];
+        volatile int sink = 0;
+        uint64_t start = nowNs();
+        for (unsigned long i = 0; i < lookups; i++)
+        {
+            uint32_t index = rngBelow(&rng, (uint32_t)players);
+            snprintf(name, sizeof(name), i % 10 == 9 ? "missing%08u" : "player%08u", index);
+            sink += scores_get_wins(server, name);
+        }
+        double times[2];
+        times[0] = (double)(nowNs() - start) / (double)lookups;
+
+        ScoreEntry updates[SCORE_UPDATES];
+        for (int i = 0; i < SCORE_UPDATES; i++)
+        {
+            snprintf(updates[i].name, sizeof(updates[i].name), "player%08u", rngBelow(&rng, (uint32_t)players));
+            updates[i].wins = 5000 + i;
+        }
+        scores_update(server, updates, SCORE_UPDATES);
+        start = nowNs();
+        scores_save(server);
+        times[1] = (double)(nowNs() - start);
+
+        write(pipeFDs[1], times, sizeof(times));
+        _exit(0);
+    }
+
+    close(pipeFDs[1]);
+    double times[2] = {0, 0};
+    bool ok = read(pipeFDs[0], times, sizeof(times)) == sizeof(times);
+    close(pipeFDs[0]);
+    int status;
+    waitpid(child, &status, 0);
+    if (!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        fprintf(stderr, "bench: score run with %zu players failed\n", players);
+        exit(1);
+    }
+    *lookupNs = times[0];
+    *saveNs = times[1];
+}
+
+static void benchScores(void)
+{
+    static const size_t sizes[] = {10000, 100000, 1000000};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        char getName[NAME_LENGTH];
+        char saveName[NAME_LENGTH];
+        snprintf(getName, sizeof(getName), "scores_get_wins_%zu", sizes[i]);
+        snprintf(saveName, sizeof(saveName), "scores_save_%zu", sizes[i]);
+        if (!selected(getName) && !selected(saveName))
+            continue;
+
+        unsigned long lookups = scaled(200000);
+        int count = config.repeat < 64 ? config.repeat : 64;
+        double lookupRuns[64];
+        double saveRuns[64];
+        for (int run = 0; run < count; run++)
+            scoreRun(sizes[i], lookups, &lookupRuns[run], &saveRuns[run]);
+        if (selected(getName))
+            addResult(getName, lookups, lookupRuns, count);
+        if (selected(saveName))
+            addResult(saveName, 1, saveRuns, count);
+    }
+}
+
+/* ---- ServerState.mutex shared between threads ---- */
+
+/*
+ * Every thread of the server (event loop, logger, persistence worker,
+ * leaderboard builder, metrics) takes ServerState's mutex. Here 1 to 8
+ * threads each take and release it in a loop; the result is the wall time
+ * per lock taken, so contention shows up as the time rising with the
+ * thread count.
+ */
+typedef struct {
+    int threads;
+    ServerState *shared;
+    unsigned long each;
+} MutexBench;
+
+static void *lockLoop(void *arg)
+{
+    MutexBench *bench = arg;
+    ServerState *shared = bench->shared;
+    //Wait on roomCount going non-zero so all threads start together
+    while (__atomic_load_n(&shared->roomCount, __ATOMIC_ACQUIRE) == 0)
+        sched_yield();
+    for (unsigned long i = 0; i < bench->each; i++)
+    {
+        pthread_mutex_lock(&shared->mutex);
+        shared->nextRoomID++;
+        pthread_mutex_unlock(&shared->mutex);
+    }
+    return NULL;
+}
+
+static uint64_t runServerMutex(void *arg, unsigned long iterations)
+{
+    MutexBench *bench = arg;
+    ServerState *shared = calloc(1, sizeof(ServerState));
+    if (!shared)
+    {
+        perror("bench: calloc");
+        exit(1);
+    }
+    pthread_mutex_init(&shared->mutex, NULL);
+    bench->shared = shared;
+    bench->each = iterations / (unsigned long)bench->threads;
+
+    pthread_t threads[16];
+    for (int t = 0; t < bench->threads; t++)
+        pthread_create(&threads[t], NULL, lockLoop, bench);
+
+    uint64_t start = nowNs();
+    __atomic_store_n(&shared->roomCount, 1, __ATOMIC_RELEASE);
+    for (int t = 0; t < bench->threads; t++)
+        pthread_join(threads[t], NULL);
+    uint64_t elapsed = nowNs() - start;
+
+    unsigned long total = bench->each * (unsigned long)bench->threads;
+    if ((unsigned long)shared->nextRoomID != total)
+        fprintf(stderr, "bench: server mutex lost updates\n");
+    pthread_mutex_destroy(&shared->mutex);
+    free(shared);
+    return elapsed * iterations / total;
+}
+
+static void benchServerMutex(void)
+{
+    static const int threads[] = {1, 2, 4, 8};
+    for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++)
+    {
+        char name[NAME_LENGTH];
+        snprintf(name, sizeof(name), "server_mutex_%d_threads", threads[i]);
+        MutexBench bench = {.threads = threads[i]};
+        runBenchmark(name, scaled(400000), runServerMutex, &bench);
+    }
+}
+
+/* ---- output ---- */
+
+/* Reads the medians out of an earlier --out file; only the lines this program writes are understood */
+static void loadBaseline(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+    {
+        perror(path);
+        exit(1);
+    }
+    char line[512];
+    while (fgets(line, sizeof(line), fp))
+    {
+        char name[NAME_LENGTH];
+        const char *median = strstr(line, "\"ns_per_op\": ");
+        if (sscanf(line, " {\"name\": \"%47[^\"]\"", name) != 1 || !median)
+            continue;
+        double value = strtod(median + strlen("\"ns_per_op\": "), NULL);
+        for (int i = 0; i < resultCount; i++)
+        {
+            if (strcmp(results[i].name, name) == 0)
+                results[i].baselineNs = value;
+        }
+    }
+    fclose(fp);
+}
+
+static void writeResults(FILE *out)
+{
+    time_t now = time(NULL);
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+    fprintf(out, "{\"generated\": \"%s\", \"repeat\": %d, \"scale\": %g, \"baseline\": ", stamp, config.repeat, config.scale);
+    if (config.baselinePath)
+        fprintf(out, "\"%s\",\n", config.baselinePath);
+    else
+        fprintf(out, "null,\n");
+    fprintf(out, "\"benchmarks\": [\n");
+    for (int i = 0; i < resultCount; i++)
+    {
+        const BenchResult *result = &results[i];
+        fprintf(out, " {\"name\": \"%s\", \"iterations\": %lu, \"ns_per_op\": %.2f, \"min_ns_per_op\": %.2f, \"ops_per_sec\": %.1f",
+                result->name, result->iterations, result->medianNs, result->minNs,
+                result->medianNs > 0 ? 1e9 / result->medianNs : 0.0);
+        if (result->baselineNs > 0)
+            fprintf(out, ", \"baseline_ns_per_op\": %.2f, \"change_percent\": %.1f", result->baselineNs,
+                    (result->medianNs - result->baselineNs) / result->baselineNs * 100.0);
+        fprintf(out, "}%s\n", i + 1 < resultCount ? "," : "");
+    }
+    fprintf(out, "]}\n");
+}
+
+static void printComparison(void)
+{
+    fprintf(stderr, "\n%-34s %14s %14s %9s\n", "Compared with baseline", "baseline ns", "now ns", "change");
+    for (int i = 0; i < resultCount; i++)
+    {
+        const BenchResult *result = &results[i];
+        if (result->baselineNs <= 0)
+        {
+            fprintf(stderr, "%-34s %14s %14.1f %9s\n", result->name, "-", result->medianNs, "new");
+            continue;
+        }
+        fprintf(stderr, "%-34s %14.1f %14.1f %+8.1f%%\n", result->name, result->baselineNs, result->medianNs,
+                (result->medianNs - result->baselineNs) / result->baselineNs * 100.0);
+    }
+}
+
+/* The scratch directory only ever holds plain files and one level of subdirectories */
+static void removeTree(const char *path)
+{
+    DIR *dir = opendir(path);
+    if (!dir)
+        return;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        char child[PATH_MAX];
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        if (unlink(child) != 0)
+            removeTree(child);
+    }
+    closedir(dir);
+    rmdir(path);
+}
+
+static void printUsage(const char *program)
+{
+    printf("Usage: %s [options]\n"
+           "  --out=FILE             write the results as JSON to FILE, - for stdout (default %s)\n"
+           "  --baseline=FILE        compare with the results of an earlier run\n"
+           "  --repeat=N             timed runs per benchmark; the median is reported (default %d)\n"
+           "  --scale=X              multiply every iteration count by X (default 1)\n"
+           "  --filter=TEXT          only run benchmarks whose name contains TEXT\n",
+           program, config.outPath, config.repeat);
+}
+
+static void parseArgs(int argc, char *argv[])
+{
+    static const struct option options[] = {
+        {"out", required_argument, NULL, 'o'},
+        {"baseline", required_argument, NULL, 'b'},
+        {"repeat", required_argument, NULL, 'r'},
+        {"scale", required_argument, NULL, 's'},
+        {"filter", required_argument, NULL, 'f'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'o':
+            config.outPath = optarg;
+            break;
+        case 'b':
+            config.baselinePath = optarg;
+            break;
+        case 'r':
+            config.repeat = atoi(optarg);
+            if (config.repeat < 1 || config.repeat > 64)
+            {
+                fprintf(stderr, "Invalid value for --repeat: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 's':
+            config.scale = strtod(optarg, NULL);
+            if (config.scale <= 0)
+            {
+                fprintf(stderr, "Invalid value for --scale: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'f':
+            config.filter = optarg;
+            break;
+        case 'h':
+            printUsage(argv[0]);
+            exit(0);
+        default:
+            printUsage(argv[0]);
+            exit(1);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    parseArgs(argc, argv);
+    signal(SIGPIPE, SIG_IGN);
+
+    //Results and baseline are named relative to where bench was started
+    FILE *out = strcmp(config.outPath, "-") == 0 ? stdout : fopen(config.outPath, "w");
+    if (!out)
+    {
+        perror(config.outPath);
+        return 1;
+    }
+    char baselinePath[PATH_MAX];
+    if (config.baselinePath && !realpath(config.baselinePath, baselinePath))
+    {
+        perror(config.baselinePath);
+        return 1;
+    }
+
+    char scratch[] = "/tmp/memory-bench-XXXXXX";
+    if (!mkdtemp(scratch) || chdir(scratch) != 0)
+    {
+        perror("bench: scratch directory");
+        return 1;
+    }
+
+    //The code under test prints to stdout as the server does; that goes nowhere while it runs
+    fflush(stdout);
+    savedStdout = dup(STDOUT_FILENO);
+    int devNull = open("/dev/null", O_WRONLY);
+    dup2(devNull, STDOUT_FILENO);
+    close(devNull);
+
+    serverConfig.logCompress = LOG_COMPRESS_NONE;
+    timerQueueInit();
+    ServerState *server = calloc(1, sizeof(ServerState));
+    pthread_mutex_init(&server->mutex, NULL);
+    server->nextRoomID = 1;
+
+    fprintf(stderr, "Running benchmarks in %s (%d runs each)\n", scratch, config.repeat);
+    benchBoards(server);
+    benchBroadcast(server, false);
+    benchBroadcast(server, true);
+    benchLogger(server);
+    benchScores();
+    benchServerMutex();
+
+    fflush(stdout);
+    dup2(savedStdout, STDOUT_FILENO);
+    close(savedStdout);
+    timerQueueDestroy();
+    removeTree(scratch);
+
+    if (config.baselinePath)
+    {
+        loadBaseline(baselinePath);
+        printComparison();
+    }
+    writeResults(out);
+    if (out != stdout)
+    {
+        fclose(out);
+        fprintf(stderr, "Results written to %s\n", config.outPath);
+    }
+    return 0;
+}
@@ -0,0 +1,112 @@
+#include "cards.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Reallocates a bitset from oldCards to newCards bits, clearing the words it gained */
+void growCardWords(CardWord **words, int oldCards, int newCards)
+{
+    size_t oldWords = CARD_WORDS(oldCards);
+    size_t newWords = CARD_WORDS(newCards);
+    if (newWords <= oldWords && *words)
+        return;
+
+    CardWord *grown = realloc(*words, newWords * sizeof(CardWord));
+    if (!grown)
+    {
+        perror("growCardWords: realloc");
+        exit(1);
+    }
+    memset(grown + oldWords, 0, (newWords - oldWords) * sizeof(CardWord));
+    *words = grown;
+}
+
+static void *growArray(void *array, size_t size)
+{
+    void *grown = realloc(array, size);
+    if (!grown)
+    {
+        perror("cardsResize: realloc");
+        exit(1);
+    }
+    return grown;
+}
+
+/* Makes room for count cards and turns them all face down; the values still need dealing */
+void cardsResize(CardBoard *cards, int count)
+{
+    if (count > cards->capacity)
+    {
+        cards->faceValue = growArray(cards->faceValue, (size_t)count * sizeof(uint16_t));
+        cards->partner = growArray(cards->partner, (size_t)count * sizeof(uint16_t));
+        growCardWords(&cards->flipped, cards->capacity, count);
+        growCardWords(&cards->matched, cards->capacity, count);
+        memset(cards->faceValue + cards->capacity, 0, (size_t)(count - cards->capacity) * sizeof(uint16_t));
+        memset(cards->partner + cards->capacity, 0, (size_t)(count - cards->capacity) * sizeof(uint16_t));
+        cards->capacity = count;
+    }
+    cards->count = count;
+    cardsClear(cards);
+}
+
+void cardsFree(CardBoard *cards)
+{
+    free(cards->faceValue);
+    free(cards->partner);
+    free(cards->flipped);
+    free(cards->matched);
+    memset(cards, 0, sizeof(*cards));
+}
+
+/* Every card face down and unmatched, including the spare capacity, so popcounts see only the board */
+void cardsClear(CardBoard *cards)
+{
+    if (cards->capacity == 0)
+        return;
+    memset(cards->flipped, 0, CARD_WORDS(cards->capacity) * sizeof(CardWord));
+    memset(cards->matched, 0, CARD_WORDS(cards->capacity) * sizeof(CardWord));
+}
+
+/* Points each card at the other card with its value; call after the values change */
+void cardsLinkPartners(CardBoard *cards)
+{
+    int pairs = cards->count / 2;
+    if (pairs == 0)
+        return;
+
+    int *firstSeen = malloc((size_t)pairs * sizeof(int));
+    if (!firstSeen)
+    {
+        perror("cardsLinkPartners: malloc");
+        exit(1);
+    }
+    for (int value = 0; value < pairs; value++)
+        firstSeen[value] = -1;
+
+    for (int card = 0; card < cards->count; card++)
+    {
+        int value = cards->faceValue[card];
+        cards->partner[card] = (uint16_t)card;
+        if (value >= pairs)
+            continue;
+        if (firstSeen[value] < 0)
+        {
+            firstSeen[value] = card;
+        }
+        else
+        {
+            cards->partner[card] = (uint16_t)firstSeen[value];
+            cards->partner[firstSeen[value]] = (uint16_t)card;
+        }
+    }
+    free(firstSeen);
+}
+
+/* Matched cards (twice the matched pairs), a popcount per 64 cards */
+int cardsMatched(const CardBoard *cards)
+{
+    int matched = 0;
+    for (int w = 0; w < CARD_WORDS(cards->count); w++)
+        matched += __builtin_popcountll(cards->matched[w]);
+    return matched;
+}
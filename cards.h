@@ -0,0 +1,73 @@
+#ifndef CARDS_H
+#define CARDS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * A room's cards, stored column-wise rather than as one struct per card.
+ *
+ * faceValue[i] is card i's pair value and partner[i] the index of the
+ * other card with that value, both fixed when the board is dealt. What
+ * changes during a game is two bitsets, one bit per card: flipped and
+ * matched. Asking whether a card is face up is a single mask test,
+ * counting matched pairs is a popcount over count / 64 words, and
+ * finding what changed since the last broadcast is an XOR of words, so
+ * even a 256x256 board's live state (16 KiB) stays in L1.
+ *
+ * Bits past count are always clear. Storage only grows; see cardsResize().
+ */
+
+typedef uint64_t CardWord;
+
+#define CARD_WORD_BITS 64
+#define CARD_WORDS(cards) (((cards) + CARD_WORD_BITS - 1) / CARD_WORD_BITS)
+
+typedef struct {
+    int count;              // cards on the board
+    int capacity;           // cards there is storage for
+    uint16_t *faceValue;    // values and indices both fit: at most 65536 cards, see MAX_BOARD_SIDE
+    uint16_t *partner;
+    CardWord *flipped;
+    CardWord *matched;
+} CardBoard;
+
+void cardsResize(CardBoard *cards, int count);
+void cardsFree(CardBoard *cards);
+void cardsClear(CardBoard *cards);
+void cardsLinkPartners(CardBoard *cards);
+int cardsMatched(const CardBoard *cards);
+void growCardWords(CardWord **words, int oldCards, int newCards);
+
+static inline bool cardFlipped(const CardBoard *cards, int card)
+{
+    return (cards->flipped[card / CARD_WORD_BITS] >> (card % CARD_WORD_BITS)) & 1;
+}
+
+static inline bool cardMatched(const CardBoard *cards, int card)
+{
+    return (cards->matched[card / CARD_WORD_BITS] >> (card % CARD_WORD_BITS)) & 1;
+}
+
+/* Flipped or matched: anything but face down */
+static inline bool cardFaceUp(const CardBoard *cards, int card)
+{
+    CardWord up = cards->flipped[card / CARD_WORD_BITS] | cards->matched[card / CARD_WORD_BITS];
+    return (up >> (card % CARD_WORD_BITS)) & 1;
+}
+
+static inline void cardSetFlipped(CardBoard *cards, int card, bool flipped)
+{
+    CardWord bit = (CardWord)1 << (card % CARD_WORD_BITS);
+    if (flipped)
+        cards->flipped[card / CARD_WORD_BITS] |= bit;
+    else
+        cards->flipped[card / CARD_WORD_BITS] &= ~bit;
+}
+
+static inline void cardSetMatched(CardBoard *cards, int card)
+{
+    cards->matched[card / CARD_WORD_BITS] |= (CardWord)1 << (card % CARD_WORD_BITS);
+}
+
+#endif
@@ -6,17 +6,37 @@
 #include <arpa/inet.h>
 #include <sys/select.h>
 
+#include "protocol.h"
+
 #define SERVER_PORT 8080
 #define BUFFER_SIZE 128
-#define BOARD_ROWS 3
-#define BOARD_COLS 4
-#define TOTAL_CARDS (BOARD_ROWS * BOARD_COLS)
-
-static void updateMatchedFromBoard(const char *msg, bool matched[])
-{
-    (void)msg;
-    (void)matched;
-}
+#define INBUF_SIZE (MAX_FRAME_PAYLOAD + FRAME_HEADER_SIZE)
+#define MAX_SCOREBOARD 8
+
+typedef struct {
+    int rows;
+    int cols;
+    unsigned char *state;
+    int *value;
+} Board;
+
+typedef struct {
+    int count;
+    int id[MAX_SCOREBOARD];
+    int score[MAX_SCOREBOARD];
+    int roundScore[MAX_SCOREBOARD];
+    char name[MAX_SCOREBOARD][32];
+} Scoreboard;
+
+static unsigned char *inbuf;
+static size_t inLen = 0;
+static size_t inConsumed = 0;
+
+static Board board;
+static Scoreboard scoreboard;
+static uint32_t boardSeq = 0;
+static bool awaitingSnapshot = false;
+static char eventText[1024];
 
 static void printPickPrompt(int pickCardCount)
 {
@@ -39,6 +59,312 @@ bool checkServerConnection(int sock)
     return true;
 }
 
+//Returns the next buffered frame, dropping the one returned before it
+static int nextFrame(uint8_t *opcode, FrameReader *payload)
+{
+    if (inConsumed > 0)
+    {
+        memmove(inbuf, inbuf + inConsumed, inLen - inConsumed);
+        inLen -= inConsumed;
+        inConsumed = 0;
+    }
+
+    int used = frameParse(inbuf, inLen, opcode, payload);
+    if (used > 0)
+        inConsumed = used;
+    return used;
+}
+
+//True when a whole frame is already buffered, e.g. the snapshot that came in with a rejoin
+static bool frameBuffered(void)
+{
+    uint8_t opcode;
+    FrameReader payload;
+    return frameParse(inbuf + inConsumed, inLen - inConsumed, &opcode, &payload) > 0;
+}
+
+static bool receiveMore(int sock)
+{
+    int bytes = recv(sock, inbuf + inLen, INBUF_SIZE - inLen, 0);
+    if (bytes <= 0)
+        return false;
+    inLen += bytes;
+    return true;
+}
+
+//Blocks until one whole frame is available
+static bool waitFrame(int sock, uint8_t *opcode, FrameReader *payload)
+{
+    while (1)
+    {
+        int used = nextFrame(opcode, payload);
+        if (used > 0)
+            return true;
+        if (used < 0)
+        {
+            printf("\nServer sent an invalid frame.\n");
+            return false;
+        }
+        if (!receiveMore(sock))
+        {
+            printf("\nDisconnected from server.\n");
+            return false;
+        }
+    }
+}
+
+static void sendSimple(int sock, uint8_t opcode)
+{
+    FrameBuffer fb;
+    frameBufferInit(&fb);
+    frameBegin(&fb, opcode);
+    frameEnd(&fb);
+    send(sock, fb.data, fb.len, 0);
+    frameBufferFree(&fb);
+}
+
+static void sendWithString(int sock, uint8_t opcode, const char *str)
+{
+    FrameBuffer fb;
+    frameBufferInit(&fb);
+    frameBegin(&fb, opcode);
+    framePutString(&fb, str);
+    frameEnd(&fb);
+    send(sock, fb.data, fb.len, 0);
+    frameBufferFree(&fb);
+}
+
+static void sendWithU32(int sock, uint8_t opcode, uint32_t value)
+{
+    FrameBuffer fb;
+    frameBufferInit(&fb);
+    frameBegin(&fb, opcode);
+    framePutU32(&fb, value);
+    frameEnd(&fb);
+    send(sock, fb.data, fb.len, 0);
+    frameBufferFree(&fb);
+}
+
+static bool isRoomCommand(const char *input)
+{
+    return strcmp(input, "ROOMS") == 0 ||
+           strncmp(input, "JOIN ", 5) == 0 ||
+           strcmp(input, "CREATE") == 0 ||
+           strncmp(input, "CREATE ", 7) == 0 ||
+           strcmp(input, "TOP") == 0 ||
+           strncmp(input, "TOP ", 4) == 0 ||
+           strcmp(input, "RANK") == 0 ||
+           strncmp(input, "RANK ", 5) == 0 ||
+           strncmp(input, "BOARD ", 6) == 0;
+}
+
+static void sendRoomCommand(int sock, const char *input)
+{
+    if (strcmp(input, "ROOMS") == 0)
+    {
+        sendSimple(sock, CMD_ROOMS);
+    }
+    else if (strncmp(input, "JOIN ", 5) == 0)
+    {
+        int roomID;
+        if (sscanf(input + 5, "%d", &roomID) == 1 && roomID > 0)
+            sendWithU32(sock, CMD_JOIN_ROOM, (uint32_t)roomID);
+        else
+            printf("Usage: JOIN <room id>\n");
+    }
+    else if (strncmp(input, "TOP", 3) == 0)
+    {
+        int count = 10;
+        sscanf(input + 3, "%d", &count);
+        FrameBuffer fb;
+        frameBufferInit(&fb);
+        frameBegin(&fb, CMD_TOP);
+        framePutU8(&fb, (uint8_t)(count < 1 ? 1 : count > 255 ? 255 : count));
+        frameEnd(&fb);
+        send(sock, fb.data, fb.len, 0);
+        frameBufferFree(&fb);
+    }
+    else if (strncmp(input, "RANK", 4) == 0)
+    {
+        char name[32] = "";
+        sscanf(input + 4, "%31s", name);
+        sendWithString(sock, CMD_RANK, name);
+    }
+    else if (strncmp(input, "BOARD ", 6) == 0)
+    {
+        int rows, cols;
+        if (sscanf(input + 6, "%dx%d", &rows, &cols) != 2 || !boardSizeValid(rows, cols))
+        {
+            printf("Usage: BOARD <rows>x<cols>, each 1 to %d, with an even number of cards\n", MAX_BOARD_SIDE);
+            printf("Please type 1 to READY: ");
+            fflush(stdout);
+            return;
+        }
+        FrameBuffer fb;
+        frameBufferInit(&fb);
+        frameBegin(&fb, CMD_BOARD_SIZE);
+        framePutU16(&fb, (uint16_t)rows);
+        framePutU16(&fb, (uint16_t)cols);
+        frameEnd(&fb);
+        send(sock, fb.data, fb.len, 0);
+        frameBufferFree(&fb);
+    }
+    else
+    {
+        char name[32] = "";
+        sscanf(input + 6, "%31s", name);
+        sendWithString(sock, CMD_CREATE_ROOM, name);
+    }
+}
+
+static int totalCards(void)
+{
+    return board.rows * board.cols;
+}
+
+/* Deltas must arrive in order; on a gap drop them and ask for a fresh snapshot */
+static bool acceptSeq(int sock, uint32_t seq)
+{
+    if (awaitingSnapshot)
+        return false;
+    if (seq != boardSeq + 1)
+    {
+        sendSimple(sock, CMD_SNAPSHOT);
+        awaitingSnapshot = true;
+        return false;
+    }
+    boardSeq = seq;
+    return true;
+}
+
+static void decodeBoard(FrameReader *payload)
+{
+    boardSeq = frameGetU32(payload);
+    awaitingSnapshot = false;
+
+    int rows = frameGetU16(payload);
+    int cols = frameGetU16(payload);
+
+    if (rows * cols != totalCards())
+    {
+        free(board.state);
+        free(board.value);
+        board.state = calloc((size_t)rows * cols + 1, 1);
+        board.value = calloc((size_t)rows * cols + 1, sizeof(int));
+        if (!board.state || !board.value)
+        {
+            perror("calloc");
+            exit(1);
+        }
+    }
+    board.rows = rows;
+    board.cols = cols;
+
+    for (int i = 0; i < rows * cols; i++)
+    {
+        board.state[i] = frameGetU8(payload);
+        board.value[i] = board.state[i] == CARD_STATE_HIDDEN ? -1 : frameGetU16(payload);
+    }
+}
+
+static void decodeScoreboard(FrameReader *payload)
+{
+    int count = frameGetU8(payload);
+    scoreboard.count = 0;
+    for (int i = 0; i < count && i < MAX_SCOREBOARD; i++)
+    {
+        scoreboard.id[i] = frameGetU8(payload);
+        scoreboard.score[i] = frameGetI32(payload);
+        scoreboard.roundScore[i] = frameGetI32(payload);
+        frameGetString(payload, scoreboard.name[i], sizeof(scoreboard.name[i]));
+        scoreboard.count++;
+    }
+}
+
+static int digitCount(int value)
+{
+    int digits = 1;
+    for (; value >= 10; value /= 10)
+        digits++;
+    return digits;
+}
+
+static void printBoard(int playerTurn)
+{
+    //Same widths as the server's text board: two digits, or more when the board needs them
+    int valueWidth = digitCount(totalCards() / 2 - 1) > 2 ? digitCount(totalCards() / 2 - 1) : 2;
+    int idWidth = digitCount(totalCards() - 1) > 2 ? digitCount(totalCards() - 1) : 2;
+
+    printf("\033[H\033[JBoard State (VALUES / IDs):\n");
+    for (int r = 0; r < board.rows; r++)
+    {
+        printf("Values: ");
+        for (int c = 0; c < board.cols; c++)
+        {
+            int idx = r * board.cols + c;
+            if (board.state[idx] == CARD_STATE_HIDDEN)
+                printf(" [%.*s] ", valueWidth, "-----");
+            else
+                printf(" [%0*d] ", valueWidth, board.value[idx]);
+        }
+        printf("\nIDs:    ");
+        for (int c = 0; c < board.cols; c++)
+            printf(" (%0*d) ", idWidth, r * board.cols + c);
+        printf("\n");
+    }
+
+    if (eventText[0] != '\0')
+        printf("\n%s\n", eventText);
+
+    printf("\nScoreboard:\n");
+    for (int i = 0; i < scoreboard.count; i++)
+    {
+        const char *name = scoreboard.name[i][0] ? scoreboard.name[i] : "Unknown";
+        printf("%s (ID %d): Total Score %d | Score This Round %d\n",
+               name, scoreboard.id[i], scoreboard.score[i], scoreboard.roundScore[i]);
+    }
+    printf("PLAYER TURN %d\n\n", playerTurn);
+}
+
+static void printRoomList(FrameReader *payload)
+{
+    uint32_t count = frameGetU32(payload);
+    printf("ROOMS %u\n", count);
+    for (uint32_t i = 0; i < count && !payload->error; i++)
+    {
+        uint32_t id = frameGetU32(payload);
+        int players = frameGetU8(payload);
+        int maxPlayers = frameGetU8(payload);
+        bool playing = frameGetU8(payload) != 0;
+        char name[64];
+        frameGetString(payload, name, sizeof(name));
+        printf("Room %u (%s): %d/%d players, %s\n", id, name, players, maxPlayers, playing ? "playing" : "waiting");
+    }
+    uint32_t omitted = frameGetU32(payload);
+    if (omitted > 0 && !payload->error)
+        printf("... and %u more rooms not listed\n", omitted);
+    printf("\n");
+}
+
+static void printLeaderboard(FrameReader *payload)
+{
+    uint32_t players = frameGetU32(payload);
+    uint32_t rank = frameGetU32(payload);
+    int count = frameGetU8(payload);
+    printf("LEADERBOARD %u players\n", players);
+    if (rank > 0)
+        printf("Ranked #%u\n", rank);
+    for (int i = 0; i < count && !payload->error; i++)
+    {
+        uint32_t rowRank = frameGetU32(payload);
+        int score = frameGetI32(payload);
+        char name[64];
+        frameGetString(payload, name, sizeof(name));
+        printf("#%u %s: %d\n", rowRank, name, score);
+    }
+    printf("\n");
+}
+
 int main()
 {
     int sock;
@@ -48,16 +374,22 @@ int main()
     static int len = 0;
     int playerTurn = -1;
     bool myTurn = false;
-    int myPlayerID = -1;    
+    int myPlayerID = -1;
     bool readyMode = false;
-    bool ignoreWaiting = false;
-    bool pendingTurnMsg = false;
+    bool gameStarted = false;
+    bool boardDirty = false;
+    bool promptAfterDraw = false;
     int lastAnnouncedTurn = -1;
     bool lastAnnouncedMyTurn = false;
-    bool matchedCards[TOTAL_CARDS] = {false};
-    int lastSentIndex = -1;
     int lastSentPick = 0;
 
+    inbuf = malloc(INBUF_SIZE);
+    if (!inbuf)
+    {
+        perror("malloc");
+        exit(1);
+    }
+
     sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock < 0)
     {
@@ -76,6 +408,7 @@ int main()
         exit(1);
     }
 
+    //The connect banner is always text; binary frames start after PROTO BIN
     bool gotPlayerID = false;
     bigBuffer[0] = '\0';
     len = 0;
@@ -125,240 +458,123 @@ int main()
         }
     }
 
-    len = 0;
-    bigBuffer[0] = '\0';
+    char hello[32];
+    snprintf(hello, sizeof(hello), "%s %d\n", PROTOCOL_HELLO, PROTOCOL_VERSION);
+    send(sock, hello, strlen(hello), 0);
 
-    while (1)
+    uint8_t opcode;
+    FrameReader payload;
+    if (!waitFrame(sock, &opcode, &payload) || opcode != MSG_HELLO)
     {
-        printf("Enter name (no spaces): ");
-        fflush(stdout);
-        if (!fgets(buffer, sizeof(buffer), stdin))
-            return 0;
-        buffer[strcspn(buffer, "\r\n")] = '\0';
-        if (buffer[0] == '\0' || strchr(buffer, ' ') != NULL || strchr(buffer, '\t') != NULL)
-        {
-            printf("Invalid name. Use letters/numbers without spaces.\n");
-            continue;
-        }
-        char nameMsg[BUFFER_SIZE + 8];
-        snprintf(nameMsg, sizeof(nameMsg), "NAME %s\n", buffer);
-        send(sock, nameMsg, strlen(nameMsg), 0);
-
-        len = 0;
-        bigBuffer[0] = '\0';
-        while (1)
-        {
-            int bytes = recv(sock, bigBuffer + len, sizeof(bigBuffer) - len - 1, 0);
-            if (bytes <= 0)
-            {
-                printf("\nDisconnected from server.\n");
-                close(sock);
-                return 0;
-            }
-            len += bytes;
-            bigBuffer[len] = '\0';
-
-            char *msgPtr;
-            while ((msgPtr = strstr(bigBuffer, "<<END>>")) != NULL)
-            {
-                *msgPtr = '\0';
-                char *currentMsg = bigBuffer;
-
-                if (strstr(currentMsg, "NAME_TAKEN") != NULL)
-                {
-                    printf("Name already taken. Please choose another.\n");
-                    int dLen = 7;
-                    int processedLen = (msgPtr + dLen) - bigBuffer;
-                    int remaining = len - processedLen;
-                    if (remaining > 0)
-                        memmove(bigBuffer, msgPtr + dLen, remaining);
-                    len = remaining;
-                    bigBuffer[len] = '\0';
-                    goto RETRY_NAME;
-                }
-
-                if (*currentMsg != '\0')
-                {
-                    printf("%s\n", currentMsg);
-                }
-
-                int dLen = 7;
-                int processedLen = (msgPtr + dLen) - bigBuffer;
-                int remaining = len - processedLen;
-                if (remaining > 0)
-                    memmove(bigBuffer, msgPtr + dLen, remaining);
-                len = remaining;
-                bigBuffer[len] = '\0';
-                goto NAME_ACCEPTED;
-            }
-        }
-
-RETRY_NAME:
-        continue;
-
-NAME_ACCEPTED:
-        break;
+        printf("Server does not support protocol version %d.\n", PROTOCOL_VERSION);
+        close(sock);
+        return 0;
     }
+    frameGetU8(&payload);
+    frameGetU32(&payload);
+    myPlayerID = frameGetU8(&payload);
 
-READY_PHASE:
+    bool rejoined = false;
     while (1)
     {
-        printf("Please type 1 to READY:");
+        printf("Enter name (no spaces), or REJOIN <token> to get a dropped seat back: ");
         fflush(stdout);
-
         if (!fgets(buffer, sizeof(buffer), stdin))
             return 0;
-
         buffer[strcspn(buffer, "\r\n")] = '\0';
-        char *p = buffer;
-        while (*p == ' ' || *p == '\t')
-            p++;
-        if (!(p[0] == '1' && p[1] == '\0'))
+        char token[32];
+        if (sscanf(buffer, "REJOIN %31s", token) == 1)
         {
-            printf("Unexpected Input. Please type exactly 1.\n\n");
+            sendWithString(sock, CMD_REJOIN, token);
+        }
+        else if (buffer[0] == '\0' || strchr(buffer, ' ') != NULL || strchr(buffer, '\t') != NULL)
+        {
+            printf("Invalid name. Use letters/numbers without spaces.\n");
             continue;
         }
-
-        /* Send READY to server */
-        send(sock, buffer, strlen(buffer), 0);
-        break;
-    }
-    bool gameStarted = false;
-    bool pendingBoardMsg = false;
-    char pendingBoard[4096];
-    pendingBoard[0] = '\0';
-
-    while (1)
-    {
-        int bytes = recv(sock, bigBuffer + len, sizeof(bigBuffer) - len - 1, 0);
-
-        if (bytes <= 0)
+        else
         {
-            printf("\nDisconnected from server.\n");
-            close(sock);
-            return 0;
+            sendWithString(sock, CMD_NAME, buffer);
         }
 
-        len += bytes;
-        bigBuffer[len] = '\0';
-
-        char *msgPtr;
-        while ((msgPtr = strstr(bigBuffer, "<<END>>")) != NULL)
+        bool accepted = false;
+        bool answered = false;
+        while (!answered)
         {
-            *msgPtr = '\0';
-            char *currentMsg = bigBuffer;
-
-            if (strstr(currentMsg, "GAME_STOPPED") != NULL)
+            if (!waitFrame(sock, &opcode, &payload))
             {
-                printf("%s\n", currentMsg);
-                myTurn = false;
-                readyMode = true;
-                playerTurn = -1;
-                ignoreWaiting = true;
-                gameStarted = false;
-                len = 0;
-                bigBuffer[0] = '\0';
-                goto READY_PHASE;
+                close(sock);
+                return 0;
             }
 
-            if (strstr(currentMsg, "GAME STARTED") != NULL)
+            if (opcode == MSG_NAME_TAKEN)
             {
-                gameStarted = true;
-                readyMode = false;
+                printf("Name already taken. Please choose another.\n");
+                answered = true;
             }
-
-            if (strstr(currentMsg, "Board State") != NULL)
+            else if (opcode == MSG_WELCOME)
             {
-                strncpy(pendingBoard, currentMsg, sizeof(pendingBoard) - 1);
-                pendingBoard[sizeof(pendingBoard) - 1] = '\0';
-                pendingBoardMsg = true;
-                if (gameStarted)
-                {
-                    printf("\033[H\033[J%s\n", pendingBoard);
-                    updateMatchedFromBoard(pendingBoard, matchedCards);
-                }
+                char name[64];
+                int savedScore = frameGetI32(&payload);
+                frameGetString(&payload, name, sizeof(name));
+                frameGetString(&payload, token, sizeof(token));
+                printf("WELCOME %s (Saved Score: %d)\n", name, savedScore);
+                printf("If you lose connection mid-game, start the client again and enter REJOIN %s\n\n", token);
+                answered = true;
+                accepted = true;
             }
-
-            char *turnIndicator = strstr(currentMsg, "PLAYER TURN");
-            if (turnIndicator)
+            else if (opcode == MSG_ROOM_JOINED)
             {
-                if (sscanf(turnIndicator, "PLAYER TURN %d", &playerTurn) == 1)
-                {
-                    myTurn = (playerTurn == myPlayerID);
-                    if (gameStarted)
-                    {
-                        if (playerTurn != lastAnnouncedTurn || myTurn != lastAnnouncedMyTurn)
-                        {
-                            if (myTurn)
-                            {
-                                printf("\n*** YOUR TURN ***\nEnter card index: ");
-                            }
-                            else
-                            {
-                                printf("\nWaiting for Player %d...\n", playerTurn);
-                            }
-                            fflush(stdout);
-                            lastAnnouncedTurn = playerTurn;
-                            lastAnnouncedMyTurn = myTurn;
-                        }
-                    }
-                    else
-                    {
-                        pendingTurnMsg = true;
-                    }
-                }
+                char name[64];
+                uint32_t roomID = frameGetU32(&payload);
+                myPlayerID = frameGetU8(&payload);
+                frameGetString(&payload, name, sizeof(name));
+                printf("REJOINED ROOM %u (%s)\nPLAYER ID %d\n\n", roomID, name, myPlayerID);
+                answered = true;
+                accepted = true;
+                rejoined = true;
             }
-
-            if (!gameStarted)
+            else if (opcode == MSG_ERROR)
             {
-                printf("%s\n", currentMsg);
+                char text[256];
+                frameGetU8(&payload);
+                frameGetText(&payload, text, sizeof(text));
+                printf("%s", text);
+                answered = true;
+            }
+            else if (opcode == MSG_INFO)
+            {
+                char text[2048];
+                frameGetText(&payload, text, sizeof(text));
+                printf("%s\n", text);
             }
-
-            int dLen = 7;
-            int processedLen = (msgPtr + dLen) - bigBuffer;
-            int remaining = len - processedLen;
-            if (remaining > 0)
-                memmove(bigBuffer, msgPtr + dLen, remaining);
-            len = remaining;
-            bigBuffer[len] = '\0';
         }
 
-        if (gameStarted)
+        if (accepted)
             break;
     }
 
-    if (pendingBoardMsg && !gameStarted)
+    //A rejoined seat is mid-game; the snapshot that follows puts the board up
+    if (rejoined)
     {
-        printf("\033[H\033[J%s\n", pendingBoard);
-        updateMatchedFromBoard(pendingBoard, matchedCards);
-        pendingBoardMsg = false;
+        gameStarted = true;
     }
-
-    if (pendingTurnMsg)
+    else
     {
-        if (myTurn)
-        {
-            printf("\n*** YOUR TURN ***\nEnter card index: ");
-        }
-        else
-        {
-            printf("\nWaiting for Player %d...\n", playerTurn);
-        }
+        printf("Type ROOMS to list rooms, CREATE <name> to open one or JOIN <id> to switch.\n");
+        printf("Type TOP [count] for the leaderboard or RANK [name] for a player's place on it.\n");
+        printf("Type BOARD <rows>x<cols> to change the room's board before a game.\n");
+        printf("Please type 1 to READY:");
         fflush(stdout);
-        pendingTurnMsg = false;
-        lastAnnouncedTurn = playerTurn;
-        lastAnnouncedMyTurn = myTurn;
+        readyMode = true;
     }
-    len = 0;
-    bigBuffer[0] = '\0';
-    
+
     int pickCardCount = 0;
     int firstPickIndex = -1;
     int secondPickIndex = -1;
-    while (1)
+    bool connected = true;
+    while (connected)
     {
-        char *msgPtr;
-        int dLen = strlen("<<END>>");
         fd_set readfds;
         FD_ZERO(&readfds);
         FD_SET(sock, &readfds);
@@ -369,88 +585,47 @@ READY_PHASE:
         int maxfd = sock;
         if (watchStdin && STDIN_FILENO > maxfd)
             maxfd = STDIN_FILENO;
-        if (select(maxfd + 1, &readfds, NULL, NULL, NULL) < 0)
+        struct timeval noWait = {0, 0};
+        if (select(maxfd + 1, &readfds, NULL, NULL, frameBuffered() ? &noWait : NULL) < 0)
             break;
 
-        if (FD_ISSET(sock, &readfds))
+        if (FD_ISSET(sock, &readfds) && !receiveMore(sock))
         {
-            int bytes = recv(sock, bigBuffer + len, sizeof(bigBuffer) - len - 1, 0);
-
-            if (bytes <= 0)
-            {
-                printf("\nDisconnected from server.\n");
-                break;
-            }
-
-            len += bytes;
-            bigBuffer[len] = '\0';
+            printf("\nDisconnected from server.\n");
+            break;
         }
 
-        while ((msgPtr = strstr(bigBuffer, "<<END>>")) != NULL)
+        int used;
+        while ((used = nextFrame(&opcode, &payload)) > 0)
         {
-            *msgPtr = '\0';
-            char *currentMsg = bigBuffer;
-            bool handled = false;
-
-            if (strstr(currentMsg, "Board State") != NULL)
-            {
-                printf("\033[H\033[J%s\n", currentMsg);
-                updateMatchedFromBoard(currentMsg, matchedCards);
-                handled = true;
-                if (myTurn && pickCardCount == 1)
-                {
-                    printPickPrompt(pickCardCount);
-                    fflush(stdout);
-                }
-            }
+            char text[2048];
 
-            if (strstr(currentMsg, "Cards ") != NULL && strstr(currentMsg, " match") != NULL)
+            switch (opcode)
             {
-                int a = -1;
-                int b = -1;
-                if (sscanf(currentMsg, "Cards %d and %d match", &a, &b) == 2)
-                {
-                    if (a >= 0 && a < TOTAL_CARDS)
-                        matchedCards[a] = true;
-                    if (b >= 0 && b < TOTAL_CARDS)
-                        matchedCards[b] = true;
-                    if (myTurn && pickCardCount > 0)
-                    {
-                        pickCardCount = 0;
-                        firstPickIndex = -1;
-                        secondPickIndex = -1;
-                        printPickPrompt(pickCardCount);
-                        fflush(stdout);
-                    }
-                }
-            }
+            case MSG_INFO:
+                frameGetText(&payload, text, sizeof(text));
+                printf("%s\n", text);
+                fflush(stdout);
+                break;
 
-            if (strstr(currentMsg, "Cards ") != NULL && strstr(currentMsg, " not match") != NULL)
+            case MSG_ERROR:
             {
-                if (myTurn && pickCardCount > 0)
+                int code = frameGetU8(&payload);
+                frameGetText(&payload, text, sizeof(text));
+                if (code == ERR_ROOM)
                 {
-                    pickCardCount = 0;
-                    firstPickIndex = -1;
-                    secondPickIndex = -1;
+                    printf("ROOM_ERROR %s\n", text);
+                    if (readyMode)
+                        printf("Please type 1 to READY: ");
+                    fflush(stdout);
+                    break;
                 }
-            }
 
-            if (strstr(currentMsg, "Invalid") != NULL ||
-                strstr(currentMsg, "already") != NULL ||
-                strstr(currentMsg, "not your turn") != NULL)
-            {
-                bool matchedErr = strstr(currentMsg, "matched") != NULL;
-                if (matchedErr)
-                {
+                if (code == ERR_ALREADY_FLIPPED)
                     printf("\nThat card is already matched. ");
-                    if (lastSentIndex >= 0 && lastSentIndex < TOTAL_CARDS)
-                        matchedCards[lastSentIndex] = true;
-                }
                 else
-                {
-                    printf("\n[SERVER ERROR]: %s\n", currentMsg);
-                }
-                handled = true;
+                    printf("\n[SERVER ERROR]: %s\n", text);
+
                 if (lastSentPick == 2)
                 {
                     pickCardCount = 1;
@@ -463,222 +638,327 @@ READY_PHASE:
                     secondPickIndex = -1;
                 }
                 lastSentPick = 0;
-                lastSentIndex = -1;
                 if (myTurn)
                 {
                     printPickPrompt(pickCardCount);
                     fflush(stdout);
                 }
+                break;
             }
 
-            if (strstr(currentMsg, "GAME_STOPPED") != NULL)
+            case MSG_ROOM_LIST:
+                printRoomList(&payload);
+                if (readyMode)
+                    printf("Please type 1 to READY: ");
+                fflush(stdout);
+                break;
+
+            case MSG_LEADERBOARD:
+                printLeaderboard(&payload);
+                if (readyMode)
+                    printf("Please type 1 to READY: ");
+                fflush(stdout);
+                break;
+
+            case MSG_BOARD_SIZE:
+            {
+                int rows = frameGetU16(&payload);
+                int cols = frameGetU16(&payload);
+                printf("\nBOARD %dx%d (%d pairs)\n", rows, cols, rows * cols / 2);
+                if (readyMode)
+                    printf("Please type 1 to READY: ");
+                fflush(stdout);
+                break;
+            }
+
+            case MSG_ROOM_JOINED:
             {
+                char name[64];
+                uint32_t roomID = frameGetU32(&payload);
+                myPlayerID = frameGetU8(&payload);
+                frameGetString(&payload, name, sizeof(name));
+                printf("JOINED ROOM %u (%s)\nPLAYER ID %d\n\n", roomID, name, myPlayerID);
+                printf("Please type 1 to READY: ");
+                fflush(stdout);
+                break;
+            }
+
+            case MSG_GAME_STARTED:
+                gameStarted = true;
+                readyMode = false;
+                pickCardCount = 0;
+                lastAnnouncedTurn = -1;
+                break;
+
+            case MSG_GAME_STOPPED:
+                frameGetText(&payload, text, sizeof(text));
                 myTurn = false;
                 pickCardCount = 0;
-                for (int i = 0; i < TOTAL_CARDS; i++)
-                    matchedCards[i] = false;
+                gameStarted = false;
                 readyMode = true;
                 playerTurn = -1;
-                ignoreWaiting = true;
-                handled = true;
-                printf("%s\n", currentMsg);
+                lastAnnouncedTurn = -1;
+                printf("\nGAME_STOPPED\n%s\n", text);
                 printf("Please type 1 to READY: ");
                 fflush(stdout);
-                len = 0;
-                bigBuffer[0] = '\0';
+                break;
+
+            case MSG_BOARD:
+                decodeBoard(&payload);
+                boardDirty = true;
+                break;
+
+            case MSG_CARD_FLIPPED:
+            {
+                int player = frameGetU8(&payload);
+                int card = (int)frameGetU32(&payload);
+                int value = frameGetU16(&payload);
+                snprintf(eventText, sizeof(eventText), "Player %d flipped card %d (Value: %d)", player, card, value);
+                boardDirty = true;
                 break;
             }
 
-            if (strstr(currentMsg, "GAME STARTED") != NULL)
+            case MSG_PAIR_RESULT:
             {
-                readyMode = false;
-                ignoreWaiting = false;
-                pickCardCount = 0;
-                for (int i = 0; i < TOTAL_CARDS; i++)
-                    matchedCards[i] = false;
-                handled = true;
+                int player = frameGetU8(&payload);
+                int first = (int)frameGetU32(&payload);
+                int firstValue = frameGetU16(&payload);
+                int second = (int)frameGetU32(&payload);
+                int secondValue = frameGetU16(&payload);
+                bool matched = frameGetU8(&payload) != 0;
+                snprintf(eventText, sizeof(eventText),
+                         "Player %d flipped card %d (Value: %d)\nPlayer %d flipped card %d (Value: %d)\nCards %d and %d %s",
+                         player, first, firstValue, player, second, secondValue, first, second,
+                         matched ? "match" : "not match");
+                boardDirty = true;
+                if (myTurn && pickCardCount > 0)
+                {
+                    pickCardCount = 0;
+                    firstPickIndex = -1;
+                    secondPickIndex = -1;
+                    promptAfterDraw = matched;
+                }
+                break;
             }
 
-            //Use strstr to find PLAYER TURN if in the current segment
-            char *turnIndicator = strstr(currentMsg, "PLAYER TURN");
-            if (turnIndicator)
+            case MSG_SCOREBOARD:
+                decodeScoreboard(&payload);
+                break;
+
+            case MSG_CARD_UPDATE:
             {
-                if (sscanf(turnIndicator, "PLAYER TURN %d", &playerTurn) == 1)
+                uint32_t seq = frameGetU32(&payload);
+                int card = (int)frameGetU32(&payload);
+                int cardState = frameGetU8(&payload);
+                int value = cardState == CARD_STATE_HIDDEN ? -1 : frameGetU16(&payload);
+                if (acceptSeq(sock, seq) && card >= 0 && card < totalCards())
                 {
-                    myTurn = (playerTurn == myPlayerID);
-                    handled = true;
-                    ignoreWaiting = false;
-                    readyMode = false;
-                    if (playerTurn != lastAnnouncedTurn || myTurn != lastAnnouncedMyTurn)
-                    {
-                        pickCardCount = 0;
-                        if (myTurn)
-                        {
-                            printf("\n*** YOUR TURN ***\nEnter card index: ");
-                        }
-                        else
-                        {
-                            printf("\nWaiting for Player %d...\n", playerTurn);
-                        }
-                        fflush(stdout);
-                        lastAnnouncedTurn = playerTurn;
-                        lastAnnouncedMyTurn = myTurn;
-                    }
+                    board.state[card] = (unsigned char)cardState;
+                    board.value[card] = value;
+                    boardDirty = true;
                 }
+                break;
             }
 
-            if (!handled)
+            case MSG_SCORE_UPDATE:
             {
-                while (*currentMsg == '\n' || *currentMsg == '\r' || *currentMsg == ' ' || *currentMsg == '\t')
-                    currentMsg++;
-                if (*currentMsg != '\0')
+                uint32_t seq = frameGetU32(&payload);
+                int player = frameGetU8(&payload);
+                int score = frameGetI32(&payload);
+                int roundScore = frameGetI32(&payload);
+                if (acceptSeq(sock, seq))
                 {
-                    if (ignoreWaiting && strstr(currentMsg, "Waiting for Player") != NULL)
-                    {
-                        //Ignore stale waiting messages after GAME_STOPPED
-                    }
-                    else
+                    for (int i = 0; i < scoreboard.count; i++)
                     {
-                        printf("%s\n", currentMsg);
+                        if (scoreboard.id[i] == player)
+                        {
+                            scoreboard.score[i] = score;
+                            scoreboard.roundScore[i] = roundScore;
+                        }
                     }
+                    boardDirty = true;
                 }
+                break;
             }
 
-            //Shift buffer
-            int dLen = 7; // strlen("<<END>>")
-            int processedLen = (msgPtr + dLen) - bigBuffer;
-            int remaining = len - processedLen;
-            if (remaining > 0)
-                memmove(bigBuffer, msgPtr + dLen, remaining);
-            len = remaining;
-            bigBuffer[len] = '\0';
+            case MSG_TURN:
+                playerTurn = (int8_t)frameGetU8(&payload);
+                myTurn = (playerTurn == myPlayerID);
+                readyMode = false;
+                break;
+
+            default:
+                break;
+            }
+        }
+
+        if (used < 0)
+        {
+            printf("\nServer sent an invalid frame.\n");
+            break;
+        }
+
+        //Redraw once per batch of updates rather than once per frame
+        if (boardDirty && gameStarted)
+        {
+            printBoard(playerTurn);
+            eventText[0] = '\0';
+            boardDirty = false;
+            if (myTurn && (pickCardCount == 1 || promptAfterDraw))
+            {
+                printPickPrompt(pickCardCount);
+                fflush(stdout);
+            }
+            promptAfterDraw = false;
+        }
+
+        if (gameStarted && playerTurn >= 0 && (playerTurn != lastAnnouncedTurn || myTurn != lastAnnouncedMyTurn))
+        {
+            pickCardCount = 0;
+            if (myTurn)
+            {
+                printf("\n*** YOUR TURN ***\nEnter card index: ");
+            }
+            else
+            {
+                printf("\nWaiting for Player %d...\n", playerTurn);
+            }
+            fflush(stdout);
+            lastAnnouncedTurn = playerTurn;
+            lastAnnouncedMyTurn = myTurn;
         }
 
         if (watchStdin && FD_ISSET(STDIN_FILENO, &readfds))
         {
-            if (fgets(buffer, sizeof(buffer), stdin))
+            if (!fgets(buffer, sizeof(buffer), stdin))
             {
-                if (buffer[strspn(buffer, " \t\r\n")] == '\0')
+                connected = false;
+                continue;
+            }
+
+            if (buffer[strspn(buffer, " \t\r\n")] == '\0')
+            {
+                if (myTurn)
                 {
-                    if (myTurn)
-                    {
-                        printPickPrompt(pickCardCount);
-                        fflush(stdout);
-                    }
-                    continue;
+                    printPickPrompt(pickCardCount);
+                    fflush(stdout);
                 }
-                if (readyMode)
+                continue;
+            }
+            if (readyMode)
+            {
+                buffer[strcspn(buffer, "\r\n")] = '\0';
+                char *p = buffer;
+                while (*p == ' ' || *p == '\t')
+                    p++;
+                if (p[0] == '1' && p[1] == '\0')
                 {
-                    buffer[strcspn(buffer, "\r\n")] = '\0';
-                    char *p = buffer;
-                    while (*p == ' ' || *p == '\t')
-                        p++;
-                    if (p[0] == '1' && p[1] == '\0')
-                    {
-                        send(sock, buffer, strlen(buffer), 0);
-                    }
-                    else
-                    {
-                        printf("Please type exactly 1 to READY: ");
-                        fflush(stdout);
-                    }
-                    continue;
+                    sendSimple(sock, CMD_READY);
                 }
-
-                if (!myTurn)
+                else if (isRoomCommand(p))
                 {
-                    //Ignore input when it is not this players turn
-                    continue;
+                    sendRoomCommand(sock, p);
                 }
-
-                if (pickCardCount >= 2)
+                else
                 {
-                    printf("Please wait for the next turn...\n");
+                    printf("Please type exactly 1 to READY: ");
                     fflush(stdout);
-                    continue;
                 }
-                int val;
-                //Check if it's a number and is within board bounds 0-23 for  4x6 board
-                if (sscanf(buffer, "%d", &val) == 1)
+                continue;
+            }
+
+            if (!myTurn)
+            {
+                //Ignore input when it is not this players turn
+                continue;
+            }
+
+            if (pickCardCount >= 2)
+            {
+                printf("Please wait for the next turn...\n");
+                fflush(stdout);
+                continue;
+            }
+            int val;
+            //Check if it's a number and is within the board the server sent
+            if (sscanf(buffer, "%d", &val) == 1)
+            {
+                if (val >= 0 && val < totalCards())
                 {
-                    if (val >= 0 && val < TOTAL_CARDS)
+                    if (board.state[val] == CARD_STATE_MATCHED)
                     {
-                        if (matchedCards[val])
-                        {
-                            if (pickCardCount == 1)
-                            {
-                                printf("That card is already matched. Pick another for the second card: ");
-                                fflush(stdout);
-                                continue;
-                            }
-                            printf("That card is already matched. Pick another: ");
-                            fflush(stdout);
-                            continue;
-                        }
-                        pickCardCount++;
                         if (pickCardCount == 1)
                         {
-                            firstPickIndex = val;
-                        }
-                        else if (pickCardCount == 2)
-                        {
-                            secondPickIndex = val;
-                            fflush(stdout);
-                        }
-                        if (firstPickIndex == secondPickIndex)
-                        {
-                            printf("You cannot pick the same card twice. Please pick the second card again.\n");
-                            pickCardCount = 1;
-                            secondPickIndex = -1;
-                            printPickPrompt(pickCardCount);
+                            printf("That card is already matched. Pick another for the second card: ");
                             fflush(stdout);
                             continue;
                         }
-                        send(sock, buffer, strlen(buffer), 0);
-                        lastSentIndex = val;
-                        lastSentPick = pickCardCount;
+                        printf("That card is already matched. Pick another: ");
+                        fflush(stdout);
+                        continue;
                     }
-                    else
+                    pickCardCount++;
+                    if (pickCardCount == 1)
                     {
-                        if (pickCardCount == 1)
-                        {
-                            printf("Error: Index %d is out of bounds (0-%d). ", val, TOTAL_CARDS - 1);
-                            printPickPrompt(pickCardCount);
-                            fflush(stdout);
-                            continue;
-                        }
-                        firstPickIndex = -1;
-                        pickCardCount = 0;
-                        printf("Error: Index %d is out of bounds (0-%d). ", val, TOTAL_CARDS - 1);
-                        if (myTurn)
-                            printPickPrompt(pickCardCount);
-                        else
-                            printf("Try again: ");
+                        firstPickIndex = val;
+                    }
+                    else if (pickCardCount == 2)
+                    {
+                        secondPickIndex = val;
                         fflush(stdout);
                     }
+                    if (firstPickIndex == secondPickIndex)
+                    {
+                        printf("You cannot pick the same card twice. Please pick the second card again.\n");
+                        pickCardCount = 1;
+                        secondPickIndex = -1;
+                        printPickPrompt(pickCardCount);
+                        fflush(stdout);
+                        continue;
+                    }
+                    sendWithU32(sock, CMD_FLIP, (uint32_t)val);
+                    lastSentPick = pickCardCount;
                 }
                 else
                 {
                     if (pickCardCount == 1)
                     {
-                        printf("Invalid input. ");
+                        printf("Error: Index %d is out of bounds (0-%d). ", val, totalCards() - 1);
                         printPickPrompt(pickCardCount);
                         fflush(stdout);
                         continue;
                     }
                     firstPickIndex = -1;
                     pickCardCount = 0;
-                    printf("Invalid input. ");
+                    printf("Error: Index %d is out of bounds (0-%d). ", val, totalCards() - 1);
                     if (myTurn)
                         printPickPrompt(pickCardCount);
                     else
-                        printf("Enter a number: ");
+                        printf("Try again: ");
+                    fflush(stdout);
+                }
+            }
+            else
+            {
+                if (pickCardCount == 1)
+                {
+                    printf("Invalid input. ");
+                    printPickPrompt(pickCardCount);
                     fflush(stdout);
+                    continue;
                 }
+                firstPickIndex = -1;
+                pickCardCount = 0;
+                printf("Invalid input. ");
+                if (myTurn)
+                    printPickPrompt(pickCardCount);
+                else
+                    printf("Enter a number: ");
+                fflush(stdout);
             }
         }
     }
 
     close(sock);
     return 0;
-}
\ No newline at end of file
+}
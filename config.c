@@ -0,0 +1,234 @@
+#include "config.h"
+#include "protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <limits.h>
+
+//Keeps timeouts in milliseconds well inside an unsigned int
+#define MAX_TIMEOUT_SEC (7 * 24 * 3600)
+
+ServerConfig serverConfig = {
+    .slowConsumerPolicy = SLOW_COALESCE,
+    .outboxLimit = 256 * 1024,
+    .turnTimeoutSec = 30,
+    .afkAction = AFK_SKIP,
+    .lobbyTimeoutSec = 600,
+    .reconnectGraceSec = 30,
+    .boardRows = 3,
+    .boardCols = 4,
+    .logFormat = LOG_FORMAT_BINARY,
+    .logSync = LOG_SYNC_NONE,
+    .logSyncIntervalMs = 1000,
+    .logMaxBytes = 16 * 1024 * 1024,
+    .logMaxAgeSec = 24 * 3600,
+    .logKeepSegments = 20,
+    .logCompress = LOG_COMPRESS_GZIP,
+    .metricsPort = 9464,
+    .replaySession = 1,
+};
+
+static void printUsage(const char *program)
+{
+    printf("Usage: %s [options]\n"
+           "  --slow-consumer=drop|coalesce|disconnect\n"
+           "                         what to do with a client whose send queue is full (default coalesce)\n"
+           "  --outbox-limit=BYTES   queued bytes per client before that happens (default %zu)\n"
+           "  --turn-timeout=SECONDS time a player has for both flips, 0 for no limit (default %u)\n"
+           "  --afk=skip|forfeit     what happens when it runs out (default skip)\n"
+           "  --lobby-timeout=SECONDS\n"
+           "                         close a waiting room after this long without activity, 0 never (default %u)\n"
+           "  --reconnect-grace=SECONDS\n"
+           "                         hold a dropped player's seat this long during a game, 0 never (default %u)\n"
+           "  --board=ROWSxCOLS      board new rooms deal, up to %dx%d with an even card count (default %dx%d)\n"
+           "  --log-format=binary|text\n"
+           "                         game.mlog records (read with ./logcat) or game.log lines (default binary)\n"
+           "  --log-sync=none|batch|interval\n"
+           "                         when game.log is forced to disk (default none)\n"
+           "  --log-sync-interval=MS how often interval mode syncs (default %u)\n"
+           "  --log-max-size=BYTES   start a new log segment past this size, 0 never (default %zu)\n"
+           "  --log-max-age=SECONDS  or after this long, 0 never (default %u)\n"
+           "  --log-keep=N           sealed segments to keep, 0 for all (default %u)\n"
+           "  --log-compress=gzip|none\n"
+           "                         compress sealed segments in the background (default gzip)\n"
+           "  --metrics-port=PORT    serve Prometheus metrics on 127.0.0.1:PORT/metrics, 0 for none (default %u)\n"
+           "  --record=FILE          record every connection, input and timer to FILE for --replay\n"
+           "  --replay=FILE          run a recording (or a text game.log) without sockets, then exit\n"
+           "  --replay-out=FILE      write what each replayed connection was sent to FILE\n"
+           "  --replay-session=N     which server run of a game.log to replay (default 1)\n",
+           program, serverConfig.outboxLimit, serverConfig.turnTimeoutSec, serverConfig.lobbyTimeoutSec,
+           serverConfig.reconnectGraceSec, MAX_BOARD_SIDE, MAX_BOARD_SIDE, serverConfig.boardRows,
+           serverConfig.boardCols, serverConfig.logSyncIntervalMs, serverConfig.logMaxBytes,
+           serverConfig.logMaxAgeSec, serverConfig.logKeepSegments, serverConfig.metricsPort);
+}
+
+static long parseNumber(const char *option, const char *value, long min, long max)
+{
+    char *end;
+    long number = strtol(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || number < min || number > max)
+    {
+        fprintf(stderr, "Invalid value for --%s: %s\n", option, value);
+        exit(1);
+    }
+    return number;
+}
+
+void parseServerArgs(int argc, char *argv[])
+{
+    static const struct option options[] = {
+        {"slow-consumer", required_argument, NULL, 's'},
+        {"outbox-limit", required_argument, NULL, 'o'},
+        {"turn-timeout", required_argument, NULL, 't'},
+        {"afk", required_argument, NULL, 'a'},
+        {"lobby-timeout", required_argument, NULL, 'l'},
+        {"reconnect-grace", required_argument, NULL, 'G'},
+        {"board", required_argument, NULL, 'b'},
+        {"log-format", required_argument, NULL, 'f'},
+        {"log-sync", required_argument, NULL, 'y'},
+        {"log-sync-interval", required_argument, NULL, 'i'},
+        {"log-max-size", required_argument, NULL, 'm'},
+        {"log-max-age", required_argument, NULL, 'g'},
+        {"log-keep", required_argument, NULL, 'k'},
+        {"log-compress", required_argument, NULL, 'c'},
+        {"metrics-port", required_argument, NULL, 'M'},
+        {"record", required_argument, NULL, 'r'},
+        {"replay", required_argument, NULL, 'p'},
+        {"replay-out", required_argument, NULL, 'O'},
+        {"replay-session", required_argument, NULL, 'S'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            if (strcmp(optarg, "drop") == 0)
+                serverConfig.slowConsumerPolicy = SLOW_DROP;
+            else if (strcmp(optarg, "coalesce") == 0)
+                serverConfig.slowConsumerPolicy = SLOW_COALESCE;
+            else if (strcmp(optarg, "disconnect") == 0)
+                serverConfig.slowConsumerPolicy = SLOW_DISCONNECT;
+            else
+            {
+                fprintf(stderr, "Unknown slow consumer policy: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'o':
+            serverConfig.outboxLimit = (size_t)parseNumber("outbox-limit", optarg, 1024, LONG_MAX);
+            break;
+        case 't':
+            serverConfig.turnTimeoutSec = (unsigned int)parseNumber("turn-timeout", optarg, 0, MAX_TIMEOUT_SEC);
+            break;
+        case 'a':
+            if (strcmp(optarg, "skip") == 0)
+                serverConfig.afkAction = AFK_SKIP;
+            else if (strcmp(optarg, "forfeit") == 0)
+                serverConfig.afkAction = AFK_FORFEIT;
+            else
+            {
+                fprintf(stderr, "Unknown afk action: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'l':
+            serverConfig.lobbyTimeoutSec = (unsigned int)parseNumber("lobby-timeout", optarg, 0, MAX_TIMEOUT_SEC);
+            break;
+        case 'G':
+            serverConfig.reconnectGraceSec = (unsigned int)parseNumber("reconnect-grace", optarg, 0, MAX_TIMEOUT_SEC);
+            break;
+        case 'b':
+        {
+            int rows, cols;
+            char tail;
+            if (sscanf(optarg, "%dx%d%c", &rows, &cols, &tail) != 2 || !boardSizeValid(rows, cols))
+            {
+                fprintf(stderr, "Invalid value for --board: %s\n", optarg);
+                exit(1);
+            }
+            serverConfig.boardRows = rows;
+            serverConfig.boardCols = cols;
+            break;
+        }
+        case 'f':
+            if (strcmp(optarg, "binary") == 0)
+                serverConfig.logFormat = LOG_FORMAT_BINARY;
+            else if (strcmp(optarg, "text") == 0)
+                serverConfig.logFormat = LOG_FORMAT_TEXT;
+            else
+            {
+                fprintf(stderr, "Unknown log format: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'y':
+            if (strcmp(optarg, "none") == 0)
+                serverConfig.logSync = LOG_SYNC_NONE;
+            else if (strcmp(optarg, "batch") == 0)
+                serverConfig.logSync = LOG_SYNC_BATCH;
+            else if (strcmp(optarg, "interval") == 0)
+                serverConfig.logSync = LOG_SYNC_INTERVAL;
+            else
+            {
+                fprintf(stderr, "Unknown log sync mode: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'i':
+            serverConfig.logSyncIntervalMs = (unsigned int)parseNumber("log-sync-interval", optarg, 1, MAX_TIMEOUT_SEC);
+            break;
+        case 'm':
+            serverConfig.logMaxBytes = (size_t)parseNumber("log-max-size", optarg, 0, LONG_MAX);
+            break;
+        case 'g':
+            serverConfig.logMaxAgeSec = (unsigned int)parseNumber("log-max-age", optarg, 0, MAX_TIMEOUT_SEC);
+            break;
+        case 'k':
+            serverConfig.logKeepSegments = (unsigned int)parseNumber("log-keep", optarg, 0, 100000);
+            break;
+        case 'c':
+            if (strcmp(optarg, "gzip") == 0)
+                serverConfig.logCompress = LOG_COMPRESS_GZIP;
+            else if (strcmp(optarg, "none") == 0)
+                serverConfig.logCompress = LOG_COMPRESS_NONE;
+            else
+            {
+                fprintf(stderr, "Unknown log compression: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'M':
+            serverConfig.metricsPort = (unsigned int)parseNumber("metrics-port", optarg, 0, 65535);
+            break;
+        case 'r':
+            serverConfig.recordPath = optarg;
+            break;
+        case 'p':
+            serverConfig.replayPath = optarg;
+            break;
+        case 'O':
+            serverConfig.replayOutPath = optarg;
+            break;
+        case 'S':
+            serverConfig.replaySession = (unsigned int)parseNumber("replay-session", optarg, 1, INT_MAX);
+            break;
+        case 'h':
+            printUsage(argv[0]);
+            exit(0);
+        default:
+            printUsage(argv[0]);
+            exit(1);
+        }
+    }
+
+    if (serverConfig.recordPath && serverConfig.replayPath)
+    {
+        fprintf(stderr, "--record and --replay cannot be used together\n");
+        exit(1);
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stddef.h>
+
+#include "outbox.h"
+
+typedef enum {
+    AFK_SKIP,           // the turn passes to the next player
+    AFK_FORFEIT         // the player loses the seat
+} AfkAction;
+
+typedef enum {
+    LOG_SYNC_NONE,      // leave flushing to the kernel
+    LOG_SYNC_BATCH,     // fdatasync after every batch the logger writes
+    LOG_SYNC_INTERVAL   // fdatasync at most once per logSyncIntervalMs
+} LogSyncMode;
+
+typedef enum {
+    LOG_FORMAT_BINARY,  // varint records in game.mlog, read with ./logcat
+    LOG_FORMAT_TEXT     // one line per event in game.log
+} LogFormat;
+
+typedef enum {
+    LOG_COMPRESS_GZIP,  // sealed segments are gzipped in the background
+    LOG_COMPRESS_NONE
+} LogCompress;
+
+/* Runtime settings, filled from the command line before anything starts */
+typedef struct {
+    SlowConsumerPolicy slowConsumerPolicy;
+    size_t outboxLimit;
+    unsigned int turnTimeoutSec;    // 0 disables turn deadlines
+    AfkAction afkAction;
+    unsigned int lobbyTimeoutSec;   // 0 keeps idle lobbies open forever
+    unsigned int reconnectGraceSec; // how long a dropped player's seat is held mid-game, 0 not at all
+    int boardRows;                  // what new rooms deal until a player picks another size
+    int boardCols;
+    LogFormat logFormat;
+    LogSyncMode logSync;
+    unsigned int logSyncIntervalMs;
+    size_t logMaxBytes;             // roll the log over past this size, 0 never
+    unsigned int logMaxAgeSec;      // or after this long, 0 never
+    unsigned int logKeepSegments;   // sealed segments kept, 0 keeps all
+    LogCompress logCompress;
+    unsigned int metricsPort;       // 127.0.0.1 port serving /metrics, 0 for none; see metrics.h
+    const char *recordPath;         // see replay.h
+    const char *replayPath;         // set: replay this file instead of serving
+    const char *replayOutPath;
+    unsigned int replaySession;     // which server run of a text game.log
+} ServerConfig;
+
+extern ServerConfig serverConfig;
+
+void parseServerArgs(int argc, char *argv[]);
+
+#endif
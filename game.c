@@ -2,171 +2,415 @@
 #include "logger.h"
 #include "shared_state.h"
 #include "scheduler.h"
+#include "room.h"
 #include "score.h"
+#include "protocol.h"
+#include "timer.h"
+#include "config.h"
+#include "latency.h"
+#include "metrics.h"
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <time.h>
 #include <sys/socket.h>
 
-static void sendInfoToAll(SharedGameState *state, const char *message)
+//How long a mismatched pair stays face up, and the pause before the next turn
+#define MISMATCH_REVEAL_MS 2000
+#define TURN_ADVANCE_DELAY_MS 500
+
+/* Every byte to a player goes through here, so no thread ever blocks on a slow socket */
+void sendToPlayer(Player *player, const void *data, size_t len, OutPriority priority)
+{
+    //A held seat has no connection; a rejoin brings the player a fresh snapshot instead
+    if (player->away)
+        return;
+    metricsAdd(METRIC_BROADCAST_BYTES, len);
+    metricsAdd(METRIC_BROADCAST_MESSAGES, 1);
+    if (player->outbox)
+        outboxSend(player->outbox, data, len, priority);
+    else
+        send(player->socket, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+/* Sends one message in the protocol the player negotiated; text clients also get the prefix and terminator */
+void sendPlayerMessage(Player *player, uint8_t opcode, const char *textPrefix, const char *body)
+{
+    if (player->binaryProtocol)
+    {
+        FrameBuffer fb;
+        frameBufferInit(&fb);
+        frameAppendText(&fb, opcode, body);
+        sendToPlayer(player, fb.data, fb.len, OUT_CONTROL);
+        frameBufferFree(&fb);
+        return;
+    }
+
+    char msg[2048];
+    snprintf(msg, sizeof(msg), "%s%s<<END>>\n", textPrefix, body);
+    sendToPlayer(player, msg, strlen(msg), OUT_CONTROL);
+}
+
+void sendPlayerError(Player *player, ErrorCode code, const char *text)
+{
+    if (player->binaryProtocol)
+    {
+        FrameBuffer fb;
+        frameBufferInit(&fb);
+        frameBegin(&fb, MSG_ERROR);
+        framePutU8(&fb, (uint8_t)code);
+        framePutBytes(&fb, text, strlen(text));
+        frameEnd(&fb);
+        sendToPlayer(player, fb.data, fb.len, OUT_CONTROL);
+        frameBufferFree(&fb);
+        return;
+    }
+
+    sendPlayerMessage(player, MSG_ERROR, "", text);
+}
+
+static void sendMessageToAll(SharedGameState *state, uint8_t opcode, const char *textPrefix, const char *body)
 {
     pthread_mutex_lock(&state->mutex);
     for (int i = 0; i < MAX_PLAYERS; i++)
     {
         if (state->players[i].connected)
         {
-            send(state->players[i].socket, message, strlen(message), 0);
+            sendPlayerMessage(&state->players[i], opcode, textPrefix, body);
         }
     }
     pthread_mutex_unlock(&state->mutex);
 }
 
-void setupBoard(SharedGameState *state, int rows, int cols)
+/* Sends the text and binary renderings of the same broadcast to every connected player; caller holds state->mutex */
+static void sendRenderedToAllLocked(SharedGameState *state, const char *text, const FrameBuffer *frames, OutPriority priority)
 {
-    pthread_mutex_lock(&state->mutex);
-    state->boardRows = rows;
-    state->boardCols = cols;
-    pthread_mutex_unlock(&state->mutex);
-    int totalCards = rows * cols;
+    size_t textLen = strlen(text);
 
-    for (int i = 0; i < totalCards; i++)
+    for (int i = 0; i < MAX_PLAYERS; i++)
     {
-        state->cards[i].isFlipped = false;
-        state->cards[i].isMatched = false;
+        if (!state->players[i].connected)
+            continue;
+
+        if (state->players[i].binaryProtocol)
+        {
+            if (frames->len > 0)
+                sendToPlayer(&state->players[i], frames->data, frames->len, priority);
+        }
+        else
+            sendToPlayer(&state->players[i], text, textLen, priority);
     }
+}
+
+static unsigned char cardState(const CardBoard *cards, int card)
+{
+    if (cardMatched(cards, card))
+        return CARD_STATE_MATCHED;
+    if (cardFlipped(cards, card))
+        return CARD_STATE_FLIPPED;
+    return CARD_STATE_HIDDEN;
+}
 
-    if (totalCards > MAX_CARDS || totalCards % 2 != 0)
+static void encodeBoardLocked(SharedGameState *state, FrameBuffer *fb)
+{
+    int rows = state->boardRows;
+    int cols = state->boardCols;
+
+    frameBegin(fb, MSG_BOARD);
+    framePutU32(fb, state->boardSeq);
+    framePutU16(fb, (uint16_t)rows);
+    framePutU16(fb, (uint16_t)cols);
+    for (int idx = 0; idx < rows * cols; idx++)
     {
-        printf("error occured!\n");
-        return;
+        unsigned char cs = cardState(&state->cards, idx);
+        framePutU8(fb, cs);
+        if (cs != CARD_STATE_HIDDEN)
+            framePutU16(fb, state->cards.faceValue[idx]);
+    }
+    frameEnd(fb);
+}
+
+static void encodeScoreboardLocked(SharedGameState *state, FrameBuffer *fb)
+{
+    int count = 0;
+    for (int i = 0; i < MAX_PLAYERS; i++)
+    {
+        if (state->players[i].connected)
+            count++;
     }
 
-    state->totalPairs = totalCards / 2;
+    frameBegin(fb, MSG_SCOREBOARD);
+    framePutU8(fb, (uint8_t)count);
+    for (int i = 0; i < MAX_PLAYERS; i++)
+    {
+        if (state->players[i].connected)
+        {
+            framePutU8(fb, (uint8_t)i);
+            framePutI32(fb, state->players[i].score);
+            framePutI32(fb, state->players[i].roundScore);
+            framePutString(fb, state->players[i].name);
+        }
+    }
+    frameEnd(fb);
+}
 
-    int cardIndex = 0;
-    for (int i = 0; i < MAX_CARDS; i++)
+static void encodeTurnLocked(SharedGameState *state, FrameBuffer *fb)
+{
+    frameBegin(fb, MSG_TURN);
+    framePutU8(fb, (uint8_t)(int8_t)state->currentTurn);
+    frameEnd(fb);
+}
+
+/* Records the current board and scores as what every binary client has seen */
+static void rememberSentStateLocked(SharedGameState *state)
+{
+    size_t words = CARD_WORDS(state->cards.count);
+    memcpy(state->sentFlipped, state->cards.flipped, words * sizeof(CardWord));
+    memcpy(state->sentMatched, state->cards.matched, words * sizeof(CardWord));
+    for (int i = 0; i < MAX_PLAYERS; i++)
     {
-        state->cards[i].isFlipped = false;
-        state->cards[i].isMatched = false;
+        state->sentScore[i] = state->players[i].score;
+        state->sentRoundScore[i] = state->players[i].roundScore;
     }
+}
 
-    for (int fv = 0; fv < state->totalPairs; fv++)
+/* Appends one sequenced update per card whose state changed since the last broadcast; 64 cards are compared at a time */
+static void encodeCardDeltasLocked(SharedGameState *state, FrameBuffer *fb)
+{
+    const CardBoard *cards = &state->cards;
+    for (int w = 0; w < CARD_WORDS(cards->count); w++)
     {
-        for (int pairC = 0; pairC < 2; pairC++)
+        CardWord changed = (cards->flipped[w] ^ state->sentFlipped[w]) | (cards->matched[w] ^ state->sentMatched[w]);
+        //Sent bits past the board can be left over from a bigger one
+        if (cards->count - w * CARD_WORD_BITS < CARD_WORD_BITS)
+            changed &= ((CardWord)1 << (cards->count % CARD_WORD_BITS)) - 1;
+        for (; changed; changed &= changed - 1)
         {
-            state->cards[cardIndex].cardID = cardIndex;
-            state->cards[cardIndex].faceValue = fv;
-            cardIndex++;
+            int idx = w * CARD_WORD_BITS + __builtin_ctzll(changed);
+            unsigned char cs = cardState(cards, idx);
+            frameBegin(fb, MSG_CARD_UPDATE);
+            framePutU32(fb, ++state->boardSeq);
+            framePutU32(fb, (uint32_t)idx);
+            framePutU8(fb, cs);
+            if (cs != CARD_STATE_HIDDEN)
+                framePutU16(fb, cards->faceValue[idx]);
+            frameEnd(fb);
         }
+        state->sentFlipped[w] = cards->flipped[w];
+        state->sentMatched[w] = cards->matched[w];
     }
+}
 
-    srand((unsigned int)time(NULL));
-    for (int i = 0; i < totalCards; i++)
+static void encodeScoreDeltasLocked(SharedGameState *state, FrameBuffer *fb)
+{
+    for (int i = 0; i < MAX_PLAYERS; i++)
     {
-        int j = rand() % totalCards;
-        Card temp = state->cards[i];
-        state->cards[i] = state->cards[j];
-        state->cards[j] = temp;
+        Player *player = &state->players[i];
+        if (!player->connected ||
+            (player->score == state->sentScore[i] && player->roundScore == state->sentRoundScore[i]))
+            continue;
+
+        frameBegin(fb, MSG_SCORE_UPDATE);
+        framePutU32(fb, ++state->boardSeq);
+        framePutU8(fb, (uint8_t)i);
+        framePutI32(fb, player->score);
+        framePutI32(fb, player->roundScore);
+        frameEnd(fb);
+        state->sentScore[i] = player->score;
+        state->sentRoundScore[i] = player->roundScore;
     }
 }
 
-void formatOfBoard(SharedGameState *state, char *buffer, size_t bufsize)
+static void encodeCardFlipped(FrameBuffer *fb, int player, int card, int value)
 {
-    if (!buffer || bufsize == 0)
-        return;
+    frameBegin(fb, MSG_CARD_FLIPPED);
+    framePutU8(fb, (uint8_t)player);
+    framePutU32(fb, (uint32_t)card);
+    framePutU16(fb, (uint16_t)value);
+    frameEnd(fb);
+}
+
+static void encodePairResult(FrameBuffer *fb, int player, int first, int firstValue, int second, int secondValue, bool matched)
+{
+    frameBegin(fb, MSG_PAIR_RESULT);
+    framePutU8(fb, (uint8_t)player);
+    framePutU32(fb, (uint32_t)first);
+    framePutU16(fb, (uint16_t)firstValue);
+    framePutU32(fb, (uint32_t)second);
+    framePutU16(fb, (uint16_t)secondValue);
+    framePutU8(fb, matched ? 1 : 0);
+    frameEnd(fb);
+}
 
+void setupBoard(SharedGameState *state, int rows, int cols)
+{
     pthread_mutex_lock(&state->mutex);
-    int rows = 3;
-    int cols = 4;
+    //Resizing also turns every card face down
+    bool resized = resizeBoardLocked(state, rows, cols);
     pthread_mutex_unlock(&state->mutex);
 
-    buffer[0] = '\0';
-    strncat(buffer, "Board State (VALUES / IDs):\n", bufsize - strlen(buffer) - 1);
+    if (!resized)
+    {
+        printf("error occured!\n");
+        return;
+    }
+    dealCards(state, rows, cols);
+}
 
-    for (int r = 0; r < rows; r++)
+/* Tells one player the size of the room's board, e.g. after someone changed it */
+void sendBoardSize(Player *player, int rows, int cols)
+{
+    if (player->binaryProtocol)
     {
-        strncat(buffer, "Values: ", bufsize - strlen(buffer) - 1);
-        for (int c = 0; c < cols; c++)
-        {
-            int idx = r * cols + c;
-            Card *card = &state->cards[idx];
-            char cell[16];
+        FrameBuffer fb;
+        frameBufferInit(&fb);
+        frameBegin(&fb, MSG_BOARD_SIZE);
+        framePutU16(&fb, (uint16_t)rows);
+        framePutU16(&fb, (uint16_t)cols);
+        frameEnd(&fb);
+        sendToPlayer(player, fb.data, fb.len, OUT_CONTROL);
+        frameBufferFree(&fb);
+        return;
+    }
 
-            if (card->isMatched)
-                snprintf(cell, sizeof(cell), " [%02d] ", card->faceValue);
-            else if (card->isFlipped)
-                snprintf(cell, sizeof(cell), " [%02d] ", card->faceValue);
-            else
-                snprintf(cell, sizeof(cell), " [--] ");
+    char msg[48];
+    snprintf(msg, sizeof(msg), "BOARD %dx%d\n<<END>>\n", rows, cols);
+    sendToPlayer(player, msg, strlen(msg), OUT_CONTROL);
+}
 
-            strncat(buffer, cell, bufsize - strlen(buffer) - 1);
-        }
+static int digitCount(int value)
+{
+    int digits = 1;
+    for (; value >= 10; value /= 10)
+        digits++;
+    return digits;
+}
 
-        strncat(buffer, "\n", bufsize - strlen(buffer) - 1);
+/* Values and IDs are printed two digits wide, as on the original 3x4 board, or wider when the board needs it */
+static void boardCellWidths(const SharedGameState *state, int *valueWidth, int *idWidth)
+{
+    int cards = state->boardRows * state->boardCols;
+    *valueWidth = digitCount(cards / 2 - 1) > 2 ? digitCount(cards / 2 - 1) : 2;
+    *idWidth = digitCount(cards - 1) > 2 ? digitCount(cards - 1) : 2;
+}
 
-        strncat(buffer, "IDs:    ", bufsize - strlen(buffer) - 1);
-        for (int c = 0; c < cols; c++)
-        {
-            int idx = r * cols + c;
-            char hint[16];
+/* Bytes formatBoardLocked() writes for the current board, terminator included */
+static size_t boardTextSize(const SharedGameState *state)
+{
+    int valueWidth, idWidth;
+    boardCellWidths(state, &valueWidth, &idWidth);
+    size_t row = strlen("Values: ") + (size_t)state->boardCols * (valueWidth + 4) +
+                 strlen("\nIDs:    ") + (size_t)state->boardCols * (idWidth + 4) + 1;
+    return strlen("Board State (VALUES / IDs):\n") + (size_t)state->boardRows * row + 1;
+}
 
-            snprintf(hint, sizeof(hint), " (%02d) ", idx);
-            strncat(buffer, hint, bufsize - strlen(buffer) - 1);
+/* Grows a render buffer to at least size bytes */
+static char *reserveText(char **text, size_t *capacity, size_t size)
+{
+    if (size > *capacity)
+    {
+        char *grown = realloc(*text, size);
+        if (!grown)
+        {
+            perror("reserveText: realloc");
+            exit(1);
         }
-
-        strncat(buffer, "\n", bufsize - strlen(buffer) - 1);
+        *text = grown;
+        *capacity = size;
     }
-
+    return *text;
 }
 
-void formatOfBoardForServer(SharedGameState *state, char *buffer, size_t bufsize)
+/* Writes value zero-padded to exactly width digits */
+static char *putDigits(char *out, int value, int width)
 {
-    if (!buffer || bufsize == 0)
-        return;
-
-    pthread_mutex_lock(&state->mutex);
-    int rows = 3;
-    int cols = 4;
-    pthread_mutex_unlock(&state->mutex);
+    for (int i = width - 1; i >= 0; i--)
+    {
+        out[i] = (char)('0' + value % 10);
+        value /= 10;
+    }
+    return out + width;
+}
 
-    buffer[0] = '\0';
-    strncat(buffer, "Board State (VALUES / IDs):\n", bufsize - strlen(buffer) - 1);
+static char *putText(char *out, const char *text)
+{
+    size_t len = strlen(text);
+    memcpy(out, text, len);
+    return out + len;
+}
 
+/*
+ * Players see face values of revealed cards. buffer holds boardTextSize() bytes. Every cell has a known width, so cells are written in place rather
+ * than printf'd: this runs on every broadcast to a text player, over every card on the board.
+ */
+static void formatBoardLocked(SharedGameState *state, char *buffer)
+{
+    const CardBoard *cards = &state->cards;
+    int rows = state->boardRows;
+    int cols = state->boardCols;
+    int valueWidth, idWidth;
+    char *out = buffer;
+
+    boardCellWidths(state, &valueWidth, &idWidth);
+    out = putText(out, "Board State (VALUES / IDs):\n");
     for (int r = 0; r < rows; r++)
     {
-        strncat(buffer, "Values: ", bufsize - strlen(buffer) - 1);
+        out = putText(out, "Values: ");
         for (int c = 0; c < cols; c++)
         {
             int idx = r * cols + c;
-            Card *card = &state->cards[idx];
-            char cell[16];
-
-            if (card->isMatched)
-                snprintf(cell, sizeof(cell), " [XX] ");
-            else if (card->isFlipped)
-                snprintf(cell, sizeof(cell), " [%02d] ", card->faceValue);
+            *out++ = ' ';
+            *out++ = '[';
+            if (cardFaceUp(cards, idx))
+                out = putDigits(out, cards->faceValue[idx], valueWidth);
             else
-                snprintf(cell, sizeof(cell), " [%02d] ", card->faceValue);
-
-            strncat(buffer, cell, bufsize - strlen(buffer) - 1);
+            {
+                memset(out, '-', (size_t)valueWidth);
+                out += valueWidth;
+            }
+            *out++ = ']';
+            *out++ = ' ';
         }
 
-        strncat(buffer, "\n", bufsize - strlen(buffer) - 1);
-
-        strncat(buffer, "IDs:    ", bufsize - strlen(buffer) - 1);
+        out = putText(out, "\nIDs:    ");
         for (int c = 0; c < cols; c++)
         {
-            int idx = r * cols + c;
-            char hint[16];
-
-            snprintf(hint, sizeof(hint), " (%02d) ", idx);
-            strncat(buffer, hint, bufsize - strlen(buffer) - 1);
+            *out++ = ' ';
+            *out++ = '(';
+            out = putDigits(out, r * cols + c, idWidth);
+            *out++ = ')';
+            *out++ = ' ';
         }
+        *out++ = '\n';
+    }
+    *out = '\0';
+}
+
+void formatOfBoard(SharedGameState *state, char *buffer, size_t bufsize)
+{
+    if (!buffer || bufsize == 0)
+        return;
 
-        strncat(buffer, "\n", bufsize - strlen(buffer) - 1);
+    pthread_mutex_lock(&state->mutex);
+    size_t size = boardTextSize(state);
+    if (bufsize >= size)
+    {
+        formatBoardLocked(state, buffer);
     }
+    else
+    {
+        //Too small for the whole board: hand back as much of it as fits
+        char *text = malloc(size);
+        if (text)
+        {
+            formatBoardLocked(state, text);
+            snprintf(buffer, bufsize, "%s", text);
+            free(text);
+        }
+        else
+            buffer[0] = '\0';
+    }
+    pthread_mutex_unlock(&state->mutex);
 }
 
 void printGameState(SharedGameState *state)
@@ -177,108 +421,228 @@ void printGameState(SharedGameState *state)
     printf("Board Rows: %d\n", state->boardRows);
     printf("Board Columns: %d\n", state->boardCols);
     printf("Total Pairs: %d\n", state->totalPairs);
-    printf("Matched Pairs: %d\n", state->matchedPaires);
+    printf("Matched Pairs: %d\n", cardsMatched(&state->cards) / 2);
 }
 
-void sendBoardStateToAll(SharedGameState *state)
+/* Renders boardText and fullText for the state the rest of the cache shows */
+static void renderBoardTextLocked(SharedGameState *state, RenderCache *cache)
 {
-    char boardMsg[4096];
-    char serverMsg[4096];
-    char scoreMsg[512];
-    char turnMsg[64];
+    size_t boardSize = boardTextSize(state);
+    reserveText(&cache->boardText, &cache->boardTextCapacity, boardSize);
+    formatBoardLocked(state, cache->boardText);
+
+    size_t fullSize = strlen(cache->boardText) + strlen(cache->scoreText) + strlen(cache->turnText) + 16;
+    reserveText(&cache->fullText, &cache->fullTextCapacity, fullSize);
+    snprintf(cache->fullText, fullSize, "%s\n%s%s<<END>>\n",
+             cache->boardText, cache->scoreText, cache->turnText);
+    cache->textCurrent = true;
+}
 
-    formatOfBoard(state, boardMsg, sizeof(boardMsg));
-    scoreMsg[0] = '\0';
-    pthread_mutex_lock(&state->mutex);
-    strncat(scoreMsg, "\nScoreboard:\n", sizeof(scoreMsg) - strlen(scoreMsg) - 1);
-    for (int i = 0; i < MAX_PLAYERS; i++)
+/*
+ * Scores, turn and the binary snapshot, plus boardText and fullText when the
+ * board is small enough for text players to be sent it whole. A big
+ * board's texts run to hundreds of kilobytes, so only the broadcasts
+ * that need them render them, through renderedBoardLocked().
+ */
+const RenderCache *renderedStateLocked(SharedGameState *state)
+{
+    RenderCache *cache = &state->render;
+    if (cache->version == state->stateVersion && cache->seq == state->boardSeq)
+        return cache;
+
+    size_t len = snprintf(cache->scoreText, sizeof(cache->scoreText), "Scoreboard:\n");
+    for (int i = 0; i < MAX_PLAYERS && len < sizeof(cache->scoreText); i++)
     {
         if (state->players[i].connected)
         {
-            char line[128];
             const char *name = state->players[i].name[0] ? state->players[i].name : "Unknown";
-            snprintf(line, sizeof(line), "%s (ID %d): Total Score %d | Score This Round %d\n",
-                     name, i, state->players[i].score, state->players[i].roundScore);
-            strncat(scoreMsg, line, sizeof(scoreMsg) - strlen(scoreMsg) - 1);
+            len += snprintf(cache->scoreText + len, sizeof(cache->scoreText) - len,
+                            "%s (ID %d): Total Score %d | Score This Round %d%s\n",
+                            name, i, state->players[i].score, state->players[i].roundScore,
+                            state->players[i].away ? " (away)" : "");
         }
     }
-    pthread_mutex_unlock(&state->mutex);
-    strncat(boardMsg, scoreMsg, sizeof(boardMsg) - strlen(boardMsg) - 1);
-    pthread_mutex_lock(&state->mutex);
-    snprintf(turnMsg, sizeof(turnMsg), "PLAYER TURN %d\n", state->currentTurn);
-    pthread_mutex_unlock(&state->mutex);
-    strncat(boardMsg, turnMsg, sizeof(boardMsg) - strlen(boardMsg) - 1);
-    strcat(boardMsg, "<<END>>\n");
+    snprintf(cache->turnText, sizeof(cache->turnText), "PLAYER TURN %d\n", state->currentTurn);
+
+    frameBufferReset(&cache->snapshot);
+    encodeBoardLocked(state, &cache->snapshot);
+    encodeScoreboardLocked(state, &cache->snapshot);
+    encodeTurnLocked(state, &cache->snapshot);
+
+    cache->version = state->stateVersion;
+    cache->seq = state->boardSeq;
+    cache->textCurrent = false;
+    if (state->cards.count <= TEXT_BOARD_MAX_CARDS)
+        renderBoardTextLocked(state, cache);
+    return cache;
+}
 
-    pthread_mutex_lock(&state->mutex);
-    for (int i = 0; i < MAX_PLAYERS; i++)
+const RenderCache *renderedBoardLocked(SharedGameState *state)
+{
+    RenderCache *cache = &state->render;
+    renderedStateLocked(state);
+    if (!cache->textCurrent)
+        renderBoardTextLocked(state, cache);
+    return cache;
+}
+
+/*
+ * "Cards changed:" and the cells that differ from what was last broadcast,
+ * as a text player sees them (nothing when none do), grown into *text.
+ * Must run before encodeCardDeltasLocked(), which moves the sent state on.
+ */
+static const char *formatCardChangesLocked(SharedGameState *state, char **text, size_t *capacity)
+{
+    const CardBoard *cards = &state->cards;
+    int valueWidth, idWidth;
+    boardCellWidths(state, &valueWidth, &idWidth);
+    size_t cell = (size_t)idWidth + valueWidth + 6;
+
+    reserveText(text, capacity, 64);
+    char *out = putText(*text, "Cards changed:");
+    for (int w = 0; w < CARD_WORDS(cards->count); w++)
     {
-        if (state->players[i].connected)
+        CardWord changed = (cards->flipped[w] ^ state->sentFlipped[w]) | (cards->matched[w] ^ state->sentMatched[w]);
+        if (cards->count - w * CARD_WORD_BITS < CARD_WORD_BITS)
+            changed &= ((CardWord)1 << (cards->count % CARD_WORD_BITS)) - 1;
+        for (; changed; changed &= changed - 1)
         {
-            send(state->players[i].socket, boardMsg, strlen(boardMsg), 0);
+            int idx = w * CARD_WORD_BITS + __builtin_ctzll(changed);
+            size_t len = (size_t)(out - *text);
+            out = reserveText(text, capacity, len + cell + 2) + len;
+            *out++ = ' ';
+            *out++ = '(';
+            out = putDigits(out, idx, idWidth);
+            out = putText(out, ") [");
+            if (cardFaceUp(cards, idx))
+                out = putDigits(out, cards->faceValue[idx], valueWidth);
+            else
+            {
+                memset(out, '-', (size_t)valueWidth);
+                out += valueWidth;
+            }
+            *out++ = ']';
         }
     }
-    pthread_mutex_unlock(&state->mutex);
-    formatOfBoardForServer(state, serverMsg, sizeof(serverMsg));
-    strncat(serverMsg, scoreMsg, sizeof(serverMsg) - strlen(serverMsg) - 1);
-    strncat(serverMsg, turnMsg, sizeof(serverMsg) - strlen(serverMsg) - 1);
-    printf("%s", serverMsg);
+    //Nothing changed: the message says all there is
+    if ((size_t)(out - *text) == strlen("Cards changed:"))
+        out = *text;
+    else
+        *out++ = '\n';
+    *out = '\0';
+    return *text;
 }
 
-static void sendBoardStateToAllWithMessage(SharedGameState *state, const char *message)
+/*
+ * Text players get the whole rendered board, or on a board too big for
+ * that (TEXT_BOARD_MAX_CARDS) just the cells that changed, and the whole
+ * board only with a snapshot. Binary players get a snapshot when asked
+ * for one, otherwise only the cards and scores that changed plus the
+ * events that explain them.
+ */
+static void broadcastBoard(SharedGameState *state, const char *message, const FrameBuffer *events, bool snapshot)
 {
-    char boardMsg[4096];
-    char serverMsg[4096];
-    char scoreMsg[512];
-    char turnMsg[64];
+    FrameBuffer deltas;
+    frameBufferInit(&deltas);
+    char *changes = NULL;
+    size_t changesCapacity = 0;
+
+    pthread_mutex_lock(&state->mutex);
+    bool wholeBoard = snapshot || state->cards.count <= TEXT_BOARD_MAX_CARDS;
+    if (!wholeBoard)
+        formatCardChangesLocked(state, &changes, &changesCapacity);
+    if (!snapshot)
+    {
+        encodeCardDeltasLocked(state, &deltas);
+        if (events)
+            framePutBytes(&deltas, events->data, events->len);
+        encodeScoreDeltasLocked(state, &deltas);
+    }
+
+    const RenderCache *render = wholeBoard ? renderedBoardLocked(state) : renderedStateLocked(state);
+    const FrameBuffer *frames = &deltas;
+    if (snapshot)
+    {
+        frames = &render->snapshot;
+        rememberSentStateLocked(state);
+    }
+    const char *board = wholeBoard ? render->boardText : changes;
 
-    formatOfBoard(state, boardMsg, sizeof(boardMsg));
     if (message && message[0] != '\0')
     {
-        strncat(boardMsg, "\n", sizeof(boardMsg) - strlen(boardMsg) - 1);
-        strncat(boardMsg, message, sizeof(boardMsg) - strlen(boardMsg) - 1);
+        size_t size = strlen(board) + strlen(message) + strlen(render->scoreText) +
+                      strlen(render->turnText) + 16;
+        char *text = malloc(size);
+        if (!text)
+        {
+            perror("broadcastBoard: malloc");
+            exit(1);
+        }
+        snprintf(text, size, "%s\n%s\n%s%s\n<<END>>\n",
+                 board, message, render->scoreText, render->turnText);
+        sendRenderedToAllLocked(state, text, frames, OUT_BULK);
+        free(text);
     }
-    scoreMsg[0] = '\0';
-    pthread_mutex_lock(&state->mutex);
-    strncat(scoreMsg, "\nScoreboard:\n", sizeof(scoreMsg) - strlen(scoreMsg) - 1);
-    for (int i = 0; i < MAX_PLAYERS; i++)
+    else if (wholeBoard)
     {
-        if (state->players[i].connected)
+        sendRenderedToAllLocked(state, render->fullText, frames, OUT_BULK);
+    }
+    else
+    {
+        size_t size = strlen(changes) + strlen(render->scoreText) + strlen(render->turnText) + 16;
+        char *text = malloc(size);
+        if (!text)
         {
-            char line[128];
-            const char *name = state->players[i].name[0] ? state->players[i].name : "Unknown";
-            snprintf(line, sizeof(line), "%s (ID %d): Total Score %d | Score This Round %d\n",
-                     name, i, state->players[i].score, state->players[i].roundScore);
-            strncat(scoreMsg, line, sizeof(scoreMsg) - strlen(scoreMsg) - 1);
+            perror("broadcastBoard: malloc");
+            exit(1);
         }
+        snprintf(text, size, "%s\n%s%s<<END>>\n", changes, render->scoreText, render->turnText);
+        sendRenderedToAllLocked(state, text, frames, OUT_BULK);
+        free(text);
     }
     pthread_mutex_unlock(&state->mutex);
-    strncat(boardMsg, scoreMsg, sizeof(boardMsg) - strlen(boardMsg) - 1);
+
+    free(changes);
+    frameBufferFree(&deltas);
+}
+
+void sendBoardStateToAll(SharedGameState *state)
+{
+    broadcastBoard(state, NULL, NULL, false);
+}
+
+void sendBoardSnapshotToAll(SharedGameState *state)
+{
+    broadcastBoard(state, NULL, NULL, true);
+}
+
+static void sendBoardStateToAllWithMessage(SharedGameState *state, const char *message, const FrameBuffer *events)
+{
+    broadcastBoard(state, message, events, false);
+}
+
+/* A flip's broadcasts (started at broadcastNs) are all sent: time them and the flip's whole trip */
+static void recordFlipSent(SharedGameState *state, uint64_t broadcastNs)
+{
+    latencySince(LAT_BROADCAST, broadcastNs);
     pthread_mutex_lock(&state->mutex);
-    snprintf(turnMsg, sizeof(turnMsg), "PLAYER TURN %d\n", state->currentTurn);
+    uint64_t arrivedNs = state->flipArrivedNs;
+    state->flipArrivedNs = 0;
     pthread_mutex_unlock(&state->mutex);
-    strncat(boardMsg, turnMsg, sizeof(boardMsg) - strlen(boardMsg) - 1);
-    strncat(boardMsg, "\n<<END>>\n", sizeof(boardMsg) - strlen(boardMsg) - 1);
+    latencySince(LAT_FLIP_TOTAL, arrivedNs);
+}
 
+/* Answers CMD_SNAPSHOT; does not touch what the rest of the room was sent */
+void sendBoardSnapshot(SharedGameState *state, int playerID)
+{
     pthread_mutex_lock(&state->mutex);
-    for (int i = 0; i < MAX_PLAYERS; i++)
+    Player *player = &state->players[playerID];
+    if (player->connected && player->binaryProtocol)
     {
-        if (state->players[i].connected)
-        {
-            send(state->players[i].socket, boardMsg, strlen(boardMsg), 0);
-        }
+        const RenderCache *render = renderedStateLocked(state);
+        sendToPlayer(player, render->snapshot.data, render->snapshot.len, OUT_BULK);
     }
     pthread_mutex_unlock(&state->mutex);
-
-    formatOfBoardForServer(state, serverMsg, sizeof(serverMsg));
-    if (message && message[0] != '\0')
-    {
-        strncat(serverMsg, "\n", sizeof(serverMsg) - strlen(serverMsg) - 1);
-        strncat(serverMsg, message, sizeof(serverMsg) - strlen(serverMsg) - 1);
-    }
-    strncat(serverMsg, scoreMsg, sizeof(serverMsg) - strlen(serverMsg) - 1);
-    strncat(serverMsg, turnMsg, sizeof(serverMsg) - strlen(serverMsg) - 1);
-    printf("%s", serverMsg);
 }
 
 static void printScoreboard(SharedGameState *state)
@@ -298,212 +662,331 @@ static void printScoreboard(SharedGameState *state)
     fflush(stdout);
 }
 
-void sendTurnMessage(SharedGameState *state)
+
+/* Timer callback: the turn ends once its result has been on screen for a moment */
+static void finishTurn(void *arg)
 {
-    char msg[256];
+    SharedGameState *state = (SharedGameState *)arg;
 
     pthread_mutex_lock(&state->mutex);
-    int turn = state->currentTurn;
+    state->turnTimer = 0;
+    pthread_mutex_unlock(&state->mutex);
+    advanceTurn(state);
+}
 
-    for (int i = 0; i < MAX_PLAYERS; i++)
+/* Timer callback: turns a mismatched pair face down again */
+static void hideMismatch(void *arg)
+{
+    SharedGameState *state = (SharedGameState *)arg;
+
+    pthread_mutex_lock(&state->mutex);
+    cardSetFlipped(&state->cards, state->revealFirst, false);
+    cardSetFlipped(&state->cards, state->revealSecond, false);
+    state->stateVersion++;
+    state->turnTimer = timerSchedule(TURN_ADVANCE_DELAY_MS, finishTurn, state);
+    pthread_mutex_unlock(&state->mutex);
+
+    sendBoardStateToAll(state);
+}
+
+/* Timer callback: the player to move let the turn deadline pass */
+static void turnDeadlineExpired(void *arg)
+{
+    SharedGameState *state = (SharedGameState *)arg;
+    bool expired = false;
+
+    pthread_mutex_lock(&state->mutex);
+    state->turnDeadline = 0;
+    int current = state->currentTurn;
+    //A second flip that already landed wins the race against the deadline
+    if (state->gameStarted && !state->closing && current >= 0 && current < MAX_PLAYERS &&
+        state->players[current].flipsDone < 2)
     {
-        if (!state->players[i].connected)
-            continue;
+        state->turnExpired = true;
+        expired = true;
+    }
+    pthread_mutex_unlock(&state->mutex);
 
-        snprintf(msg, sizeof(msg), "PLAYER TURN %d\n<<END>>\n", turn);
-        send(state->players[i].socket, msg, strlen(msg), 0);
+    if (expired)
+        expireTurn(state);
+}
+
+/* Starts the clock on the current turn; caller holds state->mutex */
+void armTurnDeadlineLocked(SharedGameState *state)
+{
+    if (state->turnDeadline)
+        timerCancel(state->turnDeadline);
+    state->turnDeadline = 0;
+    state->turnExpired = false;
+    if (serverConfig.turnTimeoutSec > 0)
+        state->turnDeadline = timerSchedule(serverConfig.turnTimeoutSec * 1000, turnDeadlineExpired, state);
+}
+
+/* Drops a pending reveal, turn advance or deadline, e.g. when the game stops under it; caller holds state->mutex */
+void cancelTurnTimer(SharedGameState *state)
+{
+    if (state->turnTimer)
+    {
+        timerCancel(state->turnTimer);
+        state->turnTimer = 0;
+    }
+    if (state->turnDeadline)
+    {
+        timerCancel(state->turnDeadline);
+        state->turnDeadline = 0;
+    }
+    state->turnExpired = false;
+}
+
+/* The current player ran out of time or dropped out (turnExpired is set): skip the turn or take the seat */
+void expireTurn(SharedGameState *state)
+{
+    pthread_mutex_lock(&state->mutex);
+    int current = state->currentTurn;
+    if (!state->turnExpired || !state->gameStarted || current < 0 || current >= MAX_PLAYERS)
+    {
+        state->turnExpired = false;
+        pthread_mutex_unlock(&state->mutex);
+        return;
+    }
+    state->turnExpired = false;
+
+    Player *player = &state->players[current];
+    if (player->flipsDone == 1 && player->firstFlipIndex >= 0)
+        cardSetFlipped(&state->cards, player->firstFlipIndex, false);
+    player->flipsDone = 0;
+    player->firstFlipIndex = -1;
+    player->secondFlipIndex = -1;
+    state->stateVersion++;
+
+    //Someone whose connection dropped is not idle, just gone for now
+    bool away = player->away;
+    bool forfeit = serverConfig.afkAction == AFK_FORFEIT && !away;
+    if (forfeit && player->connected)
+    {
+        sendPlayerMessage(player, MSG_INFO, "", "Your turn timed out and you forfeited your seat.\n");
+        //Only the read side, so what was already queued still reaches the player
+        shutdown(player->socket, SHUT_RD);
     }
     pthread_mutex_unlock(&state->mutex);
+
+    if (!away)
+        pushRoomLogEvent(state, LOG_TURN, LOGEV_TURN_TIMED_OUT, current, NULL, 1, forfeit ? 1 : 0);
+
+    //A forfeit ends in a disconnect, which stops the game for everyone
+    if (forfeit)
+        return;
+
+    char notifyMsg[128];
+    snprintf(notifyMsg, sizeof(notifyMsg), away ? "Player %d is away. Turn skipped." : "Player %d ran out of time. Turn skipped.", current);
+    FrameBuffer events;
+    frameBufferInit(&events);
+    frameAppendText(&events, MSG_INFO, notifyMsg);
+    sendBoardStateToAllWithMessage(state, notifyMsg, &events);
+    frameBufferFree(&events);
+
+    advanceTurn(state);
 }
 
-void *gameLoopThread(void *arg)
+void sendTurnMessage(SharedGameState *state)
 {
-    SharedGameState *state = (SharedGameState *)arg;
-    bool boardInitialized = false;
+    char msg[64];
+    FrameBuffer frames;
+    frameBufferInit(&frames);
+
+    pthread_mutex_lock(&state->mutex);
+    const RenderCache *render = renderedStateLocked(state);
+    encodeTurnLocked(state, &frames);
+    snprintf(msg, sizeof(msg), "%s<<END>>\n", render->turnText);
+    sendRenderedToAllLocked(state, msg, &frames, OUT_CONTROL);
+    pthread_mutex_unlock(&state->mutex);
 
-    while (1)
+    frameBufferFree(&frames);
+}
+
+/*
+ * Brings the players up to date with a game that has just started or
+ * stopped (gameStarted against gameAnnounced). Called after anything that
+ * can start or end a game, on the event loop thread like every other
+ * room handler; caller holds no lock.
+ */
+void syncRoomGame(SharedGameState *state)
+{
+    pthread_mutex_lock(&state->mutex);
+    bool gameStarted = state->gameStarted;
+    bool announced = state->gameAnnounced;
+    bool broadcastStop = state->boardNeedsBroadcast;
+    state->boardNeedsBroadcast = false;
+    state->gameAnnounced = gameStarted;
+    pthread_mutex_unlock(&state->mutex);
+
+    if (!serverRunning || state->closing)
+        return;
+
+    if (broadcastStop && !gameStarted)
     {
-        if (!serverRunning)
+        sendMessageToAll(state, MSG_GAME_STOPPED, "GAME_STOPPED\n", "Waiting for players...\nPlease type 1 to READY.\n");
+    }
+
+    if (!gameStarted && announced)
+    {
+        pushRoomLogEvent(state, LOG_GAME, LOGEV_GAME_RESTARTED, -1, NULL, 0);
+        sendMessageToAll(state, MSG_GAME_STOPPED, "GAME_STOPPED\n", "Waiting for players...\nPlease type 1 to READY.\n");
+        printf("Connected players:\n");
+        pthread_mutex_lock(&state->mutex);
+        for (int i = 0; i < MAX_PLAYERS; i++)
         {
-            printf("Game thread exiting...\n");
-            break;
+            if (state->players[i].connected)
+            {
+                printf(" - Player %d\n", i);
+            }
         }
+        pthread_mutex_unlock(&state->mutex);
+        return;
+    }
 
+    if (gameStarted && !announced)
+    {
+        printf("Game Started!\n");
         pthread_mutex_lock(&state->mutex);
-        int current = state->currentTurn;
-        bool gameStarted = state->gameStarted;
-        bool broadcastStop = state->boardNeedsBroadcast;
-        if (broadcastStop)
-            state->boardNeedsBroadcast = false;
+        uint64_t dealSeed = state->dealSeed;
+        int rows = state->boardRows;
+        int cols = state->boardCols;
         pthread_mutex_unlock(&state->mutex);
-
-        if (broadcastStop && !gameStarted)
+        pushRoomLogEvent(state, LOG_GAME, LOGEV_GAME_STARTED, -1, NULL, 4,
+                         (int)(uint32_t)(dealSeed >> 32), (int)(uint32_t)dealSeed, rows, cols);
+        sendMessageToAll(state, MSG_GAME_STARTED, "\nGAME STARTED\n", "");
+        pthread_mutex_lock(&state->mutex);
+        if (state->currentTurn < 0)
         {
-            const char *notify = "GAME_STOPPED\nWaiting for players...\nPlease type 1 to READY.\n<<END>>\n";
-            pthread_mutex_lock(&state->mutex);
             for (int i = 0; i < MAX_PLAYERS; i++)
             {
-                if (state->players[i].connected)
+                if (state->players[i].connected && !state->players[i].away)
                 {
-                    send(state->players[i].socket, notify, strlen(notify), 0);
+                    state->currentTurn = i;
+                    state->stateVersion++;
+                    break;
                 }
             }
-            pthread_mutex_unlock(&state->mutex);
         }
-        static int firstPick = -1;
-
-        if (!gameStarted && boardInitialized)
+        int current = state->currentTurn;
+        armTurnDeadlineLocked(state);
+        if (current >= 0 && current < MAX_PLAYERS)
         {
-            boardInitialized = false;
+            printf("Player %d Flips Times : %d\n", state->players[current].playerID, state->players[current].flipsDone);
+        }
+        pthread_mutex_unlock(&state->mutex);
+        sendBoardSnapshotToAll(state);
+        sendTurnMessage(state);
+    }
+}
 
-            pushLogEvent(state, LOG_GAME, "Game restarted. Waiting for players.\n");
-            pthread_mutex_lock(&state->mutex);
-            const char *notify = "GAME_STOPPED\nWaiting for players...\nPlease type 1 to READY.\n<<END>>\n";
-            for (int i = 0; i < MAX_PLAYERS; i++)
-            {
-                if (state->players[i].connected)
-                {
-                    send(state->players[i].socket, notify, strlen(notify), 0);
-                }
-            }
-            pthread_mutex_unlock(&state->mutex);
-            printf("Connected players:\n");
-            pthread_mutex_lock(&state->mutex);
-            for (int i = 0; i < MAX_PLAYERS; i++)
-            {
-                if (state->players[i].connected)
-                {
-                    printf(" - Player %d\n", i);
-                }
-            }
+/*
+ * Shows the flip pushClientCommand() just took for the current player:
+ * the first card of a turn on its own, or the pair once the second is in,
+ * after which a timer hides a mismatch and ends the turn. Caller holds no lock.
+ */
+void handleFlip(SharedGameState *state)
+{
+    uint64_t startedNs = latencyNow();
 
-            pthread_mutex_unlock(&state->mutex);
-            usleep(100000);
-            continue;
-        }
+    pthread_mutex_lock(&state->mutex);
+    int current = state->currentTurn;
+    if (!state->gameStarted || current < 0 || current >= MAX_PLAYERS)
+    {
+        pthread_mutex_unlock(&state->mutex);
+        return;
+    }
+    int flipsDone = state->players[current].flipsDone;
+    pthread_mutex_unlock(&state->mutex);
+    if (flipsDone == 1)
+    {
+        pthread_mutex_lock(&state->mutex);
+        int flippedIndex = state->players[current].firstFlipIndex;
+        cardSetFlipped(&state->cards, flippedIndex, true);
+        int flippedValue = state->cards.faceValue[flippedIndex];
+        state->stateVersion++;
+        pthread_mutex_unlock(&state->mutex);
 
-        if (gameStarted && !boardInitialized)
-        {
-            boardInitialized = true;
+        pushRoomLogEvent(state, LOG_GAME, LOGEV_CARD_FLIPPED, current, NULL, 2, flippedIndex, flippedValue);
+        char notifyMsg[256];
+        snprintf(notifyMsg, sizeof(notifyMsg),"Player %d flipped card %d (Value: %d)",current,flippedIndex,flippedValue);
+        FrameBuffer events;
+        frameBufferInit(&events);
+        encodeCardFlipped(&events, current, flippedIndex, flippedValue);
+        uint64_t broadcastNs = latencySince(LAT_FLIP_APPLY, startedNs);
+        sendBoardStateToAllWithMessage(state, notifyMsg, &events);
+        recordFlipSent(state, broadcastNs);
+        frameBufferFree(&events);
+        return;
+    }
+    if (flipsDone != 2)
+        return;
 
-            printf("Game Started!\n");
-            pushLogEvent(state, LOG_GAME, "Game started.\n");
-            const char *startMsg = "\nGAME STARTED\n<<END>>\n";
-            pthread_mutex_lock(&state->mutex);
-            for (int i = 0; i < MAX_PLAYERS; i++)
-            {
-                if (state->players[i].connected)
-                {
-                    send(state->players[i].socket,
-                         startMsg,
-                         strlen(startMsg),
-                         0);
-                }
-            }
-            if (state->currentTurn < 0)
-            {
-                for (int i = 0; i < MAX_PLAYERS; i++)
-                {
-                    if (state->players[i].connected)
-                    {
-                        state->currentTurn = i;
-                        break;
-                    }
-                }
-            }
-            current = state->currentTurn;
-            if (current >= 0 && current < MAX_PLAYERS)
-            {
-                printf("Player %d Flips Times : %d\n", state->players[current].playerID, state->players[current].flipsDone);
-            }
-            pthread_mutex_unlock(&state->mutex);
-            sendBoardStateToAll(state);
-            sendTurnMessage(state);
- 
-            continue;
-        }
+    printf("Player %d has done %d flips this turn.\n", current, flipsDone);
+    pthread_mutex_lock(&state->mutex);
+    int firstCardIndex = state->players[current].firstFlipIndex;
+    int secondCardIndex = state->players[current].secondFlipIndex;
+    int firstValue = state->cards.faceValue[firstCardIndex];
+    int secondValue = state->cards.faceValue[secondCardIndex];
+    bool matched = state->cards.partner[firstCardIndex] == secondCardIndex;
+    if (state->turnDeadline)
+    {
+        timerCancel(state->turnDeadline);
+        state->turnDeadline = 0;
+    }
+    cardSetFlipped(&state->cards, firstCardIndex, true);
+    cardSetFlipped(&state->cards, secondCardIndex, true);
+    state->stateVersion++;
+    pthread_mutex_unlock(&state->mutex);
+    uint64_t broadcastNs = latencySince(LAT_FLIP_APPLY, startedNs);
+    sendBoardStateToAll(state);
 
-        if (gameStarted)
-        {
-            sem_wait(&state->flipDoneSemaphore);
-            pthread_mutex_lock(&state->mutex);
-            current = state->currentTurn;
-            int flipsDone = state->players[current].flipsDone;
-            pthread_mutex_unlock(&state->mutex);
-            if (flipsDone == 1)
-            {
-                pthread_mutex_lock(&state->mutex);
-                int flippedIndex = state->players[current].firstFlipIndex;
-                Card *flippedCard = &state->cards[flippedIndex];
-                flippedCard->isFlipped = true;
-                pthread_mutex_unlock(&state->mutex);
-
-                char logMsg[LOG_MSG_LENGTH];
-                snprintf(logMsg, LOG_MSG_LENGTH,"Player %d flipped Card %d (Value: %d)\n",current,flippedIndex,flippedCard->faceValue);
-                pushLogEvent(state, LOG_GAME, logMsg);
-                char notifyMsg[256];
-                snprintf(notifyMsg, sizeof(notifyMsg),"Player %d flipped card %d (Value: %d)",current,flippedIndex,flippedCard->faceValue);
-                sendBoardStateToAllWithMessage(state, notifyMsg);
-            }
-            if (flipsDone == 2) 
-            {
-                printf("Player %d has done %d flips this turn.\n", current, state->players[current].flipsDone);
-                pthread_mutex_lock(&state->mutex);
-                int flipsDone = state->players[current].flipsDone;
-                int firstCardIndex = state->players[current].firstFlipIndex;
-                int secondCardIndex = state->players[current].secondFlipIndex;
-                Card *firstCard = &state->cards[firstCardIndex];
-                Card *secondCard = &state->cards[secondCardIndex];
-                firstCard->isFlipped = true;
-                secondCard->isFlipped = true;
-                pthread_mutex_unlock(&state->mutex);
-                sendBoardStateToAll(state);
-
-                if (firstCard->faceValue == secondCard->faceValue)
-                {
-                    pthread_mutex_lock(&state->mutex);
-                    firstCard->isMatched = true;
-                    secondCard->isMatched = true;
-                    state->matchedPaires++;
-                    state->players[current].score++;
-                    state->players[current].roundScore++;
-                    pthread_mutex_unlock(&state->mutex);
-                          printf("Player %d found a match! Total score: %d\n",current,state->players[current].score);
-                    fflush(stdout);
-                    char logMsg[LOG_MSG_LENGTH];
-                    snprintf(logMsg, LOG_MSG_LENGTH,"Player %d found a match: Card %d and Card %d (Value: %d)\n",current,firstCardIndex,secondCardIndex,firstCard->faceValue);
-                    pushLogEvent(state, LOG_GAME, logMsg);
-
-                    snprintf(logMsg, LOG_MSG_LENGTH,"Player %d score updated: Round %d\n",current,state->players[current].score);
-                    pushLogEvent(state, LOG_GAME, logMsg);
-
-                    printScoreboard(state);
-
-                    char notifyMsg[256];
-                    snprintf(notifyMsg, sizeof(notifyMsg),"Player %d flipped card %d (Value: %d)\nPlayer %d flipped card %d (Value: %d)\nCards %d and %d match",current,firstCardIndex,firstCard->faceValue,current,secondCardIndex,secondCard->faceValue,firstCardIndex,secondCardIndex);
-                    sendBoardStateToAllWithMessage(state, notifyMsg);
-                }
-                else
-                {
-                    char logMsg[LOG_MSG_LENGTH];
-                    snprintf(logMsg, LOG_MSG_LENGTH,"Player %d did not match: Card %d and Card %d (Values: %d, %d)\n",current,firstCardIndex,secondCardIndex,firstCard->faceValue,secondCard->faceValue);
-                    pushLogEvent(state, LOG_GAME, logMsg);
-
-                    char notifyMsg[256];
-                    snprintf(notifyMsg, sizeof(notifyMsg),"Player %d flipped card %d (Value: %d)\nPlayer %d flipped card %d (Value: %d)\nCards %d and %d not match",current,firstCardIndex,firstCard->faceValue,current,secondCardIndex,secondCard->faceValue,firstCardIndex,secondCardIndex);
-                    sendBoardStateToAllWithMessage(state, notifyMsg);
-
-                    usleep(2000000);
-                    pthread_mutex_lock(&state->mutex);
-                    firstCard->isFlipped = false;
-                    secondCard->isFlipped = false;
-                    pthread_mutex_unlock(&state->mutex);
-                    sendBoardStateToAll(state);
-                }
-                usleep(500000);
-                sem_post(&state->turnCompleteSemaphore);
-                continue;
-            }
-        }
+    if (matched)
+    {
+        pthread_mutex_lock(&state->mutex);
+        cardSetMatched(&state->cards, firstCardIndex);
+        cardSetMatched(&state->cards, secondCardIndex);
+        state->players[current].score++;
+        state->players[current].roundScore++;
+        state->stateVersion++;
+        pthread_mutex_unlock(&state->mutex);
+        printf("Player %d found a match! Total score: %d\n",current,state->players[current].score);
+        fflush(stdout);
+        pushRoomLogEvent(state, LOG_GAME, LOGEV_PAIR_MATCHED, current, NULL, 3, firstCardIndex, secondCardIndex, firstValue);
+        pushRoomLogEvent(state, LOG_GAME, LOGEV_SCORE_UPDATED, current, NULL, 1, state->players[current].score);
+
+        printScoreboard(state);
+
+        char notifyMsg[256];
+        snprintf(notifyMsg, sizeof(notifyMsg),"Player %d flipped card %d (Value: %d)\nPlayer %d flipped card %d (Value: %d)\nCards %d and %d match",current,firstCardIndex,firstValue,current,secondCardIndex,secondValue,firstCardIndex,secondCardIndex);
+        FrameBuffer events;
+        frameBufferInit(&events);
+        encodePairResult(&events, current, firstCardIndex, firstValue, secondCardIndex, secondValue, true);
+        sendBoardStateToAllWithMessage(state, notifyMsg, &events);
+        recordFlipSent(state, broadcastNs);
+        frameBufferFree(&events);
+
+        pthread_mutex_lock(&state->mutex);
+        state->turnTimer = timerSchedule(TURN_ADVANCE_DELAY_MS, finishTurn, state);
+        pthread_mutex_unlock(&state->mutex);
+        return;
     }
-}
\ No newline at end of file
+
+    pushRoomLogEvent(state, LOG_GAME, LOGEV_PAIR_MISMATCHED, current, NULL, 4, firstCardIndex, secondCardIndex, firstValue, secondValue);
+
+    char notifyMsg[256];
+    snprintf(notifyMsg, sizeof(notifyMsg),"Player %d flipped card %d (Value: %d)\nPlayer %d flipped card %d (Value: %d)\nCards %d and %d not match",current,firstCardIndex,firstValue,current,secondCardIndex,secondValue,firstCardIndex,secondCardIndex);
+    FrameBuffer events;
+    frameBufferInit(&events);
+    encodePairResult(&events, current, firstCardIndex, firstValue, secondCardIndex, secondValue, false);
+    sendBoardStateToAllWithMessage(state, notifyMsg, &events);
+    recordFlipSent(state, broadcastNs);
+    frameBufferFree(&events);
+
+    pthread_mutex_lock(&state->mutex);
+    state->revealFirst = firstCardIndex;
+    state->revealSecond = secondCardIndex;
+    state->turnTimer = timerSchedule(MISMATCH_REVEAL_MS, hideMismatch, state);
+    pthread_mutex_unlock(&state->mutex);
+}
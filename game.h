@@ -2,11 +2,25 @@
 #define GAME_H
 
 #include "shared_state.h"
+#include "protocol.h"
 
-void *gameLoopThread(void *arg);
+void syncRoomGame(SharedGameState *state);
+void handleFlip(SharedGameState *state);
+void expireTurn(SharedGameState *state);
 void sendBoardStateToAll(SharedGameState *state);
+void sendBoardSnapshotToAll(SharedGameState *state);
+void sendBoardSnapshot(SharedGameState *state, int playerID);
 void sendTurnMessage(SharedGameState *state);
+void cancelTurnTimer(SharedGameState *state);
+void armTurnDeadlineLocked(SharedGameState *state);
 void setupBoard(SharedGameState *state, int rows, int cols);
+void sendBoardSize(Player *player, int rows, int cols);
 void formatOfBoard(SharedGameState *state, char *buffer, size_t bufsize);
+void sendToPlayer(Player *player, const void *data, size_t len, OutPriority priority);
+void sendPlayerMessage(Player *player, uint8_t opcode, const char *textPrefix, const char *body);
+void sendPlayerError(Player *player, ErrorCode code, const char *text);
+//Caller holds state->mutex; the result stays valid until it is released
+const RenderCache *renderedStateLocked(SharedGameState *state);
+const RenderCache *renderedBoardLocked(SharedGameState *state);    // also fills boardText and fullText
 
 #endif
\ No newline at end of file
@@ -0,0 +1,184 @@
+#include "latency.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+
+/*
+ * Bucket layout: values below 2 * SUB_BUCKETS nanoseconds get a bucket
+ * each; above that every power of two is split into SUB_BUCKETS equal
+ * buckets, so a bucket is never wider than 1/32 of the values in it.
+ * Anything past MAX_TRACKED_NS (about 18 minutes) is counted as that.
+ */
+#define SUB_BITS 5
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define MAX_TRACKED_BITS 40
+#define MAX_TRACKED_NS ((1ULL << MAX_TRACKED_BITS) - 1)
+#define BUCKET_COUNT (2 * SUB_BUCKETS + (MAX_TRACKED_BITS - SUB_BITS - 1) * SUB_BUCKETS)
+
+typedef struct {
+    atomic_ulong buckets[BUCKET_COUNT];
+    atomic_ulong sumNs;
+    atomic_ulong maxNs;
+} Histogram;
+
+static Histogram histograms[LAT_STAGE_COUNT];
+
+//Printed name, and the stage label metrics.c exports it under
+static const struct {
+    const char *name;
+    const char *key;
+} stageNames[LAT_STAGE_COUNT] = {
+    [LAT_KERNEL_RECV] = {"kernel rx -> recv", "kernel_recv"},
+    [LAT_RECV_COMMAND] = {"recv -> command", "recv_command"},
+    [LAT_COMMAND_CHECK] = {"command checks", "command_check"},
+    [LAT_FLIP_APPLY] = {"flip -> broadcast", "flip_apply"},
+    [LAT_BROADCAST] = {"broadcast sends", "broadcast"},
+    [LAT_FLIP_TOTAL] = {"input -> broadcast sent", "flip_total"},
+    [LAT_TURN_ADVANCE] = {"turn end -> next turn", "turn_advance"},
+};
+
+static int bucketIndex(uint64_t ns)
+{
+    if (ns < 2 * SUB_BUCKETS)
+        return (int)ns;
+    if (ns > MAX_TRACKED_NS)
+        ns = MAX_TRACKED_NS;
+    int shift = (63 - __builtin_clzll(ns)) - SUB_BITS;
+    return 2 * SUB_BUCKETS + (shift - 1) * SUB_BUCKETS + (int)((ns >> shift) - SUB_BUCKETS);
+}
+
+/* Largest value that lands in bucket index, which is what percentiles report */
+static uint64_t bucketHighest(int index)
+{
+    if (index < 2 * SUB_BUCKETS)
+        return (uint64_t)index;
+    int shift = (index - 2 * SUB_BUCKETS) / SUB_BUCKETS + 1;
+    uint64_t top = SUB_BUCKETS + (uint64_t)((index - 2 * SUB_BUCKETS) % SUB_BUCKETS);
+    return ((top + 1) << shift) - 1;
+}
+
+uint64_t latencyNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* Moves a CLOCK_REALTIME stamp (what the kernel stamps packets with) onto the monotonic clock at now */
+uint64_t latencyFromRealtime(const struct timespec *stamp, uint64_t now)
+{
+    struct timespec real;
+    clock_gettime(CLOCK_REALTIME, &real);
+    int64_t ageNs = ((int64_t)real.tv_sec - (int64_t)stamp->tv_sec) * 1000000000LL +
+                    ((int64_t)real.tv_nsec - (int64_t)stamp->tv_nsec);
+    if (ageNs < 0 || (uint64_t)ageNs > now)
+        ageNs = 0;
+    return now - (uint64_t)ageNs;
+}
+
+void latencyRecord(LatencyStage stage, uint64_t ns)
+{
+    Histogram *histogram = &histograms[stage];
+    atomic_fetch_add_explicit(&histogram->buckets[bucketIndex(ns)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sumNs, ns, memory_order_relaxed);
+
+    unsigned long max = atomic_load_explicit(&histogram->maxNs, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&histogram->maxNs, &max, ns,
+                                                              memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+/* Records the time since startNs and returns now; a startNs of 0 (never stamped) records nothing */
+uint64_t latencySince(LatencyStage stage, uint64_t startNs)
+{
+    uint64_t now = latencyNow();
+    if (startNs != 0 && now >= startNs)
+        latencyRecord(stage, now - startNs);
+    return now;
+}
+
+const char *latencyStageName(LatencyStage stage)
+{
+    return stageNames[stage].name;
+}
+
+const char *latencyStageKey(LatencyStage stage)
+{
+    return stageNames[stage].key;
+}
+
+/* Copies the counts out, so a percentile walks a consistent total even while threads record */
+static unsigned long copyBuckets(const Histogram *histogram, unsigned long *counts)
+{
+    unsigned long total = 0;
+    for (int i = 0; i < BUCKET_COUNT; i++)
+    {
+        counts[i] = atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+        total += counts[i];
+    }
+    return total;
+}
+
+/*
+ * Counts how many samples are at most each of boundsNs (ascending), for
+ * exporters with fixed bucket edges. A bucket counts under the first
+ * bound its largest value fits, so a sample can be placed up to one
+ * bucket width (3%) late, never early.
+ */
+unsigned long latencyCumulative(LatencyStage stage, const uint64_t *boundsNs, int boundCount,
+                                unsigned long *atMost, uint64_t *sumNs)
+{
+    const Histogram *histogram = &histograms[stage];
+    unsigned long total = 0;
+    int bound = 0;
+    for (int i = 0; i < BUCKET_COUNT; i++)
+    {
+        while (bound < boundCount && bucketHighest(i) > boundsNs[bound])
+            atMost[bound++] = total;
+        total += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+    }
+    while (bound < boundCount)
+        atMost[bound++] = total;
+    *sumNs = atomic_load_explicit(&histogram->sumNs, memory_order_relaxed);
+    return total;
+}
+
+/* Bucket bounds can overshoot the largest value seen, so percentiles are capped at maxUs */
+static double percentileUs(const unsigned long *counts, unsigned long total, double percentile, double maxUs)
+{
+    unsigned long rank = (unsigned long)(percentile / 100.0 * (double)total + 0.999999);
+    if (rank < 1)
+        rank = 1;
+    unsigned long seen = 0;
+    for (int i = 0; i < BUCKET_COUNT; i++)
+    {
+        seen += counts[i];
+        if (seen >= rank)
+            return bucketHighest(i) / 1000.0 < maxUs ? bucketHighest(i) / 1000.0 : maxUs;
+    }
+    return maxUs;
+}
+
+void latencyDump(FILE *out)
+{
+    unsigned long counts[BUCKET_COUNT];
+
+    fprintf(out, "%-26s %10s %10s %10s %10s %10s %10s %10s\n",
+            "Flip latency (us)", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+    for (int stage = 0; stage < LAT_STAGE_COUNT; stage++)
+    {
+        const Histogram *histogram = &histograms[stage];
+        unsigned long total = copyBuckets(histogram, counts);
+        if (total == 0)
+        {
+            fprintf(out, "%-26s %10d\n", stageNames[stage].name, 0);
+            continue;
+        }
+        double meanUs = atomic_load_explicit(&histogram->sumNs, memory_order_relaxed) / (double)total / 1000.0;
+        double maxUs = atomic_load_explicit(&histogram->maxNs, memory_order_relaxed) / 1000.0;
+        fprintf(out, "%-26s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                stageNames[stage].name, total, meanUs,
+                percentileUs(counts, total, 50.0, maxUs), percentileUs(counts, total, 90.0, maxUs),
+                percentileUs(counts, total, 99.0, maxUs), percentileUs(counts, total, 99.9, maxUs), maxUs);
+    }
+    fflush(out);
+}
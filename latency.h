@@ -0,0 +1,55 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * Where a flip's time goes, one histogram per stage of its trip:
+ *
+ *   kernel receive -> recv() in handleClientReadable()    (when the kernel stamps packets)
+ *   recv()         -> pushClientCommand()
+ *   pushClientCommand() -> handleFlip()                   (validation)
+ *   handleFlip()   -> first broadcast
+ *   first broadcast -> last send() of it done
+ *   advanceTurn()  -> next turn sent
+ *
+ * plus the whole trip, input to broadcast. Times come from
+ * CLOCK_MONOTONIC in nanoseconds and land in HDR-style log-linear
+ * buckets (32 per power of two, so within about 3%), counted with
+ * relaxed atomics: recording is two clock reads and an add, from any
+ * thread, with no lock. Nothing is ever reset.
+ *
+ * SIGUSR1 prints every stage (latencyDump()) to the server's stdout;
+ * metrics.c serves them as Prometheus histograms.
+ */
+
+typedef enum {
+    LAT_KERNEL_RECV,        // kernel receive timestamp to recv() returning
+    LAT_RECV_COMMAND,       // recv() to pushClientCommand() taking the flip
+    LAT_COMMAND_CHECK,      // pushClientCommand() checking the flip before handleFlip()
+    LAT_FLIP_APPLY,         // handleFlip() to its first broadcast
+    LAT_BROADCAST,          // first broadcast to the last one sent
+    LAT_FLIP_TOTAL,         // input arriving to the last broadcast sent
+    LAT_TURN_ADVANCE,       // advanceTurn() to the next MSG_TURN sent
+    LAT_STAGE_COUNT
+} LatencyStage;
+
+/* When a client's bytes reached the kernel and when recv() handed them over; 0 = unknown */
+typedef struct {
+    uint64_t arrivedNs;
+    uint64_t readNs;
+} InputStamp;
+
+uint64_t latencyNow(void);
+uint64_t latencyFromRealtime(const struct timespec *stamp, uint64_t now);
+void latencyRecord(LatencyStage stage, uint64_t ns);
+uint64_t latencySince(LatencyStage stage, uint64_t startNs);
+const char *latencyStageName(LatencyStage stage);
+const char *latencyStageKey(LatencyStage stage);
+unsigned long latencyCumulative(LatencyStage stage, const uint64_t *boundsNs, int boundCount,
+                                unsigned long *atMost, uint64_t *sumNs);
+void latencyDump(FILE *out);
+
+#endif
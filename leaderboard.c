@@ -0,0 +1,501 @@
+#include "leaderboard.h"
+#include "rng.h"
+#include "score.h"
+#include "scoredb.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_LEVEL 32
+#define MIN_SLOTS 64
+#define COPY_CHUNK 4096         //Players copied per hold of scoreMutex
+
+typedef struct RankNode RankNode;
+
+typedef struct {
+    RankNode *next;
+    size_t span;            // players passed by following next, counting the one it lands on
+} RankLink;
+
+struct RankNode {
+    char name[PLAYER_NAME_LENGTH];
+    int wins;
+    int levels;
+    RankLink link[];
+};
+
+typedef struct {
+    RankNode *head;         // sentinel with MAX_LEVEL links, ranked before everyone
+    int levels;             // links in use on head
+    size_t length;
+    RankNode **slots;       // open addressing index by name, at most half full
+    size_t slotCount;
+    Rng rng;
+} RankList;
+
+static pthread_rwlock_t rankLock = PTHREAD_RWLOCK_INITIALIZER;
+static RankList ranking;
+static bool ready;
+static ScoreEntry *pending;         // updates that arrived while the list was being built
+static size_t pendingCount, pendingCapacity;
+
+/* True when (wins, name) ranks ahead of node */
+static bool ranksBefore(int wins, const char *name, const RankNode *node)
+{
+    if (wins != node->wins)
+        return wins > node->wins;
+    return strncmp(name, node->name, PLAYER_NAME_LENGTH) < 0;
+}
+
+static bool listInit(RankList *list, uint64_t seed)
+{
+    memset(list, 0, sizeof(*list));
+    list->head = calloc(1, sizeof(RankNode) + MAX_LEVEL * sizeof(RankLink));
+    if (!list->head)
+        return false;
+    list->head->levels = MAX_LEVEL;
+    list->levels = 1;
+    rngSeed(&list->rng, seed);
+    return true;
+}
+
+static RankNode *newNode(RankList *list, const char *name, int wins)
+{
+    //Each level up is a quarter as likely: about 1.33 links per player
+    int levels = 1;
+    while (levels < MAX_LEVEL && (rngNext(&list->rng) & 3) == 0)
+        levels++;
+
+    RankNode *node = calloc(1, sizeof(RankNode) + (size_t)levels * sizeof(RankLink));
+    if (!node)
+        return NULL;
+    strncpy(node->name, name, PLAYER_NAME_LENGTH - 1);
+    node->wins = wins;
+    node->levels = levels;
+    return node;
+}
+
+static RankNode *findNode(const RankList *list, const char *name)
+{
+    if (list->slotCount == 0)
+        return NULL;
+
+    size_t mask = list->slotCount - 1;
+    for (size_t slot = scoreNameHash(name) & mask; list->slots[slot]; slot = (slot + 1) & mask)
+    {
+        if (strncmp(list->slots[slot]->name, name, PLAYER_NAME_LENGTH) == 0)
+            return list->slots[slot];
+    }
+    return NULL;
+}
+
+static void placeNode(RankList *list, RankNode *node)
+{
+    size_t mask = list->slotCount - 1;
+    size_t slot = scoreNameHash(node->name) & mask;
+    while (list->slots[slot])
+        slot = (slot + 1) & mask;
+    list->slots[slot] = node;
+}
+
+/* Sizes the index for at least players names */
+static bool reserveIndex(RankList *list, size_t players)
+{
+    if (players * 2 <= list->slotCount)
+        return true;
+
+    size_t slotCount = list->slotCount ? list->slotCount : MIN_SLOTS;
+    while (slotCount < players * 2)
+        slotCount *= 2;
+    RankNode **slots = calloc(slotCount, sizeof(RankNode *));
+    if (!slots)
+        return false;
+
+    RankNode **old = list->slots;
+    size_t oldCount = list->slotCount;
+    list->slots = slots;
+    list->slotCount = slotCount;
+    for (size_t i = 0; i < oldCount; i++)
+    {
+        if (old[i])
+            placeNode(list, old[i]);
+    }
+    free(old);
+    return true;
+}
+
+/* Splices node in at its place by (wins, name), fixing up the spans it cuts across */
+static void linkNode(RankList *list, RankNode *node)
+{
+    RankNode *update[MAX_LEVEL];
+    size_t rank[MAX_LEVEL];
+    RankNode *x = list->head;
+
+    for (int i = list->levels - 1; i >= 0; i--)
+    {
+        rank[i] = i == list->levels - 1 ? 0 : rank[i + 1];
+        while (x->link[i].next && !ranksBefore(node->wins, node->name, x->link[i].next))
+        {
+            rank[i] += x->link[i].span;
+            x = x->link[i].next;
+        }
+        update[i] = x;
+    }
+
+    if (node->levels > list->levels)
+    {
+        for (int i = list->levels; i < node->levels; i++)
+        {
+            rank[i] = 0;
+            update[i] = list->head;
+            update[i]->link[i].span = list->length;
+        }
+        list->levels = node->levels;
+    }
+
+    for (int i = 0; i < node->levels; i++)
+    {
+        node->link[i].next = update[i]->link[i].next;
+        node->link[i].span = update[i]->link[i].span - (rank[0] - rank[i]);
+        update[i]->link[i].next = node;
+        update[i]->link[i].span = rank[0] - rank[i] + 1;
+    }
+    for (int i = node->levels; i < list->levels; i++)
+        update[i]->link[i].span++;
+    list->length++;
+}
+
+static void unlinkNode(RankList *list, RankNode *node)
+{
+    RankNode *update[MAX_LEVEL];
+    RankNode *x = list->head;
+
+    for (int i = list->levels - 1; i >= 0; i--)
+    {
+        while (x->link[i].next && ranksBefore(x->link[i].next->wins, x->link[i].next->name, node))
+            x = x->link[i].next;
+        update[i] = x;
+    }
+
+    for (int i = 0; i < list->levels; i++)
+    {
+        if (update[i]->link[i].next == node)
+        {
+            update[i]->link[i].span += node->link[i].span - 1;
+            update[i]->link[i].next = node->link[i].next;
+        }
+        else
+        {
+            update[i]->link[i].span--;
+        }
+    }
+    while (list->levels > 1 && !list->head->link[list->levels - 1].next)
+        list->levels--;
+    list->length--;
+}
+
+/* Sets name's total, adding the player if new; setting the same total twice is harmless */
+static void setScore(RankList *list, const char *name, int wins)
+{
+    RankNode *node = findNode(list, name);
+    if (node)
+    {
+        if (node->wins == wins)
+            return;
+        unlinkNode(list, node);
+        node->wins = wins;
+        linkNode(list, node);
+        return;
+    }
+
+    node = newNode(list, name, wins);
+    if (!node || !reserveIndex(list, list->length + 1))
+    {
+        perror("leaderboard");
+        free(node);
+        return;
+    }
+    placeNode(list, node);
+    linkNode(list, node);
+}
+
+/* 1-based position of node */
+static size_t rankOf(const RankList *list, const RankNode *node)
+{
+    size_t rank = 0;
+    const RankNode *x = list->head;
+    for (int i = list->levels - 1; i >= 0; i--)
+    {
+        while (x->link[i].next && !ranksBefore(node->wins, node->name, x->link[i].next))
+        {
+            rank += x->link[i].span;
+            x = x->link[i].next;
+        }
+    }
+    return x == node ? rank : 0;
+}
+
+static const RankNode *nodeAt(const RankList *list, size_t rank)
+{
+    size_t passed = 0;
+    const RankNode *x = list->head;
+    for (int i = list->levels - 1; i >= 0; i--)
+    {
+        while (x->link[i].next && passed + x->link[i].span <= rank)
+        {
+            passed += x->link[i].span;
+            x = x->link[i].next;
+        }
+        if (passed == rank)
+            return x;
+    }
+    return NULL;
+}
+
+/* Copies up to count rows starting at rank first. Caller holds rankLock */
+static void copyRows(LeaderboardView *view, size_t first, int count)
+{
+    view->players = ranking.length;
+    view->count = 0;
+    const RankNode *node = first >= 1 ? nodeAt(&ranking, first) : NULL;
+    for (; node && view->count < count; node = node->link[0].next, first++)
+    {
+        LeaderboardRow *row = &view->rows[view->count++];
+        row->rank = (uint32_t)first;
+        row->wins = node->wins;
+        memcpy(row->name, node->name, PLAYER_NAME_LENGTH);
+    }
+}
+
+/* Called under scoreMutex with the totals just saved */
+void leaderboardApply(const ScoreEntry *updates, int count)
+{
+    pthread_rwlock_wrlock(&rankLock);
+    for (int i = 0; i < count; i++)
+    {
+        if (ready)
+        {
+            setScore(&ranking, updates[i].name, updates[i].wins);
+            continue;
+        }
+
+        if (pendingCount == pendingCapacity)
+        {
+            size_t capacity = pendingCapacity ? pendingCapacity * 2 : 64;
+            ScoreEntry *grown = realloc(pending, capacity * sizeof(ScoreEntry));
+            if (!grown)
+            {
+                perror("leaderboard: pending updates");
+                break;
+            }
+            pending = grown;
+            pendingCapacity = capacity;
+        }
+        pending[pendingCount++] = updates[i];
+    }
+    pthread_rwlock_unlock(&rankLock);
+}
+
+typedef struct {
+    ScoreEntry *entries;
+    size_t count;
+    size_t capacity;
+} ScoreCopy;
+
+static void copyScore(const ScoreEntry *entry, void *arg)
+{
+    ScoreCopy *copy = arg;
+    if (copy->count < copy->capacity)
+        copy->entries[copy->count++] = *entry;
+}
+
+static int compareRanked(const void *a, const void *b)
+{
+    const ScoreEntry *x = a;
+    const ScoreEntry *y = b;
+    if (x->wins != y->wins)
+        return x->wins > y->wins ? -1 : 1;
+    return strncmp(x->name, y->name, PLAYER_NAME_LENGTH);
+}
+
+/* Links entries, already in rank order, by appending: O(n) instead of n searches */
+static bool buildFromSorted(RankList *list, const ScoreEntry *entries, size_t count)
+{
+    if (!reserveIndex(list, count))
+        return false;
+
+    RankNode *last[MAX_LEVEL];
+    size_t lastRank[MAX_LEVEL];
+    for (int i = 0; i < MAX_LEVEL; i++)
+    {
+        last[i] = list->head;
+        lastRank[i] = 0;
+    }
+
+    for (size_t k = 0; k < count; k++)
+    {
+        RankNode *node = newNode(list, entries[k].name, entries[k].wins);
+        if (!node)
+            return false;
+        placeNode(list, node);
+        for (int i = 0; i < node->levels; i++)
+        {
+            last[i]->link[i].next = node;
+            last[i]->link[i].span = k + 1 - lastRank[i];
+            last[i] = node;
+            lastRank[i] = k + 1;
+        }
+        if (node->levels > list->levels)
+            list->levels = node->levels;
+    }
+
+    //The last link on each level spans to the end of the list
+    for (int i = 0; i < list->levels; i++)
+        last[i]->link[i].span = count - lastRank[i];
+    list->length = count;
+    return true;
+}
+
+/* Ranks a copy of every saved player, then swaps it in and replays what changed meanwhile */
+void leaderboardBuild(ServerState *server)
+{
+    ScoreCopy copy = {NULL, 0, scores_count(server) + 1024};
+    copy.entries = malloc(copy.capacity * sizeof(ScoreEntry));
+    RankList list;
+    if (!copy.entries || !listInit(&list, server->boardSeed))
+    {
+        perror("leaderboard");
+        free(copy.entries);
+        return;
+    }
+
+    //Anyone saved since scores_load() is also in the pending queue, so a copy cut short loses nothing,
+    //and a total read after it changed is set again by the replay below
+    ScoreCursor cursor;
+    memset(&cursor, 0, sizeof(cursor));
+    bool more;
+    do
+    {
+        size_t before = copy.count;
+        more = scores_for_each_chunk(server, &cursor, COPY_CHUNK, copyScore, &copy);
+        if (cursor.restarted)
+        {
+            //Only this chunk is from the new scores.db
+            memmove(copy.entries, copy.entries + before, (copy.count - before) * sizeof(ScoreEntry));
+            copy.count -= before;
+        }
+    } while (more);
+    qsort(copy.entries, copy.count, sizeof(ScoreEntry), compareRanked);
+    if (!buildFromSorted(&list, copy.entries, copy.count))
+        perror("leaderboard: build");
+    free(copy.entries);
+
+    pthread_rwlock_wrlock(&rankLock);
+    ranking = list;
+    //Updates queued before the copy was taken set totals it already has, so replaying all of them is safe
+    for (size_t i = 0; i < pendingCount; i++)
+        setScore(&ranking, pending[i].name, pending[i].wins);
+    free(pending);
+    pending = NULL;
+    pendingCount = pendingCapacity = 0;
+    ready = true;
+    pthread_rwlock_unlock(&rankLock);
+}
+
+static void *leaderboardThread(void *arg)
+{
+    leaderboardBuild(arg);
+    pthread_rwlock_rdlock(&rankLock);
+    printf("Leaderboard ready: %zu players ranked\n", ranking.length);
+    pthread_rwlock_unlock(&rankLock);
+    fflush(stdout);
+    return NULL;
+}
+
+void leaderboardStart(ServerState *server)
+{
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, leaderboardThread, server) != 0)
+    {
+        perror("leaderboard thread");
+        leaderboardBuild(server);
+        return;
+    }
+    pthread_detach(thread);
+}
+
+/* The top count players; false while the leaderboard is still being built */
+bool leaderboardTop(int count, LeaderboardView *view)
+{
+    if (count > LEADERBOARD_MAX_ROWS)
+        count = LEADERBOARD_MAX_ROWS;
+
+    pthread_rwlock_rdlock(&rankLock);
+    bool isReady = ready;
+    if (isReady)
+    {
+        copyRows(view, 1, count);
+        view->rank = 0;
+    }
+    pthread_rwlock_unlock(&rankLock);
+    return isReady;
+}
+
+/* name's rank and up to radius players either side of it */
+bool leaderboardAround(const char *name, int radius, LeaderboardView *view)
+{
+    if (radius > (LEADERBOARD_MAX_ROWS - 1) / 2)
+        radius = (LEADERBOARD_MAX_ROWS - 1) / 2;
+
+    pthread_rwlock_rdlock(&rankLock);
+    bool isReady = ready;
+    if (isReady)
+    {
+        const RankNode *node = findNode(&ranking, name);
+        size_t rank = node ? rankOf(&ranking, node) : 0;
+        if (rank > 0)
+            copyRows(view, rank > (size_t)radius ? rank - radius : 1, radius * 2 + 1);
+        else
+        {
+            view->players = ranking.length;
+            view->count = 0;
+        }
+        view->rank = (uint32_t)rank;
+    }
+    pthread_rwlock_unlock(&rankLock);
+    return isReady;
+}
+
+/* Text rendering; name is the player a RANK query asked about, NULL for TOP */
+void formatLeaderboard(const LeaderboardView *view, const char *name, char *buffer, size_t bufsize)
+{
+    size_t pos = (size_t)snprintf(buffer, bufsize, "LEADERBOARD %zu players\n", view->players);
+    if (name && pos < bufsize)
+    {
+        if (view->rank > 0)
+            pos += (size_t)snprintf(buffer + pos, bufsize - pos, "%s is ranked #%u\n", name, view->rank);
+        else
+            pos += (size_t)snprintf(buffer + pos, bufsize - pos, "%s has no saved score\n", name);
+    }
+    for (int i = 0; i < view->count && pos < bufsize; i++)
+    {
+        const LeaderboardRow *row = &view->rows[i];
+        pos += (size_t)snprintf(buffer + pos, bufsize - pos, "#%u %s: %d\n", row->rank, row->name, row->wins);
+    }
+}
+
+void encodeLeaderboard(const LeaderboardView *view, FrameBuffer *fb)
+{
+    frameBegin(fb, MSG_LEADERBOARD);
+    framePutU32(fb, view->players > UINT32_MAX ? UINT32_MAX : (uint32_t)view->players);
+    framePutU32(fb, view->rank);
+    framePutU8(fb, (uint8_t)view->count);
+    for (int i = 0; i < view->count; i++)
+    {
+        framePutU32(fb, view->rows[i].rank);
+        framePutI32(fb, view->rows[i].wins);
+        framePutString(fb, view->rows[i].name);
+    }
+    frameEnd(fb);
+}
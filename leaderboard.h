@@ -0,0 +1,52 @@
+#ifndef LEADERBOARD_H
+#define LEADERBOARD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol.h"
+#include "shared_state.h"
+
+/*
+ * Every saved player ranked by total score, most first, ties broken by
+ * name. The ranking is an indexable skip list: each link also counts
+ * the players it jumps over, so finding a player's rank or the player
+ * at a given rank is O(log n), and a query costs O(log n + rows).
+ *
+ * The score store feeds it (leaderboardApply() runs under scoreMutex for
+ * every update), so it always matches the saved totals. Queries hold a
+ * read lock while they copy rows out: all the totals a game end changes
+ * are applied under one write lock, so a view never shows half of one.
+ *
+ * At startup the list is built in the background from a copy of the
+ * store, and updates that land meanwhile are queued and replayed over
+ * it; queries fail until it is ready.
+ */
+
+#define LEADERBOARD_MAX_ROWS 50
+#define LEADERBOARD_DEFAULT_ROWS 10
+#define LEADERBOARD_AROUND 5          // players shown either side of the one asked about
+
+typedef struct {
+    uint32_t rank;                  // 1 = most points
+    int wins;
+    char name[PLAYER_NAME_LENGTH];
+} LeaderboardRow;
+
+typedef struct {
+    size_t players;
+    uint32_t rank;                  // of the player asked about; 0 for TOP or when they have no saved score
+    int count;
+    LeaderboardRow rows[LEADERBOARD_MAX_ROWS];
+} LeaderboardView;
+
+void leaderboardStart(ServerState *server);
+void leaderboardBuild(ServerState *server);
+void leaderboardApply(const ScoreEntry *updates, int count);
+bool leaderboardTop(int count, LeaderboardView *view);
+bool leaderboardAround(const char *name, int radius, LeaderboardView *view);
+void formatLeaderboard(const LeaderboardView *view, const char *name, char *buffer, size_t bufsize);
+void encodeLeaderboard(const LeaderboardView *view, FrameBuffer *fb);
+
+#endif
@@ -0,0 +1,957 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "protocol.h"
+#include "shared_state.h"
+#include "rng.h"
+
+/*
+ * Headless load generator: N simulated players on the binary protocol,
+ * all driven from one epoll loop, playing whole games against a server.
+ *
+ * Every player connects and registers a name before anyone readies, so
+ * the server fills its rooms MAX_PLAYERS at a time. On its turn a player
+ * waits a think time, flips, waits again once the card is shown, flips
+ * the second card. A flip's latency runs from the moment its CMD_FLIP is
+ * written to the moment the same player sees that card face up in a
+ * broadcast: the server's whole input to broadcast path plus loopback.
+ *
+ * Build with make; ./loadgen --help lists the options.
+ */
+
+#define INBUF_SIZE (MAX_FRAME_PAYLOAD + FRAME_HEADER_SIZE)
+#define BANNER_SIZE 1024
+#define MAX_EVENTS 256
+
+typedef enum {
+    STRATEGY_MEMORY,    // remembers every card it has seen and takes known pairs
+    STRATEGY_RANDOM,    // any two face-down cards
+    STRATEGY_MIXED      // players alternate between the two
+} Strategy;
+
+typedef enum {
+    BOT_BANNER,         // waiting for the text connect banner
+    BOT_HELLO,          // sent PROTO BIN, waiting for MSG_HELLO
+    BOT_NAMING,         // sent CMD_NAME, waiting for MSG_WELCOME
+    BOT_LOBBY,          // named; READY once everyone is
+    BOT_PLAYING,
+    BOT_FINISHED
+} BotPhase;
+
+typedef enum {
+    TURN_IDLE,          // not our turn
+    TURN_THINK_FIRST,   // our turn; first flip goes out at dueUs
+    TURN_FIRST_SENT,
+    TURN_THINK_SECOND,
+    TURN_SECOND_SENT,
+    TURN_DONE           // both cards shown, waiting for the turn to move on
+} TurnStep;
+
+typedef struct {
+    int fd;
+    int index;
+    int seat;
+    BotPhase phase;
+    Strategy strategy;
+    Rng rng;
+    char name[PLAYER_NAME_LENGTH];
+
+    char banner[BANNER_SIZE];
+    size_t bannerLen;
+    unsigned char *inbuf;
+    size_t inLen;
+
+    //The board as this player has been told it, and the values it has seen
+    int cards;
+    unsigned char *state;
+    int *value;
+    int *known;
+    uint32_t boardSeq;
+    bool awaitingSnapshot;
+
+    TurnStep step;
+    uint64_t dueUs;         // next flip or READY, 0 for none
+    bool readyDue;
+    int pendingCard;
+    uint64_t sentUs;
+    int firstCard;
+    int gamesDone;
+} Bot;
+
+typedef struct {
+    const char *host;
+    int port;
+    int players;
+    int games;              // per player; 0 plays until --duration
+    unsigned int durationSec;
+    unsigned int thinkMinMs;
+    unsigned int thinkMaxMs;
+    Strategy strategy;
+    unsigned int reportSec;
+    uint64_t seed;
+    int boardRows;          // 0 plays whatever board the room has
+    int boardCols;
+} LoadConfig;
+
+/* Flip latencies in microseconds, kept whole so the percentiles are exact */
+typedef struct {
+    uint32_t *samples;
+    size_t count;
+    size_t capacity;
+} LatencyLog;
+
+static LoadConfig config = {
+    .host = "127.0.0.1",
+    .port = 8080,
+    .players = 12,
+    .games = 1,
+    .thinkMinMs = 100,
+    .thinkMaxMs = 300,
+    .strategy = STRATEGY_MEMORY,
+    .reportSec = 5,
+};
+
+static volatile sig_atomic_t stopping = 0;
+static LatencyLog latencies;
+static uint64_t gamesCompleted = 0;
+static uint64_t flipsSent = 0;
+static uint64_t flipErrors = 0;
+static uint64_t dropped = 0;
+static int named = 0;
+static int finished = 0;
+
+static uint64_t nowUs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void handleSignal(int sig)
+{
+    (void)sig;
+    stopping = 1;
+}
+
+static void recordLatency(uint64_t us)
+{
+    if (latencies.count == latencies.capacity)
+    {
+        size_t capacity = latencies.capacity ? latencies.capacity * 2 : 4096;
+        uint32_t *grown = realloc(latencies.samples, capacity * sizeof(uint32_t));
+        if (!grown)
+        {
+            perror("loadgen: realloc");
+            exit(1);
+        }
+        latencies.samples = grown;
+        latencies.capacity = capacity;
+    }
+    latencies.samples[latencies.count++] = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+}
+
+static int compareSamples(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of count sorted samples, in milliseconds */
+static double percentileMs(const uint32_t *sorted, size_t count, double percentile)
+{
+    if (count == 0)
+        return 0.0;
+    size_t rank = (size_t)(percentile / 100.0 * (double)count + 0.999999);
+    if (rank < 1)
+        rank = 1;
+    if (rank > count)
+        rank = count;
+    return sorted[rank - 1] / 1000.0;
+}
+
+/* Sorts a copy of samples [from, count) and prints its percentiles after label */
+static void printLatencies(const char *label, size_t from)
+{
+    size_t count = latencies.count - from;
+    if (count == 0)
+    {
+        printf("%sno flips\n", label);
+        return;
+    }
+    uint32_t *sorted = malloc(count * sizeof(uint32_t));
+    if (!sorted)
+        return;
+    memcpy(sorted, latencies.samples + from, count * sizeof(uint32_t));
+    qsort(sorted, count, sizeof(uint32_t), compareSamples);
+    printf("%sp50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms (%zu flips)\n", label,
+           percentileMs(sorted, count, 50.0), percentileMs(sorted, count, 99.0),
+           percentileMs(sorted, count, 99.9), sorted[count - 1] / 1000.0, count);
+    free(sorted);
+}
+
+static uint64_t thinkUs(Bot *bot)
+{
+    unsigned int span = config.thinkMaxMs - config.thinkMinMs;
+    unsigned int ms = config.thinkMinMs + (span ? rngBelow(&bot->rng, span + 1) : 0);
+    return (uint64_t)ms * 1000;
+}
+
+static void sendFrame(Bot *bot, const FrameBuffer *fb)
+{
+    //Frames are tiny and the socket buffer is empty between turns; a short write means the server is gone
+    if (send(bot->fd, fb->data, fb->len, MSG_NOSIGNAL) != (ssize_t)fb->len)
+        shutdown(bot->fd, SHUT_RDWR);
+}
+
+static void sendCommand(Bot *bot, uint8_t opcode)
+{
+    FrameBuffer fb;
+    frameBufferInit(&fb);
+    frameBegin(&fb, opcode);
+    frameEnd(&fb);
+    sendFrame(bot, &fb);
+    frameBufferFree(&fb);
+}
+
+/* Asks for the --board size; the server ignores it when the room already has that size */
+static void sendBoardSize(Bot *bot)
+{
+    FrameBuffer fb;
+    frameBufferInit(&fb);
+    frameBegin(&fb, CMD_BOARD_SIZE);
+    framePutU16(&fb, (uint16_t)config.boardRows);
+    framePutU16(&fb, (uint16_t)config.boardCols);
+    frameEnd(&fb);
+    sendFrame(bot, &fb);
+    frameBufferFree(&fb);
+}
+
+static void sendName(Bot *bot)
+{
+    FrameBuffer fb;
+    frameBufferInit(&fb);
+    frameBegin(&fb, CMD_NAME);
+    framePutString(&fb, bot->name);
+    frameEnd(&fb);
+    sendFrame(bot, &fb);
+    frameBufferFree(&fb);
+}
+
+static void sendFlip(Bot *bot, int card)
+{
+    FrameBuffer fb;
+    frameBufferInit(&fb);
+    frameBegin(&fb, CMD_FLIP);
+    framePutU32(&fb, (uint32_t)card);
+    frameEnd(&fb);
+    bot->pendingCard = card;
+    bot->sentUs = nowUs();
+    sendFrame(bot, &fb);
+    frameBufferFree(&fb);
+    flipsSent++;
+}
+
+static void resizeBoard(Bot *bot, int cards)
+{
+    if (cards == bot->cards)
+        return;
+    bot->state = realloc(bot->state, (size_t)cards);
+    bot->value = realloc(bot->value, (size_t)cards * sizeof(int));
+    bot->known = realloc(bot->known, (size_t)cards * sizeof(int));
+    if (cards > 0 && (!bot->state || !bot->value || !bot->known))
+    {
+        perror("loadgen: realloc");
+        exit(1);
+    }
+    bot->cards = cards;
+    for (int i = 0; i < cards; i++)
+        bot->known[i] = -1;
+}
+
+/* Picks a random face-down card other than skip, preferring ones never seen when unseenFirst is set */
+static int randomHidden(Bot *bot, int skip, bool unseenFirst)
+{
+    int count = 0;
+    for (int pass = unseenFirst ? 0 : 1; pass < 2 && count == 0; pass++)
+    {
+        for (int i = 0; i < bot->cards; i++)
+        {
+            if (i != skip && bot->state[i] == CARD_STATE_HIDDEN && (pass == 1 || bot->known[i] < 0))
+                count++;
+        }
+        if (count == 0)
+            continue;
+
+        int target = (int)rngBelow(&bot->rng, (uint32_t)count);
+        for (int i = 0; i < bot->cards; i++)
+        {
+            if (i != skip && bot->state[i] == CARD_STATE_HIDDEN && (pass == 1 || bot->known[i] < 0) && target-- == 0)
+                return i;
+        }
+    }
+    return -1;
+}
+
+/* A face-down card whose value is known to be value, other than skip */
+static int knownHidden(Bot *bot, int value, int skip)
+{
+    for (int i = 0; i < bot->cards; i++)
+    {
+        if (i != skip && bot->state[i] == CARD_STATE_HIDDEN && bot->known[i] == value)
+            return i;
+    }
+    return -1;
+}
+
+static bool usesMemory(const Bot *bot)
+{
+    return bot->strategy == STRATEGY_MEMORY;
+}
+
+static int pickFirst(Bot *bot)
+{
+    if (usesMemory(bot))
+    {
+        for (int i = 0; i < bot->cards; i++)
+        {
+            if (bot->state[i] == CARD_STATE_HIDDEN && bot->known[i] >= 0 && knownHidden(bot, bot->known[i], i) >= 0)
+                return i;
+        }
+    }
+    return randomHidden(bot, -1, usesMemory(bot));
+}
+
+static int pickSecond(Bot *bot)
+{
+    if (usesMemory(bot) && bot->firstCard >= 0 && bot->known[bot->firstCard] >= 0)
+    {
+        int partner = knownHidden(bot, bot->known[bot->firstCard], bot->firstCard);
+        if (partner >= 0)
+            return partner;
+    }
+    return randomHidden(bot, bot->firstCard, usesMemory(bot));
+}
+
+static void closeBot(Bot *bot, int epollFD, bool lost)
+{
+    if (bot->fd < 0)
+        return;
+    epoll_ctl(epollFD, EPOLL_CTL_DEL, bot->fd, NULL);
+    close(bot->fd);
+    bot->fd = -1;
+    if (lost && !stopping)
+        dropped++;
+    if (bot->phase != BOT_FINISHED)
+        finished++;
+    bot->phase = BOT_FINISHED;
+}
+
+/* The card a flip was waiting on is face up in a broadcast: take the sample and move the turn on */
+static void cardShown(Bot *bot, int card)
+{
+    if (card != bot->pendingCard || (bot->step != TURN_FIRST_SENT && bot->step != TURN_SECOND_SENT))
+        return;
+
+    recordLatency(nowUs() - bot->sentUs);
+    bot->pendingCard = -1;
+    if (bot->step == TURN_FIRST_SENT)
+    {
+        bot->firstCard = card;
+        bot->step = TURN_THINK_SECOND;
+        bot->dueUs = nowUs() + thinkUs(bot);
+    }
+    else
+    {
+        bot->step = TURN_DONE;
+        bot->dueUs = 0;
+    }
+}
+
+static void applyCard(Bot *bot, int card, int cardState, int value)
+{
+    if (card < 0 || card >= bot->cards)
+        return;
+    bot->state[card] = (unsigned char)cardState;
+    bot->value[card] = value;
+    if (cardState != CARD_STATE_HIDDEN)
+    {
+        bot->known[card] = value;
+        cardShown(bot, card);
+    }
+}
+
+static void decodeBoard(Bot *bot, FrameReader *payload)
+{
+    uint32_t seq = frameGetU32(payload);
+    int rows = frameGetU16(payload);
+    int cols = frameGetU16(payload);
+    if (payload->error)
+        return;
+
+    resizeBoard(bot, rows * cols);
+    bot->boardSeq = seq;
+    bot->awaitingSnapshot = false;
+    for (int i = 0; i < bot->cards && !payload->error; i++)
+    {
+        int cardState = frameGetU8(payload);
+        int value = cardState == CARD_STATE_HIDDEN ? -1 : frameGetU16(payload);
+        applyCard(bot, i, cardState, value);
+    }
+}
+
+/* Deltas must arrive in order; on a gap ask for a snapshot and ignore them until it comes */
+static bool acceptSeq(Bot *bot, uint32_t seq)
+{
+    if (bot->awaitingSnapshot)
+        return false;
+    if (seq != bot->boardSeq + 1)
+    {
+        bot->awaitingSnapshot = true;
+        sendCommand(bot, CMD_SNAPSHOT);
+        return false;
+    }
+    bot->boardSeq = seq;
+    return true;
+}
+
+static void startTurn(Bot *bot)
+{
+    bot->step = TURN_THINK_FIRST;
+    bot->firstCard = -1;
+    bot->pendingCard = -1;
+    bot->dueUs = nowUs() + thinkUs(bot);
+}
+
+static void handleFrame(Bot *bot, uint8_t opcode, FrameReader *payload, int epollFD)
+{
+    char text[2048];
+
+    switch (opcode)
+    {
+    case MSG_HELLO:
+        frameGetU8(payload);
+        frameGetU32(payload);
+        bot->seat = frameGetU8(payload);
+        bot->phase = BOT_NAMING;
+        sendName(bot);
+        break;
+
+    case MSG_NAME_TAKEN:
+        //Another run left a player of this name connected; try a longer one
+        if (strlen(bot->name) + 2 < sizeof(bot->name))
+            strcat(bot->name, "x");
+        sendName(bot);
+        break;
+
+    case MSG_WELCOME:
+        if (bot->phase == BOT_NAMING)
+        {
+            bot->phase = BOT_LOBBY;
+            named++;
+        }
+        break;
+
+    case MSG_ROOM_JOINED:
+        frameGetU32(payload);
+        bot->seat = frameGetU8(payload);
+        break;
+
+    case MSG_GAME_STARTED:
+        bot->phase = BOT_PLAYING;
+        bot->step = TURN_IDLE;
+        bot->readyDue = false;
+        for (int i = 0; i < bot->cards; i++)
+            bot->known[i] = -1;
+        break;
+
+    case MSG_GAME_STOPPED:
+        frameGetText(payload, text, sizeof(text));
+        bot->step = TURN_IDLE;
+        bot->dueUs = 0;
+        if (strstr(text, "All pairs matched"))
+        {
+            bot->gamesDone++;
+            //Every room has a seat 0, so each game is counted once
+            if (bot->seat == 0)
+                gamesCompleted++;
+            if (config.games > 0 && bot->gamesDone >= config.games)
+            {
+                closeBot(bot, epollFD, false);
+                return;
+            }
+        }
+        //READY only once the server has reset the room, or the next game could start under it
+        if (strstr(text, "Waiting for players") && bot->phase != BOT_LOBBY)
+        {
+            bot->phase = BOT_LOBBY;
+            bot->readyDue = true;
+            bot->dueUs = nowUs() + thinkUs(bot);
+        }
+        break;
+
+    case MSG_BOARD:
+        decodeBoard(bot, payload);
+        break;
+
+    case MSG_CARD_UPDATE:
+    {
+        uint32_t seq = frameGetU32(payload);
+        int card = (int)frameGetU32(payload);
+        int cardState = frameGetU8(payload);
+        int value = cardState == CARD_STATE_HIDDEN ? -1 : frameGetU16(payload);
+        if (!payload->error && acceptSeq(bot, seq))
+            applyCard(bot, card, cardState, value);
+        break;
+    }
+
+    case MSG_SCORE_UPDATE:
+        acceptSeq(bot, frameGetU32(payload));
+        break;
+
+    case MSG_TURN:
+    {
+        int turn = (int8_t)frameGetU8(payload);
+        if (turn != bot->seat)
+        {
+            bot->step = TURN_IDLE;
+            bot->dueUs = 0;
+        }
+        else if (bot->phase == BOT_PLAYING && (bot->step == TURN_IDLE || bot->step == TURN_DONE))
+        {
+            startTurn(bot);
+        }
+        break;
+    }
+
+    case MSG_ERROR:
+    {
+        int code = frameGetU8(payload);
+        if (code == ERR_ROOM)
+            break;
+        flipErrors++;
+        if (code == ERR_NOT_YOUR_TURN)
+        {
+            //The turn timed out under us
+            bot->step = TURN_IDLE;
+            bot->dueUs = 0;
+        }
+        else if (bot->step == TURN_FIRST_SENT || bot->step == TURN_SECOND_SENT)
+        {
+            //Our picture of the board was stale; pick again straight away
+            bot->step = bot->step == TURN_FIRST_SENT ? TURN_THINK_FIRST : TURN_THINK_SECOND;
+            bot->dueUs = nowUs();
+        }
+        break;
+    }
+
+    default:
+        break;
+    }
+}
+
+/* Text banner first ("... PLAYER ID n ...<<END>>"), then frames once PROTO BIN is answered */
+static void handleReadable(Bot *bot, int epollFD)
+{
+    while (bot->fd >= 0)
+    {
+        ssize_t bytes;
+        if (bot->phase == BOT_BANNER)
+            bytes = recv(bot->fd, bot->banner + bot->bannerLen, sizeof(bot->banner) - 1 - bot->bannerLen, 0);
+        else
+            bytes = recv(bot->fd, bot->inbuf + bot->inLen, INBUF_SIZE - bot->inLen, 0);
+
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return;
+        if (bytes <= 0)
+        {
+            closeBot(bot, epollFD, true);
+            return;
+        }
+
+        if (bot->phase == BOT_BANNER)
+        {
+            bot->bannerLen += (size_t)bytes;
+            bot->banner[bot->bannerLen] = '\0';
+            if (!strstr(bot->banner, "<<END>>"))
+            {
+                if (bot->bannerLen == sizeof(bot->banner) - 1)
+                    closeBot(bot, epollFD, true);
+                continue;
+            }
+            char hello[32];
+            snprintf(hello, sizeof(hello), "%s %d\n", PROTOCOL_HELLO, PROTOCOL_VERSION);
+            send(bot->fd, hello, strlen(hello), MSG_NOSIGNAL);
+            bot->phase = BOT_HELLO;
+            continue;
+        }
+
+        bot->inLen += (size_t)bytes;
+        size_t offset = 0;
+        while (bot->fd >= 0 && offset < bot->inLen)
+        {
+            uint8_t opcode;
+            FrameReader payload;
+            int used = frameParse(bot->inbuf + offset, bot->inLen - offset, &opcode, &payload);
+            if (used < 0)
+            {
+                fprintf(stderr, "loadgen: player %d got an invalid frame\n", bot->index);
+                closeBot(bot, epollFD, true);
+                return;
+            }
+            if (used == 0)
+                break;
+            handleFrame(bot, opcode, &payload, epollFD);
+            offset += (size_t)used;
+        }
+        if (bot->fd >= 0 && offset > 0)
+        {
+            memmove(bot->inbuf, bot->inbuf + offset, bot->inLen - offset);
+            bot->inLen -= offset;
+        }
+    }
+}
+
+/* Sends whatever flip or READY has come due */
+static void runDue(Bot *bot, uint64_t now, bool everyoneNamed)
+{
+    if (bot->fd < 0)
+        return;
+
+    //The first READY waits for every player to have a name, so rooms fill up before games start
+    if (bot->phase == BOT_LOBBY && !bot->readyDue && everyoneNamed && bot->gamesDone == 0)
+    {
+        bot->readyDue = true;
+        bot->dueUs = now;
+    }
+
+    if (bot->dueUs == 0 || bot->dueUs > now)
+        return;
+    bot->dueUs = 0;
+
+    if (bot->phase == BOT_LOBBY && bot->readyDue)
+    {
+        if (config.boardRows > 0)
+            sendBoardSize(bot);
+        sendCommand(bot, CMD_READY);
+        return;
+    }
+
+    int card;
+    switch (bot->step)
+    {
+    case TURN_THINK_FIRST:
+        card = pickFirst(bot);
+        if (card < 0)
+            return;
+        bot->step = TURN_FIRST_SENT;
+        sendFlip(bot, card);
+        break;
+    case TURN_THINK_SECOND:
+        card = pickSecond(bot);
+        if (card < 0)
+            return;
+        bot->step = TURN_SECOND_SENT;
+        sendFlip(bot, card);
+        break;
+    default:
+        break;
+    }
+}
+
+static int connectBot(Bot *bot, const struct sockaddr_in *address, int epollFD)
+{
+    bot->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (bot->fd < 0)
+        return -1;
+    if (connect(bot->fd, (const struct sockaddr *)address, sizeof(*address)) < 0)
+    {
+        close(bot->fd);
+        bot->fd = -1;
+        return -1;
+    }
+
+    //Flips are single small frames; do not let Nagle hold one back behind the last
+    int one = 1;
+    setsockopt(bot->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(bot->fd, F_SETFL, fcntl(bot->fd, F_GETFL, 0) | O_NONBLOCK);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = bot;
+    return epoll_ctl(epollFD, EPOLL_CTL_ADD, bot->fd, &ev);
+}
+
+static void printUsage(const char *program)
+{
+    printf("Usage: %s [options]\n"
+           "  --host=ADDR            server address (default %s)\n"
+           "  --port=N               server port (default %d)\n"
+           "  --players=N            simulated players (default %d)\n"
+           "  --games=N              games each player plays, 0 until --duration ends (default %d)\n"
+           "  --duration=SECONDS     stop after this long, 0 for no limit (default 0)\n"
+           "  --think=MS[-MS]        pause before each flip and READY, fixed or uniform in a range (default %u-%u)\n"
+           "  --strategy=memory|random|mixed\n"
+           "                         how players pick cards (default memory)\n"
+           "  --board=ROWSxCOLS      board to ask for before each READY (default: the room's)\n"
+           "  --report=SECONDS       print progress this often, 0 never (default %u)\n"
+           "  --seed=N               seed for think times and picks (default: time)\n",
+           program, config.host, config.port, config.players, config.games,
+           config.thinkMinMs, config.thinkMaxMs, config.reportSec);
+}
+
+static long parseNumber(const char *option, const char *value, long min, long max)
+{
+    char *end;
+    long number = strtol(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || number < min || number > max)
+    {
+        fprintf(stderr, "Invalid value for --%s: %s\n", option, value);
+        exit(1);
+    }
+    return number;
+}
+
+static void parseArgs(int argc, char *argv[])
+{
+    static const struct option options[] = {
+        {"host", required_argument, NULL, 'H'},
+        {"port", required_argument, NULL, 'p'},
+        {"players", required_argument, NULL, 'n'},
+        {"games", required_argument, NULL, 'g'},
+        {"duration", required_argument, NULL, 'd'},
+        {"think", required_argument, NULL, 't'},
+        {"strategy", required_argument, NULL, 's'},
+        {"report", required_argument, NULL, 'r'},
+        {"seed", required_argument, NULL, 'S'},
+        {"board", required_argument, NULL, 'b'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    config.seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'H':
+            config.host = optarg;
+            break;
+        case 'p':
+            config.port = (int)parseNumber("port", optarg, 1, 65535);
+            break;
+        case 'n':
+            config.players = (int)parseNumber("players", optarg, 1, 1000000);
+            break;
+        case 'g':
+            config.games = (int)parseNumber("games", optarg, 0, INT_MAX);
+            break;
+        case 'd':
+            config.durationSec = (unsigned int)parseNumber("duration", optarg, 0, INT_MAX);
+            break;
+        case 't':
+        {
+            char *dash = strchr(optarg, '-');
+            if (dash)
+                *dash = '\0';
+            config.thinkMinMs = (unsigned int)parseNumber("think", optarg, 0, 3600 * 1000);
+            config.thinkMaxMs = dash ? (unsigned int)parseNumber("think", dash + 1, config.thinkMinMs, 3600 * 1000)
+                                     : config.thinkMinMs;
+            break;
+        }
+        case 's':
+            if (strcmp(optarg, "memory") == 0)
+                config.strategy = STRATEGY_MEMORY;
+            else if (strcmp(optarg, "random") == 0)
+                config.strategy = STRATEGY_RANDOM;
+            else if (strcmp(optarg, "mixed") == 0)
+                config.strategy = STRATEGY_MIXED;
+            else
+            {
+                fprintf(stderr, "Unknown strategy: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'r':
+            config.reportSec = (unsigned int)parseNumber("report", optarg, 0, INT_MAX);
+            break;
+        case 'S':
+            config.seed = (uint64_t)strtoull(optarg, NULL, 0);
+            break;
+        case 'b':
+        {
+            char tail;
+            if (sscanf(optarg, "%dx%d%c", &config.boardRows, &config.boardCols, &tail) != 2 ||
+                !boardSizeValid(config.boardRows, config.boardCols))
+            {
+                fprintf(stderr, "Invalid value for --board: %s (ROWSxCOLS, each 1 to %d, even card count)\n",
+                        optarg, MAX_BOARD_SIDE);
+                exit(1);
+            }
+            break;
+        }
+        case 'h':
+            printUsage(argv[0]);
+            exit(0);
+        default:
+            printUsage(argv[0]);
+            exit(1);
+        }
+    }
+
+    if (config.games == 0 && config.durationSec == 0)
+    {
+        fprintf(stderr, "--games=0 needs a --duration\n");
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    parseArgs(argc, argv);
+    signal(SIGINT, handleSignal);
+    signal(SIGTERM, handleSignal);
+    signal(SIGPIPE, SIG_IGN);
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((uint16_t)config.port);
+    if (inet_pton(AF_INET, config.host, &address.sin_addr) != 1)
+    {
+        fprintf(stderr, "Invalid address: %s\n", config.host);
+        return 1;
+    }
+
+    int leftover = config.players % MAX_PLAYERS;
+    if (leftover > 0 && leftover < MIN_PLAYERS)
+        fprintf(stderr, "loadgen: %d players leave a room of %d, which needs %d to start\n",
+                config.players, leftover, MIN_PLAYERS);
+
+    int epollFD = epoll_create1(EPOLL_CLOEXEC);
+    Bot *bots = calloc((size_t)config.players, sizeof(Bot));
+    if (epollFD < 0 || !bots)
+    {
+        perror("loadgen: setup");
+        return 1;
+    }
+
+    static const char *strategyNames[] = {"memory", "random", "mixed"};
+    printf("loadgen: %d players on %s:%d, strategy %s, think %u-%u ms, seed %llu\n",
+           config.players, config.host, config.port, strategyNames[config.strategy],
+           config.thinkMinMs, config.thinkMaxMs, (unsigned long long)config.seed);
+
+    for (int i = 0; i < config.players; i++)
+    {
+        Bot *bot = &bots[i];
+        bot->index = i;
+        bot->seat = -1;
+        bot->pendingCard = -1;
+        bot->firstCard = -1;
+        bot->strategy = config.strategy == STRATEGY_MIXED ? (i % 2 ? STRATEGY_RANDOM : STRATEGY_MEMORY) : config.strategy;
+        rngSeed(&bot->rng, config.seed + (uint64_t)i);
+        snprintf(bot->name, sizeof(bot->name), "lg%d_%d", (int)getpid(), i);
+        bot->inbuf = malloc(INBUF_SIZE);
+        if (!bot->inbuf || connectBot(bot, &address, epollFD) < 0)
+        {
+            fprintf(stderr, "loadgen: player %d could not connect: %s\n", i, strerror(errno));
+            return 1;
+        }
+    }
+
+    uint64_t started = nowUs();
+    uint64_t nextReport = config.reportSec ? started + (uint64_t)config.reportSec * 1000000 : 0;
+    uint64_t deadline = config.durationSec ? started + (uint64_t)config.durationSec * 1000000 : 0;
+    size_t reportedSamples = 0;
+    uint64_t reportedGames = 0;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (!stopping && finished < config.players)
+    {
+        uint64_t now = nowUs();
+        if (deadline && now >= deadline)
+            break;
+
+        //Sleep until the nearest flip, READY, report or the end of the run
+        uint64_t wake = deadline ? deadline : now + 1000000;
+        if (nextReport && nextReport < wake)
+            wake = nextReport;
+        bool everyoneNamed = named == config.players;
+        for (int i = 0; i < config.players; i++)
+        {
+            runDue(&bots[i], now, everyoneNamed);
+            if (bots[i].fd >= 0 && bots[i].dueUs && bots[i].dueUs < wake)
+                wake = bots[i].dueUs;
+        }
+
+        now = nowUs();
+        int timeoutMs = wake > now ? (int)((wake - now + 999) / 1000) : 0;
+        int n = epoll_wait(epollFD, events, MAX_EVENTS, timeoutMs);
+        if (n < 0 && errno != EINTR)
+        {
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++)
+            handleReadable((Bot *)events[i].data.ptr, epollFD);
+
+        now = nowUs();
+        if (nextReport && now >= nextReport)
+        {
+            char label[96];
+            snprintf(label, sizeof(label), "%7.1f s: %llu games, %zu flips; ",
+                     (now - started) / 1e6, (unsigned long long)(gamesCompleted - reportedGames),
+                     latencies.count - reportedSamples);
+            printLatencies(label, reportedSamples);
+            fflush(stdout);
+            reportedSamples = latencies.count;
+            reportedGames = gamesCompleted;
+            nextReport += (uint64_t)config.reportSec * 1000000;
+        }
+    }
+
+    double seconds = (nowUs() - started) / 1e6;
+    for (int i = 0; i < config.players; i++)
+    {
+        closeBot(&bots[i], epollFD, false);
+        free(bots[i].inbuf);
+        free(bots[i].state);
+        free(bots[i].value);
+        free(bots[i].known);
+    }
+    free(bots);
+    close(epollFD);
+
+    printf("Ran %.2f s: %llu games (%.3f/s), %llu flips (%.1f/s), %llu rejected flips, %llu connections lost\n",
+           seconds, (unsigned long long)gamesCompleted, gamesCompleted / seconds,
+           (unsigned long long)flipsSent, flipsSent / seconds,
+           (unsigned long long)flipErrors, (unsigned long long)dropped);
+    printLatencies("Flip to broadcast: ", 0);
+    free(latencies.samples);
+    return dropped == 0 ? 0 : 1;
+}
@@ -0,0 +1,194 @@
+#include "logformat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Decodes the server's binary log (game.mlog) into the old game.log text
+ * lines, or into one JSON object per line with --json.
+ *
+ *   ./logcat [--json] [FILE...]     (FILE defaults to game.mlog, - is stdin)
+ */
+
+typedef struct {
+    bool json;
+    bool haveClock;
+    int64_t wallBaseUs;         //Wall clock at the last LOGEV_CLOCK record
+    uint64_t monoBaseUs;        //Monotonic clock at the same moment
+} LogcatState;
+
+static void printJsonString(const char *text)
+{
+    putchar('"');
+    for (const unsigned char *c = (const unsigned char *)text; *c; c++)
+    {
+        if (*c == '"' || *c == '\\')
+            printf("\\%c", *c);
+        else if (*c == '\n')
+            printf("\\n");
+        else if (*c < 0x20)
+            printf("\\u%04x", *c);
+        else
+            putchar(*c);
+    }
+    putchar('"');
+}
+
+static void printEvent(LogcatState *st, const LogEvent *event)
+{
+    char message[512];
+    formatLogMessage(event, message, sizeof(message));
+
+    int64_t wallUs = st->wallBaseUs + (int64_t)(event->timestampUs - st->monoBaseUs);
+    time_t wallSeconds = (time_t)(wallUs / 1000000);
+    struct tm local;
+    char stamp[64] = "?";
+
+    if (!st->json)
+    {
+        if (st->haveClock)
+        {
+            localtime_r(&wallSeconds, &local);
+            strftime(stamp, sizeof(stamp), "%a %b %e %H:%M:%S %Y", &local);
+        }
+        printf("[%s][%s] %s", stamp, logTypeName(event->type), message);
+        return;
+    }
+
+    message[strcspn(message, "\n")] = '\0';
+    if (st->haveClock)
+    {
+        struct tm utc;
+        gmtime_r(&wallSeconds, &utc);
+        size_t n = strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &utc);
+        snprintf(stamp + n, sizeof(stamp) - n, ".%06lldZ", (long long)(wallUs % 1000000));
+    }
+
+    printf("{\"time\":");
+    printJsonString(stamp);
+    printf(",\"mono_us\":%llu,\"type\":\"%s\",\"event\":\"%s\"",
+           (unsigned long long)event->timestampUs, logTypeName(event->type), logCodeName(event->code));
+    if (event->room > 0)
+        printf(",\"room\":%d", event->room);
+    if (event->player >= 0)
+        printf(",\"player\":%d", event->player);
+    if (event->argCount > 0)
+    {
+        printf(",\"args\":[");
+        for (int i = 0; i < event->argCount; i++)
+            printf("%s%lld", i ? "," : "", (long long)event->args[i]);
+        printf("]");
+    }
+    if (event->text[0])
+    {
+        printf(",\"text\":");
+        printJsonString(event->text);
+    }
+    //The room already has its own field
+    const char *text = message;
+    if (event->room > 0 && strstr(text, "] "))
+        text = strstr(text, "] ") + 2;
+    printf(",\"message\":");
+    printJsonString(text);
+    printf("}\n");
+}
+
+/* Returns 0 on success, 1 when the file is unreadable or not a binary log */
+static int decodeFile(LogcatState *st, const char *path)
+{
+    FILE *in = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if (!in)
+    {
+        perror(path);
+        return 1;
+    }
+
+    size_t capacity = 64 * 1024;
+    size_t len = 0;
+    unsigned char *data = malloc(capacity);
+    size_t n;
+    while (data && (n = fread(data + len, 1, capacity - len, in)) > 0)
+    {
+        len += n;
+        if (len == capacity)
+        {
+            capacity *= 2;
+            unsigned char *grown = realloc(data, capacity);
+            if (!grown)
+                free(data);
+            data = grown;
+        }
+    }
+    if (in != stdin)
+        fclose(in);
+    if (!data)
+    {
+        perror("logcat: malloc");
+        return 1;
+    }
+
+    if (len < LOG_FILE_MAGIC_LENGTH || memcmp(data, LOG_FILE_MAGIC, LOG_FILE_MAGIC_LENGTH) != 0)
+    {
+        fprintf(stderr, "%s: not a binary game log\n", path);
+        free(data);
+        return 1;
+    }
+
+    size_t pos = LOG_FILE_MAGIC_LENGTH;
+    uint64_t previousUs = 0;
+    LogEvent event;
+    size_t used;
+    while (pos < len && decodeLogRecord(data + pos, len - pos, previousUs, &event, &used))
+    {
+        pos += used;
+        if (event.code == LOGEV_CLOCK && event.argCount >= 2)
+        {
+            //A new server run: its monotonic clock has nothing to do with the last one
+            event.timestampUs = (uint64_t)event.args[1];
+            st->wallBaseUs = event.args[0];
+            st->monoBaseUs = event.timestampUs;
+            st->haveClock = true;
+        }
+        previousUs = event.timestampUs;
+        printEvent(st, &event);
+    }
+
+    if (pos < len)
+        fprintf(stderr, "%s: %zu trailing bytes (truncated record?)\n", path, len - pos);
+    free(data);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    LogcatState st;
+    memset(&st, 0, sizeof(st));
+    int files = 0;
+    int status = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--json") == 0)
+            st.json = true;
+        else if (strcmp(argv[i], "--text") == 0)
+            st.json = false;
+        else if (strcmp(argv[i], "--help") == 0)
+        {
+            printf("Usage: %s [--text|--json] [FILE...]\n"
+                   "Prints a binary game log (default game.mlog, - for stdin).\n", argv[0]);
+            return 0;
+        }
+    }
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--", 2) == 0)
+            continue;
+        status |= decodeFile(&st, argv[i]);
+        files++;
+    }
+    if (files == 0)
+        status |= decodeFile(&st, "game.mlog");
+    return status;
+}
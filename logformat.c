@@ -0,0 +1,327 @@
+#include "logformat.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+uint64_t logMonotonicUs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/* Marks where a log was opened, so readers can map monotonic timestamps to dates */
+void makeClockEvent(LogEvent *event)
+{
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+
+    memset(event, 0, sizeof(*event));
+    event->type = LOG_SERVER;
+    event->code = LOGEV_CLOCK;
+    event->timestampUs = logMonotonicUs();
+    event->player = -1;
+    event->argCount = 2;
+    event->args[0] = (int64_t)wall.tv_sec * 1000000 + wall.tv_nsec / 1000;
+    event->args[1] = (int64_t)event->timestampUs;
+}
+
+/* LEB128: seven bits per byte, low bits first; at most 10 bytes */
+size_t encodeVarint(unsigned char *out, uint64_t value)
+{
+    size_t n = 0;
+    while (value >= 0x80)
+    {
+        out[n++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (unsigned char)value;
+    return n;
+}
+
+static uint64_t zigzag(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+/* Returns bytes written to out, at most LOG_RECORD_MAX */
+size_t encodeLogRecord(const LogEvent *event, uint64_t previousUs, unsigned char *out)
+{
+    unsigned char body[LOG_RECORD_MAX];
+    size_t n = 0;
+    size_t textLength = strnlen(event->text, LOG_TEXT_LENGTH - 1);
+    int argCount = event->argCount > LOG_MAX_ARGS ? LOG_MAX_ARGS : event->argCount;
+
+    n += encodeVarint(body + n, (uint64_t)event->code);
+    n += encodeVarint(body + n, (uint64_t)event->type);
+    n += encodeVarint(body + n, event->timestampUs >= previousUs ? event->timestampUs - previousUs : 0);
+    n += encodeVarint(body + n, (uint64_t)(event->room > 0 ? event->room : 0));
+    n += encodeVarint(body + n, zigzag(event->player));
+    n += encodeVarint(body + n, (uint64_t)argCount);
+    for (int i = 0; i < argCount; i++)
+        n += encodeVarint(body + n, zigzag(event->args[i]));
+    n += encodeVarint(body + n, textLength);
+    memcpy(body + n, event->text, textLength);
+    n += textLength;
+
+    size_t header = encodeVarint(out, n);
+    memcpy(out + header, body, n);
+    return header + n;
+}
+
+typedef struct {
+    const unsigned char *data;
+    size_t len;
+    size_t pos;
+    bool ok;
+} VarintReader;
+
+/* False when data runs out (or the varint is too long) before the last byte */
+bool decodeVarint(const unsigned char *data, size_t len, size_t *pos, uint64_t *value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        if (*pos >= len)
+            break;
+        unsigned char byte = data[(*pos)++];
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    *value = 0;
+    return false;
+}
+
+static uint64_t getVarint(VarintReader *r)
+{
+    uint64_t value;
+    if (!decodeVarint(r->data, r->len, &r->pos, &value))
+        r->ok = false;
+    return value;
+}
+
+/* False when data does not hold a whole well-formed record yet */
+bool decodeLogRecord(const unsigned char *data, size_t len, uint64_t previousUs, LogEvent *event, size_t *used)
+{
+    VarintReader outer = {data, len, 0, true};
+    uint64_t bodyLength = getVarint(&outer);
+    if (!outer.ok || bodyLength > len - outer.pos)
+        return false;
+
+    VarintReader r = {data + outer.pos, (size_t)bodyLength, 0, true};
+    memset(event, 0, sizeof(*event));
+    event->code = (LogCode)getVarint(&r);
+    event->type = (LogType)getVarint(&r);
+    event->timestampUs = previousUs + getVarint(&r);
+    event->room = (int)getVarint(&r);
+    event->player = (int)unzigzag(getVarint(&r));
+    uint64_t argCount = getVarint(&r);
+    for (uint64_t i = 0; i < argCount && r.ok; i++)
+    {
+        int64_t value = unzigzag(getVarint(&r));
+        if (i < LOG_MAX_ARGS)
+            event->args[event->argCount++] = value;
+    }
+    uint64_t textLength = getVarint(&r);
+    if (!r.ok || textLength > r.len - r.pos)
+        return false;
+    size_t copy = textLength < LOG_TEXT_LENGTH - 1 ? (size_t)textLength : LOG_TEXT_LENGTH - 1;
+    memcpy(event->text, r.data + r.pos, copy);
+    event->text[copy] = '\0';
+
+    *used = outer.pos + (size_t)bodyLength;
+    return true;
+}
+
+const char *logTypeName(LogType type)
+{
+    switch (type)
+    {
+    case LOG_SERVER:
+        return "SERVER";
+    case LOG_PLAYER:
+        return "PLAYER";
+    case LOG_GAME:
+        return "GAME";
+    case LOG_TURN:
+        return "TURN";
+    default:
+        return "UNKNOWN";
+    }
+}
+
+static const char *const codeNames[LOGEV_COUNT] = {
+    [LOGEV_CLOCK] = "clock",
+    [LOGEV_SERVER_STARTED] = "server_started",
+    [LOGEV_SERVER_STOPPING] = "server_stopping",
+    [LOGEV_SERVER_STOPPED] = "server_stopped",
+    [LOGEV_LOG_DROPPED] = "log_dropped",
+    [LOGEV_ROOM_CREATED] = "room_created",
+    [LOGEV_ROOM_CLOSED] = "room_closed",
+    [LOGEV_ROOM_EXPIRED] = "room_expired",
+    [LOGEV_PLAYER_CONNECTED] = "player_connected",
+    [LOGEV_PLAYER_JOINED] = "player_joined",
+    [LOGEV_PLAYER_DISCONNECTED] = "player_disconnected",
+    [LOGEV_PLAYER_READY] = "player_ready",
+    [LOGEV_ALL_READY] = "all_ready",
+    [LOGEV_NAME_TAKEN] = "name_taken",
+    [LOGEV_NAME_REGISTERED] = "name_registered",
+    [LOGEV_FLIP_REQUEST] = "flip_request",
+    [LOGEV_GAME_STARTED] = "game_started",
+    [LOGEV_GAME_RESTARTED] = "game_restarted",
+    [LOGEV_CARD_FLIPPED] = "card_flipped",
+    [LOGEV_PAIR_MATCHED] = "pair_matched",
+    [LOGEV_PAIR_MISMATCHED] = "pair_mismatched",
+    [LOGEV_SCORE_UPDATED] = "score_updated",
+    [LOGEV_GAME_WON] = "game_won",
+    [LOGEV_GAME_DRAWN] = "game_drawn",
+    [LOGEV_GAME_RESET] = "game_reset",
+    [LOGEV_TURN_CHANGED] = "turn_changed",
+    [LOGEV_TURN_TIMED_OUT] = "turn_timed_out",
+    [LOGEV_SCORES_SAVED] = "scores_saved",
+    [LOGEV_PLAYER_AWAY] = "player_away",
+    [LOGEV_PLAYER_REJOINED] = "player_rejoined",
+    [LOGEV_BOARD_SIZE] = "board_size",
+};
+
+const char *logCodeName(LogCode code)
+{
+    if ((unsigned)code < LOGEV_COUNT && codeNames[code])
+        return codeNames[code];
+    return "unknown";
+}
+
+/* The message part of a text log line, "[Room N] ..." and newline included */
+void formatLogMessage(const LogEvent *event, char *buffer, size_t bufsize)
+{
+    const int64_t *a = event->args;
+    int p = event->player;
+    const char *text = event->text;
+    size_t pos = 0;
+
+    if (bufsize == 0)
+        return;
+    buffer[0] = '\0';
+    if (event->room > 0)
+        pos = (size_t)snprintf(buffer, bufsize, "[Room %d] ", event->room);
+    if (pos >= bufsize)
+        return;
+    buffer += pos;
+    bufsize -= pos;
+
+    switch (event->code)
+    {
+    case LOGEV_CLOCK:
+        snprintf(buffer, bufsize, "Log opened.\n");
+        break;
+    case LOGEV_SERVER_STARTED:
+        snprintf(buffer, bufsize, "Server started.\n");
+        break;
+    case LOGEV_SERVER_STOPPING:
+        snprintf(buffer, bufsize, "Server shutting down.\n");
+        break;
+    case LOGEV_SERVER_STOPPED:
+        snprintf(buffer, bufsize, "Server shutdown.\n");
+        break;
+    case LOGEV_LOG_DROPPED:
+        snprintf(buffer, bufsize, "Log queue full, %lld events dropped (%lld total).\n", (long long)a[0], (long long)a[1]);
+        break;
+    case LOGEV_ROOM_CREATED:
+        snprintf(buffer, bufsize, "Room created: %s\n", text);
+        break;
+    case LOGEV_ROOM_CLOSED:
+        snprintf(buffer, bufsize, "Room closed: %s\n", text);
+        break;
+    case LOGEV_ROOM_EXPIRED:
+        snprintf(buffer, bufsize, "Room expired after being idle: %s\n", text);
+        break;
+    case LOGEV_PLAYER_CONNECTED:
+        snprintf(buffer, bufsize, "New connection assigned to Player %d\n", p);
+        break;
+    case LOGEV_PLAYER_JOINED:
+        snprintf(buffer, bufsize, "Player %d (%s) joined the room\n", p, text[0] ? text : "Unknown");
+        break;
+    case LOGEV_PLAYER_DISCONNECTED:
+        snprintf(buffer, bufsize, "Player %d disconnected\n", p);
+        break;
+    case LOGEV_PLAYER_READY:
+        snprintf(buffer, bufsize, "Player %d is READY\n", p);
+        break;
+    case LOGEV_ALL_READY:
+        snprintf(buffer, bufsize, "All remaining players ready. Game started.\n");
+        break;
+    case LOGEV_NAME_TAKEN:
+        snprintf(buffer, bufsize, "Player %d tried duplicate name: %s\n", p, text);
+        break;
+    case LOGEV_NAME_REGISTERED:
+        snprintf(buffer, bufsize, "Player %d registered name: %s (Score %lld)\n", p, text, (long long)a[0]);
+        break;
+    case LOGEV_FLIP_REQUEST:
+        snprintf(buffer, bufsize, "Player %d flipped card %lld\n", p, (long long)a[0]);
+        break;
+    case LOGEV_GAME_STARTED:
+        if (event->argCount < 2)    //Logs from before deals were seeded
+            snprintf(buffer, bufsize, "Game started.\n");
+        else if (event->argCount < 4)   //Or before boards had a size of their own
+            snprintf(buffer, bufsize, "Game started. (Deal seed %016llx)\n",
+                     (unsigned long long)(((uint64_t)(uint32_t)a[0] << 32) | (uint32_t)a[1]));
+        else
+            snprintf(buffer, bufsize, "Game started. (Deal seed %016llx, board %lldx%lld)\n",
+                     (unsigned long long)(((uint64_t)(uint32_t)a[0] << 32) | (uint32_t)a[1]),
+                     (long long)a[2], (long long)a[3]);
+        break;
+    case LOGEV_GAME_RESTARTED:
+        snprintf(buffer, bufsize, "Game restarted. Waiting for players.\n");
+        break;
+    case LOGEV_CARD_FLIPPED:
+        snprintf(buffer, bufsize, "Player %d flipped Card %lld (Value: %lld)\n", p, (long long)a[0], (long long)a[1]);
+        break;
+    case LOGEV_PAIR_MATCHED:
+        snprintf(buffer, bufsize, "Player %d found a match: Card %lld and Card %lld (Value: %lld)\n",
+                 p, (long long)a[0], (long long)a[1], (long long)a[2]);
+        break;
+    case LOGEV_PAIR_MISMATCHED:
+        snprintf(buffer, bufsize, "Player %d did not match: Card %lld and Card %lld (Values: %lld, %lld)\n",
+                 p, (long long)a[0], (long long)a[1], (long long)a[2], (long long)a[3]);
+        break;
+    case LOGEV_SCORE_UPDATED:
+        snprintf(buffer, bufsize, "Player %d score updated: Round %lld\n", p, (long long)a[0]);
+        break;
+    case LOGEV_GAME_WON:
+        snprintf(buffer, bufsize, "Game ended. Winner: %s (Round Score %lld).\n", text, (long long)a[0]);
+        break;
+    case LOGEV_GAME_DRAWN:
+        snprintf(buffer, bufsize, "Game ended. Draw with round score %lld.\n", (long long)a[0]);
+        break;
+    case LOGEV_GAME_RESET:
+        snprintf(buffer, bufsize, "Game reset. Starting new round.\n");
+        break;
+    case LOGEV_TURN_CHANGED:
+        snprintf(buffer, bufsize, "It's now Player %d's turn.\n", p);
+        break;
+    case LOGEV_TURN_TIMED_OUT:
+        snprintf(buffer, bufsize, "Player %d timed out (%s)\n", p, a[0] ? "forfeit" : "turn skipped");
+        break;
+    case LOGEV_SCORES_SAVED:
+        snprintf(buffer, bufsize, "Scores saved: %lld updates, oldest queued %lld us before.\n", (long long)a[0], (long long)a[1]);
+        break;
+    case LOGEV_PLAYER_AWAY:
+        snprintf(buffer, bufsize, "Player %d is away, seat held for %lld seconds\n", p, (long long)a[0]);
+        break;
+    case LOGEV_PLAYER_REJOINED:
+        snprintf(buffer, bufsize, "Player %d (%s) rejoined the room\n", p, text[0] ? text : "Unknown");
+        break;
+    case LOGEV_BOARD_SIZE:
+        snprintf(buffer, bufsize, "Player %d set the board to %lldx%lld\n", p, (long long)a[0], (long long)a[1]);
+        break;
+    default:
+        snprintf(buffer, bufsize, "Unknown event %d\n", (int)event->code);
+        break;
+    }
+}
@@ -0,0 +1,99 @@
+#ifndef LOGFORMAT_H
+#define LOGFORMAT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Structured log records, shared by the server's logger and logcat.
+ *
+ * A binary log starts with LOG_FILE_MAGIC and is then a run of records:
+ *
+ *   varint bodyLength | body
+ *
+ * where body is
+ *
+ *   varint code | varint type | varint timestamp delta (us) |
+ *   varint room | zigzag player | varint argCount | zigzag args... |
+ *   varint textLength | text
+ *
+ * Timestamps are CLOCK_MONOTONIC microseconds, each one relative to the
+ * record before it. Every time the server opens a log it first writes a
+ * LOGEV_CLOCK record whose args carry the wall clock and monotonic time
+ * at that moment, which is how readers turn timestamps into dates.
+ * Unknown trailing body bytes are skipped, so fields can be added.
+ */
+
+#define LOG_FILE_MAGIC "MLOG\001"
+#define LOG_FILE_MAGIC_LENGTH 5
+#define LOG_TEXT_LENGTH 40
+#define LOG_MAX_ARGS 4
+#define LOG_RECORD_MAX (16 + 10 * 6 + 10 * LOG_MAX_ARGS + LOG_TEXT_LENGTH)
+
+typedef enum {
+    LOG_NONE,
+    LOG_SERVER,
+    LOG_PLAYER,
+    LOG_GAME,
+    LOG_TURN
+} LogType;
+
+/* What happened; each code has a fixed text rendering in logformat.c */
+typedef enum {
+    LOGEV_CLOCK,                // args: wall clock us, monotonic us
+    LOGEV_SERVER_STARTED,
+    LOGEV_SERVER_STOPPING,
+    LOGEV_SERVER_STOPPED,
+    LOGEV_LOG_DROPPED,          // args: dropped since last report, total
+    LOGEV_ROOM_CREATED,         // text: room name
+    LOGEV_ROOM_CLOSED,          // text: room name
+    LOGEV_ROOM_EXPIRED,         // text: room name
+    LOGEV_PLAYER_CONNECTED,
+    LOGEV_PLAYER_JOINED,        // text: name
+    LOGEV_PLAYER_DISCONNECTED,
+    LOGEV_PLAYER_READY,
+    LOGEV_ALL_READY,
+    LOGEV_NAME_TAKEN,           // text: name
+    LOGEV_NAME_REGISTERED,      // args: saved score; text: name
+    LOGEV_FLIP_REQUEST,         // args: card
+    LOGEV_GAME_STARTED,         // args: deal seed, high and low 32 bits, board rows, cols
+    LOGEV_GAME_RESTARTED,
+    LOGEV_CARD_FLIPPED,         // args: card, value
+    LOGEV_PAIR_MATCHED,         // args: card, card, value
+    LOGEV_PAIR_MISMATCHED,      // args: card, card, value, value
+    LOGEV_SCORE_UPDATED,        // args: score
+    LOGEV_GAME_WON,             // args: round score; text: winner
+    LOGEV_GAME_DRAWN,           // args: round score
+    LOGEV_GAME_RESET,
+    LOGEV_TURN_CHANGED,
+    LOGEV_TURN_TIMED_OUT,       // args: 1 when the seat was forfeited
+    LOGEV_SCORES_SAVED,         // args: updates synced, lag in us of the oldest
+    LOGEV_PLAYER_AWAY,          // args: seconds the seat is held
+    LOGEV_PLAYER_REJOINED,      // text: name
+    LOGEV_BOARD_SIZE,           // args: rows, cols
+    LOGEV_COUNT
+} LogCode;
+
+typedef struct {
+    LogType type;
+    LogCode code;
+    uint64_t timestampUs;       // CLOCK_MONOTONIC
+    int room;                   // 0 for server-wide events
+    int player;                 // -1 when no player is involved
+    int argCount;
+    int64_t args[LOG_MAX_ARGS];
+    char text[LOG_TEXT_LENGTH];
+} LogEvent;
+
+uint64_t logMonotonicUs(void);
+size_t encodeVarint(unsigned char *out, uint64_t value);
+bool decodeVarint(const unsigned char *data, size_t len, size_t *pos, uint64_t *value);
+size_t encodeLogRecord(const LogEvent *event, uint64_t previousUs, unsigned char *out);
+bool decodeLogRecord(const unsigned char *data, size_t len, uint64_t previousUs, LogEvent *event, size_t *used);
+void makeClockEvent(LogEvent *event);
+const char *logTypeName(LogType type);
+const char *logCodeName(LogCode code);
+void formatLogMessage(const LogEvent *event, char *buffer, size_t bufsize);
+
+#endif
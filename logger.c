@@ -1,5 +1,10 @@
 #include "logger.h"
 #include "shared_state.h"
+#include "config.h"
+#include "logrotate.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <pthread.h>
@@ -7,74 +12,376 @@
 #include <time.h>
 #include <sys/socket.h>
 
+/*
+ * The log queue is a bounded multi-producer/single-consumer ring
+ * (sequence-numbered slots, as in Vyukov's bounded queue). Producers
+ * claim a slot with one compare-and-swap on the tail and never wait:
+ * when the ring is full the event is counted in logDropped and thrown
+ * away, so a slow disk can never stall a flip.
+ */
+#define LOG_QUEUE_MASK (LOG_QUEUE_SIZE - 1)
+
+_Static_assert((LOG_QUEUE_SIZE & LOG_QUEUE_MASK) == 0, "LOG_QUEUE_SIZE must be a power of two");
+
+void initLogQueue(ServerState *server){
+    for(size_t i = 0; i < LOG_QUEUE_SIZE; i++)
+        atomic_init(&server->logQueue[i].sequence, i);//Slot i is free for the producer at position i
+    atomic_init(&server->logQueueHead, 0);
+    atomic_init(&server->logQueueTail, 0);
+    atomic_init(&server->logDropped, 0);
+}
+
+/* Consumer side; false when nothing has been published yet */
+static bool popLogEvent(ServerState *server, LogEvent *out){
+    size_t head = atomic_load_explicit(&server->logQueueHead, memory_order_relaxed);
+    LogSlot *slot = &server->logQueue[head & LOG_QUEUE_MASK];
+    size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    if(sequence != head + 1)
+        return false;//Still free, or claimed but not yet filled in
+
+    *out = slot->event;
+    atomic_store_explicit(&slot->sequence, head + LOG_QUEUE_SIZE, memory_order_release);//Hand the slot back for the next lap
+    atomic_store_explicit(&server->logQueueHead, head + 1, memory_order_relaxed);
+    return true;
+}
+
+/*
+ * The writer drains everything the ring holds in one pass, encodes it into
+ * one buffer and hands it to the kernel with a single write(). Binary logs
+ * (the default) hold the varint records described in logformat.h; text
+ * logs keep the old "[date][TYPE] message" lines, with the date formatted
+ * once per second rather than once per line.
+ */
+#define LOG_BATCH_SIZE (64 * 1024)
+#define LOG_LINE_MAX (LOG_MSG_LENGTH + 64)
+
+typedef struct {
+    int fd;
+    char buffer[LOG_BATCH_SIZE];
+    size_t len;
+    char echo[LOG_BATCH_SIZE];
+    size_t echoLen;
+    uint64_t previousUs;        //Timestamp of the last binary record
+
+    time_t stampSecond;
+    char stamp[32];
+
+    bool dirty;                 //Written since the last fdatasync
+    struct timespec lastSync;
+    unsigned long reportedDrops;
+
+    const char *path;           //Active segment, renamed away when it rolls over
+    const char *extension;
+    size_t segmentBytes;
+    struct timespec segmentOpened;
+} LogWriter;
+
+static LogWriter writer;
+
+static const char *cachedTimestamp(LogWriter *w){
+    time_t now = time(NULL);
+    if(now != w->stampSecond){
+        struct tm local;
+        localtime_r(&now, &local);
+        strftime(w->stamp, sizeof(w->stamp), "%a %b %e %H:%M:%S %Y", &local);//Same text ctime() gave
+        w->stampSecond = now;
+    }
+    return w->stamp;
+}
+
+static void writeAll(int fd, const char *data, size_t len){
+    while(len > 0){
+        ssize_t n = write(fd, data, len);
+        if(n < 0){
+            if(errno == EINTR)
+                continue;
+            perror("log write");
+            return;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+}
+
+static long msSince(const struct timespec *then){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - then->tv_sec) * 1000 + (now.tv_nsec - then->tv_nsec) / 1000000;
+}
+
+static void syncLog(LogWriter *w){
+    if(!w->dirty)
+        return;
+    fdatasync(w->fd);
+    w->dirty = false;
+    clock_gettime(CLOCK_MONOTONIC, &w->lastSync);
+}
+
+static bool openLog(LogWriter *w);
+
+static bool segmentFull(LogWriter *w){
+    if(serverConfig.logMaxBytes > 0 && w->segmentBytes >= serverConfig.logMaxBytes)
+        return true;
+    return serverConfig.logMaxAgeSec > 0 && msSince(&w->segmentOpened) >= (long)serverConfig.logMaxAgeSec * 1000;
+}
+
+/* Seals the active segment and starts a new one; compression happens on the compressor thread */
+static void rotateLog(LogWriter *w){
+    if(serverConfig.logSync != LOG_SYNC_NONE)
+        syncLog(w);
+    close(w->fd);
+    sealLogSegment(w->path, w->extension);
+    if(!openLog(w))
+        perror("Failed to open log file");
+}
+
+/* One write() for the whole batch, then whatever --log-sync asks for */
+static void flushBatch(LogWriter *w){
+    if(w->echoLen > 0){
+        writeAll(STDOUT_FILENO, w->echo, w->echoLen);
+        w->echoLen = 0;
+    }
+    if(w->len == 0)
+        return;
+
+    writeAll(w->fd, w->buffer, w->len);
+    w->segmentBytes += w->len;
+    w->len = 0;
+    w->dirty = true;
+
+    if(serverConfig.logSync == LOG_SYNC_BATCH)
+        syncLog(w);
+    else if(serverConfig.logSync == LOG_SYNC_INTERVAL && msSince(&w->lastSync) >= (long)serverConfig.logSyncIntervalMs)
+        syncLog(w);
+
+    if(segmentFull(w))
+        rotateLog(w);
+}
+
+static void appendLogEvent(LogWriter *w, const LogEvent *logEvent){
+    char message[LOG_MSG_LENGTH];
+    formatLogMessage(logEvent, message, sizeof(message));
+
+    if(LOG_BATCH_SIZE - w->len < LOG_LINE_MAX || LOG_BATCH_SIZE - w->echoLen < LOG_LINE_MAX)
+        flushBatch(w);
+
+    //Console echo, written alongside the batch instead of a printf per event
+    int n = snprintf(w->echo + w->echoLen, LOG_BATCH_SIZE - w->echoLen, "Pushed log event: [%d] %s\n", logEvent->type, message);
+    if(n > 0)
+        w->echoLen += (size_t)n < LOG_BATCH_SIZE - w->echoLen ? (size_t)n : LOG_BATCH_SIZE - w->echoLen - 1;
+
+    if(serverConfig.logFormat == LOG_FORMAT_BINARY){
+        w->len += encodeLogRecord(logEvent, w->previousUs, (unsigned char *)w->buffer + w->len);
+        if(logEvent->timestampUs > w->previousUs)
+            w->previousUs = logEvent->timestampUs;
+        return;
+    }
+
+    if(logEvent->type == LOG_NONE)
+        return;//No log to process
+    n = snprintf(w->buffer + w->len, LOG_BATCH_SIZE - w->len, "[%s][%s] %s",
+                 cachedTimestamp(w), logTypeName(logEvent->type), message);
+    if(n > 0)
+        w->len += (size_t)n < LOG_BATCH_SIZE - w->len ? (size_t)n : LOG_BATCH_SIZE - w->len - 1;
+}
+
+/* Logs a server event straight from the writer, bypassing the ring */
+static void appendWriterEvent(LogWriter *w, LogCode code, int argCount, int64_t first, int64_t second){
+    LogEvent logEvent;
+    memset(&logEvent, 0, sizeof(logEvent));
+    logEvent.type = LOG_SERVER;
+    logEvent.code = code;
+    logEvent.timestampUs = logMonotonicUs();
+    logEvent.player = -1;
+    logEvent.argCount = argCount;
+    logEvent.args[0] = first;
+    logEvent.args[1] = second;
+    appendLogEvent(w, &logEvent);
+}
+
+/* Notes in the log how many events the ring had to throw away since the last report */
+static void reportDropped(LogWriter *w, ServerState *server){
+    unsigned long dropped = atomic_load_explicit(&server->logDropped, memory_order_relaxed);
+    if(dropped == w->reportedDrops)
+        return;
+    appendWriterEvent(w, LOGEV_LOG_DROPPED, 2, (int64_t)(dropped - w->reportedDrops), (int64_t)dropped);
+    w->reportedDrops = dropped;
+}
+
+/* Formats every event that is already published */
+static void drainLogQueue(LogWriter *w, ServerState *server){
+    LogEvent logEvent;
+    while(popLogEvent(server, &logEvent))
+        appendLogEvent(w, &logEvent);
+}
+
+/* Waits for the next event; interval mode wakes up anyway to sync what is still unsynced */
+static void waitForLogItems(LogWriter *w, ServerState *server){
+    if(serverConfig.logSync != LOG_SYNC_INTERVAL || !w->dirty){
+        sem_wait(&server->logItemsSemaphore);
+        return;
+    }
+
+    long remaining = (long)serverConfig.logSyncIntervalMs - msSince(&w->lastSync);
+    if(remaining > 0){
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += remaining / 1000;
+        deadline.tv_nsec += (remaining % 1000) * 1000000;
+        if(deadline.tv_nsec >= 1000000000){
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        if(sem_timedwait(&server->logItemsSemaphore, &deadline) == 0)
+            return;
+    }
+    syncLog(w);
+    sem_wait(&server->logItemsSemaphore);
+}
+
+/* Opens the log for appending; a new binary log gets its magic, every open a clock record */
+static bool openLog(LogWriter *w){
+    bool binary = serverConfig.logFormat == LOG_FORMAT_BINARY;
+    w->path = binary ? "game.mlog" : "game.log";
+    w->extension = binary ? ".mlog" : ".log";
+    w->fd = open(w->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(w->fd < 0)
+        return false;
+
+    off_t size = lseek(w->fd, 0, SEEK_END);
+    w->segmentBytes = size > 0 ? (size_t)size : 0;
+    clock_gettime(CLOCK_MONOTONIC, &w->segmentOpened);
+    w->dirty = false;
+
+    if(binary){
+        if(size == 0){
+            writeAll(w->fd, LOG_FILE_MAGIC, LOG_FILE_MAGIC_LENGTH);
+            w->segmentBytes += LOG_FILE_MAGIC_LENGTH;
+        }
+        //Written straight away so even a segment sealed at shutdown starts with one
+        LogEvent clock;
+        unsigned char record[LOG_RECORD_MAX];
+        makeClockEvent(&clock);
+        size_t n = encodeLogRecord(&clock, 0, record);
+        writeAll(w->fd, (const char *)record, n);
+        w->segmentBytes += n;
+        w->previousUs = clock.timestampUs;
+    }
+    return true;
+}
+
 void* loggerLoopThread(void *arg){
-    SharedGameState *gameState = (SharedGameState*) arg;
-    
-    //open game.log file *gamegameState = 
-    FILE *logFile = fopen("game.log", "a");
-    if(logFile == NULL){
+    ServerState *server = (ServerState*) arg;
+    LogWriter *w = &writer;
+
+    //open game.log file *gamegameState =
+    if(!openLog(w)){
         perror("Failed to open log file");
         return NULL;
     }
-    
-    sem_post(&gameState->logReadySemaphore);//Signal that logger is ready
+    clock_gettime(CLOCK_MONOTONIC, &w->lastSync);
+    startLogCompressor(w->extension);
+
+    sem_post(&server->logReadySemaphore);//Signal that logger is ready
 
     while(serverRunning){
-        sem_wait(&gameState->logItemsSemaphore);//Wait for a log event in the log queue
+        waitForLogItems(w, server);//Wait for a log event in the log queue
         if(!serverRunning)
             break;
-        int logQueueLength =
-            (gameState->logQueueTail - gameState->logQueueHead + LOG_QUEUE_SIZE)
-            % LOG_QUEUE_SIZE;
-
-        pthread_mutex_lock(&gameState->logQueueMutex);//Lock the shared gameState to read log info
-        LogEvent logEvent = gameState->logQueue[gameState->logQueueHead];//Get the log event from the front of the queue
-        gameState->logQueueHead = (gameState->logQueueHead + 1) % LOG_QUEUE_SIZE;//Move the head forward so the current event is removed from the queue
-        pthread_mutex_unlock(&gameState->logQueueMutex);//Unlock the log queue
-
-        time_t now = time(0);
-        char timeString[32];
-        snprintf(timeString, sizeof(timeString), "%s", ctime(&now));
-        timeString[strcspn(timeString,"\n")] = '\0';
-
-        switch(logEvent.type){
-            case LOG_SERVER:
-                fprintf(logFile, "[%s][SERVER] %s",timeString, logEvent.message);
-                break;
-            case LOG_PLAYER:
-                fprintf(logFile, "[%s][PLAYER] %s",timeString,logEvent.message);
-                break;
-            case LOG_GAME:
-                fprintf(logFile, "[%s][GAME] %s",timeString,logEvent.message);
-                break;
-            case LOG_TURN:
-                fprintf(logFile, "[%s][TURN] %s",timeString,logEvent.message);
-                break;
-            case LOG_NONE:
-                //No log to process
-                break;
-            default:
-                fprintf(logFile, "[%s][UNKNOWN] %s",timeString,logEvent.message);
-                break;
-        }
 
-        fflush(logFile);//Ensure the message is written immediately
-        sem_post(&gameState->logSpacesSemaphore);//Signal that there is space in the log queue
+        //The semaphore only wakes the writer: swallow the posts of everything
+        //drained here, then drain again for events whose posts were taken.
+        //A slot claimed but not yet filled stops the drain; its own post
+        //wakes the writer again once it is published.
+        drainLogQueue(w, server);
+        while(sem_trywait(&server->logItemsSemaphore) == 0)
+            ;
+        drainLogQueue(w, server);
+
+        reportDropped(w, server);
+        flushBatch(w);
     }
 
-    fprintf(logFile,"[SERVER] Server shutdown.\n");
-    fclose(logFile);
+    drainLogQueue(w, server);//Keep whatever was queued before shutdown
+    reportDropped(w, server);
+    appendWriterEvent(w, LOGEV_SERVER_STOPPED, 0, 0, 0);
+    flushBatch(w);
+    if(serverConfig.logSync != LOG_SYNC_NONE)
+        syncLog(w);
+    close(w->fd);
+    stopLogCompressor();
     return NULL;
 }
 
-void pushLogEvent(SharedGameState *gameState, LogType type, const char *message){
-    sem_wait(&gameState->logSpacesSemaphore);//Wait for space in the log queue
-    pthread_mutex_lock(&gameState->logQueueMutex);//Lock the log queue
-    LogEvent *event = &gameState->logQueue[gameState->logQueueTail];//Push the log event from back of the queue
+/* Claims a ring slot without waiting; NULL (and a counted drop) when the ring is full */
+static LogSlot *claimLogSlot(ServerState *server, size_t *position){
+    size_t tail = atomic_load_explicit(&server->logQueueTail, memory_order_relaxed);
+
+    while(1){
+        LogSlot *slot = &server->logQueue[tail & LOG_QUEUE_MASK];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)tail;
+        if(diff == 0){
+            //Slot is free at this position; claim it unless another producer got there first
+            if(atomic_compare_exchange_weak_explicit(&server->logQueueTail, &tail, tail + 1,
+                                                     memory_order_relaxed, memory_order_relaxed)){
+                *position = tail;
+                return slot;
+            }
+        }
+        else if(diff < 0){
+            //The logger has not freed this slot since the last lap: the ring is full
+            atomic_fetch_add_explicit(&server->logDropped, 1, memory_order_relaxed);
+            return NULL;
+        }
+        else{
+            tail = atomic_load_explicit(&server->logQueueTail, memory_order_relaxed);
+        }
+    }
+}
+
+/* Fills the event in place in the ring, so a push is one CAS plus a few stores */
+static bool pushLogEventV(ServerState *server, int room, LogType type, LogCode code, int player,
+                          const char *text, int argCount, va_list args){
+    size_t position;
+    LogSlot *slot = claimLogSlot(server, &position);
+    if(!slot)
+        return false;
+
+    LogEvent *event = &slot->event;
     event->type = type;
-    strncpy(event->message, message, LOG_MSG_LENGTH);
-    gameState->logQueueTail = (gameState->logQueueTail + 1) % LOG_QUEUE_SIZE;//Move the tail forward so the current event becomes the next to be written
-    pthread_mutex_unlock(&gameState->logQueueMutex);//Unlock the log queue
-    printf("Pushed log event: [%d] %s\n", type, message);
-    sem_post(&gameState->logItemsSemaphore);//Signal that there is a new log item
-}
\ No newline at end of file
+    event->code = code;
+    event->timestampUs = logMonotonicUs();
+    event->room = room;
+    event->player = player;
+    event->argCount = argCount > LOG_MAX_ARGS ? LOG_MAX_ARGS : argCount;
+    for(int i = 0; i < event->argCount; i++)
+        event->args[i] = va_arg(args, int);
+    if(text){
+        strncpy(event->text, text, LOG_TEXT_LENGTH - 1);
+        event->text[LOG_TEXT_LENGTH - 1] = '\0';
+    }
+    else{
+        event->text[0] = '\0';
+    }
+
+    atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);//Publish to the logger
+    sem_post(&server->logItemsSemaphore);//Signal that there is a new log item
+    return true;
+}
+
+/* argCount ints follow text; see logformat.h for what each code carries */
+bool pushLogEvent(ServerState *server, LogType type, LogCode code, int player, const char *text, int argCount, ...){
+    va_list args;
+    va_start(args, argCount);
+    bool pushed = pushLogEventV(server, 0, type, code, player, text, argCount, args);
+    va_end(args);
+    return pushed;
+}
+
+void pushRoomLogEvent(SharedGameState *state, LogType type, LogCode code, int player, const char *text, int argCount, ...){
+    va_list args;
+    va_start(args, argCount);
+    pushLogEventV(state->server, state->roomID, type, code, player, text, argCount, args);
+    va_end(args);
+}
@@ -5,6 +5,8 @@
 
 void* loggerLoopThread(void *arg);
 void logMessage(SharedGameState *state, const char *message);
-void pushLogEvent(SharedGameState *state, LogType type, const char *message);
+void initLogQueue(ServerState *server);
+bool pushLogEvent(ServerState *server, LogType type, LogCode code, int player, const char *text, int argCount, ...);
+void pushRoomLogEvent(SharedGameState *state, LogType type, LogCode code, int player, const char *text, int argCount, ...);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,216 @@
+#include "logrotate.h"
+#include "config.h"
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define SEGMENT_PREFIX "game-"
+#define SEGMENT_NAME_LENGTH 64
+#define MAX_PENDING_SEGMENTS 64
+
+extern char **environ;
+
+//Sealed segments waiting for the compressor, oldest first
+static char pending[MAX_PENDING_SEGMENTS][SEGMENT_NAME_LENGTH];
+static int pendingHead = 0;
+static int pendingCount = 0;
+
+static pthread_mutex_t compressorMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compressorCond = PTHREAD_COND_INITIALIZER;
+static pthread_t compressorThread;
+static bool compressorRunning = false;
+static bool compressorStopping = false;
+static char segmentExtension[16];
+
+static bool isSegmentName(const char *name, bool compressedToo)
+{
+    size_t len = strlen(name);
+    size_t extLen = strlen(segmentExtension);
+
+    if (strncmp(name, SEGMENT_PREFIX, strlen(SEGMENT_PREFIX)) != 0)
+        return false;
+    if (len > extLen && strcmp(name + len - extLen, segmentExtension) == 0)
+        return true;
+    return compressedToo && len > extLen + 3 &&
+           strncmp(name + len - extLen - 3, segmentExtension, extLen) == 0 &&
+           strcmp(name + len - 3, ".gz") == 0;
+}
+
+static int compareNames(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Lists sealed segments oldest first (names sort by the time they were sealed) */
+static int listSegments(char ***names, bool compressedToo)
+{
+    DIR *dir = opendir(".");
+    int count = 0;
+    int capacity = 0;
+    *names = NULL;
+    if (!dir)
+        return 0;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (!isSegmentName(entry->d_name, compressedToo))
+            continue;
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 32;
+            char **grown = realloc(*names, (size_t)capacity * sizeof(char *));
+            if (!grown)
+                break;
+            *names = grown;
+        }
+        (*names)[count++] = strdup(entry->d_name);
+    }
+    closedir(dir);
+
+    if (count > 0)
+        qsort(*names, (size_t)count, sizeof(char *), compareNames);
+    return count;
+}
+
+static void freeNames(char **names, int count)
+{
+    for (int i = 0; i < count; i++)
+        free(names[i]);
+    free(names);
+}
+
+/* Runs gzip on one segment; gzip replaces it with segment.gz */
+static void compressSegment(const char *path)
+{
+    if (serverConfig.logCompress == LOG_COMPRESS_NONE)
+        return;
+
+    char *const argv[] = {"gzip", "-f", "-q", (char *)path, NULL};
+    pid_t pid;
+    int error = posix_spawnp(&pid, "gzip", NULL, NULL, argv, environ);
+    if (error != 0)
+    {
+        fprintf(stderr, "Could not run gzip on %s: %s\n", path, strerror(error));
+        return;
+    }
+    while (waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+        ;
+}
+
+/* Deletes the oldest sealed segments beyond serverConfig.logKeepSegments */
+static void applyRetention(void)
+{
+    if (serverConfig.logKeepSegments == 0)
+        return;
+
+    char **names;
+    int count = listSegments(&names, true);
+    for (int i = 0; i + (int)serverConfig.logKeepSegments < count; i++)
+        unlink(names[i]);
+    freeNames(names, count);
+}
+
+static void *compressorLoopThread(void *arg)
+{
+    (void)arg;
+
+    //Segments a previous run sealed but never got to compress
+    char **names;
+    int count = listSegments(&names, false);
+    for (int i = 0; i < count; i++)
+        compressSegment(names[i]);
+    freeNames(names, count);
+    applyRetention();
+
+    pthread_mutex_lock(&compressorMutex);
+    while (1)
+    {
+        while (pendingCount == 0 && !compressorStopping)
+            pthread_cond_wait(&compressorCond, &compressorMutex);
+        if (pendingCount == 0)
+            break;
+
+        char path[SEGMENT_NAME_LENGTH];
+        memcpy(path, pending[pendingHead], sizeof(path));
+        pendingHead = (pendingHead + 1) % MAX_PENDING_SEGMENTS;
+        pendingCount--;
+        pthread_mutex_unlock(&compressorMutex);
+
+        compressSegment(path);
+        applyRetention();
+
+        pthread_mutex_lock(&compressorMutex);
+    }
+    pthread_mutex_unlock(&compressorMutex);
+    return NULL;
+}
+
+void startLogCompressor(const char *extension)
+{
+    snprintf(segmentExtension, sizeof(segmentExtension), "%s", extension);
+    compressorStopping = false;
+    if (pthread_create(&compressorThread, NULL, compressorLoopThread, NULL) == 0)
+        compressorRunning = true;
+}
+
+/* Finishes whatever is queued, then joins the thread */
+void stopLogCompressor(void)
+{
+    if (!compressorRunning)
+        return;
+    pthread_mutex_lock(&compressorMutex);
+    compressorStopping = true;
+    pthread_cond_signal(&compressorCond);
+    pthread_mutex_unlock(&compressorMutex);
+    pthread_join(compressorThread, NULL);
+    compressorRunning = false;
+}
+
+/* Renames the active log to a new segment name and queues it; the caller reopens activePath */
+bool sealLogSegment(const char *activePath, const char *extension)
+{
+    char path[SEGMENT_NAME_LENGTH];
+    char stamp[32];
+    time_t now = time(NULL);
+    struct tm utc;
+    struct stat st;
+
+    //UTC, so names keep sorting in sealing order when the clocks go back; retention relies on it
+    gmtime_r(&now, &utc);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &utc);
+    for (int seq = 0; ; seq++)
+    {
+        snprintf(path, sizeof(path), SEGMENT_PREFIX "%s-%03d%s", stamp, seq, extension);
+        char compressed[SEGMENT_NAME_LENGTH + 3];
+        snprintf(compressed, sizeof(compressed), "%s.gz", path);
+        if (stat(path, &st) != 0 && stat(compressed, &st) != 0)
+            break;
+    }
+
+    if (rename(activePath, path) != 0)
+    {
+        perror("log rotate: rename");
+        return false;
+    }
+
+    pthread_mutex_lock(&compressorMutex);
+    if (pendingCount < MAX_PENDING_SEGMENTS)
+    {
+        int tail = (pendingHead + pendingCount) % MAX_PENDING_SEGMENTS;
+        memcpy(pending[tail], path, sizeof(path));
+        pendingCount++;
+        pthread_cond_signal(&compressorCond);
+    }
+    //else the compressor is far behind; the next start picks the segment up
+    pthread_mutex_unlock(&compressorMutex);
+    return true;
+}
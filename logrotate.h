@@ -0,0 +1,21 @@
+#ifndef LOGROTATE_H
+#define LOGROTATE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Sealed log segments.
+ *
+ * The logger thread rolls its active file over by renaming it to a
+ * timestamped segment name and handing the name to the compressor
+ * thread. That thread gzips sealed segments and deletes the oldest ones
+ * beyond serverConfig.logKeepSegments, so the logger never waits on
+ * either.
+ */
+
+void startLogCompressor(const char *extension);
+void stopLogCompressor(void);
+bool sealLogSegment(const char *activePath, const char *extension);
+
+#endif
@@ -0,0 +1,278 @@
+#define _GNU_SOURCE     //accept4()
+#include "metrics.h"
+#include "latency.h"
+#include "logformat.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define REQUEST_SIZE 2048
+#define IO_TIMEOUT_SEC 2
+
+static atomic_ulong counters[METRIC_COUNT];
+
+static ServerState *metricsServer = NULL;
+static pthread_t metricsThread;
+static int listenFD = -1;
+static atomic_bool metricsStopping = false;
+static uint64_t startedUs;
+
+//Histogram edges exported for every latency stage, in nanoseconds
+static const uint64_t latencyBoundsNs[] = {
+    10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 25000000, 50000000,
+    100000000, 250000000, 500000000, 1000000000, 2500000000ULL, 10000000000ULL,
+};
+#define LATENCY_BOUNDS (int)(sizeof(latencyBoundsNs) / sizeof(latencyBoundsNs[0]))
+
+void metricsAdd(MetricCounter counter, unsigned long amount)
+{
+    atomic_fetch_add_explicit(&counters[counter], amount, memory_order_relaxed);
+}
+
+static unsigned long counterValue(MetricCounter counter)
+{
+    return atomic_load_explicit(&counters[counter], memory_order_relaxed);
+}
+
+/* Difference of two counters bumped on different threads; a scrape between the two bumps must not wrap */
+static unsigned long counterGap(MetricCounter up, MetricCounter down)
+{
+    unsigned long removed = counterValue(down);
+    unsigned long added = counterValue(up);
+    return added > removed ? added - removed : 0;
+}
+
+static void writeMetric(FILE *out, const char *name, const char *type, const char *help, double value)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %.15g\n", name, help, name, type, name, value);
+}
+
+static void writeLatencyHistograms(FILE *out)
+{
+    const char *name = "memory_flip_stage_seconds";
+    fprintf(out, "# HELP %s Time a flip spends in each stage of the server, see latency.h\n# TYPE %s histogram\n", name, name);
+    for (int stage = 0; stage < LAT_STAGE_COUNT; stage++)
+    {
+        unsigned long atMost[LATENCY_BOUNDS];
+        uint64_t sumNs;
+        unsigned long count = latencyCumulative(stage, latencyBoundsNs, LATENCY_BOUNDS, atMost, &sumNs);
+        const char *key = latencyStageKey(stage);
+        for (int i = 0; i < LATENCY_BOUNDS; i++)
+            fprintf(out, "%s_bucket{stage=\"%s\",le=\"%g\"} %lu\n", name, key, latencyBoundsNs[i] / 1e9, atMost[i]);
+        fprintf(out, "%s_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n", name, key, count);
+        fprintf(out, "%s_sum{stage=\"%s\"} %.9f\n", name, key, sumNs / 1e9);
+        fprintf(out, "%s_count{stage=\"%s\"} %lu\n", name, key, count);
+    }
+}
+
+/* The whole exposition; nothing here takes a lock */
+static void writeMetrics(FILE *out)
+{
+    ServerState *server = metricsServer;
+    scoreBoard *board = &server->scoreBoard;
+    uint64_t nowUs = logMonotonicUs();
+
+    writeMetric(out, "memory_uptime_seconds", "gauge", "Seconds since the server started",
+                (nowUs - startedUs) / 1e6);
+    writeMetric(out, "memory_connections_open", "gauge", "Client connections currently open",
+                counterGap(METRIC_CONNECTIONS_ACCEPTED, METRIC_CONNECTIONS_CLOSED));
+    writeMetric(out, "memory_connections_accepted_total", "counter", "Client connections given a seat",
+                counterValue(METRIC_CONNECTIONS_ACCEPTED));
+    writeMetric(out, "memory_connections_rejected_total", "counter", "Connections turned away because the server was full",
+                counterValue(METRIC_CONNECTIONS_REJECTED));
+    writeMetric(out, "memory_rooms_open", "gauge", "Rooms currently hosted",
+                counterGap(METRIC_ROOMS_OPENED, METRIC_ROOMS_CLOSED));
+    writeMetric(out, "memory_games_active", "gauge", "Rooms with a game in progress",
+                counterGap(METRIC_GAMES_STARTED, METRIC_GAMES_ENDED));
+    writeMetric(out, "memory_games_started_total", "counter", "Games started",
+                counterValue(METRIC_GAMES_STARTED));
+    writeMetric(out, "memory_games_finished_total", "counter", "Games played to the last pair",
+                counterValue(METRIC_GAMES_FINISHED));
+    writeMetric(out, "memory_flips_total", "counter", "Card flips accepted; rate() gives flips per second",
+                counterValue(METRIC_FLIPS));
+    writeMetric(out, "memory_broadcast_bytes_total", "counter", "Bytes the rooms queued for players",
+                counterValue(METRIC_BROADCAST_BYTES));
+    writeMetric(out, "memory_broadcast_messages_total", "counter", "Messages the rooms queued for players",
+                counterValue(METRIC_BROADCAST_MESSAGES));
+
+    size_t tail = atomic_load_explicit(&server->logQueueTail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&server->logQueueHead, memory_order_relaxed);
+    writeMetric(out, "memory_log_queue_depth", "gauge", "Log events waiting for the logger thread",
+                tail > head ? tail - head : 0);
+    writeMetric(out, "memory_log_queue_capacity", "gauge", "Slots in the log ring", LOG_QUEUE_SIZE);
+    writeMetric(out, "memory_log_dropped_total", "counter", "Log events dropped because the ring was full",
+                atomic_load_explicit(&server->logDropped, memory_order_relaxed));
+
+    unsigned long oldestUs = atomic_load(&board->persistOldestUs);
+    writeMetric(out, "memory_scores_players", "gauge", "Players in the score store",
+                atomic_load(&board->players));
+    writeMetric(out, "memory_scores_persist_queued", "gauge", "Score updates not yet synced to scores.journal",
+                atomic_load(&board->persistQueued));
+    writeMetric(out, "memory_scores_persist_oldest_seconds", "gauge", "How long the oldest unsynced score update has waited",
+                oldestUs && nowUs > oldestUs ? (nowUs - oldestUs) / 1e6 : 0.0);
+    writeMetric(out, "memory_scores_persist_lag_seconds", "gauge", "Queued-to-synced time of the last batch's oldest update",
+                atomic_load(&board->persistLagUs) / 1e6);
+    writeMetric(out, "memory_scores_persist_max_lag_seconds", "gauge", "Largest persistence lag since the server started",
+                atomic_load(&board->persistMaxLagUs) / 1e6);
+
+    writeLatencyHistograms(out);
+}
+
+static bool sendAll(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+static void respond(int fd, const char *status, const char *body, size_t bodyLen)
+{
+    char header[256];
+    int headerLen = snprintf(header, sizeof(header),
+                             "HTTP/1.1 %s\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                             "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                             status, bodyLen);
+    if (sendAll(fd, header, (size_t)headerLen))
+        sendAll(fd, body, bodyLen);
+}
+
+/* Reads one request head and answers it; every connection is closed afterwards */
+static void serveScrape(int fd)
+{
+    char request[REQUEST_SIZE];
+    size_t len = 0;
+    while (len < sizeof(request) - 1)
+    {
+        ssize_t n = recv(fd, request + len, sizeof(request) - 1 - len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        len += (size_t)n;
+        request[len] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+            break;
+    }
+    request[len] = '\0';
+
+    char method[8];
+    char path[64];
+    if (sscanf(request, "%7s %63s", method, path) != 2)
+    {
+        const char *text = "Bad request\n";
+        respond(fd, "400 Bad Request", text, strlen(text));
+        return;
+    }
+    if (strcmp(method, "GET") != 0 || (strcmp(path, "/metrics") != 0 && strncmp(path, "/metrics?", 9) != 0))
+    {
+        const char *text = "Only GET /metrics is served here\n";
+        respond(fd, "404 Not Found", text, strlen(text));
+        return;
+    }
+
+    char *body = NULL;
+    size_t bodyLen = 0;
+    FILE *out = open_memstream(&body, &bodyLen);
+    if (!out)
+    {
+        const char *text = "Out of memory\n";
+        respond(fd, "500 Internal Server Error", text, strlen(text));
+        return;
+    }
+    writeMetrics(out);
+    fclose(out);
+    respond(fd, "200 OK", body, bodyLen);
+    free(body);
+}
+
+static void *metricsLoopThread(void *arg)
+{
+    (void)arg;
+    while (!atomic_load(&metricsStopping))
+    {
+        int fd = accept4(listenFD, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            //stopMetricsServer() shuts the listener down to get here
+            break;
+        }
+
+        //A scraper that stalls is dropped rather than waited on
+        struct timeval timeout = {.tv_sec = IO_TIMEOUT_SEC};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        serveScrape(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/* Listens on 127.0.0.1:port; false (and the server runs on without metrics) when it cannot */
+bool startMetricsServer(ServerState *server, unsigned int port)
+{
+    metricsServer = server;
+    startedUs = logMonotonicUs();
+
+    listenFD = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenFD < 0)
+    {
+        perror("metrics: socket");
+        return false;
+    }
+    int opt = 1;
+    setsockopt(listenFD, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons((uint16_t)port);
+    if (bind(listenFD, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listenFD, 16) < 0)
+    {
+        perror("metrics: bind");
+        close(listenFD);
+        listenFD = -1;
+        return false;
+    }
+
+    if (pthread_create(&metricsThread, NULL, metricsLoopThread, NULL) != 0)
+    {
+        perror("metrics: pthread_create");
+        close(listenFD);
+        listenFD = -1;
+        return false;
+    }
+    printf("Metrics on http://127.0.0.1:%u/metrics\n", port);
+    return true;
+}
+
+void stopMetricsServer(void)
+{
+    if (listenFD < 0)
+        return;
+    atomic_store(&metricsStopping, true);
+    shutdown(listenFD, SHUT_RDWR);
+    pthread_join(metricsThread, NULL);
+    close(listenFD);
+    listenFD = -1;
+}
@@ -0,0 +1,38 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+
+#include "shared_state.h"
+
+/*
+ * Prometheus text exposition on 127.0.0.1:serverConfig.metricsPort.
+ *
+ * A thread of its own answers GET /metrics, one request per connection,
+ * so a slow scraper never holds up the event loop. Everything it reports
+ * is an atomic: the counters below, the log ring's head and tail, the
+ * score store's persistence gauges and the latency histograms
+ * (latency.h). A scrape takes no lock at all, not even a room's mutex,
+ * so it cannot slow a game down however often it comes.
+ */
+
+typedef enum {
+    METRIC_CONNECTIONS_ACCEPTED,
+    METRIC_CONNECTIONS_CLOSED,
+    METRIC_CONNECTIONS_REJECTED,    // turned away with "Server full"
+    METRIC_ROOMS_OPENED,
+    METRIC_ROOMS_CLOSED,
+    METRIC_GAMES_STARTED,
+    METRIC_GAMES_ENDED,             // finished or stopped early
+    METRIC_GAMES_FINISHED,          // every pair matched
+    METRIC_FLIPS,
+    METRIC_BROADCAST_BYTES,         // everything game and scheduler threads sent to players
+    METRIC_BROADCAST_MESSAGES,
+    METRIC_COUNT
+} MetricCounter;
+
+void metricsAdd(MetricCounter counter, unsigned long amount);
+bool startMetricsServer(ServerState *server, unsigned int port);
+void stopMetricsServer(void);
+
+#endif
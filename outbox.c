@@ -0,0 +1,260 @@
+#include "outbox.h"
+#include "config.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+//Past this many times the limit even control messages stop being queued
+#define OUTBOX_HARD_LIMIT_FACTOR 2
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+void outboxInit(Outbox *box, int fd, int epollFD, void *epollTag)
+{
+    memset(box, 0, sizeof(*box));
+    pthread_mutex_init(&box->mutex, NULL);
+    box->fd = fd;
+    box->epollFD = epollFD;
+    box->epollTag = epollTag;
+    box->sentDigest = FNV_OFFSET_BASIS;
+}
+
+static void freeMessages(OutMessage *message)
+{
+    while (message)
+    {
+        OutMessage *next = message->next;
+        free(message);
+        message = next;
+    }
+}
+
+void outboxDestroy(Outbox *box)
+{
+    free(box->current);
+    freeMessages(box->controlHead);
+    freeMessages(box->bulkHead);
+    box->current = NULL;
+    box->controlHead = box->controlTail = NULL;
+    box->bulkHead = box->bulkTail = NULL;
+    pthread_mutex_destroy(&box->mutex);
+}
+
+static bool queueEmpty(Outbox *box)
+{
+    return !box->current && !box->controlHead && !box->bulkHead;
+}
+
+static void setWriteInterest(Outbox *box, bool wanted)
+{
+    if (box->writeArmed == wanted || box->epollFD < 0)
+        return;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | (wanted ? EPOLLOUT : 0);
+    ev.data.ptr = box->epollTag;
+    if (epoll_ctl(box->epollFD, EPOLL_CTL_MOD, box->fd, &ev) == 0)
+        box->writeArmed = wanted;
+}
+
+/* Shuts the socket down so the event loop sees a hangup and closes the client on its own thread */
+static void failOutbox(Outbox *box)
+{
+    if (box->failed)
+        return;
+    box->failed = true;
+    shutdown(box->fd, SHUT_RDWR);
+}
+
+static OutMessage *newMessage(const void *data, size_t len)
+{
+    OutMessage *message = malloc(sizeof(OutMessage) + len);
+    if (!message)
+    {
+        perror("outbox: malloc");
+        exit(1);
+    }
+    message->next = NULL;
+    message->len = len;
+    memcpy(message->data, data, len);
+    return message;
+}
+
+static void appendMessage(OutMessage **head, OutMessage **tail, OutMessage *message)
+{
+    if (*tail)
+        (*tail)->next = message;
+    else
+        *head = message;
+    *tail = message;
+}
+
+static void dropQueuedBulk(Outbox *box)
+{
+    for (OutMessage *message = box->bulkHead; message; message = message->next)
+    {
+        box->queuedBytes -= message->len;
+        box->droppedMessages++;
+    }
+    freeMessages(box->bulkHead);
+    box->bulkHead = box->bulkTail = NULL;
+}
+
+/* Writes queued bytes until the socket would block; false on a hard socket error */
+static bool writePending(Outbox *box)
+{
+    while (1)
+    {
+        if (!box->current)
+        {
+            OutMessage **head = box->controlHead ? &box->controlHead : &box->bulkHead;
+            OutMessage **tail = box->controlHead ? &box->controlTail : &box->bulkTail;
+            if (!*head)
+                return true;
+
+            box->current = *head;
+            *head = box->current->next;
+            if (!*head)
+                *tail = NULL;
+            box->currentSent = 0;
+        }
+
+        ssize_t n = send(box->fd, box->current->data + box->currentSent,
+                         box->current->len - box->currentSent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+
+        box->currentSent += n;
+        box->queuedBytes -= n;
+        if (box->currentSent == box->current->len)
+        {
+            free(box->current);
+            box->current = NULL;
+        }
+    }
+}
+
+static void digestSent(Outbox *box, const void *data, size_t len)
+{
+    const unsigned char *bytes = data;
+    uint64_t digest = box->sentDigest;
+    for (size_t i = 0; i < len; i++)
+        digest = (digest ^ bytes[i]) * FNV_PRIME;
+    box->sentDigest = digest;
+    box->sentBytes += len;
+}
+
+/* Never blocks; returns false once the client has been given up on */
+bool outboxSend(Outbox *box, const void *data, size_t len, OutPriority priority)
+{
+    pthread_mutex_lock(&box->mutex);
+    if (serverConfig.recordPath || box->capture)
+        digestSent(box, data, len);
+    if (box->capture)
+    {
+        box->capture(box->epollTag, data, len);
+        pthread_mutex_unlock(&box->mutex);
+        return true;
+    }
+
+    if (box->failed)
+    {
+        pthread_mutex_unlock(&box->mutex);
+        return false;
+    }
+
+    //Fast path: nothing is waiting, so the bytes can go straight to the kernel
+    if (queueEmpty(box))
+    {
+        size_t sent = 0;
+        while (sent < len)
+        {
+            ssize_t n = send(box->fd, (const unsigned char *)data + sent, len - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                failOutbox(box);
+                pthread_mutex_unlock(&box->mutex);
+                return false;
+            }
+            sent += n;
+        }
+
+        if (sent < len)
+        {
+            //The rest of a half-sent message must go out before anything else
+            box->current = newMessage((const unsigned char *)data + sent, len - sent);
+            box->currentSent = 0;
+            box->queuedBytes += len - sent;
+            setWriteInterest(box, true);
+        }
+        pthread_mutex_unlock(&box->mutex);
+        return true;
+    }
+
+    size_t limit = serverConfig.outboxLimit;
+    //A big board's text can outgrow the limit on its own; one of it in flight is not a slow consumer
+    if (len > limit)
+        limit = len;
+    if (box->queuedBytes + len > limit)
+    {
+        if (serverConfig.slowConsumerPolicy == SLOW_DISCONNECT)
+        {
+            failOutbox(box);
+            pthread_mutex_unlock(&box->mutex);
+            return false;
+        }
+
+        if (priority == OUT_BULK && serverConfig.slowConsumerPolicy == SLOW_DROP)
+        {
+            box->droppedMessages++;
+            pthread_mutex_unlock(&box->mutex);
+            return true;
+        }
+
+        if (priority == OUT_BULK)
+            dropQueuedBulk(box);
+
+        if (box->queuedBytes + len > limit * OUTBOX_HARD_LIMIT_FACTOR)
+        {
+            failOutbox(box);
+            pthread_mutex_unlock(&box->mutex);
+            return false;
+        }
+    }
+
+    OutMessage *message = newMessage(data, len);
+    if (priority == OUT_CONTROL)
+        appendMessage(&box->controlHead, &box->controlTail, message);
+    else
+        appendMessage(&box->bulkHead, &box->bulkTail, message);
+    box->queuedBytes += len;
+    setWriteInterest(box, true);
+
+    pthread_mutex_unlock(&box->mutex);
+    return true;
+}
+
+/* Called by the event loop when the socket is writable */
+bool outboxFlush(Outbox *box)
+{
+    pthread_mutex_lock(&box->mutex);
+    bool ok = !box->failed && writePending(box);
+    if (!ok)
+        failOutbox(box);
+    else if (queueEmpty(box))
+        setWriteInterest(box, false);
+    pthread_mutex_unlock(&box->mutex);
+    return ok;
+}
@@ -0,0 +1,71 @@
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Per-connection outbound queue.
+ *
+ * Room handlers never block on a client socket: bytes the
+ * kernel does not take right away are queued here and written by the
+ * event loop when epoll reports the socket writable. Control messages
+ * (turns, errors, game start/stop) jump ahead of queued bulk payloads
+ * (boards, snapshots, room lists). A consumer whose queue grows past
+ * serverConfig.outboxLimit is handled by serverConfig.slowConsumerPolicy.
+ */
+
+typedef enum {
+    OUT_CONTROL,
+    OUT_BULK
+} OutPriority;
+
+typedef enum {
+    SLOW_DROP,          // new bulk payloads are discarded while over the limit
+    SLOW_COALESCE,      // queued bulk payloads are replaced by the newest one
+    SLOW_DISCONNECT     // the client is disconnected
+} SlowConsumerPolicy;
+
+/* Replays have no sockets: their connections hand every message to one of these instead */
+typedef void (*OutboxCapture)(void *tag, const void *data, size_t len);
+
+typedef struct OutMessage {
+    struct OutMessage *next;
+    size_t len;
+    unsigned char data[];
+} OutMessage;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    int fd;
+    int epollFD;
+    void *epollTag;
+    bool writeArmed;
+    bool failed;
+
+    //Partially written message; always finished before anything else goes out
+    OutMessage *current;
+    size_t currentSent;
+
+    OutMessage *controlHead;
+    OutMessage *controlTail;
+    OutMessage *bulkHead;
+    OutMessage *bulkTail;
+    size_t queuedBytes;
+
+    unsigned long droppedMessages;
+
+    //FNV-1a of every byte offered while recording or replaying, dropped or not
+    uint64_t sentDigest;
+    uint64_t sentBytes;
+    OutboxCapture capture;      //Set (with fd -1) for replayed connections
+} Outbox;
+
+void outboxInit(Outbox *box, int fd, int epollFD, void *epollTag);
+void outboxDestroy(Outbox *box);
+bool outboxSend(Outbox *box, const void *data, size_t len, OutPriority priority);
+bool outboxFlush(Outbox *box);
+
+#endif
@@ -0,0 +1,207 @@
+#include "protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void frameBufferInit(FrameBuffer *fb)
+{
+    fb->data = NULL;
+    fb->len = 0;
+    fb->cap = 0;
+    fb->frameStart = 0;
+}
+
+void frameBufferReset(FrameBuffer *fb)
+{
+    fb->len = 0;
+    fb->frameStart = 0;
+}
+
+void frameBufferFree(FrameBuffer *fb)
+{
+    free(fb->data);
+    frameBufferInit(fb);
+}
+
+static void frameReserve(FrameBuffer *fb, size_t extra)
+{
+    if (fb->len + extra <= fb->cap)
+        return;
+
+    size_t cap = fb->cap ? fb->cap : 256;
+    while (cap < fb->len + extra)
+        cap *= 2;
+
+    unsigned char *data = realloc(fb->data, cap);
+    if (!data)
+    {
+        perror("frameReserve: realloc");
+        exit(1);
+    }
+    fb->data = data;
+    fb->cap = cap;
+}
+
+void frameBegin(FrameBuffer *fb, uint8_t opcode)
+{
+    frameReserve(fb, FRAME_HEADER_SIZE);
+    fb->frameStart = fb->len;
+    memset(fb->data + fb->len, 0, 4);
+    fb->data[fb->len + 4] = opcode;
+    fb->len += FRAME_HEADER_SIZE;
+}
+
+void frameEnd(FrameBuffer *fb)
+{
+    uint32_t payload = (uint32_t)(fb->len - fb->frameStart - FRAME_HEADER_SIZE);
+    unsigned char *header = fb->data + fb->frameStart;
+    header[0] = (unsigned char)(payload >> 24);
+    header[1] = (unsigned char)(payload >> 16);
+    header[2] = (unsigned char)(payload >> 8);
+    header[3] = (unsigned char)payload;
+}
+
+void framePutU8(FrameBuffer *fb, uint8_t value)
+{
+    frameReserve(fb, 1);
+    fb->data[fb->len++] = value;
+}
+
+void framePutU16(FrameBuffer *fb, uint16_t value)
+{
+    frameReserve(fb, 2);
+    fb->data[fb->len++] = (unsigned char)(value >> 8);
+    fb->data[fb->len++] = (unsigned char)value;
+}
+
+void framePutU32(FrameBuffer *fb, uint32_t value)
+{
+    frameReserve(fb, 4);
+    fb->data[fb->len++] = (unsigned char)(value >> 24);
+    fb->data[fb->len++] = (unsigned char)(value >> 16);
+    fb->data[fb->len++] = (unsigned char)(value >> 8);
+    fb->data[fb->len++] = (unsigned char)value;
+}
+
+void framePutI32(FrameBuffer *fb, int32_t value)
+{
+    framePutU32(fb, (uint32_t)value);
+}
+
+void framePutBytes(FrameBuffer *fb, const void *bytes, size_t len)
+{
+    frameReserve(fb, len);
+    memcpy(fb->data + fb->len, bytes, len);
+    fb->len += len;
+}
+
+void framePutString(FrameBuffer *fb, const char *str)
+{
+    size_t len = strlen(str);
+    if (len > 255)
+        len = 255;
+    framePutU8(fb, (uint8_t)len);
+    framePutBytes(fb, str, len);
+}
+
+void frameAppendText(FrameBuffer *fb, uint8_t opcode, const char *text)
+{
+    frameBegin(fb, opcode);
+    framePutBytes(fb, text, strlen(text));
+    frameEnd(fb);
+}
+
+/*
+ * Looks for one complete frame at the start of buf.
+ * Returns the number of bytes it occupies, 0 if more data is needed,
+ * or -1 if the header announces an oversized payload.
+ */
+int frameParse(const unsigned char *buf, size_t len, uint8_t *opcode, FrameReader *payload)
+{
+    if (len < FRAME_HEADER_SIZE)
+        return 0;
+
+    uint32_t payloadLen = ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) |
+                          ((uint32_t)buf[2] << 8) | (uint32_t)buf[3];
+    if (payloadLen > MAX_FRAME_PAYLOAD)
+        return -1;
+    if (len < FRAME_HEADER_SIZE + payloadLen)
+        return 0;
+
+    *opcode = buf[4];
+    payload->data = buf + FRAME_HEADER_SIZE;
+    payload->len = payloadLen;
+    payload->pos = 0;
+    payload->error = false;
+    return (int)(FRAME_HEADER_SIZE + payloadLen);
+}
+
+static bool frameHas(FrameReader *reader, size_t n)
+{
+    if (reader->error || reader->len - reader->pos < n)
+    {
+        reader->error = true;
+        return false;
+    }
+    return true;
+}
+
+uint8_t frameGetU8(FrameReader *reader)
+{
+    if (!frameHas(reader, 1))
+        return 0;
+    return reader->data[reader->pos++];
+}
+
+uint16_t frameGetU16(FrameReader *reader)
+{
+    if (!frameHas(reader, 2))
+        return 0;
+    const unsigned char *p = reader->data + reader->pos;
+    reader->pos += 2;
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+uint32_t frameGetU32(FrameReader *reader)
+{
+    if (!frameHas(reader, 4))
+        return 0;
+    const unsigned char *p = reader->data + reader->pos;
+    reader->pos += 4;
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+int32_t frameGetI32(FrameReader *reader)
+{
+    return (int32_t)frameGetU32(reader);
+}
+
+void frameGetString(FrameReader *reader, char *out, size_t outsize)
+{
+    size_t len = frameGetU8(reader);
+    if (!frameHas(reader, len))
+    {
+        out[0] = '\0';
+        return;
+    }
+    size_t copy = len < outsize - 1 ? len : outsize - 1;
+    memcpy(out, reader->data + reader->pos, copy);
+    out[copy] = '\0';
+    reader->pos += len;
+}
+
+/* Copies the rest of the payload as text */
+void frameGetText(FrameReader *reader, char *out, size_t outsize)
+{
+    size_t len = reader->len - reader->pos;
+    size_t copy = len < outsize - 1 ? len : outsize - 1;
+    memcpy(out, reader->data + reader->pos, copy);
+    out[copy] = '\0';
+    reader->pos = reader->len;
+}
+
+/* 1 to MAX_BOARD_SIDE each way, and an even number of cards so every card has a partner */
+bool boardSizeValid(int rows, int cols)
+{
+    return rows >= 1 && rows <= MAX_BOARD_SIDE && cols >= 1 && cols <= MAX_BOARD_SIDE && (rows * cols) % 2 == 0;
+}
@@ -0,0 +1,128 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Binary wire protocol.
+ *
+ * A client that sends the line PROTOCOL_HELLO right after connecting is
+ * answered with MSG_HELLO and from then on both sides exchange frames:
+ *
+ *     u32 payload length (network order) | u8 opcode | payload
+ *
+ * Integers in payloads are network order, strings are a u8 length
+ * followed by the bytes.
+ *
+ * During a game the board is kept in sync with MSG_CARD_UPDATE and
+ * MSG_SCORE_UPDATE deltas. Every delta carries the next sequence number
+ * of its room; MSG_BOARD snapshots carry the sequence number they are
+ * current to. A client that sees a gap sends CMD_SNAPSHOT. Clients that never negotiate keep the text
+ * protocol (messages terminated by <<END>>).
+ *
+ * Each room deals boards of its own size, serverConfig's by default and
+ * changed between games with CMD_BOARD_SIZE. Players are sent
+ * MSG_BOARD_SIZE when they land in a room and whenever its size changes.
+ */
+
+#define PROTOCOL_VERSION 1
+#define PROTOCOL_HELLO "PROTO BIN"
+#define FRAME_HEADER_SIZE 5
+#define MAX_FRAME_PAYLOAD (1 << 20)
+
+//Boards are at most this many rows and columns; both travel as u16
+#define MAX_BOARD_SIDE 256
+//Text players see boards up to this many cards whole; bigger ones only as changed cells, and they cannot pick one
+#define TEXT_BOARD_MAX_CARDS 1024
+
+#define CARD_STATE_HIDDEN 0
+#define CARD_STATE_FLIPPED 1
+#define CARD_STATE_MATCHED 2
+
+typedef enum {
+    /* server -> client */
+    MSG_HELLO = 1,          /* u8 version, u32 room, u8 player, str room name */
+    MSG_INFO,               /* raw text */
+    MSG_ERROR,              /* u8 ErrorCode, raw text */
+    MSG_WELCOME,            /* i32 saved score, str name, str reconnect token */
+    MSG_NAME_TAKEN,         /* empty */
+    MSG_ROOM_JOINED,        /* u32 room, u8 player, str room name */
+    MSG_ROOM_LIST,          /* u32 count, then per room: u32 id, u8 players, u8 max, u8 playing, str name; then u32 rooms left out */
+    MSG_GAME_STARTED,       /* empty */
+    MSG_GAME_STOPPED,       /* raw text */
+    MSG_BOARD,              /* u32 seq, u16 rows, u16 cols, per card: u8 state [, u16 value if not hidden] */
+    MSG_SCOREBOARD,         /* u8 count, then per player: u8 id, i32 score, i32 round score, str name */
+    MSG_TURN,               /* i8 player */
+    MSG_CARD_FLIPPED,       /* u8 player, u32 card, u16 value */
+    MSG_PAIR_RESULT,        /* u8 player, u32 first, u16 value, u32 second, u16 value, u8 matched */
+    MSG_CARD_UPDATE,        /* u32 seq, u32 card, u8 state [, u16 value if not hidden] */
+    MSG_SCORE_UPDATE,       /* u32 seq, u8 player, i32 score, i32 round score */
+    MSG_LEADERBOARD,        /* u32 players, u32 rank asked about (0 = none), u8 count, then per row: u32 rank, i32 score, str name */
+    MSG_BOARD_SIZE,         /* u16 rows, u16 cols: the room's next (or current) board */
+
+    /* client -> server */
+    CMD_NAME = 64,          /* str name */
+    CMD_READY,              /* empty */
+    CMD_FLIP,               /* u32 card */
+    CMD_ROOMS,              /* empty */
+    CMD_CREATE_ROOM,        /* str name */
+    CMD_JOIN_ROOM,          /* u32 room */
+    CMD_SNAPSHOT,           /* empty: resend MSG_BOARD, MSG_SCOREBOARD and MSG_TURN */
+    CMD_TOP,                /* u8 count */
+    CMD_RANK,               /* str name, empty for yourself */
+    CMD_REJOIN,             /* str reconnect token: answered with MSG_ROOM_JOINED and a snapshot, or ERR_ROOM */
+    CMD_BOARD_SIZE          /* u16 rows, u16 cols: deal boards of this size from the next game on, or ERR_ROOM */
+} Opcode;
+
+typedef enum {
+    ERR_INVALID_INDEX = 1,
+    ERR_NOT_YOUR_TURN,
+    ERR_SAME_CARD,
+    ERR_ALREADY_FLIPPED,
+    ERR_ROOM
+} ErrorCode;
+
+/* Growable output buffer; several frames can be appended back to back */
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+    size_t frameStart;
+} FrameBuffer;
+
+/* Cursor over one received payload; error is set on any short read */
+typedef struct {
+    const unsigned char *data;
+    size_t len;
+    size_t pos;
+    bool error;
+} FrameReader;
+
+void frameBufferInit(FrameBuffer *fb);
+void frameBufferReset(FrameBuffer *fb);
+void frameBufferFree(FrameBuffer *fb);
+
+void frameBegin(FrameBuffer *fb, uint8_t opcode);
+void frameEnd(FrameBuffer *fb);
+void framePutU8(FrameBuffer *fb, uint8_t value);
+void framePutU16(FrameBuffer *fb, uint16_t value);
+void framePutU32(FrameBuffer *fb, uint32_t value);
+void framePutI32(FrameBuffer *fb, int32_t value);
+void framePutBytes(FrameBuffer *fb, const void *bytes, size_t len);
+void framePutString(FrameBuffer *fb, const char *str);
+void frameAppendText(FrameBuffer *fb, uint8_t opcode, const char *text);
+
+bool boardSizeValid(int rows, int cols);
+
+int frameParse(const unsigned char *buf, size_t len, uint8_t *opcode, FrameReader *payload);
+
+uint8_t frameGetU8(FrameReader *reader);
+uint16_t frameGetU16(FrameReader *reader);
+uint32_t frameGetU32(FrameReader *reader);
+int32_t frameGetI32(FrameReader *reader);
+void frameGetString(FrameReader *reader, char *out, size_t outsize);
+void frameGetText(FrameReader *reader, char *out, size_t outsize);
+
+#endif
@@ -0,0 +1,855 @@
+#include "replay.h"
+#include "logformat.h"
+#include "timer.h"
+#include "score.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define REPLAY_FLAG_TIMERS 1        //Timer firings are in the file
+#define REPLAY_RECORD_HEADER_MAX 32
+
+//Logs that do not name the board were all written with 3x4
+#define IMPORT_DEFAULT_ROWS 3
+#define IMPORT_DEFAULT_COLS 4
+#define IMPORT_MAX_ROOMS 256
+//Covers the mismatch reveal and the pause before the next turn, see game.c
+#define IMPORT_TURN_GAP_MS 3000
+
+static FILE *recordFile = NULL;
+static uint64_t recordLastMs = 0;
+static unsigned int nextConn = 0;
+
+//The script a replay takes its reconnect tokens from, and where it is in it
+static const ReplayScript *tokenScript = NULL;
+static size_t tokenNext = 0;
+
+/* Kind, time and connection; times are deltas on the timer clock, which starts at 0 */
+static size_t beginRecord(unsigned char *out, ReplayKind kind, unsigned int conn, uint64_t now)
+{
+    size_t n = encodeVarint(out, kind);
+    n += encodeVarint(out + n, now > recordLastMs ? now - recordLastMs : 0);
+    n += encodeVarint(out + n, conn);
+    if (now > recordLastMs)
+        recordLastMs = now;
+    return n;
+}
+
+static void recordScore(const ScoreEntry *entry, void *arg)
+{
+    (void)arg;
+    unsigned char score[PLAYER_NAME_LENGTH + 16];
+    size_t nameLength = strnlen(entry->name, PLAYER_NAME_LENGTH - 1);
+    size_t n = encodeVarint(score, nameLength);
+    memcpy(score + n, entry->name, nameLength);
+    n += nameLength;
+    n += encodeVarint(score + n, (uint32_t)entry->wins);
+    fwrite(score, 1, n, recordFile);
+}
+
+bool replayStartRecording(const char *path, ServerState *server)
+{
+    unsigned char header[96];
+    size_t n = REPLAY_FILE_MAGIC_LENGTH;
+
+    recordFile = fopen(path, "wbe");
+    if (!recordFile)
+    {
+        perror(path);
+        return false;
+    }
+
+    memcpy(header, REPLAY_FILE_MAGIC, REPLAY_FILE_MAGIC_LENGTH);
+    n += encodeVarint(header + n, REPLAY_VERSION);
+    n += encodeVarint(header + n, REPLAY_FLAG_TIMERS);
+    n += encodeVarint(header + n, server->boardSeed);
+    n += encodeVarint(header + n, serverConfig.turnTimeoutSec);
+    n += encodeVarint(header + n, (uint64_t)serverConfig.afkAction);
+    n += encodeVarint(header + n, serverConfig.lobbyTimeoutSec);
+    n += encodeVarint(header + n, serverConfig.reconnectGraceSec);
+    n += encodeVarint(header + n, (uint64_t)serverConfig.boardRows);
+    n += encodeVarint(header + n, (uint64_t)serverConfig.boardCols);
+
+    //Recording starts before the event loop, so nobody can register in between
+    n += encodeVarint(header + n, (uint64_t)scores_count(server));
+    fwrite(header, 1, n, recordFile);
+    scores_for_each(server, recordScore, NULL);
+    return true;
+}
+
+void replayStopRecording(void)
+{
+    if (!recordFile)
+        return;
+    fclose(recordFile);
+    recordFile = NULL;
+}
+
+/* Connection numbers are handed out even when nothing is recorded */
+unsigned int replayRecordConnect(void)
+{
+    unsigned int conn = ++nextConn;
+    if (recordFile)
+    {
+        unsigned char record[REPLAY_RECORD_HEADER_MAX];
+        size_t n = beginRecord(record, REPLAY_CONNECT, conn, timerQueueNow());
+        fwrite(record, 1, n, recordFile);
+    }
+    return conn;
+}
+
+void replayRecordInput(unsigned int conn, const void *data, size_t len)
+{
+    if (!recordFile)
+        return;
+
+    unsigned char record[REPLAY_RECORD_HEADER_MAX];
+    size_t n = beginRecord(record, REPLAY_INPUT, conn, timerQueueNow());
+    n += encodeVarint(record + n, len);
+    fwrite(record, 1, n, recordFile);
+    fwrite(data, 1, len, recordFile);
+}
+
+void replayRecordDisconnect(unsigned int conn, uint64_t sentBytes, uint64_t sentDigest)
+{
+    if (!recordFile)
+        return;
+
+    unsigned char record[REPLAY_RECORD_HEADER_MAX + 24];
+    size_t n = beginRecord(record, REPLAY_DISCONNECT, conn, timerQueueNow());
+    n += encodeVarint(record + n, 1);
+    n += encodeVarint(record + n, sentBytes);
+    n += encodeVarint(record + n, sentDigest);
+    fwrite(record, 1, n, recordFile);
+}
+
+/* now is the clock reading the expiry used, so the replay fires exactly the same timers */
+void replayRecordTimers(uint64_t now)
+{
+    if (!recordFile)
+        return;
+
+    unsigned char record[REPLAY_RECORD_HEADER_MAX];
+    size_t n = beginRecord(record, REPLAY_TIMERS, 0, now);
+    fwrite(record, 1, n, recordFile);
+}
+
+void replayRecordToken(uint64_t token)
+{
+    if (!recordFile)
+        return;
+
+    unsigned char record[REPLAY_RECORD_HEADER_MAX + 10];
+    size_t n = beginRecord(record, REPLAY_TOKEN, 0, timerQueueNow());
+    n += encodeVarint(record + n, token);
+    fwrite(record, 1, n, recordFile);
+}
+
+static void appendScore(ReplayScript *script, const char *name, size_t nameLength, int wins)
+{
+    if (script->scoreCount == script->scoreCapacity)
+    {
+        script->scoreCapacity = script->scoreCapacity ? script->scoreCapacity * 2 : 16;
+        ScoreEntry *grown = realloc(script->scores, script->scoreCapacity * sizeof(ScoreEntry));
+        if (!grown)
+        {
+            perror("replay: realloc");
+            exit(1);
+        }
+        script->scores = grown;
+    }
+    ScoreEntry *entry = &script->scores[script->scoreCount++];
+    memcpy(entry->name, name, nameLength);
+    entry->name[nameLength] = '\0';
+    entry->wins = wins;
+}
+
+static void appendRecord(ReplayScript *script, size_t *capacity, const ReplayRecord *record)
+{
+    if (script->recordCount == *capacity)
+    {
+        *capacity = *capacity ? *capacity * 2 : 256;
+        ReplayRecord *grown = realloc(script->records, *capacity * sizeof(ReplayRecord));
+        if (!grown)
+        {
+            perror("replay: realloc");
+            exit(1);
+        }
+        script->records = grown;
+    }
+    script->records[script->recordCount++] = *record;
+}
+
+typedef struct {
+    const unsigned char *data;
+    size_t len;
+    size_t pos;
+    bool ok;
+} ReplayCursor;
+
+static uint64_t nextVarint(ReplayCursor *cursor)
+{
+    uint64_t value;
+    if (!decodeVarint(cursor->data, cursor->len, &cursor->pos, &value))
+        cursor->ok = false;
+    return value;
+}
+
+static bool parseRecording(ReplayScript *script, const char *path)
+{
+    ReplayCursor c = {script->storage, script->storageLength, REPLAY_FILE_MAGIC_LENGTH, true};
+
+    uint64_t version = nextVarint(&c);
+    uint64_t flags = nextVarint(&c);
+    if (!c.ok || version < 1 || version > REPLAY_VERSION)
+    {
+        fprintf(stderr, "%s: unsupported recording version %llu\n", path, (unsigned long long)version);
+        return false;
+    }
+    script->timersRecorded = (flags & REPLAY_FLAG_TIMERS) != 0;
+    script->wholeTextChunks = version < 4;
+    script->tokensRecorded = version >= 5;
+    script->boardSeed = nextVarint(&c);
+    script->turnTimeoutSec = (unsigned int)nextVarint(&c);
+    script->afkAction = (AfkAction)nextVarint(&c);
+    script->lobbyTimeoutSec = (unsigned int)nextVarint(&c);
+    //Version 1 predates held seats: every disconnect gave the seat up at once
+    script->reconnectGraceSec = version >= 2 ? (unsigned int)nextVarint(&c) : 0;
+    //Before version 3 every board was 3x4
+    script->boardRows = version >= 3 ? (int)nextVarint(&c) : IMPORT_DEFAULT_ROWS;
+    script->boardCols = version >= 3 ? (int)nextVarint(&c) : IMPORT_DEFAULT_COLS;
+    if (c.ok && !boardSizeValid(script->boardRows, script->boardCols))
+        c.ok = false;
+
+    uint64_t scoreCount = nextVarint(&c);
+    for (uint64_t i = 0; i < scoreCount && c.ok; i++)
+    {
+        uint64_t nameLength = nextVarint(&c);
+        if (nameLength >= PLAYER_NAME_LENGTH || nameLength > c.len - c.pos)
+        {
+            c.ok = false;
+            break;
+        }
+        const char *name = (const char *)c.data + c.pos;
+        c.pos += nameLength;
+        int wins = (int)(uint32_t)nextVarint(&c);
+        appendScore(script, name, (size_t)nameLength, wins);
+    }
+    if (!c.ok)
+    {
+        fprintf(stderr, "%s: damaged header\n", path);
+        return false;
+    }
+
+    size_t capacity = 0;
+    uint64_t atMs = 0;
+    while (c.pos < c.len)
+    {
+        ReplayRecord record;
+        memset(&record, 0, sizeof(record));
+        size_t start = c.pos;
+
+        record.kind = (ReplayKind)nextVarint(&c);
+        atMs += nextVarint(&c);
+        record.atMs = atMs;
+        record.conn = (unsigned int)nextVarint(&c);
+
+        switch (record.kind)
+        {
+        case REPLAY_CONNECT:
+        case REPLAY_TIMERS:
+            break;
+        case REPLAY_INPUT:
+            record.dataLength = (size_t)nextVarint(&c);
+            record.dataOffset = c.pos;
+            if (record.dataLength > c.len - c.pos)
+                c.ok = false;
+            else
+                c.pos += record.dataLength;
+            break;
+        case REPLAY_DISCONNECT:
+            record.hasDigest = nextVarint(&c) != 0;
+            if (record.hasDigest)
+            {
+                record.sentBytes = nextVarint(&c);
+                record.sentDigest = nextVarint(&c);
+            }
+            break;
+        case REPLAY_DEAL:
+            record.valueCount = (unsigned int)nextVarint(&c);
+            record.dataOffset = c.pos;
+            for (unsigned int i = 0; i < record.valueCount && c.ok; i++)
+                nextVarint(&c);
+            record.dataLength = c.pos - record.dataOffset;
+            break;
+        case REPLAY_TOKEN:
+            record.token = nextVarint(&c);
+            break;
+        default:
+            fprintf(stderr, "%s: unknown record kind %d at byte %zu\n", path, (int)record.kind, start);
+            return false;
+        }
+
+        if (!c.ok)
+        {
+            //A server that died mid-write leaves half a record; everything before it still replays
+            fprintf(stderr, "%s: truncated record at byte %zu ignored\n", path, start);
+            break;
+        }
+        appendRecord(script, &capacity, &record);
+    }
+    return true;
+}
+
+/* One game seen in a text log, with whatever card values it revealed */
+typedef struct {
+    int room;
+    size_t insertBefore;        //The record that started the game
+    int cardCount;
+    int *values;
+} ImportedDeal;
+
+typedef struct {
+    ReplayScript *script;
+    size_t recordCapacity;
+    size_t storageCapacity;
+    unsigned int nextConn;
+    unsigned int conns[IMPORT_MAX_ROOMS][MAX_PLAYERS];
+    long lastRecord[IMPORT_MAX_ROOMS];
+    long currentDeal[IMPORT_MAX_ROOMS];
+    uint64_t pairMs[IMPORT_MAX_ROOMS];      //When the last pair was resolved, 0 once the turn moved on
+    bool boardChanged[IMPORT_MAX_ROOMS];    //A player picked this room's board, so its games say nothing of --board
+    bool boardKnown;
+    ImportedDeal *deals;
+    size_t dealCount;
+    size_t dealCapacity;
+    long long firstSecond;
+    uint64_t shiftMs;
+    uint64_t lastMs;
+} Importer;
+
+static size_t storeBytes(Importer *imp, const void *data, size_t len)
+{
+    ReplayScript *script = imp->script;
+    if (script->storageLength + len > imp->storageCapacity)
+    {
+        size_t capacity = imp->storageCapacity ? imp->storageCapacity : 4096;
+        while (capacity < script->storageLength + len)
+            capacity *= 2;
+        unsigned char *grown = realloc(script->storage, capacity);
+        if (!grown)
+        {
+            perror("replay: realloc");
+            exit(1);
+        }
+        script->storage = grown;
+        imp->storageCapacity = capacity;
+    }
+    size_t offset = script->storageLength;
+    memcpy(script->storage + offset, data, len);
+    script->storageLength += len;
+    return offset;
+}
+
+/* "Sat Feb  7 03:44:51 2026" as seconds on a private scale; only differences matter */
+static bool parseLogDate(const char *text, long long *seconds)
+{
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char weekday[4], month[4];
+    int day, hour, minute, second, year;
+
+    if (sscanf(text, "%3s %3s %d %d:%d:%d %d", weekday, month, &day, &hour, &minute, &second, &year) != 7)
+        return false;
+    const char *found = strstr(months, month);
+    if (!found || (found - months) % 3 != 0)
+        return false;
+
+    //Days from civil date (proleptic Gregorian), March-based year
+    int m = (int)((found - months) / 3) + 1;
+    int y = year - (m <= 2);
+    long long era = (y >= 0 ? y : y - 399) / 400;
+    long long yoe = y - era * 400;
+    long long doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    long long days = era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    *seconds = ((days * 24 + hour) * 60 + minute) * 60 + second;
+    return true;
+}
+
+/* Splits "[date][TYPE] [Room N] message"; room is 1 for logs from before rooms existed */
+static bool parseLogLine(char *line, long long *seconds, int *room, char **message)
+{
+    if (line[0] != '[')
+        return false;
+    char *dateEnd = strchr(line, ']');
+    if (!dateEnd || dateEnd[1] != '[')
+        return false;
+    *dateEnd = '\0';
+    if (!parseLogDate(line + 1, seconds))
+        return false;
+    char *typeEnd = strchr(dateEnd + 1, ']');
+    if (!typeEnd)
+        return false;
+
+    char *text = typeEnd + 1;
+    while (*text == ' ')
+        text++;
+    int consumed = 0;
+    *room = 1;
+    if (sscanf(text, "[Room %d] %n", room, &consumed) == 1 && consumed > 0)
+        text += consumed;
+    *message = text;
+    return *room > 0 && *room < IMPORT_MAX_ROOMS;
+}
+
+static void importRecord(Importer *imp, int room, ReplayRecord *record)
+{
+    appendRecord(imp->script, &imp->recordCapacity, record);
+    if (room > 0)
+        imp->lastRecord[room] = (long)imp->script->recordCount - 1;
+}
+
+static void importInput(Importer *imp, int room, int player, uint64_t atMs, const char *line)
+{
+    if (player < 0 || player >= MAX_PLAYERS || imp->conns[room][player] == 0)
+        return;
+
+    char text[64];
+    int len = snprintf(text, sizeof(text), "%s\n", line);
+    ReplayRecord record;
+    memset(&record, 0, sizeof(record));
+    record.kind = REPLAY_INPUT;
+    record.atMs = atMs;
+    record.conn = imp->conns[room][player];
+    record.dataOffset = storeBytes(imp, text, (size_t)len);
+    record.dataLength = (size_t)len;
+    importRecord(imp, room, &record);
+}
+
+static void importScore(ReplayScript *script, const char *name, int wins)
+{
+    for (size_t i = 0; i < script->scoreCount; i++)
+    {
+        if (strcmp(script->scores[i].name, name) == 0)
+            return;
+    }
+    appendScore(script, name, strnlen(name, PLAYER_NAME_LENGTH - 1), wins);
+}
+
+static void revealCard(Importer *imp, int room, int card, int value)
+{
+    long deal = imp->currentDeal[room];
+    if (deal >= 0 && card >= 0 && card < imp->deals[deal].cardCount)
+        imp->deals[deal].values[card] = value;
+}
+
+static void startDeal(Importer *imp, int room, int rows, int cols)
+{
+    imp->currentDeal[room] = -1;
+    if (imp->lastRecord[room] < 0)
+        return;
+
+    if (imp->dealCount == imp->dealCapacity)
+    {
+        imp->dealCapacity = imp->dealCapacity ? imp->dealCapacity * 2 : 16;
+        ImportedDeal *grown = realloc(imp->deals, imp->dealCapacity * sizeof(ImportedDeal));
+        if (!grown)
+        {
+            perror("replay: realloc");
+            exit(1);
+        }
+        imp->deals = grown;
+    }
+    ImportedDeal *deal = &imp->deals[imp->dealCount];
+    deal->room = room;
+    deal->insertBefore = (size_t)imp->lastRecord[room];
+    deal->cardCount = rows * cols;
+    deal->values = malloc((size_t)deal->cardCount * sizeof(int));
+    if (!deal->values)
+    {
+        perror("replay: malloc");
+        exit(1);
+    }
+    for (int i = 0; i < deal->cardCount; i++)
+        deal->values[i] = -1;
+    imp->currentDeal[room] = (long)imp->dealCount++;
+}
+
+/* Gives the cards the log never showed the values still missing a partner; false if the log contradicts itself */
+static bool completeDeal(ImportedDeal *deal)
+{
+    int pairs = deal->cardCount / 2;
+    int *seen = calloc((size_t)pairs, sizeof(int));
+    if (!seen)
+    {
+        perror("replay: calloc");
+        exit(1);
+    }
+    for (int i = 0; i < deal->cardCount; i++)
+    {
+        int value = deal->values[i];
+        if (value < 0)
+            continue;
+        if (value >= pairs || ++seen[value] > 2)
+        {
+            free(seen);
+            return false;
+        }
+    }
+
+    int value = 0;
+    for (int i = 0; i < deal->cardCount; i++)
+    {
+        if (deal->values[i] >= 0)
+            continue;
+        while (seen[value] >= 2)
+            value++;
+        deal->values[i] = value;
+        seen[value]++;
+    }
+    free(seen);
+    return true;
+}
+
+static void importMessage(Importer *imp, int room, uint64_t atMs, const char *message)
+{
+    int player, card, first, second, value, otherValue, score;
+    int end = 0;    //%n past the literal tail, as sscanf counts a match once the number is read
+    char name[PLAYER_NAME_LENGTH];
+    char line[64];
+    ReplayRecord record;
+    memset(&record, 0, sizeof(record));
+    record.atMs = atMs;
+
+    if (sscanf(message, "New connection assigned to Player %d", &player) == 1)
+    {
+        if (player < 0 || player >= MAX_PLAYERS)
+            return;
+        record.kind = REPLAY_CONNECT;
+        record.conn = ++imp->nextConn;
+        imp->conns[room][player] = record.conn;
+        importRecord(imp, room, &record);
+    }
+    else if (sscanf(message, "Player %d registered name: %31s (Score %d)", &player, name, &score) == 3)
+    {
+        snprintf(line, sizeof(line), "NAME %s", name);
+        importInput(imp, room, player, atMs, line);
+        importScore(imp->script, name, score);
+    }
+    else if (sscanf(message, "Player %d tried duplicate name: %31s", &player, name) == 2)
+    {
+        snprintf(line, sizeof(line), "NAME %s", name);
+        importInput(imp, room, player, atMs, line);
+    }
+    else if (sscanf(message, "Player %d is READY%n", &player, &end) == 1 && end > 0)
+    {
+        importInput(imp, room, player, atMs, "1");
+    }
+    else if (sscanf(message, "Player %d flipped card %d", &player, &card) == 2)
+    {
+        snprintf(line, sizeof(line), "%d", card);
+        importInput(imp, room, player, atMs, line);
+    }
+    else if (sscanf(message, "Player %d flipped Card %d (Value: %d)", &player, &card, &value) == 3)
+    {
+        revealCard(imp, room, card, value);
+    }
+    else if (sscanf(message, "Player %d found a match: Card %d and Card %d (Value: %d)", &player, &first, &second, &value) == 4)
+    {
+        revealCard(imp, room, first, value);
+        revealCard(imp, room, second, value);
+        imp->pairMs[room] = atMs;
+    }
+    else if (sscanf(message, "Player %d did not match: Card %d and Card %d (Values: %d, %d)",
+                    &player, &first, &second, &value, &otherValue) == 5)
+    {
+        revealCard(imp, room, first, value);
+        revealCard(imp, room, second, otherValue);
+        imp->pairMs[room] = atMs;
+    }
+    else if ((sscanf(message, "Player %d disconnected%n", &player, &end) == 1 && end > 0) ||
+             (sscanf(message, "Player %d is away%n", &player, &end) == 1 && end > 0))
+    {
+        if (player < 0 || player >= MAX_PLAYERS || imp->conns[room][player] == 0)
+            return;
+        record.kind = REPLAY_DISCONNECT;
+        record.conn = imp->conns[room][player];
+        imp->conns[room][player] = 0;
+        importRecord(imp, room, &record);
+    }
+    else if (sscanf(message, "Player %d set the board to %dx%d", &player, &first, &second) == 3)
+    {
+        snprintf(line, sizeof(line), "BOARD %dx%d", first, second);
+        importInput(imp, room, player, atMs, line);
+        imp->boardChanged[room] = true;
+    }
+    else if (strncmp(message, "Game started.", 13) == 0)
+    {
+        int rows = IMPORT_DEFAULT_ROWS;
+        int cols = IMPORT_DEFAULT_COLS;
+        if (sscanf(message, "Game started. (Deal seed %*[0-9a-f], board %dx%d)", &rows, &cols) != 2 ||
+            !boardSizeValid(rows, cols))
+        {
+            rows = IMPORT_DEFAULT_ROWS;
+            cols = IMPORT_DEFAULT_COLS;
+        }
+        //The first game in a room nobody resized shows what --board was
+        if (!imp->boardChanged[room] && !imp->boardKnown)
+        {
+            imp->script->boardRows = rows;
+            imp->script->boardCols = cols;
+            imp->boardKnown = true;
+        }
+        startDeal(imp, room, rows, cols);
+    }
+    else if (sscanf(message, "It's now Player %d's turn.%n", &player, &end) == 1 && end > 0 && imp->pairMs[room] > 0)
+    {
+        //The log only has whole seconds: move time on far enough for the turn timers to have fired
+        if (atMs < imp->pairMs[room] + IMPORT_TURN_GAP_MS)
+        {
+            imp->shiftMs += imp->pairMs[room] + IMPORT_TURN_GAP_MS - atMs;
+            atMs = imp->pairMs[room] + IMPORT_TURN_GAP_MS;
+            imp->lastMs = atMs;
+        }
+        imp->pairMs[room] = 0;
+        record.kind = REPLAY_TIMERS;
+        record.atMs = atMs;
+        importRecord(imp, 0, &record);
+    }
+}
+
+/* Turns one server run of a text game.log into records; the deals go in last, in front of the games they belong to */
+static bool importGameLog(ReplayScript *script, char *text, size_t len, unsigned int session, const char *path)
+{
+    Importer *imp = calloc(1, sizeof(Importer));
+    if (!imp)
+    {
+        perror("replay: calloc");
+        return false;
+    }
+    imp->script = script;
+    script->boardRows = IMPORT_DEFAULT_ROWS;
+    script->boardCols = IMPORT_DEFAULT_COLS;
+    imp->firstSecond = -1;
+    for (int i = 0; i < IMPORT_MAX_ROOMS; i++)
+    {
+        imp->lastRecord[i] = -1;
+        imp->currentDeal[i] = -1;
+    }
+
+    //The log has no settings in it; these are the ones its games were played with
+    script->timersRecorded = false;
+    script->turnTimeoutSec = 0;
+    script->afkAction = AFK_SKIP;
+    script->lobbyTimeoutSec = 0;
+    script->reconnectGraceSec = 0;
+
+    unsigned int current = 0;
+    char *saveptr = NULL;
+    text[len - 1] = '\0';
+    for (char *line = strtok_r(text, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr))
+    {
+        long long seconds;
+        int room;
+        char *message;
+        if (!parseLogLine(line, &seconds, &room, &message))
+            continue;
+
+        if (strncmp(message, "Server started.", 15) == 0)
+        {
+            if (++current > session)
+                break;
+            continue;
+        }
+        if (current == 0)
+            current = 1;        //The log's first start line was lost
+        if (current != session)
+            continue;
+
+        if (imp->firstSecond < 0)
+            imp->firstSecond = seconds;
+        uint64_t atMs = (uint64_t)(seconds - imp->firstSecond) * 1000 + imp->shiftMs;
+        if (atMs < imp->lastMs)
+            atMs = imp->lastMs;
+        imp->lastMs = atMs;
+        importMessage(imp, room, atMs, message);
+    }
+
+    //Splice the deals in; both lists are already in order
+    ReplayRecord *records = script->records;
+    size_t count = script->recordCount;
+    script->records = NULL;
+    script->recordCount = 0;
+    imp->recordCapacity = 0;
+
+    size_t dealIndex = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        for (; dealIndex < imp->dealCount && imp->deals[dealIndex].insertBefore == i; dealIndex++)
+        {
+            ImportedDeal *deal = &imp->deals[dealIndex];
+            if (!completeDeal(deal))
+            {
+                fprintf(stderr, "%s: card values of a game in room %d contradict each other, its deal is left to the seed\n",
+                        path, deal->room);
+                continue;
+            }
+
+            unsigned char *encoded = malloc((size_t)deal->cardCount * 10);
+            if (!encoded)
+            {
+                perror("replay: malloc");
+                exit(1);
+            }
+            size_t n = 0;
+            for (int card = 0; card < deal->cardCount; card++)
+                n += encodeVarint(encoded + n, (uint64_t)deal->values[card]);
+
+            ReplayRecord record;
+            memset(&record, 0, sizeof(record));
+            record.kind = REPLAY_DEAL;
+            record.atMs = records[i].atMs;
+            record.conn = (unsigned int)deal->room;
+            record.valueCount = (unsigned int)deal->cardCount;
+            record.dataOffset = storeBytes(imp, encoded, n);
+            record.dataLength = n;
+            free(encoded);
+            appendRecord(script, &imp->recordCapacity, &record);
+        }
+        appendRecord(script, &imp->recordCapacity, &records[i]);
+    }
+    free(records);
+
+    bool found = current >= session && script->recordCount > 0;
+    if (!found)
+        fprintf(stderr, "%s: no server run %u with any players in it\n", path, session);
+    for (size_t i = 0; i < imp->dealCount; i++)
+        free(imp->deals[i].values);
+    free(imp->deals);
+    free(imp);
+    return found;
+}
+
+static bool readWholeFile(const char *path, unsigned char **data, size_t *len)
+{
+    FILE *in = fopen(path, "rb");
+    if (!in)
+    {
+        perror(path);
+        return false;
+    }
+
+    size_t capacity = 64 * 1024;
+    *len = 0;
+    *data = malloc(capacity + 1);
+    size_t n;
+    while (*data && (n = fread(*data + *len, 1, capacity - *len, in)) > 0)
+    {
+        *len += n;
+        if (*len == capacity)
+        {
+            capacity *= 2;
+            unsigned char *grown = realloc(*data, capacity + 1);
+            if (!grown)
+                free(*data);
+            *data = grown;
+        }
+    }
+    fclose(in);
+    if (!*data)
+    {
+        perror("replay: malloc");
+        return false;
+    }
+    (*data)[*len] = '\0';       //Room was kept for it, so text can be tokenized in place
+    return true;
+}
+
+bool replayLoad(const char *path, unsigned int session, ReplayScript *script)
+{
+    unsigned char *data;
+    size_t len;
+
+    memset(script, 0, sizeof(*script));
+    if (!readWholeFile(path, &data, &len))
+        return false;
+
+    bool ok;
+    if (len >= REPLAY_FILE_MAGIC_LENGTH && memcmp(data, REPLAY_FILE_MAGIC, REPLAY_FILE_MAGIC_LENGTH) == 0)
+    {
+        script->storage = data;
+        script->storageLength = len;
+        ok = parseRecording(script, path);
+    }
+    else
+    {
+        ok = importGameLog(script, (char *)data, len + 1, session, path);
+        free(data);
+    }
+
+    if (!ok)
+        replayFree(script);
+    return ok;
+}
+
+/* Puts the recorded seed, settings and saved scores in place before any room exists */
+void replayApplySettings(const ReplayScript *script, ServerState *server)
+{
+    server->boardSeed = script->boardSeed;
+    serverConfig.turnTimeoutSec = script->turnTimeoutSec;
+    serverConfig.afkAction = script->afkAction;
+    serverConfig.lobbyTimeoutSec = script->lobbyTimeoutSec;
+    serverConfig.reconnectGraceSec = script->reconnectGraceSec;
+    serverConfig.boardRows = script->boardRows;
+    serverConfig.boardCols = script->boardCols;
+
+    //Nothing is journaled: a replay never opens the score files
+    scores_update(server, script->scores, (int)script->scoreCount);
+}
+
+/* Decodes a REPLAY_DEAL; returns how many values were written */
+int replayDealValues(const ReplayScript *script, const ReplayRecord *record, int *values, int max)
+{
+    size_t pos = record->dataOffset;
+    size_t end = record->dataOffset + record->dataLength;
+    int count = 0;
+    uint64_t value;
+
+    while (count < max && count < (int)record->valueCount &&
+           decodeVarint(script->storage, end, &pos, &value))
+        values[count++] = (int)value;
+    return count;
+}
+
+/* From now on replayNextToken() hands out script's tokens; NULL stops it */
+void replayPlayTokens(const ReplayScript *script)
+{
+    tokenScript = script;
+    tokenNext = 0;
+}
+
+/* The next token the recording issued; false when not replaying or they have run out */
+bool replayNextToken(uint64_t *token)
+{
+    if (!tokenScript)
+        return false;
+    while (tokenNext < tokenScript->recordCount)
+    {
+        const ReplayRecord *record = &tokenScript->records[tokenNext++];
+        if (record->kind == REPLAY_TOKEN)
+        {
+            *token = record->token;
+            return true;
+        }
+    }
+    return false;
+}
+
+void replayFree(ReplayScript *script)
+{
+    if (tokenScript == script)
+        tokenScript = NULL;
+    free(script->records);
+    free(script->storage);
+    free(script->scores);
+    memset(script, 0, sizeof(*script));
+}
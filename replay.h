@@ -0,0 +1,111 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "shared_state.h"
+#include "config.h"
+
+/*
+ * Session recordings for --record and --replay.
+ *
+ * A recording holds what the event loop did: each new connection, each
+ * chunk of bytes a client sent exactly as recv() returned it (plus, from
+ * version 4, the newline a bare legacy READY was run without), each
+ * disconnect with a digest of everything that client had been sent, each
+ * reconnect token handed out (from version 5) and each moment timer
+ * callbacks ran, all stamped with the timer clock. The
+ * header carries the board seed, the settings that change how a game
+ * flows and the saved scores, so a replay starts from the same place.
+ *
+ * The file is REPLAY_FILE_MAGIC, the header
+ *
+ *   varint version | varint flags | varint board seed |
+ *   varint turn timeout | varint afk action | varint lobby timeout |
+ *   varint reconnect grace (from version 2) |
+ *   varint board rows | varint board columns (from version 3) |
+ *   varint score count | per score: varint name length, name, varint wins
+ *
+ * and then records
+ *
+ *   varint kind | varint ms since the previous record | varint connection
+ *
+ * where REPLAY_INPUT adds varint length and the bytes, REPLAY_DISCONNECT
+ * adds varint 1, varint bytes sent and varint digest (or varint 0 when
+ * there is no digest), REPLAY_DEAL, whose connection field is a room,
+ * adds varint card count and a varint face value per card, and
+ * REPLAY_TOKEN adds varint token. Tokens are random, so a replay hands
+ * out the recorded ones in the order they were issued.
+ *
+ * A text game.log can be loaded too. It becomes the same records: the
+ * inputs are rebuilt from the logged commands, the deals from the card
+ * values the log revealed, and timers fire by the clock. A player the
+ * log shows going away is taken to have left there and then, as the
+ * log does not say which connection came back for the seat.
+ */
+
+#define REPLAY_FILE_MAGIC "MRPL\001"
+#define REPLAY_FILE_MAGIC_LENGTH 5
+#define REPLAY_VERSION 5
+
+typedef enum {
+    REPLAY_CONNECT = 1,
+    REPLAY_INPUT,
+    REPLAY_DISCONNECT,
+    REPLAY_TIMERS,
+    REPLAY_DEAL,
+    REPLAY_TOKEN
+} ReplayKind;
+
+typedef struct {
+    ReplayKind kind;
+    uint64_t atMs;              // timer clock, see timer.h
+    unsigned int conn;          // the room for REPLAY_DEAL
+    size_t dataOffset;          // input bytes, or the deal's varint values, in ReplayScript.storage
+    size_t dataLength;
+    unsigned int valueCount;    // REPLAY_DEAL
+    bool hasDigest;             // REPLAY_DISCONNECT
+    uint64_t sentBytes;
+    uint64_t sentDigest;
+    uint64_t token;             // REPLAY_TOKEN
+} ReplayRecord;
+
+typedef struct {
+    bool timersRecorded;        // false for a game.log: due timers fire before each record
+    bool wholeTextChunks;       // before version 4 each text chunk was run as complete lines
+    bool tokensRecorded;        // before version 5 tokens were drawn from the board seed
+    uint64_t boardSeed;
+    unsigned int turnTimeoutSec;
+    AfkAction afkAction;
+    unsigned int lobbyTimeoutSec;
+    unsigned int reconnectGraceSec;
+    int boardRows;              // the size rooms open with; BOARD commands are replayed as inputs
+    int boardCols;
+    ScoreEntry *scores;
+    size_t scoreCount;
+    size_t scoreCapacity;
+
+    ReplayRecord *records;
+    size_t recordCount;
+    unsigned char *storage;
+    size_t storageLength;
+} ReplayScript;
+
+bool replayStartRecording(const char *path, ServerState *server);
+void replayStopRecording(void);
+unsigned int replayRecordConnect(void);
+void replayRecordInput(unsigned int conn, const void *data, size_t len);
+void replayRecordDisconnect(unsigned int conn, uint64_t sentBytes, uint64_t sentDigest);
+void replayRecordTimers(uint64_t now);
+void replayRecordToken(uint64_t token);
+
+bool replayLoad(const char *path, unsigned int session, ReplayScript *script);
+void replayApplySettings(const ReplayScript *script, ServerState *server);
+int replayDealValues(const ReplayScript *script, const ReplayRecord *record, int *values, int max);
+void replayPlayTokens(const ReplayScript *script);
+bool replayNextToken(uint64_t *token);
+void replayFree(ReplayScript *script);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+/*
+ * Small seedable generator (xoshiro256**) for dealing boards.
+ *
+ * Each room owns one, so rooms never share state or contend on a lock
+ * the way rand() does, and the same seed always yields the same
+ * sequence. Seeds are expanded with splitmix64, so nearby seeds (room
+ * numbers, consecutive deals) still give unrelated sequences.
+ */
+
+typedef struct {
+    uint64_t s[4];
+} Rng;
+
+void rngSeed(Rng *rng, uint64_t seed);
+uint64_t rngNext(Rng *rng);
+uint32_t rngBelow(Rng *rng, uint32_t bound);   // uniform in [0, bound), bound > 0
+
+#endif
@@ -0,0 +1,607 @@
+#include "room.h"
+#include "game.h"
+#include "scheduler.h"
+#include "logger.h"
+#include "config.h"
+#include "timer.h"
+#include "metrics.h"
+#include "replay.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+
+SharedGameState *createRoom(ServerState *server, const char *name)
+{
+    SharedGameState *room = calloc(1, sizeof(SharedGameState));
+    if (!room)
+    {
+        perror("createRoom: calloc");
+        return NULL;
+    }
+
+    pthread_mutex_init(&room->mutex, NULL);
+    room->server = server;
+
+    pthread_mutex_lock(&server->mutex);
+    room->roomID = server->nextRoomID++;
+    pthread_mutex_unlock(&server->mutex);
+
+    //The same seed and room number always deal the same boards, which is what replays rely on
+    rngSeed(&room->rng, server->boardSeed ^ ((uint64_t)room->roomID << 32));
+
+    pthread_mutex_lock(&room->mutex);
+    initGameState(room);
+    pthread_mutex_unlock(&room->mutex);
+
+    pthread_mutex_lock(&server->mutex);
+    if (name && name[0] != '\0')
+    {
+        strncpy(room->roomName, name, ROOM_NAME_LENGTH - 1);
+        room->roomName[ROOM_NAME_LENGTH - 1] = '\0';
+    }
+    else
+    {
+        snprintf(room->roomName, ROOM_NAME_LENGTH, "Room%d", room->roomID);
+    }
+    room->next = server->rooms;
+    server->rooms = room;
+    server->roomCount++;
+    pthread_mutex_unlock(&server->mutex);
+    metricsAdd(METRIC_ROOMS_OPENED, 1);
+
+    pushRoomLogEvent(room, LOG_SERVER, LOGEV_ROOM_CREATED, -1, room->roomName, 0);
+    return room;
+}
+
+SharedGameState *findRoom(ServerState *server, int roomID)
+{
+    SharedGameState *found = NULL;
+    pthread_mutex_lock(&server->mutex);
+    for (SharedGameState *room = server->rooms; room; room = room->next)
+    {
+        if (room->roomID == roomID)
+        {
+            found = room;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&server->mutex);
+    return found;
+}
+
+SharedGameState *findOpenRoom(ServerState *server)
+{
+    SharedGameState *found = NULL;
+    pthread_mutex_lock(&server->mutex);
+    for (SharedGameState *room = server->rooms; room && !found; room = room->next)
+    {
+        pthread_mutex_lock(&room->mutex);
+        if (!room->closing && !room->gameStarted && room->playerCount < MAX_PLAYERS)
+            found = room;
+        pthread_mutex_unlock(&room->mutex);
+    }
+    pthread_mutex_unlock(&server->mutex);
+    return found;
+}
+
+/* Timer callback: a waiting room saw no activity for serverConfig.lobbyTimeoutSec */
+static void lobbyExpired(void *arg)
+{
+    SharedGameState *room = (SharedGameState *)arg;
+    char notify[128];
+
+    pthread_mutex_lock(&room->mutex);
+    room->lobbyTimer = 0;
+    if (room->gameStarted || room->closing)
+    {
+        pthread_mutex_unlock(&room->mutex);
+        return;
+    }
+
+    snprintf(notify, sizeof(notify), "Room closed after %u seconds without activity.\n", serverConfig.lobbyTimeoutSec);
+    for (int i = 0; i < MAX_PLAYERS; i++)
+    {
+        if (room->players[i].connected)
+        {
+            sendPlayerMessage(&room->players[i], MSG_INFO, "", notify);
+            //The event loop sees end of input, closes the client and then the room
+            shutdown(room->players[i].socket, SHUT_RD);
+        }
+    }
+    pthread_mutex_unlock(&room->mutex);
+
+    pushRoomLogEvent(room, LOG_SERVER, LOGEV_ROOM_EXPIRED, -1, room->roomName, 0);
+}
+
+/* Restarts the idle clock of a waiting room, or stops it once a game runs; caller holds room->mutex */
+void touchLobbyLocked(SharedGameState *room)
+{
+    if (room->lobbyTimer)
+        timerCancel(room->lobbyTimer);
+    room->lobbyTimer = 0;
+    if (!room->gameStarted && !room->closing && room->playerCount > 0 && serverConfig.lobbyTimeoutSec > 0)
+        room->lobbyTimer = timerSchedule(serverConfig.lobbyTimeoutSec * 1000, lobbyExpired, room);
+}
+
+int joinRoom(SharedGameState *room, int socket, Outbox *outbox)
+{
+    int slot = -1;
+
+    pthread_mutex_lock(&room->mutex);
+    if (room->gameStarted || room->closing)
+    {
+        pthread_mutex_unlock(&room->mutex);
+        return -1;
+    }
+
+    for (int i = 0; i < MAX_PLAYERS; i++)
+    {
+        if (!room->players[i].connected)
+        {
+            slot = i;
+            room->players[i].playerID = i;
+            room->players[i].connected = true;
+            room->players[i].readyToStart = false;
+            room->players[i].waitingNotified = false;
+            room->players[i].flipsDone = 0;
+            room->players[i].firstFlipIndex = -1;
+            room->players[i].secondFlipIndex = -1;
+            room->players[i].score = 0;
+            room->players[i].roundScore = 0;
+            room->players[i].name[0] = '\0';
+            room->players[i].socket = socket;
+            room->players[i].outbox = outbox;
+            room->players[i].away = false;
+            room->players[i].reconnectToken[0] = '\0';
+            room->players[i].reconnectTimer = 0;
+            room->players[i].room = room;
+            room->playerCount++;
+            room->stateVersion++;
+            touchLobbyLocked(room);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&room->mutex);
+
+    return slot;
+}
+
+/* Gives the seat up for good: the old all-or-nothing disconnect, which also stops a running game */
+static void releaseSeat(SharedGameState *gameState, int playerID)
+{
+    pthread_mutex_lock(&gameState->mutex);
+
+    gameState->players[playerID].connected = false;
+    gameState->players[playerID].outbox = NULL;
+    gameState->players[playerID].readyToStart = false;
+    gameState->players[playerID].name[0] = '\0';
+    gameState->players[playerID].away = false;
+    gameState->players[playerID].reconnectToken[0] = '\0';
+    if (gameState->players[playerID].reconnectTimer)
+        timerCancel(gameState->players[playerID].reconnectTimer);
+    gameState->players[playerID].reconnectTimer = 0;
+
+    gameState->playerCount--;
+    gameState->stateVersion++;
+
+    pushRoomLogEvent(gameState, LOG_PLAYER, LOGEV_PLAYER_DISCONNECTED, playerID, NULL, 0);
+    bool gameRunning = gameState->gameStarted;
+    if (gameRunning)
+    {
+        cancelTurnTimer(gameState);
+        gameState->currentTurn = -1;
+        resetGameState(gameState);
+        endHeldSeatsLocked(gameState);
+    }
+    touchLobbyLocked(gameState);
+    gameState->boardNeedsBroadcast = true;
+    for (int i = 0; i < MAX_PLAYERS; i++)
+    {
+        if (gameState->players[i].connected)
+        {
+            gameState->players[i].readyToStart = false;
+            gameState->players[i].waitingNotified = false;
+            gameState->players[i].flipsDone = 0;
+            gameState->players[i].firstFlipIndex = -1;
+            gameState->players[i].secondFlipIndex = -1;
+        }
+    }
+
+    pthread_mutex_unlock(&gameState->mutex);
+
+    char notify[1024];
+    char list[128];
+    int pos = 0;
+    pos += snprintf(list + pos, sizeof(list) - pos, "Connected players: ");
+    for (int i = 0; i < MAX_PLAYERS; i++)
+    {
+        if (gameState->players[i].connected)
+        {
+            pos += snprintf(list + pos, sizeof(list) - pos, "%d ", i);
+        }
+    }
+    pthread_mutex_lock(&gameState->mutex);
+    const RenderCache *render = renderedStateLocked(gameState);
+    snprintf(notify, sizeof(notify),"Player %d left the game.\n%s\n%sPlease type 1 to READY.\n",playerID,list,render->scoreText);
+    pthread_mutex_unlock(&gameState->mutex);
+
+    for (int i = 0; i < MAX_PLAYERS; i++)
+    {
+        if (gameState->players[i].connected)
+        {
+            sendPlayerMessage(&gameState->players[i], MSG_GAME_STOPPED, "GAME_STOPPED\n", notify);
+        }
+    }
+
+    printf("Game stopped. Player %d left. Waiting for players...\n", playerID);
+
+    int connectedCount = 0;
+    int readyCount = 0;
+
+    for (int i = 0; i < MAX_PLAYERS; i++)
+    {
+        if (gameState->players[i].connected)
+        {
+            connectedCount++;
+            if (gameState->players[i].readyToStart)
+            {
+                readyCount++;
+            }
+        }
+    }
+
+    if (!gameState->gameStarted && connectedCount >= MIN_PLAYERS && readyCount == connectedCount)
+    {
+        gameState->gameStarted = true;
+        metricsAdd(METRIC_GAMES_STARTED, 1);
+
+        pushRoomLogEvent(gameState, LOG_PLAYER, LOGEV_ALL_READY, -1, NULL, 0);
+    }
+    syncRoomGame(gameState);
+}
+
+/* Timer callback: nobody came back for a held seat in time, or the game it was held for ended */
+static void reconnectExpired(void *arg)
+{
+    Player *player = (Player *)arg;
+    SharedGameState *room = player->room;
+
+    pthread_mutex_lock(&room->mutex);
+    player->reconnectTimer = 0;
+    bool away = player->away;
+    pthread_mutex_unlock(&room->mutex);
+
+    //Timers and rejoins both run on the event loop thread, so the seat cannot be taken back in between
+    if (!away)
+        return;
+    releaseSeat(room, player->playerID);
+    releaseRoomIfEmpty(room->server, room);
+}
+
+/* Lets every held seat go as soon as the event loop gets to it; caller holds room->mutex */
+void endHeldSeatsLocked(SharedGameState *room)
+{
+    for (int i = 0; i < MAX_PLAYERS; i++)
+    {
+        Player *player = &room->players[i];
+        if (!player->away)
+            continue;
+        if (player->reconnectTimer)
+            timerCancel(player->reconnectTimer);
+        player->reconnectTimer = timerSchedule(0, reconnectExpired, player);
+    }
+}
+
+/*
+ * Keeps the seat of a player who dropped out of a running game: they stay
+ * in the game (and on the scoreboard) but are away, so turns pass them by
+ * until they REJOIN or the grace window closes. Only named players get a
+ * token, so only they are held. Sets skipTurn when the turn they were on
+ * has to be skipped once the mutex is released. Caller holds room->mutex.
+ */
+static bool holdSeatLocked(SharedGameState *room, int playerID, bool *skipTurn)
+{
+    Player *player = &room->players[playerID];
+    if (!room->gameStarted || room->closing || serverConfig.reconnectGraceSec == 0 ||
+        player->reconnectToken[0] == '\0' || player->away)
+        return false;
+
+    player->away = true;
+    player->outbox = NULL;
+    player->socket = -1;
+    player->reconnectTimer = timerSchedule(serverConfig.reconnectGraceSec * 1000, reconnectExpired, player);
+    room->stateVersion++;
+
+    //Undone like a turn that timed out; a pair already turned up resolves as usual
+    if (room->currentTurn == playerID && player->flipsDone < 2 && !room->turnExpired)
+    {
+        if (room->turnDeadline)
+            timerCancel(room->turnDeadline);
+        room->turnDeadline = 0;
+        room->turnExpired = true;
+        *skipTurn = true;
+    }
+    return true;
+}
+
+/* A player's connection is gone: hold the seat if a game is running for it, otherwise give it up */
+void markPlayerDisconnected(SharedGameState *gameState, int playerID)
+{
+    bool skipTurn = false;
+
+    pthread_mutex_lock(&gameState->mutex);
+    bool held = holdSeatLocked(gameState, playerID, &skipTurn);
+    pthread_mutex_unlock(&gameState->mutex);
+
+    if (!held)
+    {
+        releaseSeat(gameState, playerID);
+        return;
+    }
+
+    pushRoomLogEvent(gameState, LOG_PLAYER, LOGEV_PLAYER_AWAY, playerID, NULL, 1, (int)serverConfig.reconnectGraceSec);
+
+    char notify[128];
+    snprintf(notify, sizeof(notify), "Player %d lost connection. Their seat is held for %u seconds.\n",
+             playerID, serverConfig.reconnectGraceSec);
+    pthread_mutex_lock(&gameState->mutex);
+    for (int i = 0; i < MAX_PLAYERS; i++)
+    {
+        if (gameState->players[i].connected && !gameState->players[i].away)
+            sendPlayerMessage(&gameState->players[i], MSG_INFO, "", notify);
+    }
+    pthread_mutex_unlock(&gameState->mutex);
+
+    if (skipTurn)
+        expireTurn(gameState);
+}
+
+/* Reconnect tokens come from their own random state, as the board seed ends up in recordings */
+void seedReconnectTokens(ServerState *server)
+{
+    if (getrandom(server->tokenRng.s, sizeof(server->tokenRng.s), 0) == sizeof(server->tokenRng.s))
+        return;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rngSeed(&server->tokenRng, ((uint64_t)ts.tv_sec << 30) ^ (uint64_t)ts.tv_nsec ^ ((uint64_t)getpid() << 16));
+}
+
+/* Gives a named player a fresh token for taking the seat back over a new connection */
+void issueReconnectToken(SharedGameState *room, int playerID, char *token)
+{
+    //A replay gives out what the recorded run did
+    uint64_t value;
+    if (!replayNextToken(&value))
+    {
+        pthread_mutex_lock(&room->server->mutex);
+        value = rngNext(&room->server->tokenRng);
+        pthread_mutex_unlock(&room->server->mutex);
+    }
+    replayRecordToken(value);
+    snprintf(token, RECONNECT_TOKEN_LENGTH, "%016llx", (unsigned long long)value);
+
+    pthread_mutex_lock(&room->mutex);
+    memcpy(room->players[playerID].reconnectToken, token, RECONNECT_TOKEN_LENGTH);
+    pthread_mutex_unlock(&room->mutex);
+}
+
+/*
+ * Hands the seat held for token to a new connection; NULL when no seat is held for it.
+ * The seat may still look connected: a dropped network can leave the old connection
+ * half-open long after the player came back. Its outbox is then passed out in
+ * *displaced and the caller cuts that connection off.
+ */
+SharedGameState *claimHeldSeat(ServerState *server, const char *token, int socket, Outbox *outbox,
+                               bool binaryProtocol, int *seat, Outbox **displaced)
+{
+    SharedGameState *found = NULL;
+    bool resumeTurns = false;
+
+    pthread_mutex_lock(&server->mutex);
+    for (SharedGameState *room = server->rooms; room && !found; room = room->next)
+    {
+        pthread_mutex_lock(&room->mutex);
+        for (int i = 0; i < MAX_PLAYERS && !room->closing; i++)
+        {
+            Player *player = &room->players[i];
+            if (!player->connected || player->reconnectToken[0] == '\0' || player->outbox == outbox ||
+                strncmp(player->reconnectToken, token, RECONNECT_TOKEN_LENGTH) != 0)
+                continue;
+
+            *displaced = player->away ? NULL : player->outbox;
+            if (player->reconnectTimer)
+                timerCancel(player->reconnectTimer);
+            player->reconnectTimer = 0;
+            player->away = false;
+            player->socket = socket;
+            player->outbox = outbox;
+            player->binaryProtocol = binaryProtocol;
+            room->stateVersion++;
+            //Everyone was away, so nobody has the turn until someone is back
+            resumeTurns = room->gameStarted && room->currentTurn < 0;
+            *seat = i;
+            found = room;
+            break;
+        }
+        pthread_mutex_unlock(&room->mutex);
+    }
+    pthread_mutex_unlock(&server->mutex);
+
+    if (resumeTurns)
+        advanceTurn(found);
+    return found;
+}
+
+static void stopRoom(SharedGameState *room)
+{
+    pthread_mutex_lock(&room->mutex);
+    room->closing = true;
+    if (room->gameStarted)
+        metricsAdd(METRIC_GAMES_ENDED, 1);
+    cancelTurnTimer(room);
+    touchLobbyLocked(room);
+    for (int i = 0; i < MAX_PLAYERS; i++)
+    {
+        if (room->players[i].reconnectTimer)
+            timerCancel(room->players[i].reconnectTimer);
+        room->players[i].reconnectTimer = 0;
+    }
+    pthread_mutex_unlock(&room->mutex);
+
+    pthread_mutex_destroy(&room->mutex);
+    freeGameState(room);
+    metricsAdd(METRIC_ROOMS_CLOSED, 1);
+}
+
+void releaseRoomIfEmpty(ServerState *server, SharedGameState *room)
+{
+    bool unlinked = false;
+
+    pthread_mutex_lock(&server->mutex);
+    pthread_mutex_lock(&room->mutex);
+    bool empty = room->playerCount <= 0;
+    pthread_mutex_unlock(&room->mutex);
+
+    if (empty)
+    {
+        for (SharedGameState **link = &server->rooms; *link; link = &(*link)->next)
+        {
+            if (*link == room)
+            {
+                *link = room->next;
+                server->roomCount--;
+                unlinked = true;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&server->mutex);
+
+    if (!unlinked)
+        return;
+
+    pushRoomLogEvent(room, LOG_SERVER, LOGEV_ROOM_CLOSED, -1, room->roomName, 0);
+
+    stopRoom(room);
+    free(room);
+}
+
+void destroyAllRooms(ServerState *server)
+{
+    pthread_mutex_lock(&server->mutex);
+    SharedGameState *room = server->rooms;
+    server->rooms = NULL;
+    server->roomCount = 0;
+    pthread_mutex_unlock(&server->mutex);
+
+    while (room)
+    {
+        SharedGameState *next = room->next;
+        for (int i = 0; i < MAX_PLAYERS; i++)
+        {
+            if (room->players[i].connected)
+                close(room->players[i].socket);
+        }
+        stopRoom(room);
+        free(room);
+        room = next;
+    }
+}
+
+//Longest "Room ..." line formatRoomList writes: the name plus five ints and fixed text
+#define ROOM_LIST_LINE (ROOM_NAME_LENGTH + 5 * 11 + 48)
+
+/* Returns every room as text followed by suffix, in a buffer the caller frees */
+char *formatRoomList(ServerState *server, const char *suffix)
+{
+    pthread_mutex_lock(&server->mutex);
+    size_t bufsize = 32 + (size_t)server->roomCount * ROOM_LIST_LINE + strlen(suffix) + 1;
+    char *buffer = malloc(bufsize);
+    if (!buffer)
+    {
+        perror("formatRoomList: malloc");
+        exit(1);
+    }
+
+    size_t pos = snprintf(buffer, bufsize, "ROOMS %d\n", server->roomCount);
+    for (SharedGameState *room = server->rooms; room; room = room->next)
+    {
+        pthread_mutex_lock(&room->mutex);
+        pos += snprintf(buffer + pos, bufsize - pos, "Room %d (%s): %d/%d players, %dx%d board, %s\n",
+                        room->roomID, room->roomName, room->playerCount, MAX_PLAYERS,
+                        room->boardRows, room->boardCols, room->gameStarted ? "playing" : "waiting");
+        pthread_mutex_unlock(&room->mutex);
+    }
+    pthread_mutex_unlock(&server->mutex);
+
+    strcpy(buffer + pos, suffix);
+    return buffer;
+}
+
+/*
+ * Rooms are listed until the next one would push the frame past
+ * MAX_FRAME_PAYLOAD; the trailing u32 says how many were left out.
+ */
+void encodeRoomList(ServerState *server, FrameBuffer *fb)
+{
+    pthread_mutex_lock(&server->mutex);
+    frameBegin(fb, MSG_ROOM_LIST);
+    size_t countAt = fb->len;
+    framePutU32(fb, 0);
+    uint32_t listed = 0, omitted = 0;
+    for (SharedGameState *room = server->rooms; room; room = room->next)
+    {
+        pthread_mutex_lock(&room->mutex);
+        size_t entry = 4 + 1 + 1 + 1 + 1 + strlen(room->roomName);
+        if (omitted > 0 || fb->len - fb->frameStart - FRAME_HEADER_SIZE + entry + 4 > MAX_FRAME_PAYLOAD)
+        {
+            omitted++;
+            pthread_mutex_unlock(&room->mutex);
+            continue;
+        }
+        framePutU32(fb, (uint32_t)room->roomID);
+        framePutU8(fb, (uint8_t)room->playerCount);
+        framePutU8(fb, MAX_PLAYERS);
+        framePutU8(fb, room->gameStarted ? 1 : 0);
+        framePutString(fb, room->roomName);
+        listed++;
+        pthread_mutex_unlock(&room->mutex);
+    }
+    framePutU32(fb, omitted);
+    frameEnd(fb);
+    pthread_mutex_unlock(&server->mutex);
+
+    fb->data[countAt] = (unsigned char)(listed >> 24);
+    fb->data[countAt + 1] = (unsigned char)(listed >> 16);
+    fb->data[countAt + 2] = (unsigned char)(listed >> 8);
+    fb->data[countAt + 3] = (unsigned char)listed;
+}
+
+bool roomNameTaken(ServerState *server, const char *name)
+{
+    bool taken = false;
+
+    pthread_mutex_lock(&server->mutex);
+    for (SharedGameState *room = server->rooms; room && !taken; room = room->next)
+    {
+        pthread_mutex_lock(&room->mutex);
+        for (int i = 0; i < MAX_PLAYERS; i++)
+        {
+            if (room->players[i].connected &&
+                room->players[i].name[0] != '\0' &&
+                strncmp(room->players[i].name, name, PLAYER_NAME_LENGTH) == 0)
+            {
+                taken = true;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&room->mutex);
+    }
+    pthread_mutex_unlock(&server->mutex);
+
+    return taken;
+}
@@ -0,0 +1,24 @@
+#ifndef ROOM_H
+#define ROOM_H
+
+#include "shared_state.h"
+#include "protocol.h"
+
+SharedGameState *createRoom(ServerState *server, const char *name);
+SharedGameState *findRoom(ServerState *server, int roomID);
+SharedGameState *findOpenRoom(ServerState *server);
+int joinRoom(SharedGameState *room, int socket, Outbox *outbox);
+void markPlayerDisconnected(SharedGameState *gameState, int playerID);
+void endHeldSeatsLocked(SharedGameState *room);
+void seedReconnectTokens(ServerState *server);
+void issueReconnectToken(SharedGameState *room, int playerID, char *token);
+SharedGameState *claimHeldSeat(ServerState *server, const char *token, int socket, Outbox *outbox,
+                               bool binaryProtocol, int *seat, Outbox **displaced);
+void touchLobbyLocked(SharedGameState *room);
+void releaseRoomIfEmpty(ServerState *server, SharedGameState *room);
+void destroyAllRooms(ServerState *server);
+char *formatRoomList(ServerState *server, const char *suffix);
+void encodeRoomList(ServerState *server, FrameBuffer *fb);
+bool roomNameTaken(ServerState *server, const char *name);
+
+#endif
@@ -3,160 +3,167 @@
 #include "logger.h"
 #include "game.h"
 #include "score.h"
+#include "room.h"
+#include "latency.h"
+#include "metrics.h"
 #include <stdio.h>
-#include <semaphore.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/socket.h>
 
-void* schedulerLoopThread(void *arg){
-    SharedGameState *gameState = (SharedGameState*) arg;
-    char logMessage[LOG_MSG_LENGTH];
-
-    while(serverRunning){   
-        sem_wait(&gameState->turnCompleteSemaphore);
-        if(!serverRunning)
-            break;
-
-        pthread_mutex_lock(&gameState->mutex);
-        if (!gameState->gameStarted)
-        {
-            pthread_mutex_unlock(&gameState->mutex);
-            continue;
-        }
+/*
+ * Ends the current turn: the game is over once every pair is matched,
+ * otherwise the next player still at the table is up. Runs on the event
+ * loop thread once a turn's result has been shown or the turn was skipped.
+ */
+void advanceTurn(SharedGameState *gameState){
+    if(!serverRunning || gameState->closing)
+        return;
+    uint64_t startedNs = latencyNow();
+
+    pthread_mutex_lock(&gameState->mutex);
+    if (!gameState->gameStarted)
+    {
         pthread_mutex_unlock(&gameState->mutex);
+        return;
+    }
+    pthread_mutex_unlock(&gameState->mutex);
 
+    pthread_mutex_lock(&gameState->mutex);
+    int matchedPairs = cardsMatched(&gameState->cards) / 2;
+    int totalPairs = gameState->totalPairs;
+    int currentTurn = gameState->currentTurn;
+    pthread_mutex_unlock(&gameState->mutex);
+        
+    if (matchedPairs == totalPairs) {
+        
         pthread_mutex_lock(&gameState->mutex);
-        int matchedPairs = gameState->matchedPaires;
-        int totalPairs = gameState->totalPairs;
-        int currentTurn = gameState->currentTurn;
+        int winner = gameState->currentTurn;
+        char winnerName[PLAYER_NAME_LENGTH];
+        if (winner >= 0 && winner < MAX_PLAYERS)
+            strncpy(winnerName, gameState->players[winner].name, PLAYER_NAME_LENGTH);
+        else
+            strncpy(winnerName, "Unknown", PLAYER_NAME_LENGTH);
+        winnerName[PLAYER_NAME_LENGTH - 1] = '\0';
         pthread_mutex_unlock(&gameState->mutex);
-            
-        if (gameState->matchedPaires == gameState->totalPairs) {
-            
-            pthread_mutex_lock(&gameState->mutex);
-            int winner = gameState->currentTurn;
-            char winnerName[PLAYER_NAME_LENGTH];
-            if (winner >= 0 && winner < MAX_PLAYERS)
-                strncpy(winnerName, gameState->players[winner].name, PLAYER_NAME_LENGTH);
-            else
-                strncpy(winnerName, "Unknown", PLAYER_NAME_LENGTH);
-            winnerName[PLAYER_NAME_LENGTH - 1] = '\0';
-            pthread_mutex_unlock(&gameState->mutex);
-
-            int maxScore = -1;
-            int winners[MAX_PLAYERS];
-            int winnerCount = 0;
-
-            pthread_mutex_lock(&gameState->mutex);
-            for (int i = 0; i < MAX_PLAYERS; i++)
-            {
-                if (!gameState->players[i].connected)
-                    continue;
-                int s = gameState->players[i].roundScore;
-                if (s > maxScore)
-                {
-                    maxScore = s;
-                    winnerCount = 0;
-                    winners[winnerCount++] = i;
-                }
-                else if (s == maxScore)
-                {
-                    winners[winnerCount++] = i;
-                }
-            }
-            pthread_mutex_unlock(&gameState->mutex);
 
-            scores_save(gameState);
+        int maxScore = -1;
+        int winners[MAX_PLAYERS];
+        int winnerCount = 0;
 
-            if (winnerCount == 1)
+        pthread_mutex_lock(&gameState->mutex);
+        for (int i = 0; i < MAX_PLAYERS; i++)
+        {
+            if (!gameState->players[i].connected)
+                continue;
+            int s = gameState->players[i].roundScore;
+            if (s > maxScore)
             {
-                snprintf(logMessage, LOG_MSG_LENGTH,"Game ended. Winner: %s (Round Score %d).\n",winnerName,maxScore);
+                maxScore = s;
+                winnerCount = 0;
+                winners[winnerCount++] = i;
             }
-            else
+            else if (s == maxScore)
             {
-                snprintf(logMessage, LOG_MSG_LENGTH,"Game ended. Draw with round score %d.\n",maxScore);
+                winners[winnerCount++] = i;
             }
-            pushLogEvent(gameState, LOG_GAME, logMessage);
+        }
+        pthread_mutex_unlock(&gameState->mutex);
 
-            resetGameState(gameState);
+        scores_save_room(gameState);
+        metricsAdd(METRIC_GAMES_FINISHED, 1);
 
-            pushLogEvent(gameState, LOG_GAME,
-                         "Game reset. Starting new round.\n");
-            pthread_mutex_lock(&gameState->mutex);
-            char notify[1024];
-            char result[256];
-            if (winnerCount == 1)
-            {
-                snprintf(result, sizeof(result),"Winner: %s (Round Score %d)\n",winnerName,maxScore);
-            }
-            else
-            {
-                result[0] = '\0';
-                strncat(result, "Draw between: ", sizeof(result) - strlen(result) - 1);
-                for (int i = 0; i < winnerCount; i++)
-                {
-                    int idx = winners[i];
-                    const char *nm = gameState->players[idx].name[0] ? gameState->players[idx].name : "Unknown";
-                    strncat(result, nm, sizeof(result) - strlen(result) - 1);
-                    if (i < winnerCount - 1)
-                    {
-                        strncat(result, ", ", sizeof(result) - strlen(result) - 1);
-                    }
-                }
-                strncat(result, "\n", sizeof(result) - strlen(result) - 1);
-            }
+        if (winnerCount == 1)
+        {
+            pushRoomLogEvent(gameState, LOG_GAME, LOGEV_GAME_WON, winner, winnerName, 1, maxScore);
+        }
+        else
+        {
+            pushRoomLogEvent(gameState, LOG_GAME, LOGEV_GAME_DRAWN, -1, NULL, 1, maxScore);
+        }
 
-            snprintf(notify, sizeof(notify),"GAME_STOPPED\nAll pairs matched.\n%sPlease type 1 to READY.\n<<END>>\n",result);
+        resetGameState(gameState);
+        pthread_mutex_lock(&gameState->mutex);
+        touchLobbyLocked(gameState);
+        //Seats were only held for this game
+        endHeldSeatsLocked(gameState);
+        pthread_mutex_unlock(&gameState->mutex);
 
-            for (int i = 0; i < MAX_PLAYERS; i++)
+        pushRoomLogEvent(gameState, LOG_GAME, LOGEV_GAME_RESET, -1, NULL, 0);
+        pthread_mutex_lock(&gameState->mutex);
+        char notify[1024];
+        char result[256];
+        if (winnerCount == 1)
+        {
+            snprintf(result, sizeof(result),"Winner: %s (Round Score %d)\n",winnerName,maxScore);
+        }
+        else
+        {
+            result[0] = '\0';
+            strncat(result, "Draw between: ", sizeof(result) - strlen(result) - 1);
+            for (int i = 0; i < winnerCount; i++)
             {
-                if (gameState->players[i].connected)
+                int idx = winners[i];
+                const char *nm = gameState->players[idx].name[0] ? gameState->players[idx].name : "Unknown";
+                strncat(result, nm, sizeof(result) - strlen(result) - 1);
+                if (i < winnerCount - 1)
                 {
-                    send(gameState->players[i].socket, notify, strlen(notify), 0);
+                    strncat(result, ", ", sizeof(result) - strlen(result) - 1);
                 }
             }
-            pthread_mutex_unlock(&gameState->mutex);
-            sem_post(&gameState->flipDoneSemaphore);
-            continue;
+            strncat(result, "\n", sizeof(result) - strlen(result) - 1);
         }
 
-        
-        pthread_mutex_lock(&gameState->mutex);
-        int nextTurn = -1;
-        int start = gameState->currentTurn;
+        snprintf(notify, sizeof(notify),"All pairs matched.\n%sPlease type 1 to READY.\n",result);
+
         for (int i = 0; i < MAX_PLAYERS; i++)
         {
-            int candidate = (start + 1 + i) % MAX_PLAYERS;
-            if (gameState->players[candidate].connected)
+            if (gameState->players[i].connected)
             {
-                nextTurn = candidate;
-                break;
+                sendPlayerMessage(&gameState->players[i], MSG_GAME_STOPPED, "GAME_STOPPED\n", notify);
             }
         }
+        pthread_mutex_unlock(&gameState->mutex);
+        syncRoomGame(gameState);
+        return;
+    }
 
-        if (nextTurn == -1)
+    
+    pthread_mutex_lock(&gameState->mutex);
+    int nextTurn = -1;
+    int start = gameState->currentTurn;
+    for (int i = 0; i < MAX_PLAYERS; i++)
+    {
+        int candidate = (start + 1 + i) % MAX_PLAYERS;
+        if (gameState->players[candidate].connected && !gameState->players[candidate].away)
         {
-            gameState->currentTurn = -1;
-            pthread_mutex_unlock(&gameState->mutex);
-            continue;
+            nextTurn = candidate;
+            break;
         }
+    }
 
-        gameState->currentTurn = nextTurn;
-        if (gameState->players[nextTurn].flipsDone >= 2)
-        {
-            gameState->players[nextTurn].flipsDone = 0;
-        }
-        currentTurn = gameState->currentTurn;
+    if (nextTurn == -1)
+    {
+        gameState->currentTurn = -1;
+        gameState->stateVersion++;
         pthread_mutex_unlock(&gameState->mutex);
+        return;
+    }
 
-        sendTurnMessage(gameState);
-        printf("It's now Player %d's turn.\n", gameState->currentTurn);
-        snprintf(logMessage, LOG_MSG_LENGTH,"It's now Player %d's turn.\n",gameState->currentTurn);
-        
-        sem_post(&gameState->turnSemaphore);
-
-        pushLogEvent(gameState, LOG_TURN, logMessage);
+    gameState->currentTurn = nextTurn;
+    gameState->stateVersion++;
+    armTurnDeadlineLocked(gameState);
+    if (gameState->players[nextTurn].flipsDone >= 2)
+    {
+        gameState->players[nextTurn].flipsDone = 0;
     }
+    currentTurn = gameState->currentTurn;
+    pthread_mutex_unlock(&gameState->mutex);
+
+    sendTurnMessage(gameState);
+    latencySince(LAT_TURN_ADVANCE, startedNs);
+    printf("It's now Player %d's turn.\n", gameState->currentTurn);
+
+    pushRoomLogEvent(gameState, LOG_TURN, LOGEV_TURN_CHANGED, currentTurn, NULL, 0);
 }
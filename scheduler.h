@@ -1,7 +1,8 @@
 #ifndef SCHEDULER_H
 #define SCHEDULER_H
 #include <stdio.h>
+#include "shared_state.h"
 
-void* schedulerLoopThread(void *arg);
+void advanceTurn(SharedGameState *gameState);
 
 #endif
\ No newline at end of file
@@ -1,151 +1,588 @@
 #include "score.h"
+#include "config.h"
+#include "leaderboard.h"
+#include "logger.h"
+#include "scoredb.h"
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-#define SCORE_FILE "scores.txt"
+#define SCORE_DB_FILE "scores.db"
+#define SCORE_TEXT_FILE "scores.txt"    //Read only when there is no scores.db yet
+#define SCORE_JOURNAL "scores.journal"
+#define SCORE_LINE_MAX (PLAYER_NAME_LENGTH + 16)
+#define MIN_SLOTS 64
+//The journal is folded into scores.db once it has this many records and more than there are players
+#define COMPACT_MIN_RECORDS 4096
+#define SCORES_PRINTED 20
 
-void scores_init(SharedGameState *state) {
-    pthread_mutexattr_t attr;
-    pthread_mutexattr_init(&attr);
-    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+/*
+ * Saved scores come from scores.db, mapped read-only and probed in place
+ * (see scoredb.h), plus an in-memory overlay of everyone whose total
+ * changed since it was written. The overlay is entries with slots, an
+ * open addressing (linear probing) index over their names holding entry
+ * index + 1, so 0 marks an empty slot; it is kept at most half full.
+ *
+ * Each change is also journaled to scores.journal as a "name wins" line;
+ * loading applies the journal over scores.db, last line wins. Updates
+ * only change memory and queue their lines: a persistence worker writes
+ * whatever has queued with one write and one fdatasync, so a game end
+ * never waits on the disk and a busy server syncs many games at once.
+ * A crash loses at most the updates still queued (persistQueued).
+ *
+ * Compaction, also on the worker, writes a new scores.db beside the old
+ * one from a copy of the overlay, renames it into place, syncs the
+ * directory and only then empties the journal, so a crash at any point leaves files that load
+ * to the same scores. scoreMutex is not held while the file is written.
+ */
 
-    pthread_mutex_init(&state->scoreBoard.scoreMutex, &attr);
-    pthread_mutexattr_destroy(&attr);
+static int journalFD = -1;
+static ScoreDatabase database;      // replaced only by the persistence worker, under scoreMutex
+static uint64_t databaseGeneration; // bumped each time database is replaced, under scoreMutex
 
-    state->scoreBoard.count = 0;
+//Journal lines waiting for the worker, under scoreMutex
+static char *queued;
+static size_t queuedLen, queuedCapacity, queuedRecords;
+static uint64_t queuedSinceUs;
+static pthread_t persistThread;
+static bool persisting;             // the worker is running and takes queued lines
+static bool persistStopping;
+
+/* Caller holds scoreMutex */
+static ScoreEntry *findEntry(scoreBoard *board, const char *name)
+{
+    if (board->slotCount == 0)
+        return NULL;
+
+    size_t mask = board->slotCount - 1;
+    for (size_t slot = scoreNameHash(name) & mask; board->slots[slot] != 0; slot = (slot + 1) & mask)
+    {
+        ScoreEntry *entry = &board->entries[board->slots[slot] - 1];
+        if (strncmp(entry->name, name, PLAYER_NAME_LENGTH) == 0)
+            return entry;
+    }
+    return NULL;
 }
 
-void scores_load(SharedGameState *state) {
-    FILE *fp = fopen(SCORE_FILE, "r");
+static void placeEntry(scoreBoard *board, size_t entryIndex)
+{
+    size_t mask = board->slotCount - 1;
+    size_t slot = scoreNameHash(board->entries[entryIndex].name) & mask;
+    while (board->slots[slot] != 0)
+        slot = (slot + 1) & mask;
+    board->slots[slot] = (uint32_t)(entryIndex + 1);
+}
 
-    pthread_mutex_lock(&state->scoreBoard.scoreMutex);
+static bool growIndex(scoreBoard *board)
+{
+    size_t slotCount = board->slotCount ? board->slotCount * 2 : MIN_SLOTS;
+    uint32_t *slots = calloc(slotCount, sizeof(uint32_t));
+    if (!slots)
+        return false;
 
-    if (!fp) {
-        state->scoreBoard.count = 0;
-        char cwd[512];
-        if (getcwd(cwd, sizeof(cwd)))
-            printf("scores_load: no scores.txt in %s\n", cwd);
-        pthread_mutex_unlock(&state->scoreBoard.scoreMutex);
-        return;
+    free(board->slots);
+    board->slots = slots;
+    board->slotCount = slotCount;
+    for (size_t i = 0; i < board->count; i++)
+        placeEntry(board, i);
+    return true;
+}
+
+/* The overlay's entry if the player changed since scores.db was written, else the file's. Caller holds scoreMutex */
+static const ScoreEntry *lookupEntry(scoreBoard *board, const char *name)
+{
+    const ScoreEntry *entry = findEntry(board, name);
+    return entry ? entry : scoreDbFind(&database, name);
+}
+
+/* Finds or adds name in the overlay; NULL only when out of memory. Caller holds scoreMutex */
+static ScoreEntry *upsertEntry(scoreBoard *board, const char *name)
+{
+    ScoreEntry *entry = findEntry(board, name);
+    if (entry)
+        return entry;
+    const ScoreEntry *saved = scoreDbFind(&database, name);
+
+    if (board->count == board->capacity)
+    {
+        size_t capacity = board->capacity ? board->capacity * 2 : MIN_SLOTS / 2;
+        ScoreEntry *grown = realloc(board->entries, capacity * sizeof(ScoreEntry));
+        if (!grown)
+            return NULL;
+        board->entries = grown;
+        board->capacity = capacity;
     }
+    if ((board->count + 1) * 2 > board->slotCount && !growIndex(board))
+        return NULL;
 
-    state->scoreBoard.count = 0;
-    char line[128];
-    while (state->scoreBoard.count < MAX_PLAYERS && fgets(line, sizeof(line), fp))
+    entry = &board->entries[board->count];
+    strncpy(entry->name, name, PLAYER_NAME_LENGTH - 1);
+    entry->name[PLAYER_NAME_LENGTH - 1] = '\0';
+    entry->wins = saved ? saved->wins : 0;
+    placeEntry(board, board->count);
+    board->count++;
+    if (!saved)
+        board->players++;
+    return entry;
+}
+
+/* Applies "name wins" lines from fp; returns the offset just past the last complete line */
+static long applyScoreLines(scoreBoard *board, FILE *fp, size_t *records)
+{
+    char line[SCORE_LINE_MAX];
+    long valid = 0;
+    while (fgets(line, sizeof(line), fp))
     {
+        if (!strchr(line, '\n'))
+            break;      //Torn by a crash mid-append
+        valid = ftell(fp);
+
         char name[PLAYER_NAME_LENGTH];
         int score = 0;
-        int fields = sscanf(line, "%31s %d", name, &score);
-        if (fields == 2)
+        if (sscanf(line, "%31s %d", name, &score) == 2)
         {
-            strncpy(state->scoreBoard.entries[state->scoreBoard.count].name, name, PLAYER_NAME_LENGTH - 1);
-            state->scoreBoard.entries[state->scoreBoard.count].name[PLAYER_NAME_LENGTH - 1] = '\0';
-            state->scoreBoard.entries[state->scoreBoard.count].wins = score;
-            state->scoreBoard.count++;
+            ScoreEntry *entry = upsertEntry(board, name);
+            if (entry)
+                entry->wins = score;
+            if (records)
+                (*records)++;
         }
     }
+    return valid;
+}
 
-    fclose(fp);
-    pthread_mutex_unlock(&state->scoreBoard.scoreMutex);
+static bool writeAllBytes(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t written = write(fd, data, len);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += written;
+        len -= (size_t)written;
+    }
+    return true;
 }
 
-void scores_print(SharedGameState *state) {
-    pthread_mutex_lock(&state->scoreBoard.scoreMutex);
-    printf("\n=== SAVED SCORES ===\n");
-    for (int i = 0; i < state->scoreBoard.count; i++) {
-        printf("%s: %d\n",state->scoreBoard.entries[i].name,state->scoreBoard.entries[i].wins);
+typedef struct {
+    scoreBoard *board;
+    size_t *added;          // overlay indexes of players scores.db does not have
+} CompactionSource;
+
+/* scores.db's players in file order, overlaid, then the players added since */
+static const ScoreEntry *compactionEntry(void *arg, size_t index)
+{
+    CompactionSource *source = arg;
+    if (index < database.count)
+    {
+        const ScoreEntry *changed = findEntry(source->board, database.entries[index].name);
+        return changed ? changed : &database.entries[index];
     }
-    printf("====================\n\n");
-    pthread_mutex_unlock(&state->scoreBoard.scoreMutex);
-    fflush(stdout);
+    return &source->board->entries[source->added[index - database.count]];
 }
 
-void scores_save(SharedGameState *state) {
-    FILE *fp = fopen(SCORE_FILE, "w");
-    if (!fp) {
-        perror("scores_save: fopen");
+/* After a compaction: drops the overlay entries scores.db now has, keeping those changed since copy was taken */
+static void keepChangedSince(scoreBoard *board, const scoreBoard *copy)
+{
+    //Entries are only ever appended between compactions, so index i is the same player in both
+    size_t kept = 0;
+    for (size_t i = 0; i < board->count; i++)
+    {
+        if (i < copy->count && board->entries[i].wins == copy->entries[i].wins)
+            continue;
+        board->entries[kept++] = board->entries[i];
+    }
+    board->count = kept;
+    if (board->slots)
+        memset(board->slots, 0, board->slotCount * sizeof(uint32_t));
+    for (size_t i = 0; i < kept; i++)
+        placeEntry(board, i);
+}
+
+/* Writes a new scores.db from a copy of the overlay, maps it and empties the journal.
+ * Called with scoreMutex held, which is released while the file is written */
+static void compact(scoreBoard *board)
+{
+    scoreBoard copy;
+    memset(&copy, 0, sizeof(copy));
+    copy.count = board->count;
+    copy.slotCount = board->slotCount;
+    copy.entries = malloc((board->count + 1) * sizeof(ScoreEntry));
+    copy.slots = malloc((board->slotCount + 1) * sizeof(uint32_t));
+    CompactionSource source = {&copy, malloc((board->count + 1) * sizeof(size_t))};
+    if (!copy.entries || !copy.slots || !source.added)
+    {
+        perror("scores: compaction");
+        free(copy.entries);
+        free(copy.slots);
+        free(source.added);
         return;
     }
+    memcpy(copy.entries, board->entries, board->count * sizeof(ScoreEntry));
+    if (board->slotCount > 0)
+        memcpy(copy.slots, board->slots, board->slotCount * sizeof(uint32_t));
+    pthread_mutex_unlock(&board->scoreMutex);
 
-    ScoreEntry entries[MAX_PLAYERS];
-    int entryCount = 0;
+    size_t added = 0;
+    for (size_t i = 0; i < copy.count; i++)
+    {
+        if (!scoreDbFind(&database, copy.entries[i].name))
+            source.added[added++] = i;
+    }
+    //False also when the rename could not be made durable, which keeps the journal below
+    bool written = scoreDbWrite(SCORE_DB_FILE, database.count + added, compactionEntry, &source);
+    ScoreDatabase fresh;
+    bool mapped = written && scoreDbOpen(&fresh, SCORE_DB_FILE);
+    free(source.added);
 
-    pthread_mutex_lock(&state->scoreBoard.scoreMutex);
-    entryCount = state->scoreBoard.count;
-    for (int i = 0; i < entryCount; i++)
+    pthread_mutex_lock(&board->scoreMutex);
+    if (mapped)
+    {
+        scoreDbClose(&database);
+        database = fresh;
+        databaseGeneration++;
+        keepChangedSince(board, &copy);
+        //Every journal line was synced before the copy was taken, so scores.db now covers them all
+        if (journalFD >= 0 && ftruncate(journalFD, 0) == 0)
+            board->journalRecords = 0;
+    }
+    else if (written)
     {
-        entries[i] = state->scoreBoard.entries[i];
+        //Nothing is lost: the old mapping, the overlay and the journal still hold every score
+        fprintf(stderr, "scores: could not map the new " SCORE_DB_FILE "\n");
     }
-    pthread_mutex_unlock(&state->scoreBoard.scoreMutex);
+    free(copy.entries);
+    free(copy.slots);
+}
 
-    pthread_mutex_lock(&state->mutex);
-    for (int i = 0; i < MAX_PLAYERS; i++)
+/* Adds entry's journal line to the worker's next batch. Caller holds scoreMutex */
+static void queueJournalLine(scoreBoard *board, const ScoreEntry *entry)
+{
+    if (queuedCapacity - queuedLen < SCORE_LINE_MAX)
     {
-        if (state->players[i].connected && state->players[i].name[0] != '\0')
+        size_t capacity = queuedCapacity ? queuedCapacity * 2 : 4096;
+        char *grown = realloc(queued, capacity);
+        if (!grown)
         {
-            bool found = false;
-            for (int j = 0; j < entryCount; j++)
-            {
-                if (strncmp(entries[j].name, state->players[i].name, PLAYER_NAME_LENGTH) == 0)
-                {
-                    entries[j].wins = state->players[i].score;
-                    found = true;
-                    break;
-                }
-            }
-            if (!found && entryCount < MAX_PLAYERS)
-            {
-                strncpy(entries[entryCount].name, state->players[i].name, PLAYER_NAME_LENGTH - 1);
-                entries[entryCount].name[PLAYER_NAME_LENGTH - 1] = '\0';
-                entries[entryCount].wins = state->players[i].score;
-                entryCount++;
-            }
+            perror("scores: queueing an update");
+            return;
         }
+        queued = grown;
+        queuedCapacity = capacity;
     }
-    pthread_mutex_unlock(&state->mutex);
 
-    for (int i = 0; i < entryCount; i++)
+    if (queuedLen == 0)
+        queuedSinceUs = logMonotonicUs();
+    if (atomic_load(&board->persistQueued) == 0)
+        atomic_store(&board->persistOldestUs, queuedSinceUs);
+    queuedLen += (size_t)snprintf(queued + queuedLen, queuedCapacity - queuedLen, "%s %d\n", entry->name, entry->wins);
+    queuedRecords++;
+    atomic_fetch_add(&board->persistQueued, 1);
+}
+
+/* The persistence worker: syncs queued journal lines in batches and compacts when the journal grows */
+static void *persistLoop(void *arg)
+{
+    ServerState *server = arg;
+    scoreBoard *board = &server->scoreBoard;
+
+    pthread_mutex_lock(&board->scoreMutex);
+    while (queuedLen > 0 || !persistStopping)
     {
-        fprintf(fp, "%s %d\n",entries[i].name,entries[i].wins);
+        if (queuedLen == 0)
+        {
+            pthread_cond_wait(&board->persistCond, &board->scoreMutex);
+            continue;
+        }
+
+        //Everything queued so far goes out together; updates keep queueing meanwhile
+        char *batch = queued;
+        size_t len = queuedLen;
+        size_t records = queuedRecords;
+        uint64_t since = queuedSinceUs;
+        queued = NULL;
+        queuedLen = queuedCapacity = queuedRecords = 0;
+        pthread_mutex_unlock(&board->scoreMutex);
+
+        if (!writeAllBytes(journalFD, batch, len) || fdatasync(journalFD) != 0)
+            perror("scores: journal append");
+        free(batch);
+        uint64_t lag = logMonotonicUs() - since;
+        pushLogEvent(server, LOG_SERVER, LOGEV_SCORES_SAVED, -1, NULL, 2, (int)records, (int)lag);
+
+        pthread_mutex_lock(&board->scoreMutex);
+        board->journalRecords += records;
+        atomic_fetch_sub(&board->persistQueued, records);
+        atomic_store(&board->persistOldestUs, queuedLen > 0 ? queuedSinceUs : 0);
+        atomic_store(&board->persistLagUs, lag);
+        if (lag > atomic_load(&board->persistMaxLagUs))
+            atomic_store(&board->persistMaxLagUs, lag);
+
+        if (board->journalRecords >= COMPACT_MIN_RECORDS && board->journalRecords > board->players)
+            compact(board);
     }
 
-    fclose(fp);
+    persisting = false;
+    if (board->count > 0 || board->journalRecords > 0)
+        compact(board);
+    pthread_mutex_unlock(&board->scoreMutex);
+    return NULL;
 }
 
-void scores_add_win(SharedGameState *state, const char *name) {
-    pthread_mutex_lock(&state->scoreBoard.scoreMutex);
+void scores_init(ServerState *server) {
+    pthread_mutex_init(&server->scoreBoard.scoreMutex, NULL);
+    pthread_cond_init(&server->scoreBoard.persistCond, NULL);
 
-    for (int i = 0; i < state->scoreBoard.count; i++) {
-        if (strncmp(state->scoreBoard.entries[i].name, name, PLAYER_NAME_LENGTH) == 0) {
-            state->scoreBoard.entries[i].wins++;
-            pthread_mutex_unlock(&state->scoreBoard.scoreMutex);
-            return;
-        }
+    server->scoreBoard.entries = NULL;
+    server->scoreBoard.count = 0;
+    server->scoreBoard.capacity = 0;
+    server->scoreBoard.slots = NULL;
+    server->scoreBoard.slotCount = 0;
+    server->scoreBoard.journalRecords = 0;
+    server->scoreBoard.players = 0;
+    atomic_init(&server->scoreBoard.persistQueued, 0);
+    atomic_init(&server->scoreBoard.persistOldestUs, 0);
+    atomic_init(&server->scoreBoard.persistLagUs, 0);
+    atomic_init(&server->scoreBoard.persistMaxLagUs, 0);
+}
+
+void scores_load(ServerState *server) {
+    scoreBoard *board = &server->scoreBoard;
+    pthread_mutex_lock(&board->scoreMutex);
+
+    FILE *fp = NULL;
+    if (scoreDbOpen(&database, SCORE_DB_FILE))
+    {
+        board->players = database.count;
+    }
+    else if ((fp = fopen(SCORE_TEXT_FILE, "r")) != NULL)
+    {
+        //Scores from before scores.db; the first compaction moves them over
+        applyScoreLines(board, fp, NULL);
+        fclose(fp);
+    }
+    else
+    {
+        char cwd[512];
+        if (getcwd(cwd, sizeof(cwd)))
+            printf("scores_load: no scores.db or scores.txt in %s\n", cwd);
     }
 
-    if (state->scoreBoard.count < MAX_PLAYERS)
+    fp = fopen(SCORE_JOURNAL, "r");
+    long valid = 0;
+    if (fp)
     {
-        strncpy(state->scoreBoard.entries[state->scoreBoard.count].name, name, PLAYER_NAME_LENGTH - 1);
-        state->scoreBoard.entries[state->scoreBoard.count].name[PLAYER_NAME_LENGTH - 1] = '\0';
-        state->scoreBoard.entries[state->scoreBoard.count].wins = 1;
-        state->scoreBoard.count++;
+        valid = applyScoreLines(board, fp, &board->journalRecords);
+        fclose(fp);
     }
 
-    pthread_mutex_unlock(&state->scoreBoard.scoreMutex);
+    journalFD = open(SCORE_JOURNAL, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (journalFD < 0)
+        perror("scores_load: " SCORE_JOURNAL);
+    else if (ftruncate(journalFD, valid) != 0)
+        perror("scores_load: truncating a torn journal");
+
+    if (journalFD >= 0)
+    {
+        persisting = pthread_create(&persistThread, NULL, persistLoop, server) == 0;
+        if (!persisting)
+            perror("scores_load: persistence thread");
+    }
+    pthread_mutex_unlock(&board->scoreMutex);
 }
 
-int scores_get_wins(SharedGameState *state, const char *name) {
-    int wins = 0;
-    pthread_mutex_lock(&state->scoreBoard.scoreMutex);
+/* Visits every saved player once, with their current total. Runs under scoreMutex */
+void scores_for_each(ServerState *server, void (*visit)(const ScoreEntry *entry, void *arg), void *arg) {
+    scoreBoard *board = &server->scoreBoard;
+    pthread_mutex_lock(&board->scoreMutex);
+    for (size_t i = 0; i < database.count; i++)
+    {
+        const ScoreEntry *changed = findEntry(board, database.entries[i].name);
+        visit(changed ? changed : &database.entries[i], arg);
+    }
+    for (size_t i = 0; i < board->count; i++)
+    {
+        if (!scoreDbFind(&database, board->entries[i].name))
+            visit(&board->entries[i], arg);
+    }
+    pthread_mutex_unlock(&board->scoreMutex);
+}
+
+/*
+ * Visits up to limit saved players from where cursor left off, taking
+ * scoreMutex for that chunk only, so a walk over millions of players
+ * never holds up a game end for long. Indices run over scores.db and
+ * then the overlay; if compaction swapped scores.db since the last
+ * chunk they mean nothing, so the walk starts over and says so in
+ * cursor->restarted. Returns false once every player was visited.
+ */
+bool scores_for_each_chunk(ServerState *server, ScoreCursor *cursor, size_t limit,
+                           void (*visit)(const ScoreEntry *entry, void *arg), void *arg) {
+    scoreBoard *board = &server->scoreBoard;
+    pthread_mutex_lock(&board->scoreMutex);
+    cursor->restarted = cursor->next > 0 && cursor->generation != databaseGeneration;
+    if (cursor->next == 0 || cursor->restarted)
+    {
+        cursor->generation = databaseGeneration;
+        cursor->next = 0;
+    }
 
-    for (int i = 0; i < state->scoreBoard.count; i++) {
-        if (strncmp(state->scoreBoard.entries[i].name, name, PLAYER_NAME_LENGTH) == 0) {
-            wins = state->scoreBoard.entries[i].wins;
-            break;
+    size_t visited = 0;
+    while (visited < limit && cursor->next < database.count)
+    {
+        const ScoreEntry *entry = &database.entries[cursor->next++];
+        const ScoreEntry *changed = findEntry(board, entry->name);
+        visit(changed ? changed : entry, arg);
+        visited++;
+    }
+    //Overlay entries are only ever appended between compactions, so their indices hold too
+    while (visited < limit && cursor->next < database.count + board->count)
+    {
+        const ScoreEntry *entry = &board->entries[cursor->next++ - database.count];
+        if (!scoreDbFind(&database, entry->name))
+            visit(entry, arg);
+        visited++;
+    }
+    bool more = cursor->next < database.count + board->count;
+    pthread_mutex_unlock(&board->scoreMutex);
+    return more;
+}
+
+size_t scores_count(ServerState *server) {
+    pthread_mutex_lock(&server->scoreBoard.scoreMutex);
+    size_t players = server->scoreBoard.players;
+    pthread_mutex_unlock(&server->scoreBoard.scoreMutex);
+    return players;
+}
+
+void scores_print(ServerState *server) {
+    //Only the first few are shown, so this stops short of touching all of scores.db
+    scoreBoard *board = &server->scoreBoard;
+    size_t printed = 0;
+    printf("\n=== SAVED SCORES ===\n");
+    pthread_mutex_lock(&board->scoreMutex);
+    for (size_t i = 0; i < database.count && printed < SCORES_PRINTED; i++, printed++)
+    {
+        const ScoreEntry *changed = findEntry(board, database.entries[i].name);
+        const ScoreEntry *entry = changed ? changed : &database.entries[i];
+        printf("%s: %d\n", entry->name, entry->wins);
+    }
+    for (size_t i = 0; i < board->count && printed < SCORES_PRINTED; i++)
+    {
+        if (scoreDbFind(&database, board->entries[i].name))
+            continue;
+        printf("%s: %d\n", board->entries[i].name, board->entries[i].wins);
+        printed++;
+    }
+    if (board->players > printed)
+        printf("... and %zu more\n", board->players - printed);
+    pthread_mutex_unlock(&board->scoreMutex);
+    printf("====================\n\n");
+    fflush(stdout);
+}
+
+/* Sets every entry and queues their journal lines for the persistence worker. Caller holds scoreMutex */
+static void updateLocked(scoreBoard *board, const ScoreEntry *updates, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        ScoreEntry *entry = upsertEntry(board, updates[i].name);
+        if (!entry)
+            continue;
+        entry->wins = updates[i].wins;
+        if (persisting)
+            queueJournalLine(board, entry);
+    }
+    leaderboardApply(updates, count);
+    if (persisting)
+        pthread_cond_signal(&board->persistCond);
+}
+
+void scores_update(ServerState *server, const ScoreEntry *updates, int count) {
+    pthread_mutex_lock(&server->scoreBoard.scoreMutex);
+    updateLocked(&server->scoreBoard, updates, count);
+    pthread_mutex_unlock(&server->scoreBoard.scoreMutex);
+}
+
+/* Persists the totals of everyone named in the room; called when a game there ends */
+void scores_save_room(SharedGameState *room) {
+    ScoreEntry updates[MAX_PLAYERS];
+    int count = 0;
+
+    pthread_mutex_lock(&room->mutex);
+    for (int i = 0; i < MAX_PLAYERS; i++)
+    {
+        if (room->players[i].connected && room->players[i].name[0] != '\0')
+        {
+            strncpy(updates[count].name, room->players[i].name, PLAYER_NAME_LENGTH - 1);
+            updates[count].name[PLAYER_NAME_LENGTH - 1] = '\0';
+            updates[count].wins = room->players[i].score;
+            count++;
         }
     }
+    pthread_mutex_unlock(&room->mutex);
+
+    if (count > 0)
+        scores_update(room->server, updates, count);
+}
+
+/* At shutdown: saves everyone still connected, waits for the worker to sync them, then folds the journal into scores.db */
+void scores_save(ServerState *server) {
+    if (serverConfig.replayPath)
+        return; //A replay must not overwrite the live scores
+
+    pthread_mutex_lock(&server->mutex);
+    for (SharedGameState *room = server->rooms; room; room = room->next)
+        scores_save_room(room);
+    pthread_mutex_unlock(&server->mutex);
+
+    scoreBoard *board = &server->scoreBoard;
+    pthread_mutex_lock(&board->scoreMutex);
+    bool running = persisting;
+    persistStopping = true;
+    pthread_cond_signal(&board->persistCond);
+    pthread_mutex_unlock(&board->scoreMutex);
+    if (running)
+        pthread_join(persistThread, NULL);      //The worker compacts on its way out
+
+    pthread_mutex_lock(&board->scoreMutex);
+    if (journalFD >= 0)
+    {
+        if (!running && (board->count > 0 || board->journalRecords > 0))
+            compact(board);
+        close(journalFD);
+        journalFD = -1;
+    }
+    pthread_mutex_unlock(&board->scoreMutex);
+}
+
+void scores_add_win(ServerState *server, const char *name) {
+    ScoreEntry update;
+    strncpy(update.name, name, PLAYER_NAME_LENGTH - 1);
+    update.name[PLAYER_NAME_LENGTH - 1] = '\0';
+
+    pthread_mutex_lock(&server->scoreBoard.scoreMutex);
+    const ScoreEntry *entry = lookupEntry(&server->scoreBoard, name);
+    update.wins = entry ? entry->wins + 1 : 1;
+    updateLocked(&server->scoreBoard, &update, 1);
+    pthread_mutex_unlock(&server->scoreBoard.scoreMutex);
+}
+
+int scores_get_wins(ServerState *server, const char *name) {
+    int wins = 0;
+    pthread_mutex_lock(&server->scoreBoard.scoreMutex);
+
+    const ScoreEntry *entry = lookupEntry(&server->scoreBoard, name);
+    if (entry)
+        wins = entry->wins;
 
-    pthread_mutex_unlock(&state->scoreBoard.scoreMutex);
+    pthread_mutex_unlock(&server->scoreBoard.scoreMutex);
     return wins;
 }
@@ -3,11 +3,24 @@
 
 #include "shared_state.h"
 
-void scores_init(SharedGameState *state);
-void scores_load(SharedGameState *state);
-void scores_save(SharedGameState *state);
-void scores_add_win(SharedGameState *state, const char *name);
-int scores_get_wins(SharedGameState *state, const char *name);
-void scores_print(SharedGameState *state);
+//Where a scores_for_each_chunk() walk is; zero it to start
+typedef struct {
+    uint64_t generation;
+    size_t next;
+    bool restarted;     // the last chunk began the walk again, drop what was visited
+} ScoreCursor;
+
+void scores_init(ServerState *server);
+void scores_load(ServerState *server);
+void scores_save(ServerState *server);
+void scores_save_room(SharedGameState *room);
+void scores_update(ServerState *server, const ScoreEntry *updates, int count);
+void scores_add_win(ServerState *server, const char *name);
+int scores_get_wins(ServerState *server, const char *name);
+void scores_print(ServerState *server);
+void scores_for_each(ServerState *server, void (*visit)(const ScoreEntry *entry, void *arg), void *arg);
+bool scores_for_each_chunk(ServerState *server, ScoreCursor *cursor, size_t limit,
+                           void (*visit)(const ScoreEntry *entry, void *arg), void *arg);
+size_t scores_count(ServerState *server);
 
 #endif
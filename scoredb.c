@@ -0,0 +1,210 @@
+#include "scoredb.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MIN_SLOTS 64
+
+uint64_t scoreNameHash(const char *name)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < PLAYER_NAME_LENGTH && name[i] != '\0'; i++)
+        hash = (hash ^ (unsigned char)name[i]) * 0x100000001b3ULL;
+    return hash;
+}
+
+static uint64_t headerChecksum(const ScoreFileHeader *header)
+{
+    const unsigned char *bytes = (const unsigned char *)header;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < offsetof(ScoreFileHeader, checksum); i++)
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    return hash;
+}
+
+/* Maps path read-only and checks the header; false (db left empty) when missing or unusable */
+bool scoreDbOpen(ScoreDatabase *db, const char *path)
+{
+    memset(db, 0, sizeof(*db));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        if (errno != ENOENT)
+            perror(path);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ScoreFileHeader))
+    {
+        fprintf(stderr, "%s: too short to be a score database, ignored\n", path);
+        close(fd);
+        return false;
+    }
+
+    //No MAP_POPULATE: pages are read the first time a lookup touches them
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        perror(path);
+        return false;
+    }
+
+    const ScoreFileHeader *header = map;
+    uint64_t slotCount = header->slotCount;
+    uint64_t count = header->entryCount;
+    bool valid = memcmp(header->magic, SCORE_DB_MAGIC, sizeof(header->magic)) == 0 &&
+                 header->checksum == headerChecksum(header) &&
+                 header->version == SCORE_DB_VERSION &&
+                 header->recordSize == sizeof(ScoreEntry) &&
+                 slotCount >= MIN_SLOTS && (slotCount & (slotCount - 1)) == 0 &&
+                 count * 2 <= slotCount && slotCount <= UINT32_MAX &&
+                 (uint64_t)st.st_size == sizeof(ScoreFileHeader) + slotCount * sizeof(uint32_t) + count * sizeof(ScoreEntry);
+    if (!valid)
+    {
+        fprintf(stderr, "%s: bad header, ignored\n", path);
+        munmap(map, (size_t)st.st_size);
+        return false;
+    }
+
+    db->map = map;
+    db->mapSize = (size_t)st.st_size;
+    db->slots = (const uint32_t *)((const unsigned char *)map + sizeof(ScoreFileHeader));
+    db->slotCount = slotCount;
+    db->entries = (const ScoreEntry *)(db->slots + slotCount);
+    db->count = count;
+    madvise(map, db->mapSize, MADV_RANDOM);
+    return true;
+}
+
+void scoreDbClose(ScoreDatabase *db)
+{
+    if (db->map)
+        munmap(db->map, db->mapSize);
+    memset(db, 0, sizeof(*db));
+}
+
+const ScoreEntry *scoreDbFind(const ScoreDatabase *db, const char *name)
+{
+    if (!db->map)
+        return NULL;
+
+    uint64_t mask = db->slotCount - 1;
+    //Bounded by slotCount so a damaged body cannot loop forever
+    for (uint64_t probe = 0, slot = scoreNameHash(name) & mask; probe < db->slotCount; probe++, slot = (slot + 1) & mask)
+    {
+        uint32_t index = db->slots[slot];
+        if (index == 0)
+            return NULL;
+        if (index > db->count)
+            continue;
+        const ScoreEntry *entry = &db->entries[index - 1];
+        if (strncmp(entry->name, name, PLAYER_NAME_LENGTH) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+static bool writeBlock(FILE *fp, const void *data, size_t len)
+{
+    return fwrite(data, 1, len, fp) == len;
+}
+
+/* fsyncs the directory holding path, which makes a rename into it durable */
+static bool syncParentDir(const char *path)
+{
+    char dir[256];
+    const char *slash = strrchr(path, '/');
+    if (!slash)
+        snprintf(dir, sizeof(dir), ".");
+    else
+        snprintf(dir, sizeof(dir), "%.*s", slash == path ? 1 : (int)(slash - path), path);
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+/* Writes count entries to path.tmp, syncs it, renames it over path and syncs the directory.
+ * Returns false unless the new file is durably in place */
+bool scoreDbWrite(const char *path, size_t count, ScoreDbSource source, void *arg)
+{
+    uint64_t slotCount = MIN_SLOTS;
+    while (slotCount < (uint64_t)count * 2)
+        slotCount *= 2;
+
+    uint32_t *slots = calloc(slotCount, sizeof(uint32_t));
+    if (!slots)
+    {
+        perror("scoreDbWrite: calloc");
+        return false;
+    }
+    uint64_t mask = slotCount - 1;
+    for (size_t i = 0; i < count; i++)
+    {
+        uint64_t slot = scoreNameHash(source(arg, i)->name) & mask;
+        while (slots[slot] != 0)
+            slot = (slot + 1) & mask;
+        slots[slot] = (uint32_t)(i + 1);
+    }
+
+    ScoreFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCORE_DB_MAGIC, sizeof(header.magic));
+    header.version = SCORE_DB_VERSION;
+    header.recordSize = sizeof(ScoreEntry);
+    header.entryCount = count;
+    header.slotCount = slotCount;
+    header.checksum = headerChecksum(&header);
+
+    char temp[256];
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    FILE *fp = fopen(temp, "wbe");
+    if (!fp)
+    {
+        perror(temp);
+        free(slots);
+        return false;
+    }
+    setvbuf(fp, NULL, _IOFBF, 1 << 16);
+
+    bool ok = writeBlock(fp, &header, sizeof(header)) && writeBlock(fp, slots, slotCount * sizeof(uint32_t));
+    free(slots);
+    for (size_t i = 0; ok && i < count; i++)
+    {
+        //Copied so the bytes after each name are always zero
+        ScoreEntry record;
+        memset(&record, 0, sizeof(record));
+        const ScoreEntry *entry = source(arg, i);
+        memcpy(record.name, entry->name, strnlen(entry->name, PLAYER_NAME_LENGTH - 1));
+        record.wins = entry->wins;
+        ok = writeBlock(fp, &record, sizeof(record));
+    }
+
+    ok = ok && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    if (fclose(fp) != 0)
+        ok = false;
+    if (!ok || rename(temp, path) != 0)
+    {
+        perror("scoreDbWrite");
+        unlink(temp);
+        return false;
+    }
+    //Until the directory is synced a crash may bring back the old scores.db
+    if (!syncParentDir(path))
+    {
+        perror("scoreDbWrite: syncing the directory");
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,54 @@
+#ifndef SCOREDB_H
+#define SCOREDB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "shared_state.h"
+
+/*
+ * scores.db: the saved scores in a form the server maps and reads in
+ * place, so startup costs the same for ten players or ten million.
+ *
+ *   ScoreFileHeader | uint32 slots[slotCount] | ScoreEntry entries[entryCount]
+ *
+ * slots is an open addressing (linear probing) index over the names,
+ * holding entry index + 1 with 0 for an empty slot, at most half full.
+ * Records are raw ScoreEntry structs in host byte order; the header
+ * records their size so a file from a different build is rejected
+ * rather than misread. Only the header is checksummed: checking the
+ * body would mean reading all of it at startup.
+ */
+
+#define SCORE_DB_MAGIC "MSCOREDB"
+#define SCORE_DB_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;        // sizeof(ScoreEntry)
+    uint64_t entryCount;
+    uint64_t slotCount;         // power of two
+    uint64_t checksum;          // FNV-1a of everything above
+} ScoreFileHeader;
+
+typedef struct {
+    void *map;
+    size_t mapSize;
+    const uint32_t *slots;
+    uint64_t slotCount;
+    const ScoreEntry *entries;
+    uint64_t count;
+} ScoreDatabase;
+
+//Hands scoreDbWrite() the entries to save, by index
+typedef const ScoreEntry *(*ScoreDbSource)(void *arg, size_t index);
+
+uint64_t scoreNameHash(const char *name);
+bool scoreDbOpen(ScoreDatabase *db, const char *path);
+void scoreDbClose(ScoreDatabase *db);
+const ScoreEntry *scoreDbFind(const ScoreDatabase *db, const char *name);
+bool scoreDbWrite(const char *path, size_t count, ScoreDbSource source, void *arg);
+
+#endif
@@ -1,44 +1,91 @@
+#define _GNU_SOURCE     //accept4()
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/ipc.h>
-#include <sys/shm.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/random.h>
+#include <sys/ioctl.h>
+#include <linux/net_tstamp.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <errno.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <unistd.h>
 #include <signal.h>
 #include <string.h>
+#include <time.h>
 
 #include "shared_state.h"
 #include "scheduler.h"
 #include "logger.h"
 #include "score.h"
 #include "game.h"
+#include "room.h"
+#include "protocol.h"
+#include "outbox.h"
+#include "config.h"
+#include "timer.h"
+#include "replay.h"
+#include "leaderboard.h"
+#include "latency.h"
+#include "metrics.h"
 
 #define SERVER_PORT 8080
-#define MAX_CLIENTS 4
-
-int sharedMemoryID;
-SharedGameState *gameState;
+#define LISTEN_BACKLOG SOMAXCONN
+#define MAX_EVENTS 256
+#define CLIENT_INBUF_SIZE 2048
+//A peer that vanished without a FIN is noticed after about a minute, by keepalive probes
+//while the connection is quiet or by TCP_USER_TIMEOUT when sent data goes unacknowledged
+#define KEEPALIVE_IDLE_SEC 30
+#define KEEPALIVE_INTERVAL_SEC 10
+#define KEEPALIVE_PROBES 3
+#define USER_TIMEOUT_MS 60000
+
+typedef enum {
+    SOURCE_LISTENER,
+    SOURCE_WAKEUP,
+    SOURCE_TIMER,
+    SOURCE_CLIENT
+} EventSourceType;
+
+/* Everything registered with epoll carries one of these in data.ptr */
+typedef struct {
+    EventSourceType type;
+    int fd;
+    int playerID;
+    SharedGameState *room;
+    bool binaryProtocol;
+    unsigned char inbuf[CLIENT_INBUF_SIZE];     // frames, or text up to the next newline, not yet handled
+    size_t inLen;
+    InputStamp input;           // the read being handled, see latency.h
+    Outbox outbox;
+    unsigned int connID;        // numbers the connection in recordings
+    FrameBuffer transcript;     // replays only: everything the connection was sent
+} EventSource;
+
+ServerState *serverState;
 volatile bool serverRunning = true;
 volatile sig_atomic_t shuttingDown = 0;
+volatile sig_atomic_t latencyDumpRequested = 0;
 
-pid_t childsPID[MAX_CLIENTS];
-int childCount = 0;
+int epollFD = -1;
+int wakeupFD = -1;
+int timerFD = -1;
 pthread_t loggerThread;
-pthread_t gameThread;
-pthread_t schedulerThread;
 
 int setupServerSocket()
 {
     int server_fd;
     struct sockaddr_in address;
 
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    //Close-on-exec, like every other descriptor, so the gzip the log rotation spawns holds no sockets
+    server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (server_fd < 0)
     {
         perror("Socket failed");
@@ -58,7 +105,13 @@ int setupServerSocket()
         exit(1);
     }
 
-    if (listen(server_fd, MAX_CLIENTS) < 0)
+    if (fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL, 0) | O_NONBLOCK) < 0)
+    {
+        perror("fcntl failed");
+        exit(1);
+    }
+
+    if (listen(server_fd, LISTEN_BACKLOG) < 0)
     {
         perror("Listen failed");
         exit(1);
@@ -68,164 +121,118 @@ int setupServerSocket()
     return server_fd;
 }
 
-void cleanup(int sig)
+void wakeupEventLoop()
 {
-    if (shuttingDown)
+    uint64_t one = 1;
+    if (wakeupFD >= 0)
+        write(wakeupFD, &one, sizeof(one));
+}
+
+void handleSignal(int sig)
+{
+    if (sig == SIGUSR1)
+    {
+        latencyDumpRequested = 1;
+        wakeupEventLoop();
         return;
+    }
     shuttingDown = 1;
     serverRunning = false;
+    wakeupEventLoop();
+}
 
-    if (!gameState)
-    {
-        printf("\nShutting down server...\n");
-        fflush(stdout);
-        exit(0);
-    }
+void cleanup()
+{
+    pushLogEvent(serverState, LOG_SERVER, LOGEV_SERVER_STOPPING, -1, NULL, 0);
 
-    pushLogEvent(gameState, LOG_SERVER, "Server shutting down.\n");
+    printf("Syncing scores.journal and compacting it into scores.db...\n");
+    fflush(stdout);
+    scores_save(serverState);
 
-    sem_post(&gameState->turnCompleteSemaphore);
-    sem_post(&gameState->turnSemaphore);
-    sem_post(&gameState->flipDoneSemaphore);
-    sem_post(&gameState->logReadySemaphore);
-    sem_post(&gameState->logItemsSemaphore);
-    sem_post(&gameState->logSpacesSemaphore);
+    stopMetricsServer();
+    destroyAllRooms(serverState);
+    close(epollFD);
+    close(wakeupFD);
+    timerQueueDestroy();
+    replayStopRecording();
 
-    pthread_join(gameThread, NULL);
+    sem_post(&serverState->logReadySemaphore);
+    sem_post(&serverState->logItemsSemaphore);
     pthread_join(loggerThread, NULL);
-    pthread_join(schedulerThread, NULL);
 
-    for (int i = 0; i < childCount; i++)
-        kill(childsPID[i], SIGTERM);
-
-    printf("Saving scores to scores.txt...\n");
-    fflush(stdout);
-    scores_save(gameState);
+    sem_destroy(&serverState->logReadySemaphore);
+    sem_destroy(&serverState->logItemsSemaphore);
 
-    sem_destroy(&gameState->turnSemaphore);
-    sem_destroy(&gameState->turnCompleteSemaphore);
-    sem_destroy(&gameState->logReadySemaphore);
-    sem_destroy(&gameState->logItemsSemaphore);
-    sem_destroy(&gameState->logSpacesSemaphore);
-
-    pthread_mutex_destroy(&gameState->mutex);
-    pthread_mutex_destroy(&gameState->logQueueMutex);
-
-    shmdt(gameState);
-    if (sharedMemoryID > 0)
-        shmctl(sharedMemoryID, IPC_RMID, NULL);
+    pthread_mutex_destroy(&serverState->mutex);
+    free(serverState);
 
     printf("Server shutdown complete.\n");
     exit(0);
 }
 
-void markPlayerDisconnected(SharedGameState *gameState, int playerID)
+/* BOARD <rows>x<cols> between games: the room deals boards of that size from now on, and everyone READYs again */
+void changeBoardSize(SharedGameState *gameState, int playerID, const char *size)
 {
-    pthread_mutex_lock(&gameState->mutex);
-    char msg[LOG_MSG_LENGTH];
-
-    gameState->players[playerID].connected = false;
-    gameState->players[playerID].readyToStart = false;
-    gameState->players[playerID].name[0] = '\0';
-
-    gameState->playerCount--;
-
-    snprintf(msg, LOG_MSG_LENGTH, "Player %d disconnected\n", playerID);
-    pushLogEvent(gameState, LOG_PLAYER, msg);
-    bool gameRunning = gameState->gameStarted;
-    if (gameRunning)
+    Player *player = &gameState->players[playerID];
+    int rows, cols;
+    char tail;
+    if (sscanf(size, "%dx%d%c", &rows, &cols, &tail) != 2 || !boardSizeValid(rows, cols))
     {
-        gameState->gameStarted = false;
-        gameState->currentTurn = -1;
-        resetGameState(gameState);
+        char text[128];
+        snprintf(text, sizeof(text), "Board must be ROWSxCOLS, each 1 to %d, with an even number of cards.\n", MAX_BOARD_SIDE);
+        sendPlayerError(player, ERR_ROOM, text);
+        return;
     }
-    gameState->boardNeedsBroadcast = true;
-    for (int i = 0; i < MAX_PLAYERS; i++)
+    //A text player would be sent the whole of such a board at every game start
+    if (!player->binaryProtocol && rows * cols > TEXT_BOARD_MAX_CARDS)
     {
-        if (gameState->players[i].connected)
-        {
-            gameState->players[i].readyToStart = false;
-            gameState->players[i].waitingNotified = false;
-            gameState->players[i].flipsDone = 0;
-            gameState->players[i].firstFlipIndex = -1;
-            gameState->players[i].secondFlipIndex = -1;
-        }
+        char text[128];
+        snprintf(text, sizeof(text), "Text clients can pick boards of up to %d cards; bigger ones need the binary protocol.\n",
+                 TEXT_BOARD_MAX_CARDS);
+        sendPlayerError(player, ERR_ROOM, text);
+        return;
     }
 
-    pthread_mutex_unlock(&gameState->mutex);
-
-    char notify[512];
-    char list[128];
-    int pos = 0;
-    pos += snprintf(list + pos, sizeof(list) - pos, "Connected players: ");
-    for (int i = 0; i < MAX_PLAYERS; i++)
-    {
-        if (gameState->players[i].connected)
-        {
-            pos += snprintf(list + pos, sizeof(list) - pos, "%d ", i);
-        }
-    }
-    char scoreMsg[256];
-    scoreMsg[0] = '\0';
     pthread_mutex_lock(&gameState->mutex);
-    strncat(scoreMsg, "Scoreboard:\n", sizeof(scoreMsg) - strlen(scoreMsg) - 1);
-    for (int i = 0; i < MAX_PLAYERS; i++)
+    if (gameState->gameStarted)
     {
-        if (gameState->players[i].connected)
-        {
-            const char *name = gameState->players[i].name[0] ? gameState->players[i].name : "Unknown";
-            char line[64];
-            snprintf(line, sizeof(line), "%s (ID %d): %d\n", name, i, gameState->players[i].score);
-            strncat(scoreMsg, line, sizeof(scoreMsg) - strlen(scoreMsg) - 1);
-        }
+        pthread_mutex_unlock(&gameState->mutex);
+        sendPlayerError(player, ERR_ROOM, "Cannot change the board during a game.\n");
+        return;
     }
-    pthread_mutex_unlock(&gameState->mutex);
-
-    snprintf(notify, sizeof(notify),"GAME_STOPPED\nPlayer %d left the game.\n%s\n%sPlease type 1 to READY.\n<<END>>\n",playerID,list,scoreMsg);
-
-    for (int i = 0; i < MAX_PLAYERS; i++)
+    //Asking for the size already set changes nothing, so players who READY'd stay ready
+    if (rows == gameState->boardRows && cols == gameState->boardCols)
     {
-        if (gameState->players[i].connected)
-        {
-            send(gameState->players[i].socket,
-                 notify,
-                 strlen(notify), 0);
-        }
+        sendBoardSize(player, rows, cols);
+        pthread_mutex_unlock(&gameState->mutex);
+        return;
     }
 
-    printf("Game stopped. Player %d left. Waiting for players...\n", playerID);
-
-    sem_post(&gameState->turnCompleteSemaphore);
-    sem_post(&gameState->flipDoneSemaphore);
-
-    int connectedCount = 0;
-    int readyCount = 0;
-
+    resizeBoardLocked(gameState, rows, cols);
+    resetGameState(gameState);      //Deals the new board and clears everyone's READY
+    char notify[128];
+    snprintf(notify, sizeof(notify), "Player %d set the board to %dx%d. Please type 1 to READY.\n", playerID, rows, cols);
     for (int i = 0; i < MAX_PLAYERS; i++)
     {
-        if (gameState->players[i].connected)
+        if (gameState->players[i].connected && !gameState->players[i].away)
         {
-            connectedCount++;
-            if (gameState->players[i].readyToStart)
-            {
-                readyCount++;
-            }
+            sendBoardSize(&gameState->players[i], rows, cols);
+            sendPlayerMessage(&gameState->players[i], MSG_INFO, "", notify);
         }
     }
+    pthread_mutex_unlock(&gameState->mutex);
 
-    if (!gameState->gameStarted && connectedCount >= MIN_PLAYERS && readyCount == connectedCount)
-    {
-        gameState->gameStarted = true;
-
-        pushLogEvent(gameState, LOG_PLAYER, "All remaining players ready. Game started.\n");
-    }
+    pushRoomLogEvent(gameState, LOG_PLAYER, LOGEV_BOARD_SIZE, playerID, NULL, 2, rows, cols);
 }
 
-void pushClientCommand(SharedGameState *gameState, int playerID, char *buffer)
+void pushClientCommand(SharedGameState *gameState, int playerID, char *buffer, InputStamp input)
 {
+    uint64_t commandNs = latencyNow();
     pthread_mutex_lock(&gameState->mutex);
     buffer[strcspn(buffer, "\r\n")] = 0;
     bool gameStarted = gameState->gameStarted;
+    if (!gameStarted)
+        touchLobbyLocked(gameState);
     pthread_mutex_unlock(&gameState->mutex);
 
     int connectedCount = 0;
@@ -240,9 +247,7 @@ void pushClientCommand(SharedGameState *gameState, int playerID, char *buffer)
             gameState->players[playerID].waitingNotified = false;
             pthread_mutex_unlock(&gameState->mutex);
 
-            char msg[LOG_MSG_LENGTH];
-            snprintf(msg, LOG_MSG_LENGTH,"Player %d is READY\n",playerID);
-            pushLogEvent(gameState, LOG_PLAYER, msg);
+            pushRoomLogEvent(gameState, LOG_PLAYER, LOGEV_PLAYER_READY, playerID, NULL, 0);
         }
 
         if (!gameState->gameStarted)
@@ -268,7 +273,10 @@ void pushClientCommand(SharedGameState *gameState, int playerID, char *buffer)
         {
             pthread_mutex_lock(&gameState->mutex);
             gameState->gameStarted = true;
+            touchLobbyLocked(gameState);
             pthread_mutex_unlock(&gameState->mutex);
+            metricsAdd(METRIC_GAMES_STARTED, 1);
+            syncRoomGame(gameState);
         }
     }
 
@@ -277,27 +285,12 @@ void pushClientCommand(SharedGameState *gameState, int playerID, char *buffer)
         char name[PLAYER_NAME_LENGTH];
         if (sscanf(buffer + 5, "%31s", name) == 1)
         {
-            pthread_mutex_lock(&gameState->mutex);
-            bool nameTaken = false;
-            for (int i = 0; i < MAX_PLAYERS; i++)
-            {
-                if (gameState->players[i].connected &&
-                    gameState->players[i].name[0] != '\0' &&
-                    strncmp(gameState->players[i].name, name, PLAYER_NAME_LENGTH) == 0)
-                {
-                    nameTaken = true;
-                    break;
-                }
-            }
-            pthread_mutex_unlock(&gameState->mutex);
+            bool nameTaken = roomNameTaken(gameState->server, name);
 
             if (nameTaken)
             {
-                char logMsg[LOG_MSG_LENGTH];
-                snprintf(logMsg, LOG_MSG_LENGTH,"Player %d tried duplicate name: %s\n",playerID,name);
-                pushLogEvent(gameState, LOG_PLAYER, logMsg);
-                const char *errMsg = "NAME_TAKEN\n<<END>>\n";
-                send(gameState->players[playerID].socket, errMsg, strlen(errMsg), 0);
+                pushRoomLogEvent(gameState, LOG_PLAYER, LOGEV_NAME_TAKEN, playerID, name, 0);
+                sendPlayerMessage(&gameState->players[playerID], MSG_NAME_TAKEN, "NAME_TAKEN\n", "");
                 return;
             }
 
@@ -306,22 +299,45 @@ void pushClientCommand(SharedGameState *gameState, int playerID, char *buffer)
             gameState->players[playerID].name[PLAYER_NAME_LENGTH - 1] = '\0';
             pthread_mutex_unlock(&gameState->mutex);
 
-            int savedScore = scores_get_wins(gameState, name);
+            int savedScore = scores_get_wins(gameState->server, name);
             pthread_mutex_lock(&gameState->mutex);
             gameState->players[playerID].score = savedScore;
             gameState->players[playerID].roundScore = 0;
+            gameState->stateVersion++;
             pthread_mutex_unlock(&gameState->mutex);
-            char msg[128];
-            snprintf(msg, sizeof(msg), "WELCOME %s (Saved Score: %d)\n<<END>>\n", name, savedScore);
-            send(gameState->players[playerID].socket, msg, strlen(msg), 0);
 
-            char logMsg[LOG_MSG_LENGTH];
-            snprintf(logMsg, LOG_MSG_LENGTH,"Player %d registered name: %s (Score %d)\n",playerID,name,savedScore);
-            pushLogEvent(gameState, LOG_PLAYER, logMsg);
+            char token[RECONNECT_TOKEN_LENGTH];
+            issueReconnectToken(gameState, playerID, token);
+            if (gameState->players[playerID].binaryProtocol)
+            {
+                FrameBuffer fb;
+                frameBufferInit(&fb);
+                frameBegin(&fb, MSG_WELCOME);
+                framePutI32(&fb, savedScore);
+                framePutString(&fb, name);
+                framePutString(&fb, token);
+                frameEnd(&fb);
+                sendToPlayer(&gameState->players[playerID], fb.data, fb.len, OUT_CONTROL);
+                frameBufferFree(&fb);
+            }
+            else
+            {
+                char msg[160];
+                snprintf(msg, sizeof(msg), "WELCOME %s (Saved Score: %d)\nRECONNECT %s\n<<END>>\n", name, savedScore, token);
+                sendToPlayer(&gameState->players[playerID], msg, strlen(msg), OUT_CONTROL);
+            }
+
+            pushRoomLogEvent(gameState, LOG_PLAYER, LOGEV_NAME_REGISTERED, playerID, name, 1, savedScore);
         }
         return;
     }
 
+    if (strncmp(buffer, "BOARD ", 6) == 0)
+    {
+        changeBoardSize(gameState, playerID, buffer + 6);
+        return;
+    }
+
     int cardIndex;
 
     if (gameStarted && sscanf(buffer, "%d", &cardIndex) == 1)
@@ -330,36 +346,47 @@ void pushClientCommand(SharedGameState *gameState, int playerID, char *buffer)
         int maxCards = gameState->boardRows * gameState->boardCols;
         bool gameStarted = gameState->gameStarted;
         int currentTurn = gameState->currentTurn;
-        int socket = gameState->players[playerID].socket;
-        Card *cards = gameState->cards;
+        Player *player = &gameState->players[playerID];
         pthread_mutex_unlock(&gameState->mutex);
         if (cardIndex < 0 || cardIndex >= maxCards)
         {
-            const char *msg = "Invalid card index!\n<<END>>\n";
-            send(socket, msg, strlen(msg), 0);
+            sendPlayerError(player, ERR_INVALID_INDEX, "Invalid card index!\n");
             return;
         }
         if (currentTurn != playerID)
         {
-            const char *msg = "It's not your turn!\n<<END>>\n";
-            send(socket, msg, strlen(msg), 0);
+            sendPlayerError(player, ERR_NOT_YOUR_TURN, "It's not your turn!\n");
             return;
         }
         pthread_mutex_lock(&gameState->mutex);
 
+        if (gameState->turnExpired)
+        {
+            pthread_mutex_unlock(&gameState->mutex);
+            sendPlayerError(player, ERR_NOT_YOUR_TURN, "Your turn timed out!\n");
+            return;
+        }
+
+        //Both cards are already up; the pair is being resolved
+        if (gameState->players[playerID].flipsDone >= 2)
+        {
+            pthread_mutex_unlock(&gameState->mutex);
+            sendPlayerError(player, ERR_NOT_YOUR_TURN, "Wait for the next turn!\n");
+            return;
+        }
+
         if (gameState->players[playerID].flipsDone == 1 &&
             gameState->players[playerID].firstFlipIndex == cardIndex)
         {
             pthread_mutex_unlock(&gameState->mutex);
-            send(socket, "You cannot pick the same card twice!\n<<END>>\n", 46, 0);
+            sendPlayerError(player, ERR_SAME_CARD, "You cannot pick the same card twice!\n");
             return;
         }
 
-        if (cards[cardIndex].isMatched || cards[cardIndex].isFlipped)
+        if (cardFaceUp(&gameState->cards, cardIndex))
         {
             pthread_mutex_unlock(&gameState->mutex);
-            const char *msg = "Card already matched or flipped!\n<<END>>\n";
-            send(socket, msg, strlen(msg), 0);
+            sendPlayerError(player, ERR_ALREADY_FLIPPED, "Card already matched or flipped!\n");
             return;
         }
         pthread_mutex_unlock(&gameState->mutex);
@@ -368,7 +395,6 @@ void pushClientCommand(SharedGameState *gameState, int playerID, char *buffer)
         gameState->players[playerID].pendingAction = true;
         pthread_mutex_unlock(&gameState->mutex);
 
-        char msg[LOG_MSG_LENGTH];
         if (gameStarted)
         {
             pthread_mutex_lock(&gameState->mutex);
@@ -385,242 +411,1118 @@ void pushClientCommand(SharedGameState *gameState, int playerID, char *buffer)
                 gameState->players[playerID].secondFlipIndex = cardIndex;
                 gameState->players[playerID].flipsDone = 2;
             }
+            gameState->flipArrivedNs = input.arrivedNs ? input.arrivedNs : input.readNs;
             pthread_mutex_unlock(&gameState->mutex);
-            sem_post(&gameState->flipDoneSemaphore);
+            if (input.readNs)
+                latencyRecord(LAT_RECV_COMMAND, commandNs - input.readNs);
+            latencySince(LAT_COMMAND_CHECK, commandNs);
+            metricsAdd(METRIC_FLIPS, 1);
+
+            printf("Player flipped done: %d\n", gameState->players[playerID].flipsDone);
+            pushRoomLogEvent(gameState, LOG_PLAYER, LOGEV_FLIP_REQUEST, playerID, NULL, 1, cardIndex);
+            handleFlip(gameState);
         }
+    }
+}
+
+void notifyWaitingPlayers(SharedGameState *gameState)
+{
+    pthread_mutex_lock(&gameState->mutex);
+    bool started = gameState->gameStarted;
+    pthread_mutex_unlock(&gameState->mutex);
+
+    if (started)
+        return;
+
+    for (int p = 0; p < MAX_PLAYERS; p++)
+    {
+        pthread_mutex_lock(&gameState->mutex);
+        bool pending = gameState->players[p].connected &&
+                       gameState->players[p].readyToStart &&
+                       !gameState->players[p].waitingNotified;
+        pthread_mutex_unlock(&gameState->mutex);
+
+        if (!pending)
+            continue;
+
+        char waitMsg[1024];
+        pthread_mutex_lock(&gameState->mutex);
+        const RenderCache *render = renderedStateLocked(gameState);
+        snprintf(waitMsg, sizeof(waitMsg),"Waiting for other players to connect/ready...\n%s",render->scoreText);
+        gameState->players[p].waitingNotified = true;
+        pthread_mutex_unlock(&gameState->mutex);
+        sendPlayerMessage(&gameState->players[p], MSG_INFO, "", waitMsg);
+    }
+}
 
-        printf("Player flipped done: %d\n", gameState->players[playerID].flipsDone);
+/* Gives up the client's seat; nothing more is queued for it afterwards */
+void releaseClientSeat(ServerState *server, EventSource *client)
+{
+    //A connection whose seat was taken over by REJOIN has none left
+    if (!client->room)
+        return;
+    markPlayerDisconnected(client->room, client->playerID);
+    releaseRoomIfEmpty(server, client->room);
+    client->room = NULL;
+}
+
+void recordClientDisconnect(EventSource *client)
+{
+    pthread_mutex_lock(&client->outbox.mutex);
+    uint64_t sentBytes = client->outbox.sentBytes;
+    uint64_t sentDigest = client->outbox.sentDigest;
+    pthread_mutex_unlock(&client->outbox.mutex);
+    replayRecordDisconnect(client->connID, sentBytes, sentDigest);
+}
+
+void closeClient(ServerState *server, EventSource *client)
+{
+    epoll_ctl(epollFD, EPOLL_CTL_DEL, client->fd, NULL);
+    releaseClientSeat(server, client);
+    recordClientDisconnect(client);
+    close(client->fd);
+    metricsAdd(METRIC_CONNECTIONS_CLOSED, 1);
+    outboxDestroy(&client->outbox);
+    free(client);
+}
 
-        snprintf(msg, LOG_MSG_LENGTH,"Player %d flipped card %d\n",playerID,cardIndex);
+/* MSG_BOARD_SIZE for the client's room; binary clients get it after MSG_HELLO and every MSG_ROOM_JOINED */
+void sendRoomBoardSize(EventSource *client)
+{
+    pthread_mutex_lock(&client->room->mutex);
+    int rows = client->room->boardRows;
+    int cols = client->room->boardCols;
+    pthread_mutex_unlock(&client->room->mutex);
+
+    FrameBuffer fb;
+    frameBufferInit(&fb);
+    frameBegin(&fb, MSG_BOARD_SIZE);
+    framePutU16(&fb, (uint16_t)rows);
+    framePutU16(&fb, (uint16_t)cols);
+    frameEnd(&fb);
+    outboxSend(&client->outbox, fb.data, fb.len, OUT_CONTROL);
+    frameBufferFree(&fb);
+}
 
-        pushLogEvent(gameState, LOG_PLAYER, msg);
+void sendRoomJoined(EventSource *client)
+{
+    if (client->binaryProtocol)
+    {
+        FrameBuffer fb;
+        frameBufferInit(&fb);
+        frameBegin(&fb, MSG_ROOM_JOINED);
+        framePutU32(&fb, (uint32_t)client->room->roomID);
+        framePutU8(&fb, (uint8_t)client->playerID);
+        framePutString(&fb, client->room->roomName);
+        frameEnd(&fb);
+        outboxSend(&client->outbox, fb.data, fb.len, OUT_CONTROL);
+        frameBufferFree(&fb);
+        sendRoomBoardSize(client);
+        return;
     }
+
+    pthread_mutex_lock(&client->room->mutex);
+    int rows = client->room->boardRows;
+    int cols = client->room->boardCols;
+    pthread_mutex_unlock(&client->room->mutex);
+
+    char msg[192];
+    snprintf(msg, sizeof(msg), "JOINED ROOM %d (%s)\nPLAYER ID %d\nBOARD %dx%d\n<<END>>\n",
+             client->room->roomID, client->room->roomName, client->playerID, rows, cols);
+    outboxSend(&client->outbox, msg, strlen(msg), OUT_CONTROL);
 }
 
-void handleTCPClient(int sock, SharedGameState *gameState, int myPlayerID)
+void sendRoomError(EventSource *client, const char *text)
 {
-    char buffer[128];
-    char msg[128];
-    snprintf(msg, sizeof(msg), "Successful connect to Server\nPLAYER ID %d\n<<END>>\n", myPlayerID);
-    send(sock, msg, strlen(msg), 0);
+    if (client->binaryProtocol)
+    {
+        FrameBuffer fb;
+        frameBufferInit(&fb);
+        frameBegin(&fb, MSG_ERROR);
+        framePutU8(&fb, ERR_ROOM);
+        framePutBytes(&fb, text, strlen(text));
+        frameEnd(&fb);
+        outboxSend(&client->outbox, fb.data, fb.len, OUT_CONTROL);
+        frameBufferFree(&fb);
+        return;
+    }
 
-    bool sentWaiting = false;
+    char msg[256];
+    snprintf(msg, sizeof(msg), "ROOM_ERROR %s<<END>>\n", text);
+    outboxSend(&client->outbox, msg, strlen(msg), OUT_CONTROL);
+}
 
-    while (1)
+void sendRoomList(ServerState *server, EventSource *client)
+{
+    if (client->binaryProtocol)
     {
-        fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(sock, &readfds);
+        FrameBuffer fb;
+        frameBufferInit(&fb);
+        encodeRoomList(server, &fb);
+        outboxSend(&client->outbox, fb.data, fb.len, OUT_BULK);
+        frameBufferFree(&fb);
+        return;
+    }
 
-        struct timeval tv;
-        tv.tv_sec = 0;
-        tv.tv_usec = 200000;
+    char *reply = formatRoomList(server, "<<END>>\n");
+    outboxSend(&client->outbox, reply, strlen(reply), OUT_BULK);
+    free(reply);
+}
 
-        int rv = select(sock + 1, &readfds, NULL, NULL, &tv);
+/* Moves a client into another room, carrying its registered name and score with it */
+bool moveClientToRoom(ServerState *server, EventSource *client, SharedGameState *target)
+{
+    int seat = joinRoom(target, client->fd, &client->outbox);
+    if (seat < 0)
+        return false;
+
+    SharedGameState *previous = client->room;
+    int previousID = client->playerID;
+
+    pthread_mutex_lock(&previous->mutex);
+    char name[PLAYER_NAME_LENGTH];
+    snprintf(name, sizeof(name), "%s", previous->players[previousID].name);
+    char token[RECONNECT_TOKEN_LENGTH];
+    memcpy(token, previous->players[previousID].reconnectToken, RECONNECT_TOKEN_LENGTH);
+    int score = previous->players[previousID].score;
+    bool binaryProtocol = previous->players[previousID].binaryProtocol;
+    pthread_mutex_unlock(&previous->mutex);
+
+    markPlayerDisconnected(previous, previousID);
+    releaseRoomIfEmpty(server, previous);
+
+    pthread_mutex_lock(&target->mutex);
+    snprintf(target->players[seat].name, PLAYER_NAME_LENGTH, "%s", name);
+    memcpy(target->players[seat].reconnectToken, token, RECONNECT_TOKEN_LENGTH);
+    target->players[seat].score = score;
+    target->players[seat].binaryProtocol = binaryProtocol;
+    target->stateVersion++;
+    pthread_mutex_unlock(&target->mutex);
+
+    client->room = target;
+    client->playerID = seat;
+
+    pushRoomLogEvent(target, LOG_PLAYER, LOGEV_PLAYER_JOINED, seat, name, 0);
+    sendRoomJoined(client);
+    return true;
+}
 
-        if (rv > 0 && FD_ISSET(sock, &readfds))
-        {
-            memset(buffer, 0, sizeof(buffer));
-            int bytes = recv(sock, buffer, sizeof(buffer) - 1, 0);
+/* REJOIN <token>: the client takes back the seat it held when its last connection dropped */
+bool rejoinHeldSeat(ServerState *server, EventSource *client, const char *token)
+{
+    int seat;
+    Outbox *displaced;
+    SharedGameState *target = claimHeldSeat(server, token, client->fd, &client->outbox, client->binaryProtocol,
+                                            &seat, &displaced);
+    if (!target)
+        return false;
+
+    //The seat's old connection never told us it was gone: it keeps nothing and is hung up on,
+    //and closing it later finds no seat to give up
+    if (displaced)
+    {
+        EventSource *stale = displaced->epollTag;
+        stale->room = NULL;
+        if (stale->fd >= 0)
+            shutdown(stale->fd, SHUT_RDWR);
+    }
 
-            if (bytes <= 0)
-            {
-                markPlayerDisconnected(gameState, myPlayerID);
-                break;
-            }
+    SharedGameState *previous = client->room;
+    int previousID = client->playerID;
+    markPlayerDisconnected(previous, previousID);
+    releaseRoomIfEmpty(server, previous);
 
-            buffer[bytes] = '\0';
-            char *saveptr = NULL;
-            char *line = strtok_r(buffer, "\n", &saveptr);
-            while (line)
-            {
-                //Remove /r
-                line[strcspn(line, "\r")] = 0;
-                if (line[0] != '\0')
-                {
-                    pushClientCommand(gameState, myPlayerID, line);
-                }
-                line = strtok_r(NULL, "\n", &saveptr);
-            }
-        }
+    client->room = target;
+    client->playerID = seat;
 
-        pthread_mutex_lock(&gameState->mutex);
-        bool iAmReady = gameState->players[myPlayerID].readyToStart;
-        bool started = gameState->gameStarted;
-        int matched = gameState->matchedPaires;
-        pthread_mutex_unlock(&gameState->mutex);
+    pthread_mutex_lock(&target->mutex);
+    char name[PLAYER_NAME_LENGTH];
+    snprintf(name, sizeof(name), "%s", target->players[seat].name);
+    pthread_mutex_unlock(&target->mutex);
+
+    pushRoomLogEvent(target, LOG_PLAYER, LOGEV_PLAYER_REJOINED, seat, name, 0);
+    sendRoomJoined(client);
+
+    //Whatever happened while away is covered by a fresh copy of the board
+    if (client->binaryProtocol)
+    {
+        sendBoardSnapshot(target, seat);
+    }
+    else
+    {
+        pthread_mutex_lock(&target->mutex);
+        const RenderCache *render = renderedBoardLocked(target);
+        outboxSend(&client->outbox, render->fullText, strlen(render->fullText), OUT_BULK);
+        pthread_mutex_unlock(&target->mutex);
+    }
 
-        if (iAmReady && !started && !gameState->players[myPlayerID].waitingNotified)
+    char notify[64];
+    snprintf(notify, sizeof(notify), "Player %d is back.\n", seat);
+    pthread_mutex_lock(&target->mutex);
+    for (int i = 0; i < MAX_PLAYERS; i++)
+    {
+        if (i != seat && target->players[i].connected && !target->players[i].away)
+            sendPlayerMessage(&target->players[i], MSG_INFO, "", notify);
+    }
+    pthread_mutex_unlock(&target->mutex);
+    return true;
+}
+
+void sendLeaderboard(EventSource *client, const LeaderboardView *view, const char *name)
+{
+    if (client->binaryProtocol)
+    {
+        FrameBuffer fb;
+        frameBufferInit(&fb);
+        encodeLeaderboard(view, &fb);
+        outboxSend(&client->outbox, fb.data, fb.len, OUT_BULK);
+        frameBufferFree(&fb);
+        return;
+    }
+
+    char reply[LEADERBOARD_MAX_ROWS * (PLAYER_NAME_LENGTH + 24) + 128];
+    formatLeaderboard(view, name, reply, sizeof(reply) - 8);
+    strcat(reply, "<<END>>\n");
+    outboxSend(&client->outbox, reply, strlen(reply), OUT_BULK);
+}
+
+/* TOP [count] and RANK [name]; RANK without a name ranks the asking player */
+bool handleLeaderboardCommand(EventSource *client, const char *line)
+{
+    bool isTop = strncmp(line, "TOP", 3) == 0 && (line[3] == ' ' || line[3] == '\0');
+    bool isRank = strncmp(line, "RANK", 4) == 0 && (line[4] == ' ' || line[4] == '\0');
+    if (!isTop && !isRank)
+        return false;
+
+    LeaderboardView view;
+    bool answered;
+    char name[PLAYER_NAME_LENGTH] = "";
+    if (isTop)
+    {
+        int count = LEADERBOARD_DEFAULT_ROWS;
+        if (sscanf(line + 3, "%d", &count) != 1 || count < 1)
+            count = LEADERBOARD_DEFAULT_ROWS;
+        answered = leaderboardTop(count, &view);
+    }
+    else
+    {
+        if (sscanf(line + 4, "%31s", name) != 1)
         {
-            char scoreMsg[256];
-            char waitMsg[512];
-            scoreMsg[0] = '\0';
-            pthread_mutex_lock(&gameState->mutex);
-            strncat(scoreMsg, "Scoreboard:\n", sizeof(scoreMsg) - strlen(scoreMsg) - 1);
-            for (int i = 0; i < MAX_PLAYERS; i++)
-            {
-                if (gameState->players[i].connected)
-                {
-                    const char *name = gameState->players[i].name[0] ? gameState->players[i].name : "Unknown";
-                    char line[128];
-                    snprintf(line, sizeof(line), "%s (ID %d): Total Score %d | Score This Round %d\n",name,i,gameState->players[i].score,gameState->players[i].roundScore);
-                    strncat(scoreMsg, line, sizeof(scoreMsg) - strlen(scoreMsg) - 1);
-                }
-            }
-            pthread_mutex_unlock(&gameState->mutex);
-            snprintf(waitMsg, sizeof(waitMsg),"Waiting for other players to connect/ready...\n%s<<END>>\n",scoreMsg);
-            send(sock, waitMsg, strlen(waitMsg), 0);
-            gameState->players[myPlayerID].waitingNotified = true;
+            pthread_mutex_lock(&client->room->mutex);
+            strncpy(name, client->room->players[client->playerID].name, PLAYER_NAME_LENGTH - 1);
+            pthread_mutex_unlock(&client->room->mutex);
+        }
+        if (name[0] == '\0')
+        {
+            sendRoomError(client, "RANK needs a name until you have registered one.\n");
+            return true;
         }
+        answered = leaderboardAround(name, LEADERBOARD_AROUND, &view);
+    }
 
-        if (started)
+    if (!answered)
+    {
+        sendRoomError(client, "Leaderboard is still loading, try again shortly.\n");
+        return true;
+    }
+    sendLeaderboard(client, &view, isRank ? name : NULL);
+    return true;
+}
+
+/* Room commands (ROOMS, CREATE <name>, JOIN <id>, REJOIN <token>) are handled here before game commands */
+bool handleRoomCommand(ServerState *server, EventSource *client, const char *line)
+{
+    if (strcmp(line, "ROOMS") == 0)
+    {
+        sendRoomList(server, client);
+        return true;
+    }
+
+    bool isCreate = strncmp(line, "CREATE", 6) == 0 && (line[6] == ' ' || line[6] == '\0');
+    bool isJoin = strncmp(line, "JOIN ", 5) == 0;
+    bool isRejoin = strncmp(line, "REJOIN ", 7) == 0;
+    if (!isCreate && !isJoin && !isRejoin)
+        return false;
+
+    pthread_mutex_lock(&client->room->mutex);
+    bool playing = client->room->gameStarted;
+    pthread_mutex_unlock(&client->room->mutex);
+    if (playing)
+    {
+        sendRoomError(client, "Cannot change room during a game.\n");
+        return true;
+    }
+
+    if (isRejoin)
+    {
+        char token[RECONNECT_TOKEN_LENGTH] = "";
+        sscanf(line + 7, "%16s", token);
+        if (token[0] == '\0' || !rejoinHeldSeat(server, client, token))
+            sendRoomError(client, "No seat is being held for that token.\n");
+        return true;
+    }
+
+    if (isCreate)
+    {
+        char name[ROOM_NAME_LENGTH] = "";
+        sscanf(line + 6, "%31s", name);
+        SharedGameState *room = createRoom(server, name);
+        if (!room || !moveClientToRoom(server, client, room))
         {
-            sentWaiting = true;
+            sendRoomError(client, "Could not create room.\n");
+            if (room)
+                releaseRoomIfEmpty(server, room);
         }
+        return true;
     }
 
-    close(sock);
+    int roomID;
+    char reply[128];
+    SharedGameState *room = NULL;
+    if (sscanf(line + 5, "%d", &roomID) == 1)
+        room = findRoom(server, roomID);
+
+    if (!room)
+    {
+        snprintf(reply, sizeof(reply), "No such room.\n");
+    }
+    else if (room == client->room)
+    {
+        snprintf(reply, sizeof(reply), "Already in room %d.\n", roomID);
+    }
+    else if (moveClientToRoom(server, client, room))
+    {
+        return true;
+    }
+    else
+    {
+        snprintf(reply, sizeof(reply), "Room %d is full or playing.\n", roomID);
+    }
+    sendRoomError(client, reply);
+    return true;
 }
 
-int main()
+void dispatchClientFrame(ServerState *server, EventSource *client, uint8_t opcode, FrameReader *payload)
 {
-    key_t key = ftok("server.c", 65);
-    int existingID = shmget(key, 0, 0666);
-    //Remove existing shared memory if have
-    if (existingID != -1)
+    char line[128];
+    char name[PLAYER_NAME_LENGTH];
+
+    /* Binary commands are fed through the same handlers as their text equivalents */
+    switch (opcode)
     {
-        shmctl(existingID, IPC_RMID, NULL);
+    case CMD_NAME:
+        frameGetString(payload, name, sizeof(name));
+        snprintf(line, sizeof(line), "NAME %s", name);
+        break;
+    case CMD_READY:
+        snprintf(line, sizeof(line), "1");
+        break;
+    case CMD_FLIP:
+        snprintf(line, sizeof(line), "%d", (int)frameGetU32(payload));
+        break;
+    case CMD_ROOMS:
+        snprintf(line, sizeof(line), "ROOMS");
+        break;
+    case CMD_CREATE_ROOM:
+        frameGetString(payload, name, sizeof(name));
+        snprintf(line, sizeof(line), "CREATE %s", name);
+        break;
+    case CMD_JOIN_ROOM:
+        snprintf(line, sizeof(line), "JOIN %u", frameGetU32(payload));
+        break;
+    case CMD_SNAPSHOT:
+        sendBoardSnapshot(client->room, client->playerID);
+        return;
+    case CMD_TOP:
+        snprintf(line, sizeof(line), "TOP %u", (unsigned)frameGetU8(payload));
+        break;
+    case CMD_RANK:
+        frameGetString(payload, name, sizeof(name));
+        snprintf(line, sizeof(line), "RANK %s", name);
+        break;
+    case CMD_REJOIN:
+        frameGetString(payload, name, sizeof(name));
+        snprintf(line, sizeof(line), "REJOIN %s", name);
+        break;
+    case CMD_BOARD_SIZE:
+    {
+        unsigned int rows = frameGetU16(payload);
+        unsigned int cols = frameGetU16(payload);
+        snprintf(line, sizeof(line), "BOARD %ux%u", rows, cols);
+        break;
+    }
+    default:
+        return;
     }
 
-    sharedMemoryID = shmget(key, sizeof(SharedGameState), 0666 | IPC_CREAT | IPC_EXCL);
-    //Check if shmget failed
-    if (sharedMemoryID == -1)
+    if (payload->error)
+        return;
+
+    if (!handleRoomCommand(server, client, line) && !handleLeaderboardCommand(client, line))
+        pushClientCommand(client->room, client->playerID, line, client->input);
+}
+
+/* Returns false when the client sent something that is not a valid frame */
+bool handleClientFrames(ServerState *server, EventSource *client)
+{
+    size_t offset = 0;
+    while (offset < client->inLen)
     {
-        perror("shmget failed");
-        exit(1);
+        uint8_t opcode;
+        FrameReader payload;
+        int used = frameParse(client->inbuf + offset, client->inLen - offset, &opcode, &payload);
+        if (used < 0 || (used == 0 && client->inLen == CLIENT_INBUF_SIZE))
+            return false;
+        if (used == 0)
+            break;
+        dispatchClientFrame(server, client, opcode, &payload);
+        offset += used;
     }
 
-    //Attach shared memory
-    gameState = (SharedGameState *)shmat(sharedMemoryID, NULL, 0);
-    if (gameState == (void *)-1)
+    if (offset > 0)
     {
-        perror("shmat failed");
-        exit(1);
+        memmove(client->inbuf, client->inbuf + offset, client->inLen - offset);
+        client->inLen -= offset;
     }
+    return true;
+}
 
-    memset(gameState, 0, sizeof(SharedGameState));
+/* Answers PROTOCOL_HELLO; returns true once the client is switched to binary frames */
+bool negotiateProtocol(EventSource *client, const char *line)
+{
+    int version = 0;
+    if (sscanf(line + strlen(PROTOCOL_HELLO), "%d", &version) != 1 || version != PROTOCOL_VERSION)
+    {
+        const char *msg = "PROTO_UNSUPPORTED\n<<END>>\n";
+        outboxSend(&client->outbox, msg, strlen(msg), OUT_CONTROL);
+        return false;
+    }
 
-    pthread_mutexattr_t attr;
-    pthread_mutexattr_init(&attr);
-    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
-    pthread_mutex_init(&gameState->mutex, &attr);
+    client->binaryProtocol = true;
+    client->inLen = 0;
+    pthread_mutex_lock(&client->room->mutex);
+    client->room->players[client->playerID].binaryProtocol = true;
+    pthread_mutex_unlock(&client->room->mutex);
+
+    FrameBuffer fb;
+    frameBufferInit(&fb);
+    frameBegin(&fb, MSG_HELLO);
+    framePutU8(&fb, PROTOCOL_VERSION);
+    framePutU32(&fb, (uint32_t)client->room->roomID);
+    framePutU8(&fb, (uint8_t)client->playerID);
+    framePutString(&fb, client->room->roomName);
+    frameEnd(&fb);
+    outboxSend(&client->outbox, fb.data, fb.len, OUT_CONTROL);
+    frameBufferFree(&fb);
+    sendRoomBoardSize(client);
+    return true;
+}
 
-    pthread_mutex_lock(&gameState->mutex);
-    initGameState(gameState);
-    pthread_mutex_unlock(&gameState->mutex);
+/* Runs every complete line waiting in a text client's buffer; a partial one stays there for the rest */
+bool handleTextLines(ServerState *server, EventSource *client)
+{
+    size_t offset = 0;
+    while (offset < client->inLen)
+    {
+        unsigned char *end = memchr(client->inbuf + offset, '\n', client->inLen - offset);
+        if (!end)
+            break;
+        *end = '\0';
+        char *line = (char *)client->inbuf + offset;
+        offset = (size_t)(end - client->inbuf) + 1;
+
+        //Remove /r
+        line[strcspn(line, "\r")] = 0;
+        if (strncmp(line, PROTOCOL_HELLO, strlen(PROTOCOL_HELLO)) == 0)
+        {
+            size_t rest = client->inLen - offset;
+            if (negotiateProtocol(client, line))
+            {
+                /* Anything after the hello line is already framed */
+                memmove(client->inbuf, client->inbuf + offset, rest);
+                client->inLen = rest;
+                return handleClientFrames(server, client);
+            }
+        }
+        else if (line[0] != '\0' && !handleRoomCommand(server, client, line) && !handleLeaderboardCommand(client, line))
+        {
+            pushClientCommand(client->room, client->playerID, line, client->input);
+        }
+    }
 
-    scores_init(gameState);
-    scores_load(gameState);
-    scores_print(gameState);
+    if (offset > 0)
+    {
+        memmove(client->inbuf, client->inbuf + offset, client->inLen - offset);
+        client->inLen -= offset;
+    }
+    //A line longer than the whole buffer is not a command
+    return client->inLen < CLIENT_INBUF_SIZE;
+}
 
+/* Handles one chunk exactly as recv() returned it; false when the client has to be closed */
+bool handleClientInput(ServerState *server, EventSource *client, char *data, size_t len)
+{
+    memcpy(client->inbuf + client->inLen, data, len);
+    client->inLen += len;
+    if (!(client->binaryProtocol ? handleClientFrames(server, client) : handleTextLines(server, client)))
+        return false;
+    notifyWaitingPlayers(client->room);
+    return true;
+}
 
-    sem_init(&gameState->turnSemaphore, 1, 0);
-    sem_init(&gameState->turnCompleteSemaphore, 1, 0);
-    sem_init(&gameState->logReadySemaphore, 1, 0);
-    sem_init(&gameState->logItemsSemaphore, 1, 0);
-    sem_init(&gameState->logSpacesSemaphore, 1, LOG_QUEUE_SIZE);
-    sem_init(&gameState->flipDoneSemaphore, 1, 0);
+/* Older clients send READY as a bare "1" with no newline; true when that is what the buffer holds */
+bool legacyReadyPending(const EventSource *client)
+{
+    size_t i = 0;
+    while (i < client->inLen && (client->inbuf[i] == ' ' || client->inbuf[i] == '\t'))
+        i++;
+    return !client->binaryProtocol && i + 1 == client->inLen && client->inbuf[i] == '1';
+}
 
-    pthread_mutexattr_t logAttr;
-    pthread_mutexattr_init(&logAttr);
-    pthread_mutexattr_setpshared(&logAttr, PTHREAD_PROCESS_SHARED);
-    pthread_mutex_init(&gameState->logQueueMutex, &logAttr);
+void handleClientReadable(ServerState *server, EventSource *client)
+{
+    //Taken over by REJOIN and hung up on; whatever it still sends goes nowhere
+    if (!client->room)
+    {
+        closeClient(server, client);
+        return;
+    }
 
-    pthread_create(&loggerThread, NULL, loggerLoopThread, gameState);
-    sem_wait(&gameState->logReadySemaphore);
-    pushLogEvent(gameState, LOG_SERVER, "Server started.\n");   
+    char buffer[CLIENT_INBUF_SIZE];
+    size_t space = CLIENT_INBUF_SIZE - client->inLen;
+    char control[CMSG_SPACE(3 * sizeof(struct timespec))];
+    struct iovec iov = {.iov_base = buffer, .iov_len = space};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+    int bytes = recvmsg(client->fd, &msg, 0);
 
-    pthread_create(&gameThread, NULL, gameLoopThread, gameState);
-    pthread_create(&schedulerThread, NULL, schedulerLoopThread, gameState);
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
 
-    int serverSocket = setupServerSocket();
-    signal(SIGINT, cleanup);
-    signal(SIGTERM, cleanup);
-    signal(SIGHUP, cleanup);
+    if (bytes <= 0)
+    {
+        closeClient(server, client);
+        return;
+    }
 
-    printf("Waiting for players...\n");
+    //SO_TIMESTAMPING hands back three stamps; the first is the software receive time
+    client->input.readNs = latencyNow();
+    client->input.arrivedNs = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SO_TIMESTAMPING)
+            continue;
+        struct timespec stamp;
+        memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+        if (stamp.tv_sec != 0 || stamp.tv_nsec != 0)
+        {
+            client->input.arrivedNs = latencyFromRealtime(&stamp, client->input.readNs);
+            latencyRecord(LAT_KERNEL_RECV, client->input.readNs - client->input.arrivedNs);
+        }
+    }
 
+    replayRecordInput(client->connID, buffer, (size_t)bytes);
+    if (!handleClientInput(server, client, buffer, (size_t)bytes))
+    {
+        closeClient(server, client);
+        return;
+    }
+
+    //A bare READY is only complete once nothing more is waiting behind it; the newline
+    //it lacked is recorded like any other input so a replay runs it at the same point
+    int pending = 0;
+    if (legacyReadyPending(client) && ioctl(client->fd, FIONREAD, &pending) == 0 && pending == 0)
+    {
+        char newline[] = "\n";
+        replayRecordInput(client->connID, newline, 1);
+        if (!handleClientInput(server, client, newline, 1))
+            closeClient(server, client);
+    }
+}
+
+/* New players land in the first room still waiting for players, or a fresh one; false when the server is full */
+bool seatClient(ServerState *server, EventSource *client)
+{
+    SharedGameState *room = findOpenRoom(server);
+    if (!room)
+        room = createRoom(server, NULL);
+
+    int slot = room ? joinRoom(room, client->fd, &client->outbox) : -1;
+    if (slot == -1)
+    {
+        if (room)
+            releaseRoomIfEmpty(server, room);
+        return false;
+    }
+    client->playerID = slot;
+    client->room = room;
+
+    pushRoomLogEvent(room, LOG_PLAYER, LOGEV_PLAYER_CONNECTED, slot, NULL, 0);
+
+    pthread_mutex_lock(&room->mutex);
+    int rows = room->boardRows;
+    int cols = room->boardCols;
+    pthread_mutex_unlock(&room->mutex);
+
+    char welcome[320];
+    snprintf(welcome, sizeof(welcome),
+             "Successful connect to Server\nJOINED ROOM %d (%s)\nPLAYER ID %d\nBOARD %dx%d\n"
+             "Commands before READY: ROOMS, CREATE <name>, JOIN <id>, REJOIN <token>, BOARD <rows>x<cols>, TOP [count], RANK [name]\n<<END>>\n",
+             room->roomID, room->roomName, slot, rows, cols);
+    outboxSend(&client->outbox, welcome, strlen(welcome), OUT_CONTROL);
+    return true;
+}
+
+void acceptClients(ServerState *server, int serverSocket)
+{
     while (1)
     {
         struct sockaddr_in clientAddr;
         socklen_t len = sizeof(clientAddr);
 
-        int clientSocket = accept(serverSocket,(struct sockaddr *)&clientAddr, &len);
+        //Sends never block; whatever the kernel will not take waits in the client's outbox
+        int clientSocket = accept4(serverSocket, (struct sockaddr *)&clientAddr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientSocket < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept failed");
+            return;
+        }
+
+        int on = 1, idle = KEEPALIVE_IDLE_SEC, interval = KEEPALIVE_INTERVAL_SEC, probes = KEEPALIVE_PROBES;
+        unsigned int userTimeout = USER_TIMEOUT_MS;
+        setsockopt(clientSocket, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+        setsockopt(clientSocket, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+        setsockopt(clientSocket, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+        setsockopt(clientSocket, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
+        setsockopt(clientSocket, IPPROTO_TCP, TCP_USER_TIMEOUT, &userTimeout, sizeof(userTimeout));
 
-        pthread_mutex_lock(&gameState->mutex);
-        if (gameState->gameStarted)
+        //Kernel receive stamps for the latency histograms; without them ingress is timed from recv()
+        int stamping = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+        setsockopt(clientSocket, SOL_SOCKET, SO_TIMESTAMPING, &stamping, sizeof(stamping));
+
+        EventSource *client = malloc(sizeof(EventSource));
+        if (!client)
         {
-            pthread_mutex_unlock(&gameState->mutex);
-            send(clientSocket, "Game already started\n", 21, 0);
             close(clientSocket);
             continue;
         }
-        pthread_mutex_unlock(&gameState->mutex);
-        if (clientSocket < 0)
+        client->type = SOURCE_CLIENT;
+        client->fd = clientSocket;
+        client->binaryProtocol = false;
+        client->inLen = 0;
+        client->input = (InputStamp){0};
+        outboxInit(&client->outbox, clientSocket, epollFD, client);
+
+        //Registered before taking a seat so the outbox can arm EPOLLOUT right away
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = client;
+        if (epoll_ctl(epollFD, EPOLL_CTL_ADD, clientSocket, &ev) < 0)
+        {
+            perror("epoll_ctl client");
+            close(clientSocket);
+            outboxDestroy(&client->outbox);
+            free(client);
             continue;
+        }
 
-        /* assign player section befor fork() */
-        int slot = -1;
+        client->room = NULL;
+        client->connID = replayRecordConnect();
+        if (!seatClient(server, client))
+        {
+            metricsAdd(METRIC_CONNECTIONS_REJECTED, 1);
+            const char *msg = "Server full. Try later.\n";
+            send(clientSocket, msg, strlen(msg), MSG_NOSIGNAL);
+            recordClientDisconnect(client);
+            close(clientSocket);
+            outboxDestroy(&client->outbox);
+            free(client);
+            continue;
+        }
+        metricsAdd(METRIC_CONNECTIONS_ACCEPTED, 1);
+    }
+}
 
-        pthread_mutex_lock(&gameState->mutex);
-        for (int i = 0; i < MAX_PLAYERS; i++)
+void raiseFileLimit()
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+void runEventLoop(ServerState *server, int serverSocket)
+{
+    EventSource listener = {.type = SOURCE_LISTENER, .fd = serverSocket, .playerID = -1};
+    EventSource wakeup = {.type = SOURCE_WAKEUP, .fd = wakeupFD, .playerID = -1};
+    EventSource timers = {.type = SOURCE_TIMER, .fd = timerFD, .playerID = -1};
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listener;
+    epoll_ctl(epollFD, EPOLL_CTL_ADD, serverSocket, &ev);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &wakeup;
+    epoll_ctl(epollFD, EPOLL_CTL_ADD, wakeupFD, &ev);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &timers;
+    epoll_ctl(epollFD, EPOLL_CTL_ADD, timerFD, &ev);
+
+    struct epoll_event events[MAX_EVENTS];
+
+    while (serverRunning)
+    {
+        int n = epoll_wait(epollFD, events, MAX_EVENTS, -1);
+        if (n < 0)
         {
-            if (!gameState->players[i].connected)
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait failed");
+            break;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            EventSource *source = (EventSource *)events[i].data.ptr;
+            switch (source->type)
             {
-                slot = i;
-                gameState->players[i].playerID = i;
-                gameState->players[i].connected = true;
-                gameState->players[i].readyToStart = false;
-                gameState->players[i].pid = -1;
-                gameState->players[i].socket = clientSocket;
-                gameState->playerCount++;
+            case SOURCE_LISTENER:
+                acceptClients(server, serverSocket);
+                break;
+            case SOURCE_WAKEUP:
+            {
+                uint64_t count;
+                read(wakeupFD, &count, sizeof(count));
+                if (latencyDumpRequested)
+                {
+                    latencyDumpRequested = 0;
+                    latencyDump(stdout);
+                }
+                break;
+            }
+            case SOURCE_TIMER:
+            {
+                uint64_t now = timerQueueNow();
+                if (timerQueueExpire(now) > 0)
+                    replayRecordTimers(now);
+                break;
+            }
+            case SOURCE_CLIENT:
+                if ((events[i].events & EPOLLOUT) && !outboxFlush(&source->outbox))
+                {
+                    closeClient(server, source);
+                    break;
+                }
+                if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+                    handleClientReadable(server, source);
                 break;
             }
         }
-        pthread_mutex_unlock(&gameState->mutex);
+    }
 
-        if (slot == -1)
-        {
-            const char *msg = "Server full. Try later.\n";
-            send(clientSocket, msg, strlen(msg), 0);
-            close(clientSocket);
+    close(serverSocket);
+}
+
+/* Replayed connections have no socket; whatever they are sent lands here */
+void captureReplayOutput(void *tag, const void *data, size_t len)
+{
+    EventSource *client = tag;
+    if (serverConfig.replayOutPath)
+        framePutBytes(&client->transcript, data, len);
+}
+
+void applyReplayDeal(ServerState *server, const ReplayScript *script, const ReplayRecord *record)
+{
+    SharedGameState *room = findRoom(server, (int)record->conn);
+    if (!room)
+        return;
+    int *values = malloc(record->valueCount * sizeof(int));
+    if (!values)
+        return;
+    int count = replayDealValues(script, record, values, (int)record->valueCount);
+
+    pthread_mutex_lock(&room->mutex);
+    if (!room->gameStarted && count == room->boardRows * room->boardCols)
+    {
+        for (int i = 0; i < count; i++)
+            room->cards.faceValue[i] = (uint16_t)values[i];
+        cardsLinkPartners(&room->cards);
+        room->stateVersion++;
+    }
+    pthread_mutex_unlock(&room->mutex);
+    free(values);
+}
+
+void writeReplayTranscripts(EventSource **clients, unsigned int clientCount)
+{
+    FILE *out = fopen(serverConfig.replayOutPath, "wb");
+    if (!out)
+    {
+        perror(serverConfig.replayOutPath);
+        return;
+    }
+    for (unsigned int conn = 1; conn <= clientCount; conn++)
+    {
+        if (!clients[conn])
             continue;
-        }
+        fprintf(out, "=== connection %u: %zu bytes ===\n", conn, clients[conn]->transcript.len);
+        fwrite(clients[conn]->transcript.data, 1, clients[conn]->transcript.len, out);
+        fprintf(out, "\n");
+    }
+    fclose(out);
+}
 
-        pid_t pid = fork();
+/*
+ * Feeds a recording through the same handlers the event loop uses, one
+ * record at a time; rooms have no threads of their own, so each record is
+ * fully handled by the time the call for it returns. Returns
+ * the number of connections whose output differed from the recording.
+ */
+int runReplay(ServerState *server)
+{
+    ReplayScript script;
+    if (!replayLoad(serverConfig.replayPath, serverConfig.replaySession, &script))
+        return -1;
+    replayApplySettings(&script, server);
+    seedReconnectTokens(server);
+    //Before version 5 tokens were drawn from the board seed and not recorded
+    if (script.tokensRecorded)
+        replayPlayTokens(&script);
+    else
+        rngSeed(&server->tokenRng, ~server->boardSeed);
+    timerQueueSetClock(0);
+
+    unsigned int clientCount = 0;
+    for (size_t i = 0; i < script.recordCount; i++)
+    {
+        if (script.records[i].kind != REPLAY_DEAL && script.records[i].conn > clientCount)
+            clientCount = script.records[i].conn;
+    }
+    EventSource **clients = calloc(clientCount + 1, sizeof(EventSource *));
+    if (!clients)
+    {
+        perror("replay: calloc");
+        replayFree(&script);
+        return -1;
+    }
 
-        if (pid == 0)
-        {
-            /* child section */
-            close(serverSocket);
-            signal(SIGINT, SIG_IGN);
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    int mismatches = 0;
+    int checked = 0;
+    char chunk[CLIENT_INBUF_SIZE + 1];
 
-            handleTCPClient(clientSocket, gameState, slot);
-            exit(0);
+    for (size_t i = 0; i < script.recordCount; i++)
+    {
+        const ReplayRecord *record = &script.records[i];
+        EventSource *client = record->kind == REPLAY_DEAL ? NULL : clients[record->conn];
+
+        //A text log never says when timers ran, so the ones due by now run first
+        uint64_t due;
+        while (!script.timersRecorded && timerQueueNextDue(&due) && due <= record->atMs)
+        {
+            if (due < timerQueueNow())
+                due = timerQueueNow();
+            timerQueueSetClock(due);
+            timerQueueExpire(due);
         }
-        else if (pid > 0)
+        if (record->atMs > timerQueueNow())
+            timerQueueSetClock(record->atMs);
+
+        switch (record->kind)
+        {
+        case REPLAY_CONNECT:
+            if (client || record->conn == 0)
+                break;
+            client = calloc(1, sizeof(EventSource));
+            if (!client)
+                break;
+            client->type = SOURCE_CLIENT;
+            client->fd = -1;
+            client->connID = record->conn;
+            frameBufferInit(&client->transcript);
+            outboxInit(&client->outbox, -1, -1, client);
+            client->outbox.capture = captureReplayOutput;
+            clients[record->conn] = client;
+            seatClient(server, client);
+            break;
+        case REPLAY_INPUT:
         {
-            /* parent section */
-            childsPID[childCount++] = pid;
+            if (!client || !client->room)
+                break;
+            size_t space = CLIENT_INBUF_SIZE - client->inLen;
+            if (record->dataLength > space)
+            {
+                fprintf(stderr, "replay: connection %u input at %llu ms does not fit its buffer\n",
+                        record->conn, (unsigned long long)record->atMs);
+                break;
+            }
+            memcpy(chunk, script.storage + record->dataOffset, record->dataLength);
+            if (!handleClientInput(server, client, chunk, record->dataLength))
+            {
+                releaseClientSeat(server, client);
+                break;
+            }
+            //The server that made the recording ran a line left open at the end of a chunk anyway
+            if (script.wholeTextChunks && !client->binaryProtocol && client->inLen > 0)
+            {
+                chunk[0] = '\n';
+                if (!handleClientInput(server, client, chunk, 1))
+                    releaseClientSeat(server, client);
+            }
+            break;
+        }
+        case REPLAY_DISCONNECT:
+            if (!client)
+                break;
+            if (client->room)
+                releaseClientSeat(server, client);
+            if (record->hasDigest)
+            {
+                checked++;
+                if (client->outbox.sentBytes != record->sentBytes || client->outbox.sentDigest != record->sentDigest)
+                {
+                    mismatches++;
+                    fprintf(stderr, "replay: connection %u was sent %llu bytes (digest %016llx), recording has %llu (%016llx)\n",
+                            record->conn, (unsigned long long)client->outbox.sentBytes,
+                            (unsigned long long)client->outbox.sentDigest,
+                            (unsigned long long)record->sentBytes, (unsigned long long)record->sentDigest);
+                }
+            }
+            break;
+        case REPLAY_TIMERS:
+            timerQueueExpire(record->atMs);
+            break;
+        case REPLAY_DEAL:
+            applyReplayDeal(server, &script, record);
+            break;
+        case REPLAY_TOKEN:
+            //Taken by issueReconnectToken() when the input that issued it ran
+            break;
+        }
+    }
 
-            pthread_mutex_lock(&gameState->mutex);
-            gameState->players[slot].pid = pid;
+    //Connections still open when the recording ended
+    for (unsigned int conn = 1; conn <= clientCount; conn++)
+    {
+        if (clients[conn] && clients[conn]->room)
+            releaseClientSeat(server, clients[conn]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finished);
 
-            char msg[LOG_MSG_LENGTH];
-            snprintf(msg, LOG_MSG_LENGTH,"New connection assigned to Player %d\n",slot);
-            pushLogEvent(gameState, LOG_PLAYER, msg);
+    if (serverConfig.replayOutPath)
+        writeReplayTranscripts(clients, clientCount);
 
-            pthread_mutex_unlock(&gameState->mutex);
-        }
+    double seconds = (double)(finished.tv_sec - started.tv_sec) + (double)(finished.tv_nsec - started.tv_nsec) / 1e9;
+    printf("Replayed %zu records, %u connections, %llu ms of play in %.3f s: %d of %d digests differ\n",
+           script.recordCount, clientCount, (unsigned long long)timerQueueNow(), seconds, mismatches, checked);
+
+    for (unsigned int conn = 1; conn <= clientCount; conn++)
+    {
+        if (!clients[conn])
+            continue;
+        outboxDestroy(&clients[conn]->outbox);
+        frameBufferFree(&clients[conn]->transcript);
+        free(clients[conn]);
+    }
+    free(clients);
+    replayFree(&script);
+    return mismatches;
+}
+
+/* --replay: no sockets and no logger thread; log events are simply dropped */
+int replayMain(void)
+{
+    serverState = calloc(1, sizeof(ServerState));
+    if (!serverState)
+    {
+        perror("calloc");
+        return 1;
+    }
+    serverState->nextRoomID = 1;
+    pthread_mutex_init(&serverState->mutex, NULL);
+    scores_init(serverState);
+    leaderboardBuild(serverState);
+
+    sem_init(&serverState->logReadySemaphore, 0, 0);
+    sem_init(&serverState->logItemsSemaphore, 0, 0);
+    initLogQueue(serverState);
+
+    timerFD = timerQueueInit();
+    if (timerFD < 0)
+    {
+        perror("timerfd setup failed");
+        return 1;
     }
-}
\ No newline at end of file
+
+    int mismatches = runReplay(serverState);
+
+    destroyAllRooms(serverState);
+    timerQueueDestroy();
+    return mismatches == 0 ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+    parseServerArgs(argc, argv);
+    if (serverConfig.replayPath)
+        return replayMain();
+
+    //One process serves everyone, so the state is ordinary memory shared by its threads
+    serverState = calloc(1, sizeof(ServerState));
+    if (!serverState)
+    {
+        perror("calloc ServerState");
+        exit(1);
+    }
+    serverState->nextRoomID = 1;
+    if (getrandom(&serverState->boardSeed, sizeof(serverState->boardSeed), 0) != sizeof(serverState->boardSeed))
+        serverState->boardSeed = ((uint64_t)time(NULL) << 20) ^ (uint64_t)getpid();
+    seedReconnectTokens(serverState);
+
+    pthread_mutex_init(&serverState->mutex, NULL);
+
+    scores_init(serverState);
+    scores_load(serverState);
+    scores_print(serverState);
+    leaderboardStart(serverState);
+
+    sem_init(&serverState->logReadySemaphore, 0, 0);
+    sem_init(&serverState->logItemsSemaphore, 0, 0);
+    initLogQueue(serverState);
+
+    pthread_create(&loggerThread, NULL, loggerLoopThread, serverState);
+    sem_wait(&serverState->logReadySemaphore);
+    pushLogEvent(serverState, LOG_SERVER, LOGEV_SERVER_STARTED, -1, NULL, 0);   
+
+    raiseFileLimit();
+    epollFD = epoll_create1(EPOLL_CLOEXEC);
+    wakeupFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    timerFD = timerQueueInit();
+    if (epollFD < 0 || wakeupFD < 0 || timerFD < 0)
+    {
+        perror("epoll/eventfd/timerfd setup failed");
+        exit(1);
+    }
+    if (serverConfig.recordPath && !replayStartRecording(serverConfig.recordPath, serverState))
+        exit(1);
+
+    int serverSocket = setupServerSocket();
+    signal(SIGINT, handleSignal);
+    signal(SIGTERM, handleSignal);
+    signal(SIGHUP, handleSignal);
+    signal(SIGUSR1, handleSignal);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (serverConfig.metricsPort)
+        startMetricsServer(serverState, serverConfig.metricsPort);
+    printf("Waiting for players...\n");
+
+    runEventLoop(serverState, serverSocket);
+    cleanup();
+    return 0;
+}
@@ -1,50 +1,56 @@
 #include "shared_state.h"
+#include "metrics.h"
+#include "config.h"
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
 
 
-void randomCardValues(SharedGameState *state, int rows, int cols){
+/* Lays out the pairs, then a Fisher-Yates shuffle from a fresh seed drawn from the room's generator */
+void dealCards(SharedGameState *state, int rows, int cols){
     int totalCards = rows * cols;
 
-    if (totalCards > MAX_CARDS || totalCards % 2 != 0) {
+    if (totalCards > state->cards.capacity || totalCards % 2 != 0) {
         printf("Error: Invalid board size for card values.\n");
         return;
     }
 
     state->totalPairs = totalCards / 2;
 
-    int cardIndex = 0;
-    for (int fv = 0; fv < state->totalPairs; fv++) {
-        for (int pairC = 0; pairC < 2; pairC++) {
-            state->cards[cardIndex].cardID = cardIndex;
-            state->cards[cardIndex].faceValue = fv;
-            cardIndex++;
-        }
+    //Pairs start out side by side, so each card's partner is its neighbour; the swaps below keep the links true
+    uint16_t *faceValue = state->cards.faceValue;
+    uint16_t *partner = state->cards.partner;
+    for (int cardIndex = 0; cardIndex < totalCards; cardIndex++) {
+        faceValue[cardIndex] = (uint16_t)(cardIndex / 2);
+        partner[cardIndex] = (uint16_t)(cardIndex ^ 1);
     }
 
-    srand((unsigned int)time(NULL));
-    for (int i = 0; i < totalCards; i++) {
-        int j = rand() % totalCards;
-        Card temp = state->cards[i];
-        state->cards[i] = state->cards[j];
-        state->cards[j] = temp;
+    Rng deal;
+    state->dealSeed = rngNext(&state->rng);
+    rngSeed(&deal, state->dealSeed);
+    for (int i = totalCards - 1; i > 0; i--) {
+        int j = (int)rngBelow(&deal, (uint32_t)i + 1);
+        uint16_t temp = faceValue[i];
+        faceValue[i] = faceValue[j];
+        faceValue[j] = temp;
+
+        //Swapping the two halves of a pair leaves them partnered; otherwise both partners follow their card
+        int partnerI = partner[i];
+        int partnerJ = partner[j];
+        if (partnerI != j) {
+            partner[i] = (uint16_t)partnerJ;
+            partner[j] = (uint16_t)partnerI;
+            partner[partnerJ] = (uint16_t)i;
+            partner[partnerI] = (uint16_t)j;
+        }
     }
 }
 
 void initCard(SharedGameState *state){
-    for(int i = 0; i < MAX_CARDS; i++){
-        state->cards[i].cardID = -1;
-        state->cards[i].faceValue = -1;
-        state->cards[i].isFlipped = false;
-        state->cards[i].isMatched = false;
-    }
-    
-
-    randomCardValues(state, state->boardRows, state->boardCols);
+    cardsClear(&state->cards);
+    dealCards(state, state->boardRows, state->boardCols);
 }
 
 
@@ -53,12 +59,8 @@ void initGameState(SharedGameState *state){
     state->boardNeedsBroadcast = false;
     state->playerCount = 0;
     state->currentTurn = -1;
-    state->boardRows = 3;
-    state->boardCols = 4;
     state->totalPairs = 0;
-    state->matchedPaires = 0;
-    state->logQueueHead = 0;
-    state->logQueueTail = 0;
+    resizeBoardLocked(state, serverConfig.boardRows, serverConfig.boardCols);
 
     for(int i = 0; i < MAX_PLAYERS; i++){
         state->players[i].playerID = -1;
@@ -75,15 +77,15 @@ void initGameState(SharedGameState *state){
     }
 
     initCard(state);
+    state->stateVersion++;
 }
 
 void resetGameState(SharedGameState *state){
+    if (state->gameStarted)
+        metricsAdd(METRIC_GAMES_ENDED, 1);
     state->gameStarted = false;
     state->currentTurn = -1;
-    state->matchedPaires = 0;
     state->totalPairs = 0;
-    state->boardRows = 3;
-    state->boardCols = 4;
     state->boardNeedsBroadcast = false;
 
     for (int i = 0; i < MAX_PLAYERS; i++) {
@@ -99,4 +101,42 @@ void resetGameState(SharedGameState *state){
     }
 
     initCard(state);
+    state->stateVersion++;
+}
+
+/* Switches the room to a rows x cols board, growing the card storage if it has to; the cards still need dealing.
+   Caller holds state->mutex and no game is running */
+bool resizeBoardLocked(SharedGameState *state, int rows, int cols)
+{
+    if (!boardSizeValid(rows, cols))
+        return false;
+
+    int totalCards = rows * cols;
+    if (totalCards > state->cards.capacity)
+    {
+        //New cards start out as last sent face down, which is what a fresh board is
+        growCardWords(&state->sentFlipped, state->cards.capacity, totalCards);
+        growCardWords(&state->sentMatched, state->cards.capacity, totalCards);
+    }
+    cardsResize(&state->cards, totalCards);
+
+    state->boardRows = rows;
+    state->boardCols = cols;
+    state->stateVersion++;
+    return true;
+}
+
+/* Releases what initGameState() and the renderer allocated; no timer may still point at the room */
+void freeGameState(SharedGameState *state)
+{
+    cardsFree(&state->cards);
+    free(state->sentFlipped);
+    free(state->sentMatched);
+    state->sentFlipped = NULL;
+    state->sentMatched = NULL;
+
+    free(state->render.boardText);
+    free(state->render.fullText);
+    frameBufferFree(&state->render.snapshot);
+    memset(&state->render, 0, sizeof(state->render));
 }
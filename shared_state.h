@@ -2,33 +2,36 @@
 #define SHARED_STATE_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <sys/types.h>
 
+#include "protocol.h"
+#include "outbox.h"
+#include "timer.h"
+#include "logformat.h"
+#include "rng.h"
+#include "cards.h"
+
 #define MIN_PLAYERS 3
 #define MAX_PLAYERS 4
-#define MAX_CARDS 24
 #define LOG_MSG_LENGTH 256
-#define LOG_QUEUE_SIZE 50
+#define LOG_QUEUE_SIZE 1024    //Power of two, see logger.c
 #define PLAYER_NAME_LENGTH 32
+#define ROOM_NAME_LENGTH 32
+#define RECONNECT_TOKEN_LENGTH 17   //16 hex digits and the terminator
 
 extern volatile bool serverRunning;
 
-typedef struct {
-    int cardID;
-    int faceValue;
-    bool isFlipped;
-    bool isMatched;
-} Card;
-
 typedef struct {
     int playerID;
     int socket;
+    Outbox *outbox;         //Owned by the connection, NULL while the seat is empty
     int score;
     int roundScore;
     char name[PLAYER_NAME_LENGTH];
-    pid_t pid;
     bool connected;
     bool wantToJoin;
     bool readyToStart;
@@ -37,6 +40,14 @@ typedef struct {
     int firstFlipIndex;
     int secondFlipIndex;
     bool waitingNotified;
+    bool binaryProtocol;
+
+    //A dropped player keeps the seat (still connected, but away) until the grace
+    //window ends or the game does; the token lets a new connection take it back
+    bool away;
+    char reconnectToken[RECONNECT_TOKEN_LENGTH];
+    TimerID reconnectTimer;
+    struct SharedGameState *room;
 } Player;
 
 typedef struct {
@@ -44,54 +55,126 @@ typedef struct {
     int wins;
 } ScoreEntry;
 
+/* Players whose totals changed since scores.db was written, hash-indexed by name; see score.c */
 typedef struct {
-    ScoreEntry entries[MAX_PLAYERS];
-    int count;
+    ScoreEntry *entries;
+    size_t count;
+    size_t capacity;
+    uint32_t *slots;            // entry index + 1, 0 empty; power-of-two sized
+    size_t slotCount;
+    size_t journalRecords;      // appended to scores.journal since the last compaction
+    atomic_size_t players;      // everyone saved, in scores.db or only here; read by metrics without scoreMutex
     pthread_mutex_t scoreMutex;
-} scoreBoard;
+    pthread_cond_t persistCond; // wakes the persistence worker
 
-typedef enum {
-    LOG_NONE,
-    LOG_SERVER,
-    LOG_PLAYER,
-    LOG_GAME,
-    LOG_TURN
-} LogType;
+    //Persistence lag, kept up to date by the worker and readable without scoreMutex
+    atomic_ulong persistQueued;     // updates not yet synced to scores.journal
+    atomic_ulong persistOldestUs;   // monotonic time the oldest of them was queued, 0 when none
+    atomic_ulong persistLagUs;      // queued-to-synced time of the last batch's oldest update
+    atomic_ulong persistMaxLagUs;
+} scoreBoard;
 
+/* One ring slot; sequence says whether it is free or holds a published event */
 typedef struct {
-    LogType type;
-    char message[LOG_MSG_LENGTH];
-} LogEvent;
+    atomic_size_t sequence;
+    LogEvent event;
+} LogSlot;
+
+typedef struct ServerState ServerState;
 
+/* Board, scoreboard and turn renderings, rebuilt only when the state version moves */
 typedef struct {
+    unsigned long version;
+    uint32_t seq;
+    //Board texts grow with the board; see reserveText() in game.c
+    char *boardText;
+    size_t boardTextCapacity;
+    char scoreText[512];
+    char turnText[32];
+    char *fullText;
+    size_t fullTextCapacity;
+    bool textCurrent;       // boardText and fullText match version; big boards render them only on demand
+    FrameBuffer snapshot;
+} RenderCache;
+
+typedef struct SharedGameState {
     pthread_mutex_t mutex;
-    pthread_mutex_t logQueueMutex;
-    sem_t turnSemaphore;
-    sem_t turnCompleteSemaphore;
-    sem_t flipDoneSemaphore;
-    sem_t logReadySemaphore;
-    sem_t logItemsSemaphore;
-    sem_t logSpacesSemaphore;
+
+    int roomID;
+    char roomName[ROOM_NAME_LENGTH];
+    ServerState *server;
+    bool closing;
 
     int playerCount;         
     int currentTurn;         
     int boardRows;           
     int boardCols;           
     int totalPairs;
-    int matchedPaires;
-    int logQueueHead;
-    int logQueueTail;
 
     bool gameStarted;
+    bool gameAnnounced;         //gameStarted as players were last told, see syncRoomGame()
     bool boardNeedsBroadcast;
 
+    //Pending mismatch reveal or turn advance, see game.c
+    TimerID turnTimer;
+    int revealFirst;
+    int revealSecond;
+
+    //AFK deadline for the current turn and idle expiry while waiting, see config.h
+    TimerID turnDeadline;
+    bool turnExpired;
+    TimerID lobbyTimer;
+
     Player players[MAX_PLAYERS];
-    Card cards[MAX_CARDS];
-    LogEvent logQueue[LOG_QUEUE_SIZE];
-    scoreBoard scoreBoard;
 
+    //boardRows * boardCols cards; the storage only ever grows, see resizeBoardLocked()
+    CardBoard cards;
+
+    //Bumped under mutex whenever anything players are shown changes
+    unsigned long stateVersion;
+    RenderCache render;
+
+    //What binary clients were last told, so broadcasts only carry changes
+    uint32_t boardSeq;
+    CardWord *sentFlipped;          // cards.capacity bits each, like the live bitsets
+    CardWord *sentMatched;
+    int sentScore[MAX_PLAYERS];
+    int sentRoundScore[MAX_PLAYERS];
+
+    //Each deal draws its own seed from rng (seeded from ServerState.boardSeed and
+    //the room number); dealSeed alone reproduces the board and is logged at game start
+    Rng rng;
+    uint64_t dealSeed;
+
+    //Flip timing, see latency.h: when the flip being handled reached the server (under mutex)
+    uint64_t flipArrivedNs;
+
+    struct SharedGameState *next;
 }SharedGameState;
 
+/* Process-wide state: the log queue, saved scores and every hosted room */
+struct ServerState {
+    pthread_mutex_t mutex;
+    sem_t logReadySemaphore;
+    sem_t logItemsSemaphore;
+
+    //Lock-free multi-producer ring drained by the logger thread
+    atomic_size_t logQueueHead;
+    atomic_size_t logQueueTail;
+    atomic_ulong logDropped;
+    LogSlot logQueue[LOG_QUEUE_SIZE];
+
+    int roomCount;
+    int nextRoomID;
+
+    SharedGameState *rooms;
+    scoreBoard scoreBoard;
+
+    //Every room's deals derive from this; --record saves it so a replay deals the same cards
+    uint64_t boardSeed;
+    Rng tokenRng;               // reconnect tokens, seeded by getrandom(); guarded by mutex
+};
+
 typedef enum {
     ACTION_FLIP,
     ACTION_JOIN,
@@ -113,6 +196,9 @@ typedef struct {
 
 void initGameState(SharedGameState *state);
 void resetGameState(SharedGameState *state);
+bool resizeBoardLocked(SharedGameState *state, int rows, int cols);
+void freeGameState(SharedGameState *state);
+void dealCards(SharedGameState *state, int rows, int cols);
 void printGameState(SharedGameState *state);
 void setupBoard(SharedGameState *state, int rows, int cols);
 void formatOfBoard(SharedGameState *state, char *buffer, size_t bufsize);
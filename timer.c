@@ -0,0 +1,425 @@
+#include "timer.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+/*
+ * Hierarchical timing wheel (the classic kernel layout): a 256 slot root
+ * wheel of TIMER_TICK_MS ticks, then three 64 slot wheels each covering
+ * 64 times the span of the one below. A timer sits in the slot of the
+ * coarsest wheel it fits in and is cascaded down as the root wheel wraps.
+ * Arming and cancelling only link or unlink a node, so both are O(1)
+ * however many rooms have a deadline pending.
+ */
+#define TIMER_TICK_MS 10
+#define ROOT_BITS 8
+#define LEVEL_BITS 6
+#define ROOT_SIZE (1 << ROOT_BITS)
+#define LEVEL_SIZE (1 << LEVEL_BITS)
+#define OUTER_LEVELS 3
+#define MAX_TICKS ((1ULL << (ROOT_BITS + OUTER_LEVELS * LEVEL_BITS)) - 1)
+
+#define NO_NODE -1
+
+typedef struct {
+    uint64_t expiresTick;
+    uint32_t generation;    //Bumped on every reuse so stale TimerIDs miss
+    TimerCallback callback;
+    void *arg;
+    int32_t prev;
+    int32_t next;
+    int32_t *list;          //Slot head the node is linked into, NULL when free
+} TimerNode;
+
+static pthread_mutex_t timerMutex = PTHREAD_MUTEX_INITIALIZER;
+static TimerNode *nodes = NULL;
+static int32_t nodeCapacity = 0;
+static int32_t freeNodes = NO_NODE;
+static size_t activeCount = 0;
+
+static int32_t rootWheel[ROOT_SIZE];
+static int32_t outerWheels[OUTER_LEVELS][LEVEL_SIZE];
+static int32_t dueList = NO_NODE;
+
+static uint64_t startMs;
+static uint64_t currentTick;    //Next tick to be expired
+static uint64_t armedTick;      //Tick the timerfd is set to go off at
+static bool armed = false;
+static int timerFD = -1;
+
+//Replays set the time themselves instead of following CLOCK_MONOTONIC
+static bool manualClock = false;
+static uint64_t manualMs;
+
+static uint64_t nowMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/* Milliseconds since timerQueueInit(); caller holds timerMutex */
+static uint64_t elapsedMs(void)
+{
+    return manualClock ? manualMs : nowMs() - startMs;
+}
+
+static uint64_t nowTick(void)
+{
+    return elapsedMs() / TIMER_TICK_MS;
+}
+
+/* Encodes slot index and generation so a recycled node never matches an old id */
+static TimerID makeID(int32_t index)
+{
+    return ((TimerID)nodes[index].generation << 32) | (TimerID)(index + 1);
+}
+
+static void linkNode(int32_t *list, int32_t index)
+{
+    TimerNode *node = &nodes[index];
+    node->list = list;
+    node->prev = NO_NODE;
+    node->next = *list;
+    if (*list != NO_NODE)
+        nodes[*list].prev = index;
+    *list = index;
+}
+
+static void unlinkNode(int32_t index)
+{
+    TimerNode *node = &nodes[index];
+    if (node->prev != NO_NODE)
+        nodes[node->prev].next = node->next;
+    else
+        *node->list = node->next;
+    if (node->next != NO_NODE)
+        nodes[node->next].prev = node->prev;
+    node->list = NULL;
+}
+
+static void releaseNode(int32_t index)
+{
+    nodes[index].generation++;
+    nodes[index].next = freeNodes;
+    freeNodes = index;
+    activeCount--;
+}
+
+static int32_t allocNode(void)
+{
+    if (freeNodes == NO_NODE)
+    {
+        int32_t capacity = nodeCapacity ? nodeCapacity * 2 : 64;
+        TimerNode *grown = realloc(nodes, (size_t)capacity * sizeof(TimerNode));
+        if (!grown)
+        {
+            perror("timerSchedule: realloc");
+            exit(1);
+        }
+        nodes = grown;
+        for (int32_t i = capacity - 1; i >= nodeCapacity; i--)
+        {
+            nodes[i].generation = 0;
+            nodes[i].list = NULL;
+            nodes[i].next = freeNodes;
+            freeNodes = i;
+        }
+        nodeCapacity = capacity;
+    }
+
+    int32_t index = freeNodes;
+    freeNodes = nodes[index].next;
+    activeCount++;
+    return index;
+}
+
+/* Files a node under the wheel that matches its distance from currentTick */
+static void placeNode(int32_t index)
+{
+    uint64_t expires = nodes[index].expiresTick;
+    if (expires < currentTick)
+        expires = currentTick;
+    uint64_t delta = expires - currentTick;
+
+    if (delta < ROOT_SIZE)
+    {
+        linkNode(&rootWheel[expires & (ROOT_SIZE - 1)], index);
+        return;
+    }
+
+    if (delta > MAX_TICKS)
+    {
+        expires = currentTick + MAX_TICKS;
+        nodes[index].expiresTick = expires;
+        delta = MAX_TICKS;
+    }
+    for (int level = 0; level < OUTER_LEVELS; level++)
+    {
+        int shift = ROOT_BITS + level * LEVEL_BITS;
+        if (delta < (1ULL << (shift + LEVEL_BITS)) || level == OUTER_LEVELS - 1)
+        {
+            linkNode(&outerWheels[level][(expires >> shift) & (LEVEL_SIZE - 1)], index);
+            return;
+        }
+    }
+}
+
+/* Re-files every node of one outer slot; returns the slot index so the caller knows whether it wrapped */
+static int cascade(int level)
+{
+    int slot = (int)((currentTick >> (ROOT_BITS + level * LEVEL_BITS)) & (LEVEL_SIZE - 1));
+    int32_t index = outerWheels[level][slot];
+    outerWheels[level][slot] = NO_NODE;
+
+    while (index != NO_NODE)
+    {
+        int32_t next = nodes[index].next;
+        placeNode(index);
+        index = next;
+    }
+    return slot;
+}
+
+/* Moves everything due at currentTick onto dueList and steps the wheel; caller holds timerMutex */
+static void advanceTick(void)
+{
+    int slot = (int)(currentTick & (ROOT_SIZE - 1));
+    if (slot == 0)
+    {
+        for (int level = 0; level < OUTER_LEVELS && cascade(level) == 0; level++)
+            ;
+    }
+
+    int32_t index = rootWheel[slot];
+    rootWheel[slot] = NO_NODE;
+    while (index != NO_NODE)
+    {
+        int32_t next = nodes[index].next;
+        linkNode(&dueList, index);
+        index = next;
+    }
+    currentTick++;
+}
+
+/* First tick at or after currentTick that is a multiple of span and lands on slot of its wheel */
+static uint64_t cascadeTick(int shift, int slot)
+{
+    uint64_t span = 1ULL << shift;
+    uint64_t start = (currentTick + span - 1) & ~(span - 1);
+    uint64_t steps = (uint64_t)(slot - (int)((start >> shift) & (LEVEL_SIZE - 1))) & (LEVEL_SIZE - 1);
+    return start + steps * span;
+}
+
+/*
+ * Earliest tick with work: the first root slot in use, or the first outer
+ * slot due to cascade, whichever comes sooner. A cascade may only move
+ * timers down a wheel, which costs one extra wake-up per level at most.
+ * Caller holds timerMutex and activeCount is non-zero.
+ */
+static uint64_t nextWorkTick(void)
+{
+    uint64_t next = currentTick + MAX_TICKS;
+    for (int i = 0; i < ROOT_SIZE; i++)
+    {
+        if (rootWheel[(currentTick + i) & (ROOT_SIZE - 1)] != NO_NODE)
+        {
+            next = currentTick + i;
+            break;
+        }
+    }
+    for (int level = 0; level < OUTER_LEVELS; level++)
+    {
+        int shift = ROOT_BITS + level * LEVEL_BITS;
+        for (int slot = 0; slot < LEVEL_SIZE; slot++)
+        {
+            if (outerWheels[level][slot] == NO_NODE)
+                continue;
+            uint64_t tick = cascadeTick(shift, slot);
+            if (tick < next)
+                next = tick;
+        }
+    }
+    return next;
+}
+
+/* Sets the one-shot timerfd for the next tick with work, or disarms it; caller holds timerMutex */
+static void armTimer(void)
+{
+    if (timerFD < 0 || manualClock)
+        return;
+
+    bool wanted = activeCount > 0;
+    uint64_t tick = wanted ? nextWorkTick() : 0;
+    if (armed == wanted && (!wanted || armedTick == tick))
+        return;
+
+    //Absolute CLOCK_MONOTONIC time, so an arm that is already late fires at once
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (wanted)
+    {
+        uint64_t dueMs = startMs + tick * TIMER_TICK_MS;
+        spec.it_value.tv_sec = (time_t)(dueMs / 1000);
+        spec.it_value.tv_nsec = (long)(dueMs % 1000) * 1000000L;
+    }
+    timerfd_settime(timerFD, TFD_TIMER_ABSTIME, &spec, NULL);
+    armed = wanted;
+    armedTick = tick;
+}
+
+int timerQueueInit(void)
+{
+    for (int i = 0; i < ROOT_SIZE; i++)
+        rootWheel[i] = NO_NODE;
+    for (int level = 0; level < OUTER_LEVELS; level++)
+        for (int i = 0; i < LEVEL_SIZE; i++)
+            outerWheels[level][i] = NO_NODE;
+    dueList = NO_NODE;
+    startMs = nowMs();
+    currentTick = 0;
+
+    timerFD = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerFD < 0)
+        perror("timerfd_create");
+    return timerFD;
+}
+
+void timerQueueDestroy(void)
+{
+    pthread_mutex_lock(&timerMutex);
+    free(nodes);
+    nodes = NULL;
+    nodeCapacity = 0;
+    freeNodes = NO_NODE;
+    activeCount = 0;
+    if (timerFD >= 0)
+        close(timerFD);
+    timerFD = -1;
+    armed = false;
+    pthread_mutex_unlock(&timerMutex);
+}
+
+TimerID timerSchedule(unsigned int delayMs, TimerCallback callback, void *arg)
+{
+    pthread_mutex_lock(&timerMutex);
+    //An idle wheel has not been stepped; nothing is filed, so just catch it up
+    if (activeCount == 0)
+        currentTick = nowTick();
+
+    int32_t index = allocNode();
+    TimerNode *node = &nodes[index];
+    //Round up so a timer never fires early
+    node->expiresTick = nowTick() + (delayMs + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    node->callback = callback;
+    node->arg = arg;
+    placeNode(index);
+
+    armTimer();
+    TimerID id = makeID(index);
+    pthread_mutex_unlock(&timerMutex);
+    return id;
+}
+
+/* Returns false when the timer already fired or never existed */
+bool timerCancel(TimerID id)
+{
+    int32_t index = (int32_t)(id & 0xffffffffu) - 1;
+    uint32_t generation = (uint32_t)(id >> 32);
+    bool found = false;
+
+    pthread_mutex_lock(&timerMutex);
+    if (index >= 0 && index < nodeCapacity &&
+        nodes[index].generation == generation && nodes[index].list)
+    {
+        unlinkNode(index);
+        releaseNode(index);
+        armTimer();
+        found = true;
+    }
+    pthread_mutex_unlock(&timerMutex);
+    return found;
+}
+
+uint64_t timerQueueNow(void)
+{
+    pthread_mutex_lock(&timerMutex);
+    uint64_t now = elapsedMs();
+    pthread_mutex_unlock(&timerMutex);
+    return now;
+}
+
+void timerQueueSetClock(uint64_t now)
+{
+    pthread_mutex_lock(&timerMutex);
+    manualClock = true;
+    manualMs = now;
+    pthread_mutex_unlock(&timerMutex);
+}
+
+/* Earliest expiry still pending; a linear scan, which only replays need */
+bool timerQueueNextDue(uint64_t *dueMs)
+{
+    bool found = false;
+    uint64_t earliest = 0;
+
+    pthread_mutex_lock(&timerMutex);
+    for (int32_t i = 0; i < nodeCapacity; i++)
+    {
+        if (nodes[i].list && (!found || nodes[i].expiresTick < earliest))
+        {
+            earliest = nodes[i].expiresTick;
+            found = true;
+        }
+    }
+    pthread_mutex_unlock(&timerMutex);
+
+    if (found)
+        *dueMs = earliest * TIMER_TICK_MS;
+    return found;
+}
+
+int timerQueueExpire(uint64_t now)
+{
+    uint64_t expirations;
+    int fired = 0;
+    if (!manualClock)
+    {
+        while (read(timerFD, &expirations, sizeof(expirations)) < 0 && errno == EINTR)
+            ;
+    }
+
+    pthread_mutex_lock(&timerMutex);
+    uint64_t target = now / TIMER_TICK_MS;
+    while (currentTick <= target && activeCount > 0)
+    {
+        advanceTick();
+
+        //Callbacks run one at a time and unlocked, so they may arm or cancel
+        //timers; a cancel of something still on dueList simply unlinks it
+        while (dueList != NO_NODE)
+        {
+            int32_t index = dueList;
+            unlinkNode(index);
+            TimerCallback callback = nodes[index].callback;
+            void *arg = nodes[index].arg;
+            releaseNode(index);
+            pthread_mutex_unlock(&timerMutex);
+
+            callback(arg);
+            fired++;
+
+            pthread_mutex_lock(&timerMutex);
+        }
+    }
+    //The timerfd is one-shot, so every expiry arms it for the next work
+    armed = false;
+    armTimer();
+    pthread_mutex_unlock(&timerMutex);
+    return fired;
+}
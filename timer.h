@@ -0,0 +1,31 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * One-shot timers for the whole server.
+ *
+ * Any thread may schedule or cancel. Callbacks run on the event loop
+ * thread, which calls timerQueueExpire() whenever the descriptor
+ * returned by timerQueueInit() becomes readable. A callback must not
+ * block; it usually updates a room under its mutex and broadcasts.
+ *
+ * Times are milliseconds since timerQueueInit(). A replay takes the
+ * clock over with timerQueueSetClock() and expires timers itself.
+ */
+
+typedef uint64_t TimerID;           // 0 is never a valid timer
+typedef void (*TimerCallback)(void *arg);
+
+int timerQueueInit(void);
+void timerQueueDestroy(void);
+TimerID timerSchedule(unsigned int delayMs, TimerCallback callback, void *arg);
+bool timerCancel(TimerID id);
+int timerQueueExpire(uint64_t now);        // returns how many callbacks ran
+uint64_t timerQueueNow(void);
+void timerQueueSetClock(uint64_t now);
+bool timerQueueNextDue(uint64_t *dueMs);
+
+#endif